@@ -41,6 +41,121 @@ export interface NativeClient {
      * @param fn 
      */
     executeAsync(fn: (asyncClient: NativeAsyncClient) => any): Promise<any>;
+
+    /**
+     * RedisAI client, only available if RedisAI is loaded.
+     */
+    redisai: RedisAIClient;
+}
+
+/**
+ * RedisAI tensor object.
+ */
+export interface RedisAITensor {
+    /**
+     * Returns a copy of the tensor data.
+     */
+    get_data(): ArrayBuffer;
+
+    /**
+     * Returns the tensor dimensions.
+     */
+    dims(): Array<number>;
+
+    /**
+     * Returns the size (in bytes) of a single tensor element.
+     */
+    element_size(): number;
+}
+
+/**
+ * RedisAI DAG object, chains model and script runs that are executed as a
+ * single RedisAI execution. Tensors are referenced by their names inside the DAG.
+ */
+export interface RedisAIDAG {
+    /**
+     * Add the given tensor to the DAG under the given name.
+     * @param name - the tensor name.
+     * @param tensor - the tensor.
+     */
+    add_input(name: string, tensor: RedisAITensor): void;
+
+    /**
+     * Add a run of the model stored in the given key.
+     * @param modelKey - the model key.
+     * @param inputs - the names of the run inputs.
+     * @param outputs - the names given to the run outputs.
+     */
+    add_model_run(modelKey: string, inputs: Array<string>, outputs: Array<string>): void;
+
+    /**
+     * Add a run of the given function of the script stored in the given key.
+     * @param scriptKey - the script key.
+     * @param func - the function to run.
+     * @param inputs - the names of the run inputs.
+     * @param outputs - the names given to the run outputs.
+     */
+    add_script_run(scriptKey: string, func: string, inputs: Array<string>, outputs: Array<string>): void;
+
+    /**
+     * Add the operations described by the given string, using the
+     * `AI.DAGEXECUTE` syntax, to the DAG.
+     * @param ops - the DAG operations.
+     */
+    add_ops_from_string(ops: string): void;
+
+    /**
+     * Mark the tensor with the given name as an output of the DAG.
+     * @param name - the tensor name.
+     */
+    add_output(name: string): void;
+
+    /**
+     * Run the DAG in the background. Returns a promise that will be resolved
+     * with the output tensors, in the order they were added with `add_output`.
+     */
+    run(): Promise<Array<RedisAITensor>>;
+}
+
+/**
+ * RedisAI client object.
+ */
+export interface RedisAIClient {
+    /**
+     * Create a new DAG of model and script runs.
+     */
+    create_dag(): RedisAIDAG;
+}
+
+/**
+ * Options for `NativeAsyncClient::reduceOnShards`.
+ */
+export interface ReduceOnShardsOptions {
+    /**
+     * A synchronous function that combines the accumulated value with the next
+     * shard result, or the name of a native reducer that combines the results
+     * without running any JS code:
+     * 'sum', 'count', 'min', 'max', 'union' or 'topk'.
+     */
+    reducer: string | ((accumulator: any, result: any) => any);
+
+    /**
+     * The amount of numbers kept by the 'topk' reducer.
+     */
+    k?: number;
+
+    /**
+     * The initial accumulated value given to a JS reducer. If not given, the first
+     * result is used as the initial value.
+     */
+    initialValue?: any;
+
+    /**
+     * Whether to resolve with the results of the shards that succeeded when
+     * some of the shards failed (or timed out). When false, the promise is
+     * rejected with the first error as soon as it happens. Default is true.
+     */
+    allowPartialResults?: boolean;
 }
 
 /**
@@ -88,6 +203,41 @@ export interface NativeAsyncClient {
      * @param args - Extra arguments to give to the remote function (must be json serializabale).
      */
     runOnShards(remoteFunction: string, ...args: Array<string | object>): Promise<any>
+
+    /**
+     * Runs a remote function on all the shards and reduce the results instead
+     * of collecting them into an array. The reduction runs once all the shards
+     * replied (or timed out). Returns a promise which will be fulfilled when the
+     * invocation finishes on all the shards.
+     * 
+     * The result is array of 2 elements, the first is the reduced value and the second
+     * is an array of all the errors happened durring the invocation.
+     * 
+     * Notice that remote function can only perform read operations, not writes are allowed.
+     * 
+     * @param remoteFunction - The remote function name to run
+     * @param options - The reduce options.
+     * @param args - Extra arguments to give to the remote function (must be json serializabale).
+     */
+    reduceOnShards(remoteFunction: string, options: ReduceOnShardsOptions, ...args: Array<string | object>): Promise<any>
+
+    /**
+     * Runs a remote function once for each of the given keys, on the shard that
+     * owns the key. The key is given to the remote function as its first argument,
+     * followed by the extra arguments. A single message is sent to each shard,
+     * regardless of the number of keys.
+     * 
+     * The result is array of 2 elements, the first is an array of the results and the
+     * second is an array of the errors. Both arrays are ordered the same as the given keys,
+     * with `null` on the places that does not apply.
+     * 
+     * Notice that remote function can only perform read operations, not writes are allowed.
+     * 
+     * @param keys - The keys on which to run the remote function on.
+     * @param remoteFunction - The remote function name to run
+     * @param args - Extra arguments to give to the remote function (must be json serializabale).
+     */
+    runOnKeys(keys: Array<string | ArrayBuffer>, remoteFunction: string, ...args: Array<string | object>): Promise<any>
 }
 
 /**
@@ -244,7 +394,7 @@ export const redis: {
 
     /**
      * Can only be called on library load time.
-     * Register a cluster function that can later be called using `NativeAsyncClient::runOnKey` or `NativeAsyncClient::runOnShards`.
+     * Register a cluster function that can later be called using `NativeAsyncClient::runOnKey`, `NativeAsyncClient::runOnKeys` or `NativeAsyncClient::runOnShards`.
      * For more information refer to: https://github.com/RedisGears/RedisGears/blob/master/docs/cluster_support.md
      * 
      * @param name - the name of the cluster function.
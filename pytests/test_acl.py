@@ -219,3 +219,51 @@ redis.registerStreamTrigger("consumer", "", async function(client){
     last_error = toDictionary(env.execute_command('TFUNCTION', 'LIST', 'vvv'), 6)[0]['stream_triggers'][0]['streams'][0]['last_error']
     env.assertContains(NO_PERMISSIONS_ERROR_MSG, last_error)
 
+
+@gearsTest()
+def testAclOnCachedResults(env):
+    """#!js api_version=1.0 name=lib
+redis.registerFunction("get", function(client, key){
+    return client.call('get', key);
+}, {
+    flags: [redis.functionFlags.NO_WRITES, redis.functionFlags.CACHE_RESULTS]
+});
+    """
+    env.expect('ACL', 'SETUSER', 'alice', 'on', '>pass', '~*', '+get', '+tfunction', '+TFCALL').equal('OK')
+    env.expect('set', 'x', '1').equal(True)
+    c = env.getConnection()
+    c.execute_command('AUTH', 'alice', 'pass')
+    env.assertEqual(env.tfcall('lib', 'get', [], ['x'], c=c), '1')
+    env.assertEqual(env.tfcall('lib', 'get', [], ['x'], c=c), '1')
+    # the reply is cached, it must not be served once alice lost access to the key.
+    # the key is given as an argument so TFCALL itself is not rejected by the ACL.
+    env.expect('ACL', 'SETUSER', 'alice', 'resetkeys', '~cached:*').equal('OK')
+    try:
+        env.tfcall('lib', 'get', [], ['x'], c=c)
+        env.assertTrue(False, message='Cached reply was served without permissions')
+    except Exception as e:
+        env.assertContains(NO_PERMISSIONS_ERROR_MSG, str(e))
+
+@gearsTest()
+def testAclOnCachedRedisAIScript(env):
+    """#!js api_version=1.0 name=lib
+redis.registerFunction("open", function(client, key){
+    client.redisai.open_script(key);
+    return "OK";
+});
+    """
+    if not any('ai' in m for m in env.cmd('MODULE', 'LIST')):
+        env.skip() # RedisAI is not loaded
+    env.cmd('AI.SCRIPTSTORE', 'x', 'CPU', 'ENTRY_POINTS', '1', 'bar', 'SOURCE', 'def bar(tensors: List[Tensor], keys: List[str], args: List[str]):\n    return tensors[0]\n')
+    env.expect('ACL', 'SETUSER', 'alice', 'on', '>pass', '~*', '+get', '+tfunction', '+TFCALL').equal('OK')
+    c = env.getConnection()
+    c.execute_command('AUTH', 'alice', 'pass')
+    env.assertEqual(env.tfcall('lib', 'open', [], ['x'], c=c), 'OK')
+    env.assertEqual(env.tfcall('lib', 'open', [], ['x'], c=c), 'OK')
+    # the script is cached, it must not be given to alice once alice can not read its key
+    env.expect('ACL', 'SETUSER', 'alice', 'resetkeys', '%W~x', '~cached:*').equal('OK')
+    try:
+        env.tfcall('lib', 'open', [], ['x'], c=c)
+        env.assertTrue(False, message='Cached script was opened without read permissions')
+    except Exception as e:
+        env.assertContains('User does not have permissions on key', str(e))
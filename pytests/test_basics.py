@@ -3,6 +3,7 @@ from common import toDictionary
 from common import runUntil
 from redis import Redis
 import time
+import os
 
 MODULE_NAME = "redisgears_2"
 
@@ -533,6 +534,121 @@ redis.registerFunction("test1", function(){
     env.expect('debug', 'reload').equal("OK")
     env.expectTfcall('lib', 'test1').equal(['foo', 'bar'])
 
+@gearsTest()
+def testLibrariesSharedCodeSavedOnce(env):
+    shared_code = "\n".join(["function shared_%d() { return 'shared value number %d'; }" % (i, i) for i in range(2000)])
+    for name in ['lib1', 'lib2']:
+        code = """#!js api_version=1.0 name=%s
+%s
+redis.registerFunction("test", function(){
+    return shared_1999();
+});
+        """ % (name, shared_code)
+        env.expect('TFUNCTION', 'LOAD', code).equal("OK")
+    for compression in ['no', 'yes']:
+        env.expect('CONFIG', 'SET', f'{MODULE_NAME}.rdb-compression', compression).equal("OK")
+        env.expect('debug', 'reload').equal("OK")
+        env.expectTfcall('lib1', 'test').equal('shared value number 1999')
+        env.expectTfcall('lib2', 'test').equal('shared value number 1999')
+        info = env.cmd('info', 'redisgears_2_rdb')
+        # the shared code is saved only once
+        env.assertGreater(int(info['redisgears_2_libraries_code_saved_bytes']), len(shared_code) / 2)
+
+def rdbLen(val):
+    if val < (1 << 6):
+        return bytes([val])
+    if val < (1 << 14):
+        return bytes([0x40 | (val >> 8), val & 0xff])
+    if val <= 0xffffffff:
+        return bytes([0x80]) + val.to_bytes(4, 'big')
+    return bytes([0x81]) + val.to_bytes(8, 'big')
+
+def rdbModuleUnsigned(val):
+    return rdbLen(2) + rdbLen(val)
+
+def rdbModuleString(val):
+    val = val.encode() if isinstance(val, str) else val
+    return rdbLen(5) + rdbLen(len(val)) + val
+
+def gearsRdbV1(libraries):
+    """
+    Returns an RDB that contains the given libraries, encoded the way encoding
+    version 1 saved them: each library code and stream consumer checkpoints as
+    plain strings and without a libraries manifest. Each library is given as
+    (name, code, user, config, {consumer: [(stream, ms, seq)]}).
+    """
+    charset = 'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_'
+    module_id = 0
+    for c in 'GearsType':
+        module_id = (module_id << 6) | charset.index(c)
+    module_id = (module_id << 10) | 1 # encoding version
+
+    data = rdbModuleUnsigned(len(libraries))
+    for name, code, user, config, consumers in libraries:
+        data += rdbModuleString(name) + rdbModuleString(code) + rdbModuleString(user)
+        data += rdbModuleUnsigned(0) if config is None else rdbModuleUnsigned(1) + rdbModuleString(config)
+        data += rdbModuleUnsigned(len(consumers))
+        for consumer, streams in consumers.items():
+            data += rdbModuleString(consumer) + rdbModuleUnsigned(len(streams))
+            for stream, ms, seq in streams:
+                data += rdbModuleString(stream) + rdbModuleUnsigned(ms) + rdbModuleUnsigned(seq)
+
+    aux = bytes([0xf7]) + rdbLen(module_id) + rdbModuleUnsigned(1) + data + rdbLen(0)
+    # a zero checksum tells Redis the checksum was not calculated
+    return b'REDIS0009' + aux + bytes([0xff]) + bytes(8)
+
+@gearsTest()
+def testLoadRdbEncodingVersion1(env):
+    code = """#!js api_version=1.0 name=lib
+redis.registerFunction("test", function(){
+    return redis.config;
+});
+redis.registerStreamTrigger("consumer", "stream", function(){});
+    """
+    rdb = gearsRdbV1([('lib', code, 'default', '{"foo":"bar"}', {'consumer': [('stream:1', 5, 1)]})])
+    rdb_dir = env.cmd('config', 'get', 'dir')[1]
+    rdb_file = env.cmd('config', 'get', 'dbfilename')[1]
+    with open(os.path.join(rdb_dir, rdb_file), 'wb') as f:
+        f.write(rdb)
+    env.expect('debug', 'reload', 'nosave').equal("OK")
+    env.expectTfcall('lib', 'test').equal(['foo', 'bar'])
+    res = toDictionary(env.cmd('TFUNCTION', 'LIST', 'vvv'), 6)
+    env.assertEqual(res[0]['stream_triggers'][0]['streams'][0]['name'], 'stream:1')
+    env.assertEqual(res[0]['stream_triggers'][0]['streams'][0]['id_to_read_from'], '5-1')
+
+    # saving again uses the current encoding version
+    env.expect('debug', 'reload').equal("OK")
+    env.expectTfcall('lib', 'test').equal(['foo', 'bar'])
+    res = toDictionary(env.cmd('TFUNCTION', 'LIST', 'vvv'), 6)
+    env.assertEqual(res[0]['stream_triggers'][0]['streams'][0]['id_to_read_from'], '5-1')
+
+@gearsTest()
+def testLazyLibraryLoading(env):
+    code = """#!js api_version=1.0 name=lib
+redis.registerFunction("test1", function(){
+    return redis.config;
+});
+    """
+    env.expect('CONFIG', 'SET', f'{MODULE_NAME}.lazy-library-loading', 'yes').equal("OK")
+    env.expect('TFUNCTION', 'LOAD', 'CONFIG', '{"foo":"bar"}', code).equal("OK")
+
+    def library_info(field):
+        info = env.cmd('info', 'redisgears_2_perlibraryinformation')
+        return next((v[field] for v in info.values() if isinstance(v, dict) and field in v), None)
+
+    env.assertEqual(library_info('materialized'), 'yes')
+    env.expect('debug', 'reload').equal("OK")
+    libraries = toDictionary(env.cmd('TFUNCTION', 'LIST', 'vvv'), 6)
+    env.assertEqual(libraries[0]['name'], 'lib')
+    # the library is only registered, it is evaluated on its first use
+    env.assertEqual(library_info('materialized'), 'no')
+    env.expectTfcall('lib', 'test1').equal(['foo', 'bar'])
+    env.assertEqual(library_info('materialized'), 'yes')
+    env.expect('debug', 'reload').equal("OK")
+    env.assertEqual(library_info('materialized'), 'no')
+    env.expectTfcall('lib', 'test1').equal(['foo', 'bar'])
+    env.assertEqual(library_info('materialized'), 'yes')
+
 @gearsTest()
 def testLibraryLoadingTimesout(env):
     code = """#!js api_version=1.0 name=lib
@@ -1121,3 +1237,377 @@ redis.registerFunction("start", function(client, key, val){
     runUntil(env, 'OK', lambda: env.tfcall('lib', 'continue'))
     env.expectTfcall('lib', 'continue').equal('OK')
     future.equal('OK')
+
+@gearsTest()
+def testLibraryWithMultipleIsolates(env):
+    """#!js api_version=1.0 name=lib isolates=4
+var isolate_id = Math.random().toString();
+
+redis.registerAsyncFunction("async_get_isolate_id", async function(){
+    return isolate_id;
+});
+
+redis.registerFunction("get_isolate_id", function(){
+    return isolate_id;
+});
+    """
+    # async invocations are distributed between all the isolates
+    async_ids = set([env.tfcallAsync('lib', 'async_get_isolate_id') for _ in range(8)])
+    env.assertEqual(4, len(async_ids))
+    # sync invocations always run on the primary isolate
+    ids = set([env.tfcall('lib', 'get_isolate_id') for _ in range(8)])
+    env.assertEqual(1, len(ids))
+    env.assertContains(ids.pop(), async_ids)
+
+@gearsTest(gearsConfig={"v8-shared-isolate-max-libraries": "2"})
+def testLibrariesSharingIsolate(env):
+    code = """#!js api_version=1.0 name=%s
+var val = '%s';
+
+redis.registerFunction("get", function(){
+    return val;
+});
+
+redis.registerFunction("set", function(client, new_val){
+    val = new_val;
+    return 'OK';
+});
+    """
+    for name in ['lib1', 'lib2', 'lib3']:
+        env.expect('TFUNCTION', 'LOAD', code % (name, name)).equal('OK')
+    # libraries that share an isolate do not share their globals
+    env.expectTfcall('lib1', 'set', [], ['foo']).equal('OK')
+    env.expectTfcall('lib1', 'get').equal('foo')
+    env.expectTfcall('lib2', 'get').equal('lib2')
+    env.expectTfcall('lib3', 'get').equal('lib3')
+    env.expect('TFUNCTION', 'DELETE', 'lib2').equal('OK')
+    env.expect('TFUNCTION', 'LOAD', code % ('lib4', 'lib4')).equal('OK')
+    env.expectTfcall('lib4', 'get').equal('lib4')
+    env.expectTfcall('lib1', 'get').equal('foo')
+
+@gearsTest(enableGearsDebugCommands=True)
+def testInvocationAllocationStats(env):
+    """#!js api_version=1.0 name=lib
+redis.registerFunction("test", function(client){
+    return client.call('ping');
+});
+    """
+    env.expect('TFUNCTION', 'DEBUG', 'reset_allocation_stats').equal('OK')
+    env.expectTfcall('lib', 'test').equal('PONG')
+    env.expectTfcall('lib', 'test').equal('PONG')
+    stats = toDictionary(env.cmd('TFUNCTION', 'DEBUG', 'allocation_stats'))
+    env.assertEqual(stats['function']['invocations'], 2)
+    env.assertEqual(stats['key_space_notification']['invocations'], 0)
+    env.assertEqual(stats['stream_record']['invocations'], 0)
+    env.assertLessEqual(stats['function']['last_invocation_allocations'], stats['function']['max_invocation_allocations'])
+    env.expect('TFUNCTION', 'DEBUG', 'reset_allocation_stats').equal('OK')
+    stats = toDictionary(env.cmd('TFUNCTION', 'DEBUG', 'allocation_stats'))
+    env.assertEqual(stats['function']['invocations'], 0)
+
+@gearsTest()
+def testManyDistinctMapKeys(env):
+    """#!js api_version=1.0 name=lib
+redis.registerFunction("test", function(client){
+    var res = 0;
+    for (var i = 0; i < 3; i++) {
+        var obj = client.call('hgetall', 'h');
+        res += Object.keys(obj).filter(function(k){ return obj[k] == 'v' + k; }).length;
+    }
+    return res;
+});
+    """
+    # more distinct keys than the strings cache can hold, to make sure eviction is correct
+    for i in range(0, 3000, 500):
+        env.cmd('hset', 'h', *[v for j in range(i, i + 500) for v in ('f%d' % j, 'vf%d' % j)])
+    env.expectTfcall('lib', 'test').equal(9000)
+
+@gearsTest()
+def testTfcallMulti(env):
+    """#!js api_version=1.0 name=lib
+redis.registerFunction("incrby", function(client, key, by){
+    if (by == 'fail') {
+        throw 'failed incrby';
+    }
+    return client.call('incrby', key, by);
+});
+redis.registerAsyncFunction("async", async function(client){
+    return 1;
+});
+    """
+    res = env.cmd('TFCALLMULTI', 'lib.incrby', '3', '1', 'x', '1', '1', '1', 'x', '1', 'fail', '1', 'y', '1', '5')
+    env.assertEqual(res[0], 1)
+    env.assertContains('failed incrby', str(res[1]))
+    env.assertEqual(res[2], 5)
+    env.expect('GET', 'x').equal('1')
+    env.expect('TFCALLMULTI', 'lib.incrby', '0').equal([])
+    env.expect('TFCALLMULTI', 'lib.incrby', '2', '1', 'x', '1', '1').error().contains('Not enough arguments')
+    env.expect('TFCALLMULTI', 'lib.incrby', '1', '1', 'x', '1', '1', 'extra').error().contains('Too many arguments')
+    env.expect('TFCALLMULTI', 'lib.async', '1', '0', '0').error().contains('async')
+    env.expect('TFCALLMULTI', 'lib.unknown', '1', '0', '0').error().contains('Unknown function')
+    # nothing ran on syntax errors
+    env.expect('GET', 'x').equal('1')
+
+@gearsTest()
+def testCacheResults(env):
+    """#!js api_version=1.0 name=lib
+var invocations = 0;
+redis.registerFunction("get", function(client, key){
+    invocations++;
+    return [client.call('get', key), invocations];
+}, {
+    flags: [redis.functionFlags.NO_WRITES, redis.functionFlags.CACHE_RESULTS]
+});
+redis.registerFunction("time", function(client){
+    invocations++;
+    client.call('time');
+    return invocations;
+}, {
+    flags: [redis.functionFlags.NO_WRITES, redis.functionFlags.CACHE_RESULTS]
+});
+    """
+    env.cmd('set', 'x', '1')
+    env.expectTfcall('lib', 'get', ['x']).equal(['1', 1])
+    env.expectTfcall('lib', 'get', ['x']).equal(['1', 1])
+    env.cmd('set', 'x', '2')
+    env.expectTfcall('lib', 'get', ['x']).equal(['2', 2])
+    # a key miss does not invalidate the cached reply
+    env.expectTfcall('lib', 'get', ['y']).equal([None, 3])
+    env.expectTfcall('lib', 'get', ['y']).equal([None, 3])
+    env.expect('FLUSHALL').equal(True)
+    env.expectTfcall('lib', 'get', ['x']).equal([None, 4])
+    # replies that depend on untracked data are not cached
+    env.expectTfcall('lib', 'time').equal(5)
+    env.expectTfcall('lib', 'time').equal(6)
+
+    functions = toDictionary(env.cmd('TFUNCTION', 'LIST', 'v'))[0]['functions']
+    cache = [f for f in functions if f['name'] == 'get'][0]['results_cache']
+    env.assertEqual(cache['hits'], 2)
+    env.assertEqual(cache['misses'], 4)
+    env.assertEqual(cache['cached_replies'], 1)
+
+    env.expect('CONFIG', 'SET', 'redisgears_2.function-results-cache-max-memory', '0').equal('OK')
+    env.expectTfcall('lib', 'get', ['z']).equal([None, 7])
+    env.expectTfcall('lib', 'get', ['z']).equal([None, 8])
+
+    code = """#!js api_version=1.0 name=lib2
+redis.registerFunction("test", function(client){
+    return 1;
+}, {
+    flags: [redis.functionFlags.CACHE_RESULTS]
+});
+    """
+    env.expect('TFUNCTION', 'LOAD', code).error().contains('requires the')
+
+@gearsTest()
+def testCacheResultsExpiredKeysAndSwapDb(env):
+    """#!js api_version=1.0 name=lib
+var invocations = 0;
+redis.registerFunction("get", function(client, key){
+    invocations++;
+    return [client.call('get', key), invocations];
+}, {
+    flags: [redis.functionFlags.NO_WRITES, redis.functionFlags.CACHE_RESULTS]
+});
+    """
+    env.expect('DEBUG', 'SET-ACTIVE-EXPIRE', '0').equal('OK')
+    env.cmd('set', 'x', '1')
+    env.cmd('pexpire', 'x', '100')
+    env.expectTfcall('lib', 'get', ['x']).equal(['1', 1])
+    env.expectTfcall('lib', 'get', ['x']).equal(['1', 1])
+    # the key is expired before the cached reply is served
+    time.sleep(0.2)
+    env.expectTfcall('lib', 'get', ['x']).equal([None, 2])
+    env.expect('DEBUG', 'SET-ACTIVE-EXPIRE', '1').equal('OK')
+
+    env.cmd('set', 'x', '2')
+    env.cmd('move', 'x', '1')
+    env.cmd('set', 'x', '1')
+    env.expectTfcall('lib', 'get', ['x']).equal(['1', 3])
+    # the reply cached for db 0 is dropped once db 0 holds another dataset
+    env.expect('SWAPDB', '0', '1').equal('OK')
+    env.expectTfcall('lib', 'get', ['x']).equal(['2', 4])
+
+@gearsTest()
+def testBackgroundScan(env):
+    """#!js api_version=1.0 name=lib
+redis.registerAsyncFunction("scan", async function(client, pattern, keyType){
+    var keys = [];
+    var batches = 0;
+    var scanned = client.scan(function(batch){
+        batches++;
+        batch.forEach(function(k){ keys.push(k.key + ':' + k.type + ':' + k.value); });
+    }, {pattern: pattern, keyType: keyType, count: 5, withValues: true});
+    keys.sort();
+    return [scanned, batches > 1 ? 1 : 0, keys];
+});
+redis.registerAsyncFunction("scan_stop", async function(client){
+    var batches = 0;
+    client.scan(function(batch){
+        batches++;
+        return false;
+    }, {count: 1});
+    return batches;
+});
+    """
+    for i in range(100):
+        env.cmd('set', 'x%d' % i, str(i))
+    env.cmd('lpush', 'l1', 'a')
+    env.cmd('set', 'y', '1')
+    res = env.tfcallAsync('lib', 'scan', args=['x1*', 'string'])
+    env.assertEqual(res[0], 11)
+    env.assertEqual(res[1], 1)
+    env.assertEqual(res[2], sorted(['x1:string:1'] + ['x1%d:string:1%d' % (i, i) for i in range(10)]))
+    env.expectTfcallAsync('lib', 'scan', args=['*', 'list']).equal([1, 0, ['l1:list:a']])
+    env.expectTfcallAsync('lib', 'scan_stop').equal(1)
+
+@gearsTest()
+def testBackgroundScanPathologicalPattern(env):
+    """#!js api_version=1.0 name=lib
+redis.registerAsyncFunction("scan", async function(client, pattern){
+    var keys = [];
+    var scanned = client.scan(function(batch){
+        batch.forEach(function(k){ keys.push(k.key); });
+    }, {pattern: pattern});
+    return [scanned, keys];
+});
+    """
+    env.cmd('set', 'a' * 200, '1')
+    env.cmd('set', 'a' * 199 + 'b', '1')
+    # without the skip longer matches cut-off this pattern takes exponential time to reject a key
+    start = time.time()
+    env.expectTfcallAsync('lib', 'scan', args=['*a' * 20 + '*b']).equal([1, ['a' * 199 + 'b']])
+    env.assertLess(time.time() - start, 5)
+
+@gearsTest()
+def testBackgroundScanBatchesRespectCount(env):
+    """#!js api_version=1.0 name=lib
+redis.registerAsyncFunction("scan", async function(client){
+    var keys = [];
+    var max_batch = 0;
+    var scanned = client.scan(function(batch){
+        max_batch = Math.max(max_batch, batch.length);
+        batch.forEach(function(k){ keys.push(k.key); });
+    }, {count: 1, withValues: true});
+    return [scanned, max_batch, new Set(keys).size];
+});
+    """
+    for i in range(100):
+        env.cmd('set', 'x%d' % i, str(i))
+    # keys found by a scan step beyond the batch count are returned by the following batches
+    env.expectTfcallAsync('lib', 'scan').equal([100, 1, 100])
+
+@gearsTest(gearsConfig={"library-max-async-calls-in-flight": "1"})
+def testAsyncCallsAdmissionControl(env):
+    """#!js api_version=1.0 name=lib
+var resolvers = [];
+
+redis.registerAsyncFunction("wait", async function(client){
+    return await new Promise((resolve, reject) => {
+        resolvers.push(resolve);
+    });
+});
+
+redis.registerFunction("release", function(){
+    if (resolvers.length == 0) {
+        return "nothing to release";
+    }
+    resolvers.shift()("done");
+    return "OK";
+});
+    """
+    def library_info(field):
+        info = env.cmd('info', 'redisgears_2_perlibraryinformation')
+        return next((v[field] for v in info.values() if isinstance(v, dict) and field in v), None)
+
+    first = env.noBlockingTfcallAsync('lib', 'wait')
+    runUntil(env, 1, lambda: library_info('async_calls_in_flight'))
+
+    # the library is at its limit and the queue is disabled, the invocation is rejected
+    env.expectTfcallAsync('lib', 'wait').error().contains('TRYAGAIN')
+    env.assertEqual(library_info('async_calls_rejected'), 1)
+
+    # with a queue, the invocation waits until the library has room for it
+    env.expect('config', 'set', 'redisgears_2.library-async-calls-queue-size', '1').equal('OK')
+    second = env.noBlockingTfcallAsync('lib', 'wait')
+    runUntil(env, 1, lambda: library_info('async_calls_waiting'))
+    env.expectTfcallAsync('lib', 'wait').error().contains('TRYAGAIN')
+
+    runUntil(env, 'OK', lambda: env.tfcall('lib', 'release'))
+    first.equal('done')
+    runUntil(env, 1, lambda: library_info('async_calls_waited'))
+    runUntil(env, 'OK', lambda: env.tfcall('lib', 'release'))
+    second.equal('done')
+
+    # an invocation that waits for too long is rejected
+    env.expect('config', 'set', 'redisgears_2.library-async-calls-queue-timeout', '10').equal('OK')
+    first = env.noBlockingTfcallAsync('lib', 'wait')
+    runUntil(env, 1, lambda: library_info('async_calls_in_flight'))
+    env.expectTfcallAsync('lib', 'wait').error().contains('Timed out waiting')
+    env.assertEqual(library_info('async_calls_timed_out'), 1)
+    runUntil(env, 'OK', lambda: env.tfcall('lib', 'release'))
+    first.equal('done')
+    runUntil(env, 0, lambda: library_info('async_calls_in_flight'))
+
+@gearsTest(gearsConfig={"library-max-background-queue-depth": "1", "library-async-calls-queue-size": "1", "library-async-calls-queue-timeout": "100000"})
+def testAsyncCallsAdmissionBacklog(env):
+    """#!js api_version=1.0 name=lib
+redis.registerStreamTrigger("consumer", "stream", function(client, data){
+    return client.callAsync('blpop', 'l', '0');
+});
+
+redis.registerAsyncFunction("hello", async function(client){
+    return "hello";
+});
+    """
+    def library_info(field):
+        info = env.cmd('info', 'redisgears_2_perlibraryinformation')
+        return next((v[field] for v in info.values() if isinstance(v, dict) and field in v), None)
+
+    # the pending blpop fills the library backlog, it is not an invocation in flight
+    env.cmd('xadd', 'stream:1', '*', 'foo', 'bar')
+    runUntil(env, 'blpop l 0', lambda: toDictionary(env.cmd('TFUNCTION', 'LIST', 'vv'), 2)[0]['pending_async_calls'][0])
+    future = env.noBlockingTfcallAsync('lib', 'hello')
+    runUntil(env, 1, lambda: library_info('async_calls_waiting'))
+
+    # the invocation is admitted once the backlog drains
+    env.expect('lpush', 'l', '1').equal(1)
+    future.equal('hello')
+    env.assertEqual(library_info('async_calls_waited'), 1)
+    env.assertEqual(library_info('async_calls_timed_out'), 0)
+
+@gearsTest(gearsConfig={"library-max-async-calls-in-flight": "1"})
+def testAsyncCallsAdmissionStatsRemovedOnDelete(env):
+    """#!js api_version=1.0 name=lib
+var resolvers = [];
+
+redis.registerAsyncFunction("wait", async function(client){
+    return await new Promise((resolve, reject) => {
+        resolvers.push(resolve);
+    });
+});
+
+redis.registerFunction("release", function(){
+    if (resolvers.length == 0) {
+        return "nothing to release";
+    }
+    resolvers.shift()("done");
+    return "OK";
+});
+    """
+    def library_info(field):
+        info = env.cmd('info', 'redisgears_2_perlibraryinformation')
+        return next((v[field] for v in info.values() if isinstance(v, dict) and field in v), None)
+
+    first = env.noBlockingTfcallAsync('lib', 'wait')
+    runUntil(env, 1, lambda: library_info('async_calls_in_flight'))
+    env.expectTfcallAsync('lib', 'wait').error().contains('TRYAGAIN')
+    env.assertEqual(library_info('async_calls_rejected'), 1)
+    runUntil(env, 'OK', lambda: env.tfcall('lib', 'release'))
+    first.equal('done')
+    runUntil(env, 0, lambda: library_info('async_calls_in_flight'))
+
+    # a library that reuses the name of a deleted library starts with fresh statistics
+    env.expect('TFUNCTION', 'DELETE', 'lib').equal('OK')
+    code = "#!js api_version=1.0 name=lib\nredis.registerAsyncFunction('wait', async () => 'done');"
+    env.expect('TFUNCTION', 'LOAD', code).equal('OK')
+    env.assertEqual(library_info('async_calls_rejected'), None)
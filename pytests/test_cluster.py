@@ -23,6 +23,62 @@ redis.registerAsyncFunction("test", async (async_client, key) => {
         res = env.tfcallAsync('foo', 'test', ['x'], c=conn)
         env.assertEqual(res, '1')
 
+@gearsTest(cluster=True)
+def testRunOnKeyLocalExecution(env, cluster_conn):
+    """#!js api_version=1.0 name=foo
+const remote_get = "remote_get";
+
+redis.registerClusterFunction(remote_get, async(client, key) => {
+    return client.block((client) => {
+        return client.call("get", key);
+    });
+});
+
+redis.registerAsyncFunction("test", async (async_client, key) => {
+    return await async_client.runOnKey(key, remote_get, key);
+});
+    """
+    cluster_conn.execute_command('set', 'x', '1')
+    local_executions = 0
+    remote_executions = 0
+    for conn in shardsConnections(env):
+        res = env.tfcallAsync('foo', 'test', ['x'], c=conn)
+        env.assertEqual(res, '1')
+        info = conn.execute_command('info', 'redisgears_2_remotefunctions')
+        local_executions += int(info['redisgears_2_run_on_key_local_executions'])
+        remote_executions += int(info['redisgears_2_run_on_key_remote_executions'])
+    # only the shard that owns the key executes the remote function locally
+    env.assertEqual(local_executions, 1)
+    env.assertEqual(remote_executions, env.shardsCount - 1)
+
+@gearsTest()
+def testRunOnKeyLocalExecutionWithConcurrentCalls(env):
+    """#!js api_version=1.0 name=foo
+const remote_get = "remote_get";
+
+redis.registerClusterFunction(remote_get, async(client, key) => {
+    return client.block((client) => {
+        return client.call("get", key);
+    });
+});
+
+redis.registerAsyncFunction("test", async (async_client, key) => {
+    return await async_client.runOnKey(key, remote_get, key);
+});
+
+redis.registerFunction("sync_get", (client, key) => {
+    return client.call("get", key);
+});
+    """
+    env.cmd('set', 'x', '1')
+    # the key is local, make sure the local runOnKey executions do not
+    # deadlock with the function invocations that run at the same time.
+    futures = [env.noBlockingTfcallAsync('foo', 'test', ['x']) for _ in range(100)]
+    for _ in range(100):
+        env.expectTfcall('foo', 'sync_get', ['x']).equal('1')
+    for f in futures:
+        f.equal('1')
+
 @gearsTest(cluster=True)
 def testBasicClusterBinaryInputOutputSupport(env, cluster_conn):
     """#!js api_version=1.0 name=foo
@@ -49,6 +105,98 @@ redis.registerAsyncFunction("test",
         res = env.tfcallAsync('foo', 'test', ['x'], c=conn)
         env.assertEqual(res, '1')
 
+@gearsTest(cluster=True, gearsConfig={"remote-functions-structured-encoding": "yes"})
+def testStructuredInputOutputSupport(env, cluster_conn):
+    """#!js api_version=1.0 name=foo
+const remote_echo = "remote_echo";
+
+redis.registerClusterFunction(remote_echo, async(client, key, arg) => {
+    return {
+        key: key,
+        set_size: arg.set.size,
+        buffer_size: arg.buffer.byteLength,
+        nan: Number.isNaN(arg.nan),
+        set: arg.set,
+        map: arg.map,
+        big: arg.big * 2n,
+        floats: arg.floats,
+        view: arg.view,
+    };
+});
+
+redis.registerAsyncFunction("test", async (async_client, key) => {
+    let buffer = new ArrayBuffer(16);
+    new Uint8Array(buffer).set([1, 2, 3, 4, 5, 6, 7, 8]);
+    let res = await async_client.runOnKey(key, remote_echo, key, {
+        set: new Set([1, 2, 3]),
+        buffer: new ArrayBuffer(4),
+        nan: NaN,
+        map: new Map([[1, 'a'], ['b', new Set([2])]]),
+        big: 12345678901234567890n,
+        floats: new Float64Array([1.5, -2.5]),
+        view: new DataView(buffer, 2, 4),
+    });
+    return [
+        res.key, res.set_size, res.buffer_size, res.nan, res.set instanceof Set,
+        res.map instanceof Map, res.map.get(1), res.map.get('b') instanceof Set,
+        res.big.toString(),
+        res.floats instanceof Float64Array, Array.from(res.floats).map((v) => v.toString()),
+        res.view instanceof DataView, res.view.byteLength, res.view.getUint8(0),
+    ];
+});
+    """
+    for conn in shardsConnections(env):
+        res = env.tfcallAsync('foo', 'test', ['x'], c=conn)
+        env.assertEqual(res, ['x', 3, 4, 1, 1, 1, 'a', 1, '24691357802469135780', 1, ['1.5', '-2.5'], 1, 4, 3])
+
+@gearsTest(cluster=True)
+def testRunOnKeys(env, cluster_conn):
+    """#!js api_version=1.0 name=foo
+const remote_get = "remote_get";
+
+redis.registerClusterFunction(remote_get, async(client, key, suffix) => {
+    if (key == "y") {
+        throw "Remote function failure";
+    }
+    return client.block((client) => {
+        return client.call("get", key) + suffix;
+    });
+});
+
+redis.registerAsyncFunction("test", async (async_client, ...keys) => {
+    return await async_client.runOnKeys(keys, remote_get, "_suffix");
+});
+    """
+    cluster_conn.execute_command('set', 'x', '1')
+    cluster_conn.execute_command('set', 'z', '3')
+    for conn in shardsConnections(env):
+        res = env.tfcallAsync('foo', 'test', ['x', 'y', 'z'], c=conn)
+        env.assertEqual(res[0], ['1_suffix', None, '3_suffix'])
+        env.assertEqual(res[1][0], None)
+        env.assertContains('Remote function failure', res[1][1])
+        env.assertEqual(res[1][2], None)
+
+@gearsTest(cluster=True, gearsConfig={"remote-functions-structured-encoding": "yes"})
+def testStructuredInputUnsupportedValues(env, cluster_conn):
+    """#!js api_version=1.0 name=foo
+const remote_echo = "remote_echo";
+
+redis.registerClusterFunction(remote_echo, async(client, key, arg) => {
+    return arg;
+});
+
+redis.registerAsyncFunction("test", async (async_client, key) => {
+    return await async_client.runOnKey(key, remote_echo, key, {map: new WeakMap()});
+});
+    """
+    for conn in shardsConnections(env):
+        try:
+            env.tfcallAsync('foo', 'test', ['x'], c=conn)
+        except Exception as e:
+            env.assertContains('WeakMap values can not be passed to remote functions', str(e))
+            continue
+        failTest(env, 'error was not raised by command')
+
 @gearsTest(cluster=True)
 def testRemoteFunctionRaiseError(env, cluster_conn):
     """#!js api_version=1.0 name=foo
@@ -152,6 +300,107 @@ redis.registerAsyncFunction("test", async(async_client) => {
         res = env.tfcallAsync('foo', 'test', c=conn)
         env.assertEqual(res, 1000)
 
+@gearsTest(cluster=True)
+def testReduceOnShards(env, cluster_conn):
+    """#!js api_version=1.0 name=foo
+const dbside_remote_func = "dbsize";
+
+redis.registerClusterFunction(dbside_remote_func, async(client) => {
+    return await client.block((client) => {
+        return client.call("dbsize");
+    });
+});
+
+redis.registerAsyncFunction("native", async(async_client, reducer) => {
+    let res = await async_client.reduceOnShards(dbside_remote_func, {reducer: reducer});
+    if (res[1].length > 0) {
+        throw res[1][0];
+    }
+    return res[0];
+});
+
+redis.registerAsyncFunction("js", async(async_client) => {
+    let res = await async_client.reduceOnShards(dbside_remote_func, {
+        reducer: (acc, val) => acc + val,
+        initialValue: 0,
+    });
+    if (res[1].length > 0) {
+        throw res[1][0];
+    }
+    return res[0];
+});
+
+redis.registerAsyncFunction("topk", async(async_client, k) => {
+    let res = await async_client.reduceOnShards(dbside_remote_func, {reducer: 'topk', k: parseInt(k)});
+    if (res[1].length > 0) {
+        throw res[1][0];
+    }
+    return res[0];
+});
+    """
+    for i in range(1000):
+        cluster_conn.execute_command('set', 'key%d' % i, '1')
+    top_2 = sorted([conn.execute_command('dbsize') for conn in shardsConnections(env)], reverse=True)[:2]
+    for conn in shardsConnections(env):
+        env.assertEqual(env.tfcallAsync('foo', 'native', [], ['sum'], c=conn), 1000)
+        env.assertEqual(env.tfcallAsync('foo', 'native', [], ['count'], c=conn), env.shardsCount)
+        env.assertEqual(env.tfcallAsync('foo', 'js', c=conn), 1000)
+        env.assertEqual(env.tfcallAsync('foo', 'topk', [], ['2'], c=conn), top_2)
+    env.expectTfcallAsync('foo', 'native', [], ['foo']).error().contains("Unknown native reducer 'foo'")
+    env.expectTfcallAsync('foo', 'topk', [], ['0']).error().contains("requires a positive integer 'k'")
+
+@gearsTest(cluster=True, gearsConfig={'remote-task-default-timeout': '100'})
+def testReduceOnShardsPartialResultsOnTimeout(env, cluster_conn):
+    """#!js api_version=1.0 name=foo
+redis.registerClusterFunction("one", async(client) => {
+    let owner = client.block((client) => {
+        try {
+            return client.call("get", "z") == "1";
+        } catch(e) {
+            return false;
+        }
+    });
+    if (owner) {
+        await new Promise(() => {}); // never reply so this shard times out
+    }
+    return 1;
+});
+
+redis.registerAsyncFunction("native", async(async_client, allow) => {
+    let res = await async_client.reduceOnShards("one", {reducer: 'sum', allowPartialResults: allow == 'true'});
+    return [res[0], res[1].length];
+});
+
+redis.registerAsyncFunction("js", async(async_client) => {
+    let res = await async_client.reduceOnShards("one", {reducer: (acc, val) => acc + val});
+    return [res[0], res[1].length];
+});
+    """
+    cluster_conn.execute_command('set', 'z', '1')
+    # the shards that replied in time are reduced, the shard that timed out is reported as an error
+    env.expectTfcallAsync('foo', 'native', [], ['true']).equal([env.shardsCount - 1, 1])
+    env.expectTfcallAsync('foo', 'js').equal([env.shardsCount - 1, 1])
+    # either 'Timeout' or 'Remote task timeout', depending on whether the shard that times out is the local one
+    env.expectTfcallAsync('foo', 'native', [], ['false']).error().contains('imeout')
+
+@gearsTest(cluster=True)
+def testReduceOnShardsCountAnyResult(env, cluster_conn):
+    """#!js api_version=1.0 name=foo
+redis.registerClusterFunction("object", async(client) => {
+    return {foo: "bar"};
+});
+
+redis.registerAsyncFunction("count", async(async_client) => {
+    let res = await async_client.reduceOnShards("object", {reducer: 'count'});
+    if (res[1].length > 0) {
+        throw res[1][0];
+    }
+    return res[0];
+});
+    """
+    for conn in shardsConnections(env):
+        env.assertEqual(env.tfcallAsync('foo', 'count', c=conn), env.shardsCount)
+
 @gearsTest(cluster=True, gearsConfig={'remote-task-default-timeout': '1'})
 def testRunOnAllShardsTimeout(env, cluster_conn):
     """#!js api_version=1.0 name=foo
@@ -263,6 +263,33 @@ redis.registerFunction("test", (client) => {
     """
     env.expectTfcall('foo', 'test').error().contains('RedisAI is not initialize')
 
+@gearsTest()
+def testRedisAITensorCreateFromViewWithoutRedisAI(env):
+    """#!js api_version=1.0 name=foo
+redis.registerFunction("test", (client) => {
+    return redis.redisai.create_tensor("FLOAT", [1, 3], new Float32Array(new ArrayBuffer(32), 8, 3));
+});
+    """
+    env.expectTfcall('foo', 'test').error().contains('RedisAI is not initialize')
+
+@gearsTest()
+def testRedisAITensorCreateWithWrongDataType(env):
+    """#!js api_version=1.0 name=foo
+redis.registerFunction("test", (client) => {
+    return redis.redisai.create_tensor("FLOAT", [1, 3], [1, 2, 3]);
+});
+    """
+    env.expectTfcall('foo', 'test').error().contains('Tensor data must be an ArrayBuffer or a view on an ArrayBuffer')
+
+@gearsTest()
+def testRedisAITensorCreateWithFakeView(env):
+    """#!js api_version=1.0 name=foo
+redis.registerFunction("test", (client) => {
+    return redis.redisai.create_tensor("FLOAT", [1, 3], {buffer: new ArrayBuffer(12), byteOffset: 0, byteLength: 12});
+});
+    """
+    env.expectTfcall('foo', 'test').error().contains('Tensor data must be an ArrayBuffer or a view on an ArrayBuffer')
+
 @gearsTest()
 def testRedisAIModelCreateWithoutRedisAI(env):
     """#!js api_version=1.0 name=foo
@@ -281,6 +308,15 @@ redis.registerFunction("test", (client) => {
     """
     env.expectTfcall('foo', 'test').error().contains('RedisAI is not initialize')
 
+@gearsTest()
+def testRedisAIDAGCreateWithoutRedisAI(env):
+    """#!js api_version=1.0 name=foo
+redis.registerFunction("test", (client) => {
+    return client.redisai.create_dag();
+});
+    """
+    env.expectTfcall('foo', 'test').error().contains('RedisAI is not initialize')
+
 @gearsTest()
 def testUseOfInvalidClient(env):
     """#!js api_version=1.0 name=foo
@@ -362,6 +398,11 @@ def testMalformedLibraryMetaData7(env):
     code = '#!js name=foo' # no API version
     env.expect('TFUNCTION', 'LOAD', code).error().contains('The api version is missing from the prologue.')
 
+@gearsTest()
+def testMalformedLibraryMetaData8(env):
+    code = '#!js api_version=1.0 name=foo isolates=0' # invalid number of isolates
+    env.expect('TFUNCTION', 'LOAD', code).error().contains('Invalid number of isolates: "0"')
+
 
 @gearsTest()
 def testNoLibraryCode(env):
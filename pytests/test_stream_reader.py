@@ -191,6 +191,161 @@ redis.registerStreamTrigger("consumer", "stream",
     res = toDictionary(env.cmd('TFUNCTION', 'LIST', 'vvv'), 6)
     env.assertEqual(2, res[0]['stream_triggers'][0]['streams'][0]['total_record_processed'])
 
+@gearsTest()
+def testStreamPartitionKey(env):
+    """#!js api_version=1.0 name=lib
+var promises = [];
+redis.registerFunction("in_flight", function(){
+    return promises.map((p) => p[0]);
+})
+
+redis.registerFunction("continue", function(client, user){
+    var i = promises.findIndex((p) => p[0] == user);
+    if (i < 0) {
+        throw "No pending records"
+    }
+    promises[i][1]('continue');
+    promises.splice(i, 1);
+    return "OK"
+})
+
+redis.registerStreamTrigger("consumer", "stream",
+    async function(client, data){
+        var user = data.record[0][1];
+        return await new Promise((resolve, reject) => {
+            promises.push([user, resolve]);
+        });
+    },
+    {
+        isStreamTrimmed: true,
+        window: 10,
+        partitionKey: "user"
+    }
+);
+    """
+    env.cmd('xadd', 'stream:1', '*', 'user', 'a', 'n', '1')
+    env.cmd('xadd', 'stream:1', '*', 'user', 'a', 'n', '2')
+    env.cmd('xadd', 'stream:1', '*', 'user', 'b', 'n', '1')
+
+    # records of different users run together, records of the same user wait
+    runUntil(env, ['a', 'b'], lambda: env.tfcall('lib', 'in_flight'))
+    res = toDictionary(env.cmd('TFUNCTION', 'LIST', 'vvv'), 6)
+    env.assertEqual('user', res[0]['stream_triggers'][0]['partition_key'])
+    env.assertEqual(3, len(res[0]['stream_triggers'][0]['streams'][0]['pending_ids']))
+    env.expect('xlen', 'stream:1').equal(3)
+
+    env.expectTfcall('lib', 'continue', args=['a']).equal('OK')
+    runUntil(env, ['b', 'a'], lambda: env.tfcall('lib', 'in_flight'))
+    # the record of 'b' is still in flight, only the first record was trimmed
+    env.expect('xlen', 'stream:1').equal(2)
+
+    env.expectTfcall('lib', 'continue', args=['b']).equal('OK')
+    runUntil(env, ['a'], lambda: env.tfcall('lib', 'in_flight'))
+
+    env.expectTfcall('lib', 'continue', args=['a']).equal('OK')
+    runUntil(env, [], lambda: env.tfcall('lib', 'in_flight'))
+    runUntil(env, 0, lambda: env.cmd('xlen', 'stream:1'))
+
+    res = toDictionary(env.cmd('TFUNCTION', 'LIST', 'vvv'), 6)
+    env.assertEqual(3, res[0]['stream_triggers'][0]['streams'][0]['total_record_processed'])
+
+@gearsTest()
+def testStreamPartitionKeyStalled(env):
+    """#!js api_version=1.0 name=lib
+var promises = [];
+redis.registerFunction("in_flight", function(){
+    return promises.map((p) => p[0]);
+})
+
+redis.registerFunction("continue", function(client, user){
+    var i = promises.findIndex((p) => p[0] == user);
+    if (i < 0) {
+        throw "No pending records"
+    }
+    promises[i][1]('continue');
+    promises.splice(i, 1);
+    return "OK"
+})
+
+redis.registerStreamTrigger("consumer", "stream",
+    async function(client, data){
+        var user = data.record[0][1];
+        return await new Promise((resolve, reject) => {
+            promises.push([user, resolve]);
+        });
+    },
+    {
+        window: 10,
+        partitionKey: "user"
+    }
+);
+    """
+    env.cmd('xadd', 'stream:1', '1-1', 'user', 'a', 'n', '1')
+    env.cmd('xadd', 'stream:1', '1-2', 'user', 'a', 'n', '2')
+    runUntil(env, ['a'], lambda: env.tfcall('lib', 'in_flight'))
+
+    # the waiting record can not be read while the stream is renamed, it stays pending
+    env.cmd('rename', 'stream:1', 'tmp')
+    env.expectTfcall('lib', 'continue', args=['a']).equal('OK')
+    runUntil(env, 1, lambda: len(toDictionary(env.cmd('TFUNCTION', 'LIST', 'vvv'), 6)[0]['stream_triggers'][0]['streams'][0]['pending_ids']))
+    res = toDictionary(env.cmd('TFUNCTION', 'LIST', 'vvv'), 6)
+    env.assertContains('Failed reading records waiting for their partition', res[0]['stream_triggers'][0]['streams'][0]['last_error'])
+    env.assertEqual([], env.tfcall('lib', 'in_flight'))
+
+    # the partition is retried from a timer, no new notification of the stream is needed
+    env.cmd('rename', 'tmp', 'stream:1')
+    runUntil(env, ['a'], lambda: env.tfcall('lib', 'in_flight'))
+
+@gearsTest()
+def testStreamPartitionKeyWaitingRecordsOutsideWindow(env):
+    """#!js api_version=1.0 name=lib
+var promises = [];
+redis.registerFunction("in_flight", function(){
+    return promises.map((p) => p[0]);
+})
+
+redis.registerFunction("continue", function(client, user){
+    var i = promises.findIndex((p) => p[0] == user);
+    if (i < 0) {
+        throw "No pending records"
+    }
+    promises[i][1]('continue');
+    promises.splice(i, 1);
+    return "OK"
+})
+
+redis.registerStreamTrigger("consumer", "stream",
+    async function(client, data){
+        var user = data.record[0][1];
+        return await new Promise((resolve, reject) => {
+            promises.push([user, resolve]);
+        });
+    },
+    {
+        window: 2,
+        partitionKey: "user"
+    }
+);
+    """
+    env.cmd('xadd', 'stream:1', '*', 'user', 'a', 'n', '1')
+    env.cmd('xadd', 'stream:1', '*', 'user', 'a', 'n', '2')
+    env.cmd('xadd', 'stream:1', '*', 'user', 'a', 'n', '3')
+    env.cmd('xadd', 'stream:1', '*', 'user', 'b', 'n', '1')
+
+    # the waiting records of 'a' do not fill the window, the record of 'b' runs
+    runUntil(env, ['a', 'b'], lambda: env.tfcall('lib', 'in_flight'))
+    res = toDictionary(env.cmd('TFUNCTION', 'LIST', 'vvv'), 6)
+    env.assertEqual(4, len(res[0]['stream_triggers'][0]['streams'][0]['pending_ids']))
+
+    env.expectTfcall('lib', 'continue', args=['a']).equal('OK')
+    runUntil(env, ['b', 'a'], lambda: env.tfcall('lib', 'in_flight'))
+    env.expectTfcall('lib', 'continue', args=['a']).equal('OK')
+    runUntil(env, ['b', 'a'], lambda: env.tfcall('lib', 'in_flight'))
+    env.expectTfcall('lib', 'continue', args=['a']).equal('OK')
+    runUntil(env, ['b'], lambda: env.tfcall('lib', 'in_flight'))
+    env.expectTfcall('lib', 'continue', args=['b']).equal('OK')
+    runUntil(env, [], lambda: env.tfcall('lib', 'in_flight'))
+
 @gearsTest(withReplicas=True)
 def testStreamWithReplication(env):
     """#!js api_version=1.0 name=lib
@@ -487,6 +642,36 @@ redis.registerStreamTrigger("consumer", "stream", async function(client, data){
 
     env.assertEqual(id_to_read_from1, id_to_read_from2)
 
+@gearsTest()
+def testRDBSaveAndLoadStreamsSharedByConsumers(env):
+    script = """#!js api_version=1.0 name=%s
+
+redis.registerStreamTrigger("consumer", "stream", async function(client, data){
+    redis.log(data.id);
+})
+    """
+    env.expect('TFUNCTION', 'LOAD', script % 'lib1').equal('OK')
+    env.expect('TFUNCTION', 'LOAD', script % 'lib2').equal('OK')
+
+    for i in range(10):
+        env.cmd('xadd', 'stream:%d' % i, '*', 'foo', 'bar')
+        env.cmd('xadd', 'stream:%d' % i, '*', 'foo', 'bar')
+
+    def get_ids_to_read_from():
+        res = {}
+        for lib in toDictionary(env.execute_command('TFUNCTION', 'LIST', 'vvv'), 6):
+            res[lib['name']] = {s['name']: s['id_to_read_from'] for s in lib['stream_triggers'][0]['streams']}
+        return res
+
+    runUntil(env, 40, lambda: sum([s['total_record_processed'] for lib in toDictionary(env.execute_command('TFUNCTION', 'LIST', 'vvv'), 6) for s in lib['stream_triggers'][0]['streams']]))
+    ids_to_read_from1 = get_ids_to_read_from()
+    env.assertEqual(10, len(ids_to_read_from1['lib1']))
+    env.assertEqual(ids_to_read_from1['lib1'], ids_to_read_from1['lib2'])
+
+    env.expect('DEBUG', 'RELOAD').equal('OK')
+
+    env.assertEqual(ids_to_read_from1, get_ids_to_read_from())
+
 @gearsTest()
 def testSteamReaderPromiseFromSyncFunction(env):
     """#!js api_version=1.0 name=lib
@@ -5,7 +5,7 @@
  */
 
 use redis_module::Context;
-use std::os::raw::c_int;
+use std::os::raw::{c_int, c_void};
 
 pub mod redisai;
 pub mod redisai_raw;
@@ -39,3 +39,22 @@ pub fn redisai_init(ctx: &Context) -> Result<(), RedisAIError> {
         Ok(())
     }
 }
+
+/// Returns the module value stored in the given key, or null if the key
+/// does not exist or does not hold a module value.
+pub(crate) fn get_key_module_value(ctx: &Context, key_name: &str) -> *mut c_void {
+    let key_redis_str = ctx.create_string(key_name);
+    let key = unsafe {
+        redis_module::raw::RedisModule_OpenKey.unwrap()(
+            ctx.ctx,
+            key_redis_str.inner,
+            redisai_raw::bindings::REDISMODULE_READ as c_int,
+        )
+    } as *mut redis_module::raw::RedisModuleKey;
+    if key.is_null() {
+        return std::ptr::null_mut();
+    }
+    let value = unsafe { redis_module::raw::RedisModule_ModuleTypeGetValue.unwrap()(key) };
+    unsafe { redis_module::raw::RedisModule_CloseKey.unwrap()(key) };
+    value
+}
@@ -4,6 +4,8 @@
  * the Server Side Public License v1 (SSPLv1).
  */
 
+pub mod redisai_dag;
 pub mod redisai_model;
+pub mod redisai_model_batcher;
 pub mod redisai_script;
 pub mod redisai_tensor;
@@ -0,0 +1,312 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+use crate::redisai_raw::bindings::{
+    RAI_DAGRunCtx, RAI_DAGRunOp, RAI_Error, RAI_OnFinishCtx, RAI_Tensor,
+    RedisAI_DAGAddOpsFromString, RedisAI_DAGAddRunOp, RedisAI_DAGAddTensorGet,
+    RedisAI_DAGCreateModelRunOp, RedisAI_DAGCreateScriptRunOp, RedisAI_DAGFree,
+    RedisAI_DAGGetError, RedisAI_DAGLoadTensor, RedisAI_DAGNumOutputs, RedisAI_DAGOutputTensor,
+    RedisAI_DAGRun, RedisAI_DAGRunCtxCreate, RedisAI_DAGRunError, RedisAI_DAGRunOpAddInput,
+    RedisAI_DAGRunOpAddOutput, RedisAI_DAGRunOpFree, RedisAI_FreeError, RedisAI_GetError,
+    RedisAI_InitError, RedisAI_TensorGetShallowCopy, REDISMODULE_OK,
+};
+
+use crate::redisai::redisai_model::RedisAIModel;
+use crate::redisai::redisai_script::RedisAIScript;
+use crate::redisai::redisai_tensor::RedisAITensor;
+
+use crate::RedisAIError;
+
+use std::ffi::{CStr, CString};
+
+use std::os::raw::c_void;
+
+use redisgears_plugin_api::redisgears_plugin_api::redisai_interface::{
+    AIDAGRunnerInterface, AIModelInterface, AIScriptInterface, AITensorInterface,
+};
+
+use redisgears_plugin_api::redisgears_plugin_api::GearsApiError;
+
+/// A DAG of RedisAI operations (models and scripts runs) that is executed
+/// as a single asynchronous RedisAI execution. Intermediate tensors are
+/// kept inside RedisAI and never returned to the caller.
+pub struct RedisAIDAGRunCtx {
+    inner_run_ctx: *mut RAI_DAGRunCtx,
+}
+
+fn to_c_strings(names: &[&str]) -> Result<Vec<CString>, RedisAIError> {
+    names
+        .iter()
+        .map(|v| CString::new(*v).map_err(|_| format!("Invalid tensor name '{}'", v)))
+        .collect()
+}
+
+extern "C" fn dag_run_done<Callback: FnOnce(Result<Vec<RedisAITensor>, RedisAIError>)>(
+    ctx: *mut RAI_OnFinishCtx,
+    private_data: *mut ::std::os::raw::c_void,
+) {
+    let on_done = unsafe { Box::from_raw(private_data as *mut Callback) };
+
+    let res = if unsafe { RedisAI_DAGRunError.unwrap()(ctx) } != 0 {
+        let err = unsafe { RedisAI_DAGGetError.unwrap()(ctx) };
+        let err_str = unsafe { RedisAI_GetError.unwrap()(err as *mut RAI_Error) };
+        let err_c_str = unsafe { CStr::from_ptr(err_str) };
+        Err(err_c_str.to_str().unwrap().to_string())
+    } else {
+        let num_outputs = unsafe { RedisAI_DAGNumOutputs.unwrap()(ctx) };
+        let mut outputs = Vec::new();
+        for i in 0..num_outputs {
+            let inner_tensor = unsafe {
+                RedisAI_TensorGetShallowCopy.unwrap()(
+                    RedisAI_DAGOutputTensor.unwrap()(ctx, i) as *mut RAI_Tensor
+                )
+            };
+            outputs.push(RedisAITensor::from_inner(inner_tensor));
+        }
+        Ok(outputs)
+    };
+    // The outputs are shallow copies so we can free the DAG before
+    // calling the callback.
+    unsafe { RedisAI_DAGFree.unwrap()(ctx as *mut RAI_DAGRunCtx) };
+    on_done(res);
+}
+
+impl RedisAIDAGRunCtx {
+    pub fn create() -> Result<RedisAIDAGRunCtx, RedisAIError> {
+        if !crate::redisai_is_init() {
+            return Err("RedisAI is not initialize".to_string());
+        }
+        let inner_run_ctx = unsafe { RedisAI_DAGRunCtxCreate.unwrap()() };
+        Ok(RedisAIDAGRunCtx { inner_run_ctx })
+    }
+
+    fn verify_valid(&self) -> Result<(), RedisAIError> {
+        if self.inner_run_ctx.is_null() {
+            return Err("Invalid DAG run ctx was used".to_string());
+        }
+        Ok(())
+    }
+
+    /// Load the given tensor into the DAG under the given name, so it can be
+    /// used as an input of the DAG operations.
+    pub fn add_input(&mut self, name: &str, tensor: &RedisAITensor) -> Result<(), RedisAIError> {
+        self.verify_valid()?;
+        let name_c_string = to_c_strings(&[name])?.pop().unwrap();
+        if unsafe {
+            RedisAI_DAGLoadTensor.unwrap()(
+                self.inner_run_ctx,
+                name_c_string.as_ptr(),
+                tensor.inner_tensor,
+            )
+        } != REDISMODULE_OK as i32
+        {
+            return Err(format!("Failed loading tensor '{}' into DAG", name));
+        }
+        Ok(())
+    }
+
+    /// Add the given operation to the DAG, the operation is freed on failure.
+    fn add_op(
+        &mut self,
+        op: *mut RAI_DAGRunOp,
+        inputs: &[&str],
+        outputs: &[&str],
+    ) -> Result<(), RedisAIError> {
+        let inputs = to_c_strings(inputs);
+        let outputs = to_c_strings(outputs);
+        let (inputs, outputs) = match (inputs, outputs) {
+            (Ok(i), Ok(o)) => (i, o),
+            (Err(e), _) | (_, Err(e)) => {
+                unsafe { RedisAI_DAGRunOpFree.unwrap()(op) };
+                return Err(e);
+            }
+        };
+        inputs.iter().for_each(|v| {
+            unsafe { RedisAI_DAGRunOpAddInput.unwrap()(op, v.as_ptr()) };
+        });
+        outputs.iter().for_each(|v| {
+            unsafe { RedisAI_DAGRunOpAddOutput.unwrap()(op, v.as_ptr()) };
+        });
+
+        let mut err: *mut RAI_Error = std::ptr::null_mut();
+        unsafe { RedisAI_InitError.unwrap()(&mut err) };
+        let res = unsafe { RedisAI_DAGAddRunOp.unwrap()(self.inner_run_ctx, op, err) };
+        if res != REDISMODULE_OK as i32 {
+            let err_str = unsafe { RedisAI_GetError.unwrap()(err) };
+            let err_c_str = unsafe { CStr::from_ptr(err_str) };
+            let err_rust_string = err_c_str.to_str().unwrap().to_string();
+            unsafe { RedisAI_FreeError.unwrap()(err) };
+            unsafe { RedisAI_DAGRunOpFree.unwrap()(op) };
+            return Err(err_rust_string);
+        }
+        unsafe { RedisAI_FreeError.unwrap()(err) };
+        Ok(())
+    }
+
+    /// Add a model run operation to the DAG. The inputs and outputs are the
+    /// names of the DAG tensors.
+    pub fn add_model_run(
+        &mut self,
+        model: &RedisAIModel,
+        inputs: &[&str],
+        outputs: &[&str],
+    ) -> Result<(), RedisAIError> {
+        self.verify_valid()?;
+        let op = unsafe { RedisAI_DAGCreateModelRunOp.unwrap()(model.inner_model) };
+        self.add_op(op, inputs, outputs)
+    }
+
+    /// Add a script run operation to the DAG. The inputs and outputs are the
+    /// names of the DAG tensors.
+    pub fn add_script_run(
+        &mut self,
+        script: &RedisAIScript,
+        func_name: &str,
+        inputs: &[&str],
+        outputs: &[&str],
+    ) -> Result<(), RedisAIError> {
+        self.verify_valid()?;
+        let func_name_c_str = to_c_strings(&[func_name])?.pop().unwrap();
+        let op = unsafe {
+            RedisAI_DAGCreateScriptRunOp.unwrap()(script.inner_script, func_name_c_str.as_ptr())
+        };
+        self.add_op(op, inputs, outputs)
+    }
+
+    /// Add the operations described by the given string to the DAG. The string
+    /// uses the `AI.DAGEXECUTE` syntax, e.g. `|> AI.MODELEXECUTE m INPUTS 1 a OUTPUTS 1 b`.
+    pub fn add_ops_from_string(&mut self, ops: &str) -> Result<(), RedisAIError> {
+        self.verify_valid()?;
+        let ops_c_string = CString::new(ops).map_err(|_| "Invalid DAG ops string".to_string())?;
+        let mut err: *mut RAI_Error = std::ptr::null_mut();
+        unsafe { RedisAI_InitError.unwrap()(&mut err) };
+        let res = unsafe {
+            RedisAI_DAGAddOpsFromString.unwrap()(self.inner_run_ctx, ops_c_string.as_ptr(), err)
+        };
+        if res != REDISMODULE_OK as i32 {
+            let err_str = unsafe { RedisAI_GetError.unwrap()(err) };
+            let err_c_str = unsafe { CStr::from_ptr(err_str) };
+            let err_rust_string = err_c_str.to_str().unwrap().to_string();
+            unsafe { RedisAI_FreeError.unwrap()(err) };
+            return Err(err_rust_string);
+        }
+        unsafe { RedisAI_FreeError.unwrap()(err) };
+        Ok(())
+    }
+
+    /// Mark the given DAG tensor as an output of the DAG. The outputs are given
+    /// to the run callback by the order they were added.
+    pub fn add_output(&mut self, name: &str) -> Result<(), RedisAIError> {
+        self.verify_valid()?;
+        let name_c_string = to_c_strings(&[name])?.pop().unwrap();
+        if unsafe { RedisAI_DAGAddTensorGet.unwrap()(self.inner_run_ctx, name_c_string.as_ptr()) }
+            != REDISMODULE_OK as i32
+        {
+            return Err(format!("Failed adding output '{}' to DAG", name));
+        }
+        Ok(())
+    }
+
+    pub fn run<Callback: FnOnce(Result<Vec<RedisAITensor>, RedisAIError>)>(
+        &mut self,
+        on_done: Callback,
+    ) {
+        if self.inner_run_ctx.is_null() {
+            on_done(Err("Invalid DAG run ctx was used".to_string()));
+            return;
+        }
+        let on_done = Box::into_raw(Box::new(on_done));
+        let mut err: *mut RAI_Error = std::ptr::null_mut();
+        unsafe { RedisAI_InitError.unwrap()(&mut err) };
+        let res = unsafe {
+            RedisAI_DAGRun.unwrap()(
+                self.inner_run_ctx,
+                Some(dag_run_done::<Callback>),
+                on_done as *mut c_void,
+                err,
+            )
+        };
+        if res != REDISMODULE_OK as i32 {
+            // the DAG was not executed, we still own the callback and the DAG.
+            let err_str = unsafe { RedisAI_GetError.unwrap()(err) };
+            let err_c_str = unsafe { CStr::from_ptr(err_str) };
+            let err_rust_string = err_c_str.to_str().unwrap().to_string();
+            unsafe { RedisAI_FreeError.unwrap()(err) };
+            let on_done = unsafe { Box::from_raw(on_done) };
+            on_done(Err(err_rust_string));
+            return;
+        }
+        unsafe { RedisAI_FreeError.unwrap()(err) };
+        // the DAG is now owned by RedisAI and will be freed when the run finishes.
+        self.inner_run_ctx = std::ptr::null_mut();
+    }
+}
+
+impl AIDAGRunnerInterface for RedisAIDAGRunCtx {
+    fn add_input(
+        &mut self,
+        name: &str,
+        tensor: &dyn AITensorInterface,
+    ) -> Result<(), GearsApiError> {
+        let tensor = unsafe { &*(tensor as *const dyn AITensorInterface as *const RedisAITensor) };
+        self.add_input(name, tensor).map_err(GearsApiError::new)
+    }
+
+    fn add_model_run(
+        &mut self,
+        model: &dyn AIModelInterface,
+        inputs: &[&str],
+        outputs: &[&str],
+    ) -> Result<(), GearsApiError> {
+        let model = unsafe { &*(model as *const dyn AIModelInterface as *const RedisAIModel) };
+        self.add_model_run(model, inputs, outputs)
+            .map_err(GearsApiError::new)
+    }
+
+    fn add_script_run(
+        &mut self,
+        script: &dyn AIScriptInterface,
+        func_name: &str,
+        inputs: &[&str],
+        outputs: &[&str],
+    ) -> Result<(), GearsApiError> {
+        let script = unsafe { &*(script as *const dyn AIScriptInterface as *const RedisAIScript) };
+        self.add_script_run(script, func_name, inputs, outputs)
+            .map_err(GearsApiError::new)
+    }
+
+    fn add_ops_from_string(&mut self, ops: &str) -> Result<(), GearsApiError> {
+        self.add_ops_from_string(ops).map_err(GearsApiError::new)
+    }
+
+    fn add_output(&mut self, name: &str) -> Result<(), GearsApiError> {
+        self.add_output(name).map_err(GearsApiError::new)
+    }
+
+    fn run(
+        &mut self,
+        on_done: Box<dyn FnOnce(Result<Vec<Box<dyn AITensorInterface + Send>>, GearsApiError>)>,
+    ) {
+        self.run(move |res| match res {
+            Ok(res) => {
+                let mut v: Vec<Box<dyn AITensorInterface + Send>> = Vec::new();
+                for r in res {
+                    v.push(Box::new(r));
+                }
+                on_done(Ok(v));
+            }
+            Err(e) => on_done(Err(GearsApiError::new(e))),
+        });
+    }
+}
+
+impl Drop for RedisAIDAGRunCtx {
+    fn drop(&mut self) {
+        if !self.inner_run_ctx.is_null() {
+            unsafe { RedisAI_DAGFree.unwrap()(self.inner_run_ctx) };
+        }
+    }
+}
@@ -14,6 +14,7 @@ use crate::redisai_raw::bindings::{
     RedisModuleCtx, RedisModuleString, REDISMODULE_OK, REDISMODULE_READ,
 };
 
+use crate::redisai::redisai_model_batcher::RedisAIBatchedModelRunCtx;
 use crate::redisai::redisai_tensor::RedisAITensor;
 
 use redis_module::Context;
@@ -23,6 +24,7 @@ use std::ffi::{CStr, CString};
 use crate::RedisAIError;
 
 use std::os::raw::c_void;
+use std::time::Duration;
 
 use redisgears_plugin_api::redisgears_plugin_api::redisai_interface::{
     AIModelInterface, AIModelRunnerInterface, AITensorInterface,
@@ -31,7 +33,7 @@ use redisgears_plugin_api::redisgears_plugin_api::redisai_interface::{
 use redisgears_plugin_api::redisgears_plugin_api::GearsApiError;
 
 pub struct RedisAIModel {
-    inner_model: *mut RAI_Model,
+    pub(crate) inner_model: *mut RAI_Model,
 }
 
 impl RedisAIModel {
@@ -65,6 +67,17 @@ impl RedisAIModel {
         Ok(RedisAIModel { inner_model })
     }
 
+    /// Returns a new reference to the same model.
+    pub fn shallow_copy(&self) -> RedisAIModel {
+        let inner_model = unsafe { RedisAI_ModelGetShallowCopy.unwrap()(self.inner_model) };
+        RedisAIModel { inner_model }
+    }
+
+    /// Returns `true` if the given key still holds this model.
+    pub fn is_stored_in_key(&self, ctx: &Context, key_name: &str) -> bool {
+        crate::get_key_module_value(ctx, key_name) == self.inner_model as *mut c_void
+    }
+
     pub fn create_run_ctx(&self) -> RedisAIModelRunCtx {
         let inner_run_ctx = unsafe { RedisAI_ModelRunCtxCreate.unwrap()(self.inner_model) };
         RedisAIModelRunCtx { inner_run_ctx }
@@ -75,6 +88,18 @@ impl AIModelInterface for RedisAIModel {
     fn get_model_runner(&self) -> Box<dyn AIModelRunnerInterface> {
         Box::new(self.create_run_ctx())
     }
+
+    fn get_batched_model_runner(
+        &self,
+        max_batch_size: usize,
+        max_wait: Duration,
+    ) -> Box<dyn AIModelRunnerInterface> {
+        Box::new(RedisAIBatchedModelRunCtx::new(
+            self.shallow_copy(),
+            max_batch_size,
+            max_wait,
+        ))
+    }
 }
 
 impl Drop for RedisAIModel {
@@ -0,0 +1,657 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+//! Micro-batching of model runs. Run requests for the same model (with the
+//! same inputs and outputs names, the same inputs shapes, except for the
+//! first dimension, and the same batching settings) that arrive within a
+//! short window are collected into a single batch. The inputs are
+//! concatenated along the first dimension, the model runs once, and the
+//! outputs are sliced back and given to each of the callers.
+//!
+//! The maximal batch size bounds the sum of the first dimension of the
+//! batched inputs, a run whose own first dimension is bigger is rejected.
+//! Batches are always flushed by the batcher thread, so the callers never
+//! pay for the concatenation.
+
+use crate::redisai::redisai_model::RedisAIModel;
+use crate::redisai::redisai_tensor::RedisAITensor;
+use crate::RedisAIError;
+
+use redisgears_plugin_api::redisgears_plugin_api::redisai_interface::{
+    AIModelRunnerInterface, AITensorInterface,
+};
+use redisgears_plugin_api::redisgears_plugin_api::GearsApiError;
+
+use std::sync::{Condvar, Mutex, Once};
+use std::time::{Duration, Instant};
+
+type BatchOnDone<T> = Box<dyn FnOnce(Result<Vec<T>, RedisAIError>)>;
+
+/// The tensor operations the batching relies on, implemented by
+/// [`RedisAITensor`] (and by fake tensors on the unit tests).
+trait BatchTensor: Sized {
+    fn num_dims(&self) -> usize;
+    fn dim(&self, index: i32) -> i64;
+    fn concat(tensors: &[&Self]) -> Result<Self, RedisAIError>;
+    fn slice(&self, offset: i64, len: i64) -> Result<Self, RedisAIError>;
+}
+
+impl BatchTensor for RedisAITensor {
+    fn num_dims(&self) -> usize {
+        self.num_dims()
+    }
+
+    fn dim(&self, index: i32) -> i64 {
+        self.dim(index)
+    }
+
+    fn concat(tensors: &[&Self]) -> Result<Self, RedisAIError> {
+        RedisAITensor::concat(tensors)
+    }
+
+    fn slice(&self, offset: i64, len: i64) -> Result<Self, RedisAIError> {
+        self.slice(offset, len)
+    }
+}
+
+/// Identifies the requests that can be batched together.
+#[derive(PartialEq)]
+struct BatchKey {
+    model: usize,
+    inputs: Vec<(String, usize, Vec<i64>)>,
+    outputs: Vec<String>,
+    max_batch_size: i64,
+    max_wait: Duration,
+}
+
+struct BatchRequest<T> {
+    inputs: Vec<T>,
+    batch_size: i64,
+    on_done: BatchOnDone<T>,
+}
+
+struct PendingBatch<M, T> {
+    key: BatchKey,
+    model: M,
+    requests: Vec<BatchRequest<T>>,
+    /// The sum of the requests batch sizes.
+    rows: i64,
+    deadline: Instant,
+}
+
+// The callbacks and RedisAI objects are only moved between threads,
+// they are never used concurrently.
+unsafe impl<M, T> Send for PendingBatch<M, T> {}
+
+struct Batches<M, T> {
+    /// Batches that still accept requests.
+    pending: Vec<PendingBatch<M, T>>,
+    /// Batches that are full and wait for the batcher thread to flush them.
+    ready: Vec<PendingBatch<M, T>>,
+}
+
+impl<M, T> Batches<M, T> {
+    const fn new() -> Batches<M, T> {
+        Batches {
+            pending: Vec::new(),
+            ready: Vec::new(),
+        }
+    }
+
+    /// Adds the request to the pending batch with the same key, a new batch
+    /// (of the model returned by `model`) is started if there is no such batch
+    /// or if it has no room for the request. A batch that reaches the maximal
+    /// batch size is moved to the ready batches.
+    fn add(
+        &mut self,
+        key: BatchKey,
+        model: impl FnOnce() -> M,
+        request: BatchRequest<T>,
+        now: Instant,
+    ) {
+        let mut index = self.pending.iter().position(|v| v.key == key);
+        if let Some(i) = index {
+            let batch = &self.pending[i];
+            if batch_fit(batch.rows, request.batch_size, key.max_batch_size)
+                == BatchFit::FlushAndStart
+            {
+                let batch = self.pending.swap_remove(i);
+                self.ready.push(batch);
+                index = None;
+            }
+        }
+        let index = index.unwrap_or_else(|| {
+            let deadline = now + key.max_wait;
+            self.pending.push(PendingBatch {
+                key,
+                model: model(),
+                requests: Vec::new(),
+                rows: 0,
+                deadline,
+            });
+            self.pending.len() - 1
+        });
+        let batch = &mut self.pending[index];
+        let fit = batch_fit(batch.rows, request.batch_size, batch.key.max_batch_size);
+        batch.rows += request.batch_size;
+        batch.requests.push(request);
+        if fit == BatchFit::JoinAndFlush {
+            let batch = self.pending.swap_remove(index);
+            self.ready.push(batch);
+        }
+    }
+
+    /// Moves the pending batches whose deadline passed to the ready batches,
+    /// and returns all the ready batches.
+    fn take_ready(&mut self, now: Instant) -> Vec<PendingBatch<M, T>> {
+        let (expired, rest): (Vec<_>, Vec<_>) =
+            self.pending.drain(..).partition(|v| v.deadline <= now);
+        self.pending = rest;
+        self.ready.extend(expired);
+        std::mem::take(&mut self.ready)
+    }
+
+    /// The nearest deadline of the pending batches.
+    fn next_deadline(&self) -> Option<Instant> {
+        self.pending.iter().map(|v| v.deadline).min()
+    }
+}
+
+static BATCHES: Mutex<Batches<RedisAIModel, RedisAITensor>> = Mutex::new(Batches::new());
+static BATCHES_CONDVAR: Condvar = Condvar::new();
+static START_BATCHER_THREAD: Once = Once::new();
+
+/// Waits for full batches or for the nearest batch deadline and flushes
+/// the batches that are full or expired.
+fn batcher_thread_main() {
+    let mut batches = BATCHES.lock().unwrap();
+    loop {
+        let now = Instant::now();
+        let ready = batches.take_ready(now);
+        if !ready.is_empty() {
+            drop(batches);
+            ready.into_iter().for_each(flush_batch);
+            batches = BATCHES.lock().unwrap();
+            continue;
+        }
+        batches = match batches.next_deadline() {
+            Some(deadline) => {
+                BATCHES_CONDVAR
+                    .wait_timeout(batches, deadline.saturating_duration_since(now))
+                    .unwrap()
+                    .0
+            }
+            None => BATCHES_CONDVAR.wait(batches).unwrap(),
+        };
+    }
+}
+
+/// Concatenates the input at the given index of all the requests, by the
+/// requests order.
+fn concat_requests_inputs<T: BatchTensor>(
+    requests: &[BatchRequest<T>],
+    index: usize,
+) -> Result<T, RedisAIError> {
+    let tensors: Vec<&T> = requests.iter().map(|r| &r.inputs[index]).collect();
+    T::concat(&tensors)
+}
+
+/// Slices the outputs of a batch run back into the outputs of each of the
+/// batched requests, given by their batch sizes (by the requests order).
+fn split_outputs<T: BatchTensor>(
+    outputs: &[T],
+    batch_sizes: &[i64],
+) -> Result<Vec<Result<Vec<T>, RedisAIError>>, RedisAIError> {
+    let total_batch_size: i64 = batch_sizes.iter().sum();
+    if outputs
+        .iter()
+        .any(|o| o.num_dims() == 0 || o.dim(0) != total_batch_size)
+    {
+        return Err("Model outputs first dimension does not match the batch size".to_string());
+    }
+    let mut offset = 0;
+    Ok(batch_sizes
+        .iter()
+        .map(|batch_size| {
+            let res = outputs
+                .iter()
+                .map(|o| o.slice(offset, *batch_size))
+                .collect::<Result<Vec<_>, _>>();
+            offset += batch_size;
+            res
+        })
+        .collect())
+}
+
+/// Runs the model once on the concatenated inputs of all the requests
+/// and gives each request its slice of the outputs.
+fn flush_batch(batch: PendingBatch<RedisAIModel, RedisAITensor>) {
+    let PendingBatch {
+        key,
+        model,
+        mut requests,
+        ..
+    } = batch;
+    let mut run_ctx = model.create_run_ctx();
+    let res = key
+        .inputs
+        .iter()
+        .enumerate()
+        .try_for_each(|(i, (name, ..))| {
+            if requests.len() == 1 {
+                return run_ctx.add_input(name, &requests[0].inputs[i]);
+            }
+            // RedisAI keeps its own reference to the input, we can drop ours.
+            run_ctx.add_input(name, &concat_requests_inputs(&requests, i)?)
+        });
+    let res = res.and_then(|_| {
+        key.outputs
+            .iter()
+            .try_for_each(|name| run_ctx.add_output(name))
+    });
+    if let Err(e) = res {
+        requests
+            .into_iter()
+            .for_each(|r| (r.on_done)(Err(e.clone())));
+        return;
+    }
+    // the inputs are no longer needed, release them before the run.
+    requests.iter_mut().for_each(|r| r.inputs.clear());
+
+    run_ctx.run(move |res| {
+        let outputs = match res {
+            Ok(o) => o,
+            Err(e) => {
+                requests
+                    .into_iter()
+                    .for_each(|r| (r.on_done)(Err(e.clone())));
+                return;
+            }
+        };
+        if requests.len() == 1 {
+            (requests.pop().unwrap().on_done)(Ok(outputs));
+            return;
+        }
+        let batch_sizes: Vec<i64> = requests.iter().map(|r| r.batch_size).collect();
+        match split_outputs(&outputs, &batch_sizes) {
+            Ok(res) => requests
+                .into_iter()
+                .zip(res)
+                .for_each(|(r, res)| (r.on_done)(res)),
+            Err(e) => requests
+                .into_iter()
+                .for_each(|r| (r.on_done)(Err(e.clone()))),
+        }
+    });
+}
+
+/// How a request fits into the pending batch with the same key.
+#[derive(Debug, PartialEq)]
+enum BatchFit {
+    /// The request joins the batch, which still has room for more rows.
+    Join,
+    /// The request joins the batch, which is now full.
+    JoinAndFlush,
+    /// The batch has no room for the request, it is flushed and the
+    /// request starts a new batch.
+    FlushAndStart,
+}
+
+fn batch_fit(batch_rows: i64, rows: i64, max_batch_size: i64) -> BatchFit {
+    match (batch_rows + rows).cmp(&max_batch_size) {
+        std::cmp::Ordering::Less => BatchFit::Join,
+        std::cmp::Ordering::Equal => BatchFit::JoinAndFlush,
+        std::cmp::Ordering::Greater => BatchFit::FlushAndStart,
+    }
+}
+
+/// Adds the request to a pending batch (creating one if needed). The batch
+/// is handed to the batcher thread once it reaches the maximal batch size,
+/// or after the maximal wait time passed.
+fn add_request(key: BatchKey, model: &RedisAIModel, request: BatchRequest<RedisAITensor>) {
+    START_BATCHER_THREAD.call_once(|| {
+        std::thread::Builder::new()
+            .name("RedisAIBatcher".to_string())
+            .spawn(batcher_thread_main)
+            .expect("Failed starting RedisAI batcher thread");
+    });
+    BATCHES
+        .lock()
+        .unwrap()
+        .add(key, || model.shallow_copy(), request, Instant::now());
+    // a new deadline or a full batch, the batcher thread might need to wake up.
+    BATCHES_CONDVAR.notify_one();
+}
+
+/// A model runner that batches its run together with concurrent runs
+/// of the same model.
+pub struct RedisAIBatchedModelRunCtx {
+    model: RedisAIModel,
+    inputs: Vec<(String, RedisAITensor)>,
+    outputs: Vec<String>,
+    max_batch_size: i64,
+    max_wait: Duration,
+}
+
+impl RedisAIBatchedModelRunCtx {
+    pub(crate) fn new(
+        model: RedisAIModel,
+        max_batch_size: usize,
+        max_wait: Duration,
+    ) -> RedisAIBatchedModelRunCtx {
+        RedisAIBatchedModelRunCtx {
+            model,
+            inputs: Vec::new(),
+            outputs: Vec::new(),
+            max_batch_size: max_batch_size as i64,
+            max_wait,
+        }
+    }
+
+    pub fn add_input(&mut self, name: &str, tensor: &RedisAITensor) -> Result<(), RedisAIError> {
+        if tensor.num_dims() == 0 {
+            return Err("Batched model run inputs must have a batch dimension".to_string());
+        }
+        if let Some(first) = self.inputs.first() {
+            if first.1.dim(0) != tensor.dim(0) {
+                return Err("All the inputs must have the same batch size".to_string());
+            }
+        }
+        self.inputs.push((name.to_string(), tensor.shallow_copy()));
+        Ok(())
+    }
+
+    pub fn add_output(&mut self, name: &str) -> Result<(), RedisAIError> {
+        self.outputs.push(name.to_string());
+        Ok(())
+    }
+
+    pub fn run<Callback: FnOnce(Result<Vec<RedisAITensor>, RedisAIError>) + 'static>(
+        &mut self,
+        on_done: Callback,
+    ) {
+        if self.inputs.is_empty() {
+            on_done(Err(
+                "Batched model run requires at least one input".to_string()
+            ));
+            return;
+        }
+        let inputs = std::mem::take(&mut self.inputs);
+        let batch_size = inputs[0].1.dim(0);
+        if batch_size > self.max_batch_size {
+            on_done(Err(format!(
+                "Run batch dimension ({batch_size}) is bigger than the runner batch_size ({})",
+                self.max_batch_size
+            )));
+            return;
+        }
+        let key = BatchKey {
+            model: self.model.inner_model as usize,
+            inputs: inputs
+                .iter()
+                .map(|(name, t)| {
+                    let dims = (1..t.num_dims()).map(|i| t.dim(i as i32)).collect();
+                    (name.clone(), t.data_type(), dims)
+                })
+                .collect(),
+            outputs: std::mem::take(&mut self.outputs),
+            max_batch_size: self.max_batch_size,
+            max_wait: self.max_wait,
+        };
+        let request = BatchRequest {
+            batch_size,
+            inputs: inputs.into_iter().map(|(_, t)| t).collect(),
+            on_done: Box::new(on_done),
+        };
+        add_request(key, &self.model, request);
+    }
+}
+
+impl AIModelRunnerInterface for RedisAIBatchedModelRunCtx {
+    fn add_input(
+        &mut self,
+        name: &str,
+        tensor: &dyn AITensorInterface,
+    ) -> Result<(), GearsApiError> {
+        let tensor = unsafe { &*(tensor as *const dyn AITensorInterface as *const RedisAITensor) };
+        self.add_input(name, tensor).map_err(GearsApiError::new)
+    }
+
+    fn add_output(&mut self, name: &str) -> Result<(), GearsApiError> {
+        self.add_output(name).map_err(GearsApiError::new)
+    }
+
+    fn run(
+        &mut self,
+        on_done: Box<dyn FnOnce(Result<Vec<Box<dyn AITensorInterface + Send>>, GearsApiError>)>,
+    ) {
+        self.run(move |res| match res {
+            Ok(res) => {
+                let mut v: Vec<Box<dyn AITensorInterface + Send>> = Vec::new();
+                for r in res {
+                    v.push(Box::new(r));
+                }
+                on_done(Ok(v));
+            }
+            Err(e) => on_done(Err(GearsApiError::new(e))),
+        });
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// A tensor whose rows are single values, so the concatenation and
+    /// slicing results can be compared by value.
+    #[derive(Debug, PartialEq)]
+    struct FakeTensor {
+        num_dims: usize,
+        rows: Vec<i64>,
+    }
+
+    fn tensor(rows: &[i64]) -> FakeTensor {
+        FakeTensor {
+            num_dims: 1,
+            rows: rows.to_vec(),
+        }
+    }
+
+    impl BatchTensor for FakeTensor {
+        fn num_dims(&self) -> usize {
+            self.num_dims
+        }
+
+        fn dim(&self, index: i32) -> i64 {
+            assert_eq!(index, 0);
+            self.rows.len() as i64
+        }
+
+        fn concat(tensors: &[&Self]) -> Result<Self, RedisAIError> {
+            Ok(tensor(
+                &tensors
+                    .iter()
+                    .flat_map(|t| t.rows.iter().copied())
+                    .collect::<Vec<_>>(),
+            ))
+        }
+
+        fn slice(&self, offset: i64, len: i64) -> Result<Self, RedisAIError> {
+            self.rows
+                .get(offset as usize..(offset + len) as usize)
+                .map(tensor)
+                .ok_or_else(|| "Slice out of range".to_string())
+        }
+    }
+
+    fn key(model: usize, max_batch_size: i64, max_wait: Duration) -> BatchKey {
+        BatchKey {
+            model,
+            inputs: vec![("input".to_string(), 0, Vec::new())],
+            outputs: vec!["output".to_string()],
+            max_batch_size,
+            max_wait,
+        }
+    }
+
+    fn request(rows: &[i64]) -> BatchRequest<FakeTensor> {
+        BatchRequest {
+            inputs: vec![
+                tensor(rows),
+                tensor(&rows.iter().map(|v| -v).collect::<Vec<_>>()),
+            ],
+            batch_size: rows.len() as i64,
+            on_done: Box::new(|_| {}),
+        }
+    }
+
+    fn batches_rows(batches: &[PendingBatch<usize, FakeTensor>]) -> Vec<Vec<i64>> {
+        batches
+            .iter()
+            .map(|b| concat_requests_inputs(&b.requests, 0).unwrap().rows)
+            .collect()
+    }
+
+    #[test]
+    fn test_concat_requests_inputs() {
+        let requests = vec![request(&[1, 2]), request(&[3]), request(&[4, 5, 6])];
+        assert_eq!(
+            concat_requests_inputs(&requests, 0).unwrap(),
+            tensor(&[1, 2, 3, 4, 5, 6])
+        );
+        assert_eq!(
+            concat_requests_inputs(&requests, 1).unwrap(),
+            tensor(&[-1, -2, -3, -4, -5, -6])
+        );
+    }
+
+    #[test]
+    fn test_split_outputs() {
+        let outputs = vec![tensor(&[1, 2, 3, 4, 5, 6]), tensor(&[7, 8, 9, 10, 11, 12])];
+        let res = split_outputs(&outputs, &[2, 1, 3]).unwrap();
+        let res = res
+            .into_iter()
+            .map(|v| v.unwrap())
+            .collect::<Vec<Vec<FakeTensor>>>();
+        assert_eq!(
+            res,
+            vec![
+                vec![tensor(&[1, 2]), tensor(&[7, 8])],
+                vec![tensor(&[3]), tensor(&[9])],
+                vec![tensor(&[4, 5, 6]), tensor(&[10, 11, 12])],
+            ]
+        );
+    }
+
+    #[test]
+    fn test_split_outputs_batch_size_mismatch() {
+        let outputs = vec![tensor(&[1, 2, 3]), tensor(&[4, 5])];
+        assert!(split_outputs(&outputs, &[2, 1]).is_err());
+        let scalar = FakeTensor {
+            num_dims: 0,
+            rows: vec![1, 2, 3],
+        };
+        assert!(split_outputs(&[scalar], &[2, 1]).is_err());
+    }
+
+    #[test]
+    fn test_flush_on_full() {
+        let now = Instant::now();
+        let max_wait = Duration::from_secs(60);
+        let mut batches: Batches<usize, FakeTensor> = Batches::new();
+
+        batches.add(key(1, 4, max_wait), || 1, request(&[1]), now);
+        batches.add(key(1, 4, max_wait), || 1, request(&[2, 3]), now);
+        assert!(batches.ready.is_empty());
+        assert_eq!(batches.pending.len(), 1);
+        assert_eq!(batches.pending[0].rows, 3);
+
+        // a request that does not fit flushes the batch and starts a new one.
+        batches.add(key(1, 4, max_wait), || 1, request(&[4, 5]), now);
+        assert_eq!(batches_rows(&batches.ready), vec![vec![1, 2, 3]]);
+        assert_eq!(batches_rows(&batches.pending), vec![vec![4, 5]]);
+
+        // a request that fills the batch flushes it.
+        batches.add(key(1, 4, max_wait), || 1, request(&[6, 7]), now);
+        assert!(batches.pending.is_empty());
+        assert_eq!(
+            batches_rows(&batches.take_ready(now)),
+            vec![vec![1, 2, 3], vec![4, 5, 6, 7]]
+        );
+        assert!(batches.ready.is_empty());
+        assert_eq!(batches.next_deadline(), None);
+    }
+
+    #[test]
+    fn test_flush_on_full_single_request() {
+        let now = Instant::now();
+        let mut batches: Batches<usize, FakeTensor> = Batches::new();
+        batches.add(
+            key(1, 2, Duration::from_secs(60)),
+            || 1,
+            request(&[1, 2]),
+            now,
+        );
+        assert!(batches.pending.is_empty());
+        assert_eq!(batches_rows(&batches.take_ready(now)), vec![vec![1, 2]]);
+    }
+
+    #[test]
+    fn test_flush_on_timeout() {
+        let now = Instant::now();
+        let mut batches: Batches<usize, FakeTensor> = Batches::new();
+        batches.add(
+            key(1, 8, Duration::from_millis(10)),
+            || 1,
+            request(&[1]),
+            now,
+        );
+        batches.add(
+            key(1, 8, Duration::from_millis(10)),
+            || 1,
+            request(&[2]),
+            now + Duration::from_millis(5),
+        );
+        batches.add(
+            key(2, 8, Duration::from_millis(20)),
+            || 2,
+            request(&[3]),
+            now,
+        );
+
+        // the deadline is set by the first request of the batch.
+        assert_eq!(
+            batches.next_deadline(),
+            Some(now + Duration::from_millis(10))
+        );
+        assert!(batches
+            .take_ready(now + Duration::from_millis(9))
+            .is_empty());
+
+        let ready = batches.take_ready(now + Duration::from_millis(10));
+        assert_eq!(ready.len(), 1);
+        assert_eq!(ready[0].model, 1);
+        assert_eq!(batches_rows(&ready), vec![vec![1, 2]]);
+
+        assert_eq!(
+            batches.next_deadline(),
+            Some(now + Duration::from_millis(20))
+        );
+        let ready = batches.take_ready(now + Duration::from_millis(25));
+        assert_eq!(ready.len(), 1);
+        assert_eq!(ready[0].model, 2);
+        assert_eq!(batches.next_deadline(), None);
+    }
+
+    #[test]
+    fn test_batch_fit() {
+        assert_eq!(batch_fit(0, 1, 4), BatchFit::Join);
+        assert_eq!(batch_fit(2, 1, 4), BatchFit::Join);
+        assert_eq!(batch_fit(3, 1, 4), BatchFit::JoinAndFlush);
+        assert_eq!(batch_fit(0, 4, 4), BatchFit::JoinAndFlush);
+        assert_eq!(batch_fit(3, 2, 4), BatchFit::FlushAndStart);
+    }
+}
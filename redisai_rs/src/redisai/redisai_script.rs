@@ -31,7 +31,7 @@ use redisgears_plugin_api::redisgears_plugin_api::redisai_interface::{
 use redisgears_plugin_api::redisgears_plugin_api::GearsApiError;
 
 pub struct RedisAIScript {
-    inner_script: *mut RAI_Script,
+    pub(crate) inner_script: *mut RAI_Script,
 }
 
 impl RedisAIScript {
@@ -65,6 +65,17 @@ impl RedisAIScript {
         Ok(RedisAIScript { inner_script })
     }
 
+    /// Returns a new reference to the same script.
+    pub fn shallow_copy(&self) -> RedisAIScript {
+        let inner_script = unsafe { RedisAI_ScriptGetShallowCopy.unwrap()(self.inner_script) };
+        RedisAIScript { inner_script }
+    }
+
+    /// Returns `true` if the given key still holds this script.
+    pub fn is_stored_in_key(&self, ctx: &Context, key_name: &str) -> bool {
+        crate::get_key_module_value(ctx, key_name) == self.inner_script as *mut c_void
+    }
+
     pub fn create_run_ctx(&self, func_name: &str) -> RedisAIScriptRunCtx {
         let func_name_c_str = CString::new(func_name).unwrap();
         let inner_run_ctx = unsafe {
@@ -5,9 +5,11 @@
  */
 
 use crate::redisai_raw::bindings::{
-    RAI_Tensor, RedisAI_TensorByteSize, RedisAI_TensorCreate, RedisAI_TensorData,
-    RedisAI_TensorDataSize, RedisAI_TensorDim, RedisAI_TensorFree, RedisAI_TensorLength,
-    RedisAI_TensorNumDims, RedisAI_TensorSetData,
+    RAI_Tensor, RedisAI_TensorByteSize, RedisAI_TensorCreate,
+    RedisAI_TensorCreateByConcatenatingTensors, RedisAI_TensorCreateBySlicingTensor,
+    RedisAI_TensorData, RedisAI_TensorDataSize, RedisAI_TensorDataType, RedisAI_TensorDim,
+    RedisAI_TensorFree, RedisAI_TensorGetShallowCopy, RedisAI_TensorLength, RedisAI_TensorNumDims,
+    RedisAI_TensorSetData,
 };
 use std::ffi::CString;
 
@@ -86,6 +88,46 @@ impl RedisAITensor {
         }
     }
 
+    /// Returns a new reference to the same tensor.
+    pub fn shallow_copy(&self) -> RedisAITensor {
+        RedisAITensor::from_inner(unsafe {
+            RedisAI_TensorGetShallowCopy.unwrap()(self.inner_tensor)
+        })
+    }
+
+    pub fn data_type(&self) -> usize {
+        unsafe { RedisAI_TensorDataType.unwrap()(self.inner_tensor) }
+    }
+
+    /// Creates a new tensor by concatenating the given tensors along the
+    /// first dimension. The tensors must have the same data type and the
+    /// same dimensions (except for the first one).
+    pub fn concat(tensors: &[&RedisAITensor]) -> Result<RedisAITensor, RedisAIError> {
+        let mut inner_tensors: Vec<*mut RAI_Tensor> =
+            tensors.iter().map(|v| v.inner_tensor).collect();
+        let inner_tensor = unsafe {
+            RedisAI_TensorCreateByConcatenatingTensors.unwrap()(
+                inner_tensors.as_mut_ptr(),
+                inner_tensors.len() as i64,
+            )
+        };
+        if inner_tensor.is_null() {
+            return Err("Failed concatenating tensors".to_string());
+        }
+        Ok(RedisAITensor { inner_tensor })
+    }
+
+    /// Creates a new tensor out of `len` entries of the first dimension
+    /// of this tensor, starting at `offset`.
+    pub fn slice(&self, offset: i64, len: i64) -> Result<RedisAITensor, RedisAIError> {
+        let inner_tensor =
+            unsafe { RedisAI_TensorCreateBySlicingTensor.unwrap()(self.inner_tensor, offset, len) };
+        if inner_tensor.is_null() {
+            return Err("Failed slicing tensor".to_string());
+        }
+        Ok(RedisAITensor { inner_tensor })
+    }
+
     pub fn data(&self) -> &[u8] {
         let size = self.bytes_len();
         let data = unsafe { RedisAI_TensorData.unwrap()(self.inner_tensor) };
@@ -0,0 +1,326 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+//! Admission control for the invocations of async functions. Each library
+//! is allowed a bounded number of async invocations in flight (invocations
+//! that blocked the client and did not reply yet) and a bounded background
+//! backlog (pending background jobs and pending async Redis calls).
+//!
+//! An invocation that arrives while the library is at its limits waits on
+//! a bounded queue, with its client blocked, until the library has room for
+//! it or until its deadline passes. If the queue is full (or disabled) the
+//! invocation is rejected with a `TRYAGAIN` error so the client can back off
+//! and retry later.
+//!
+//! The queue is drained when an in flight invocation is done. The backlog
+//! drains without such an event (background jobs and async Redis calls that
+//! are not tied to an invocation), so while the backlog is full the queue is
+//! re-checked on a timer, with an exponential backoff.
+
+use redis_module::{BlockedClient, Context, RedisError, RedisString, ThreadSafeContext};
+
+use crate::config::{
+    ASYNC_CALLS_MAX_IN_FLIGHT, ASYNC_CALLS_QUEUE_SIZE, ASYNC_CALLS_QUEUE_TIMEOUT,
+    BACKGROUND_QUEUE_MAX_DEPTH,
+};
+use crate::{
+    execute_on_pool, get_globals_mut, get_libraries, invoke_admitted_function, library_backlog,
+};
+
+use std::collections::VecDeque;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+/// The first delay before re-checking the queue of a library whose backlog is full.
+const BACKLOG_RECHECK_MIN_DELAY: Duration = Duration::from_millis(1);
+
+/// The maximal delay before re-checking the queue of a library whose backlog is full.
+const BACKLOG_RECHECK_MAX_DELAY: Duration = Duration::from_millis(100);
+
+/// The admission state that is shared with the in flight guards, which
+/// might be dropped on any thread.
+#[derive(Default)]
+struct SharedAdmission {
+    in_flight: AtomicUsize,
+    /// Set as long as there are waiting invocations.
+    has_waiting: AtomicBool,
+    /// Set when a drain of the waiting invocations is scheduled.
+    drain_scheduled: AtomicBool,
+}
+
+/// Counts an async invocation as in flight until dropped. Dropping the
+/// guard while invocations are waiting schedules a drain of the queue.
+pub(crate) struct InFlightGuard {
+    shared: Arc<SharedAdmission>,
+    lib_name: String,
+}
+
+impl Drop for InFlightGuard {
+    fn drop(&mut self) {
+        self.shared.in_flight.fetch_sub(1, Ordering::SeqCst);
+        if !self.shared.has_waiting.load(Ordering::SeqCst)
+            || self.shared.drain_scheduled.swap(true, Ordering::SeqCst)
+        {
+            return;
+        }
+        // The guard might be dropped on the main thread or on a background
+        // thread, so the drain is scheduled from the thread pool where it is
+        // always safe to lock Redis.
+        let lib_name = std::mem::take(&mut self.lib_name);
+        execute_on_pool(move || {
+            let ctx_guard = ThreadSafeContext::new().lock();
+            ctx_guard.create_timer(Duration::ZERO, on_drain, lib_name);
+        });
+    }
+}
+
+/// An invocation waiting for the library to have room for it.
+pub(crate) struct WaitingCall {
+    pub(crate) function_name: String,
+    pub(crate) args: Vec<Vec<u8>>,
+    pub(crate) user: RedisString,
+    pub(crate) blocked_client: BlockedClient,
+    enqueued_at: Instant,
+    deadline: Instant,
+}
+
+/// The admission decision of a new async invocation.
+pub(crate) enum Admission {
+    /// The invocation can run now.
+    Admitted,
+    /// The invocation should wait on the queue.
+    Wait,
+    /// The invocation is rejected.
+    Rejected,
+}
+
+/// The admission state and statistics of a single library.
+#[derive(Default)]
+pub(crate) struct LibraryAdmission {
+    shared: Arc<SharedAdmission>,
+    waiting: VecDeque<WaitingCall>,
+    /// Set when a timer is armed for the deadline of the first waiting invocation.
+    deadline_timer_armed: bool,
+    /// Set when a timer is armed to re-check the queue while the backlog is full.
+    backlog_recheck_armed: bool,
+    /// The delay of the next backlog re-check, doubled on each re-check
+    /// that finds the backlog still full.
+    backlog_recheck_delay: Duration,
+    pub(crate) rejected: usize,
+    pub(crate) timed_out: usize,
+    pub(crate) waited: usize,
+    pub(crate) total_wait_time: Duration,
+    pub(crate) max_wait_time: Duration,
+}
+
+/// The error returned to a rejected invocation.
+pub(crate) fn rejected_error(lib_name: &str) -> RedisError {
+    RedisError::String(format!(
+        "TRYAGAIN The library '{lib_name}' reached its limit of async invocations, try again later"
+    ))
+}
+
+impl LibraryAdmission {
+    pub(crate) fn in_flight(&self) -> usize {
+        self.shared.in_flight.load(Ordering::SeqCst)
+    }
+
+    pub(crate) fn waiting(&self) -> usize {
+        self.waiting.len()
+    }
+
+    /// Count a new async invocation of the given library as in flight,
+    /// until the returned guard is dropped.
+    pub(crate) fn in_flight_guard(&self, lib_name: &str) -> InFlightGuard {
+        self.shared.in_flight.fetch_add(1, Ordering::SeqCst);
+        InFlightGuard {
+            shared: Arc::clone(&self.shared),
+            lib_name: lib_name.to_owned(),
+        }
+    }
+
+    /// Returns `true` if the library reached its limit of async invocations in flight.
+    fn in_flight_full(&self) -> bool {
+        let max_in_flight = ASYNC_CALLS_MAX_IN_FLIGHT.load(Ordering::Relaxed) as usize;
+        max_in_flight > 0 && self.in_flight() >= max_in_flight
+    }
+
+    /// Returns `true` if the library has room for another async invocation.
+    /// The backlog is only computed if it is limited.
+    fn has_room<F: FnOnce() -> usize>(&self, backlog: F) -> bool {
+        if self.in_flight_full() {
+            return false;
+        }
+        let max_backlog = BACKGROUND_QUEUE_MAX_DEPTH.load(Ordering::Relaxed) as usize;
+        max_backlog == 0 || backlog() < max_backlog
+    }
+
+    /// Decide whether a new async invocation can run now, should wait on
+    /// the queue, or is rejected. Invocations that arrive while others are
+    /// waiting are queued behind them.
+    pub(crate) fn admit<F: FnOnce() -> usize>(&mut self, can_wait: bool, backlog: F) -> Admission {
+        if self.waiting.is_empty() && self.has_room(backlog) {
+            return Admission::Admitted;
+        }
+        let queue_size = ASYNC_CALLS_QUEUE_SIZE.load(Ordering::Relaxed) as usize;
+        if can_wait && self.waiting.len() < queue_size {
+            return Admission::Wait;
+        }
+        self.rejected += 1;
+        Admission::Rejected
+    }
+
+    /// Queue an invocation whose client was blocked, the invocation
+    /// will run once an in flight invocation of the library is done and
+    /// the library has room for it.
+    pub(crate) fn wait(
+        &mut self,
+        ctx: &Context,
+        lib_name: &str,
+        function_name: &str,
+        args: Vec<Vec<u8>>,
+        user: RedisString,
+        blocked_client: BlockedClient,
+    ) {
+        let now = Instant::now();
+        let timeout =
+            Duration::from_millis(ASYNC_CALLS_QUEUE_TIMEOUT.load(Ordering::Relaxed) as u64);
+        self.waiting.push_back(WaitingCall {
+            function_name: function_name.to_owned(),
+            args,
+            user,
+            blocked_client,
+            enqueued_at: now,
+            deadline: now + timeout,
+        });
+        if self.waiting.len() == 1 {
+            self.shared.has_waiting.store(true, Ordering::SeqCst);
+            // An in flight invocation might have finished before it could
+            // see the waiting invocation, check the queue once more.
+            if !self.shared.drain_scheduled.swap(true, Ordering::SeqCst) {
+                ctx.create_timer(Duration::ZERO, on_drain, lib_name.to_owned());
+            }
+        }
+        self.arm_deadline_timer(ctx, lib_name);
+    }
+
+    /// Arm a timer for the deadline of the first waiting invocation,
+    /// unless one is already armed.
+    fn arm_deadline_timer(&mut self, ctx: &Context, lib_name: &str) {
+        if self.deadline_timer_armed {
+            return;
+        }
+        if let Some(front) = self.waiting.front() {
+            self.deadline_timer_armed = true;
+            ctx.create_timer(
+                front.deadline.saturating_duration_since(Instant::now()),
+                on_deadline,
+                lib_name.to_owned(),
+            );
+        }
+    }
+
+    /// Arm a timer to re-check the queue while the backlog is full, unless
+    /// one is already armed. Each re-check doubles the delay of the next one.
+    fn arm_backlog_recheck_timer(&mut self, ctx: &Context, lib_name: &str) {
+        if self.backlog_recheck_armed {
+            return;
+        }
+        self.backlog_recheck_armed = true;
+        let delay = self.backlog_recheck_delay.max(BACKLOG_RECHECK_MIN_DELAY);
+        self.backlog_recheck_delay = (delay * 2).min(BACKLOG_RECHECK_MAX_DELAY);
+        ctx.create_timer(delay, on_backlog_recheck, lib_name.to_owned());
+    }
+}
+
+/// Removes the admission state of a deleted library, the waiting
+/// invocations are rejected.
+pub(crate) fn remove_library_admission(lib_name: &str) {
+    let admission = match get_globals_mut().library_admissions.remove(lib_name) {
+        Some(a) => a,
+        None => return,
+    };
+    for call in admission.waiting {
+        ThreadSafeContext::with_blocked_client(call.blocked_client).reply(Err(RedisError::String(
+            format!("The library '{lib_name}' was deleted while the invocation was waiting"),
+        )));
+    }
+}
+
+fn on_drain(ctx: &Context, lib_name: String) {
+    if let Some(admission) = get_globals_mut().library_admissions.get_mut(&lib_name) {
+        admission
+            .shared
+            .drain_scheduled
+            .store(false, Ordering::SeqCst);
+        process_waiting_calls(ctx, &lib_name);
+    }
+}
+
+fn on_deadline(ctx: &Context, lib_name: String) {
+    if let Some(admission) = get_globals_mut().library_admissions.get_mut(&lib_name) {
+        admission.deadline_timer_armed = false;
+        process_waiting_calls(ctx, &lib_name);
+    }
+}
+
+fn on_backlog_recheck(ctx: &Context, lib_name: String) {
+    if let Some(admission) = get_globals_mut().library_admissions.get_mut(&lib_name) {
+        admission.backlog_recheck_armed = false;
+        process_waiting_calls(ctx, &lib_name);
+    }
+}
+
+/// Runs the waiting invocations of the given library as long as the library
+/// has room for them, and rejects the invocations whose deadline has passed.
+fn process_waiting_calls(ctx: &Context, lib_name: &str) {
+    loop {
+        // The library might be deleted by the invocation that just ran.
+        let admission = match get_globals_mut().library_admissions.get_mut(lib_name) {
+            Some(a) => a,
+            None => return,
+        };
+        let front = match admission.waiting.front() {
+            Some(c) => c,
+            None => {
+                admission.shared.has_waiting.store(false, Ordering::SeqCst);
+                return;
+            }
+        };
+        if front.deadline <= Instant::now() {
+            let call = admission.waiting.pop_front().unwrap();
+            admission.timed_out += 1;
+            ThreadSafeContext::with_blocked_client(call.blocked_client).reply(Err(
+                RedisError::String(format!(
+                    "TRYAGAIN Timed out waiting for the library '{lib_name}' to accept the async invocation, try again later"
+                )),
+            ));
+            continue;
+        }
+        let has_room = admission.has_room(|| {
+            get_libraries()
+                .get(lib_name)
+                .map_or(0, |l| library_backlog(l))
+        });
+        if !has_room {
+            admission.arm_deadline_timer(ctx, lib_name);
+            if !admission.in_flight_full() {
+                // Waiting for the backlog, which drains without notifying us.
+                admission.arm_backlog_recheck_timer(ctx, lib_name);
+            }
+            return;
+        }
+        admission.backlog_recheck_delay = BACKLOG_RECHECK_MIN_DELAY;
+        let call = admission.waiting.pop_front().unwrap();
+        let wait_time = call.enqueued_at.elapsed();
+        admission.waited += 1;
+        admission.total_wait_time += wait_time;
+        admission.max_wait_time = admission.max_wait_time.max(wait_time);
+        let in_flight = admission.in_flight_guard(lib_name);
+        invoke_admitted_function(ctx, lib_name, call, in_flight);
+    }
+}
@@ -6,22 +6,31 @@
 
 use redisgears_plugin_api::redisgears_plugin_api::load_library_ctx::FunctionFlags;
 use redisgears_plugin_api::redisgears_plugin_api::{
-    run_function_ctx::BackgroundRunFunctionCtxInterface, run_function_ctx::RedisClientCtxInterface,
-    run_function_ctx::RemoteFunctionData, GearsApiError,
+    run_function_ctx::BackgroundRunFunctionCtxInterface, run_function_ctx::KeysScanInterface,
+    run_function_ctx::KeysScanOptions, run_function_ctx::RedisClientCtxInterface,
+    run_function_ctx::RemoteFunctionData, run_function_ctx::RemoteFunctionKey, GearsApiError,
 };
 
 use crate::background_run_scope_guard::BackgroundRunScopeGuardCtx;
+use crate::keys_scan::KeysScan;
+use crate::lazy_library::materialize_library;
 use crate::run_ctx::RedisClientCallOptions;
 use crate::{
-    get_libraries, verify_ok_on_replica, verify_oom, Deserialize, GearsLibraryMetaData, Serialize,
+    execute_on_pool, get_libraries, verify_ok_on_replica, verify_oom, Deserialize, GearsLibrary,
+    GearsLibraryMetaData, Serialize,
 };
 
-use redis_module::{RedisString, RedisValue};
+use redis_module::{Context, RedisString, RedisValue, ThreadSafeContext};
 
-use std::sync::atomic::Ordering;
-use std::sync::Arc;
+use std::collections::{BTreeMap, HashMap};
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex, Once};
+use std::time::{Duration, Instant};
 
-use mr::libmr::{calc_slot, record::Record, remote_task::RemoteTask, RustMRError};
+use mr::libmr::{
+    calc_slot, is_cluster_in_cluster_mode, is_my_slot, record::Record, remote_task::RemoteTask,
+    RustMRError,
+};
 
 use mr_derive::BaseObject;
 
@@ -60,13 +69,7 @@ impl Record for GearsRemoteFunctionInputsRecord {
         RedisValue::Array(
             self.inputs
                 .iter()
-                .map(|v| {
-                    let buff = match v {
-                        RemoteFunctionData::Binary(b) => b,
-                        RemoteFunctionData::String(s) => s.as_bytes(),
-                    };
-                    RedisValue::StringBuffer(buff.to_vec())
-                })
+                .map(|v| RedisValue::StringBuffer(v.as_bytes().to_vec()))
                 .collect(),
         )
     }
@@ -83,22 +86,99 @@ pub(crate) struct GearsRemoteFunctionOutputRecord {
 
 impl Record for GearsRemoteFunctionOutputRecord {
     fn to_redis_value(&mut self) -> RedisValue {
-        let buff = match &self.output {
-            RemoteFunctionData::Binary(b) => b,
-            RemoteFunctionData::String(s) => s.as_bytes(),
-        };
-        RedisValue::StringBuffer(buff.to_vec())
+        RedisValue::StringBuffer(self.output.as_bytes().to_vec())
     }
 
     fn hash_slot(&self) -> usize {
-        let buff = match &self.output {
-            RemoteFunctionData::Binary(b) => b,
-            RemoteFunctionData::String(s) => s.as_bytes(),
-        };
-        calc_slot(buff)
+        calc_slot(self.output.as_bytes())
+    }
+}
+
+/// Number of `runOnKey` invocations that were executed on the current shard,
+/// without serializing the inputs and going through the cluster messaging.
+pub(crate) static RUN_ON_KEY_LOCAL_EXECUTIONS: AtomicUsize = AtomicUsize::new(0);
+
+/// Number of `runOnKey` invocations that were sent to another shard.
+pub(crate) static RUN_ON_KEY_REMOTE_EXECUTIONS: AtomicUsize = AtomicUsize::new(0);
+
+#[derive(Clone, Serialize, Deserialize, BaseObject)]
+pub(crate) struct GearsRemoteFunctionBatchInputsRecord {
+    keys: Vec<RemoteFunctionKey>,
+    inputs: Vec<RemoteFunctionData>,
+}
+
+impl Record for GearsRemoteFunctionBatchInputsRecord {
+    fn to_redis_value(&mut self) -> RedisValue {
+        RedisValue::Array(
+            self.keys
+                .iter()
+                .map(|v| RedisValue::StringBuffer(v.name.clone()))
+                .collect(),
+        )
+    }
+
+    fn hash_slot(&self) -> usize {
+        1 // not relevant here
+    }
+}
+
+/// The results of a batch remote function invocation on a single shard.
+/// Each result is coupled with the index of its key in the original
+/// keys list.
+#[derive(Clone, Serialize, Deserialize, BaseObject)]
+pub(crate) struct GearsRemoteFunctionBatchOutputRecord {
+    results: Vec<(usize, Result<RemoteFunctionData, String>)>,
+}
+
+impl Record for GearsRemoteFunctionBatchOutputRecord {
+    fn to_redis_value(&mut self) -> RedisValue {
+        RedisValue::Array(
+            self.results
+                .iter()
+                .map(|(_, v)| match v {
+                    Ok(r) => RedisValue::StringBuffer(r.as_bytes().to_vec()),
+                    Err(e) => RedisValue::BulkString(e.clone()),
+                })
+                .collect(),
+        )
+    }
+
+    fn hash_slot(&self) -> usize {
+        1 // not relevant here
     }
 }
 
+/// Returns the library to run the given remote function from, materializing
+/// the library if it was loaded lazily.
+fn get_remote_function_library(
+    lib_name: &str,
+    job_name: &str,
+) -> Result<Arc<GearsLibrary>, String> {
+    let is_lazy = get_libraries()
+        .get(lib_name)
+        .map_or(false, |l| l.lazy.is_some());
+    if is_lazy {
+        // the library was loaded lazily, it must be materialized before use.
+        let ctx_guard = ThreadSafeContext::new().lock();
+        materialize_library(&ctx_guard, lib_name).map_err(|e| e.to_string())?;
+    }
+    let library = get_libraries()
+        .get(lib_name)
+        .map(Arc::clone) // make sure the library will not be free while in use
+        .ok_or_else(|| format!("Library {} does not exists on remote shard", lib_name))?;
+    if !library
+        .gears_lib_ctx
+        .remote_functions
+        .contains_key(job_name)
+    {
+        return Err(format!(
+            "Remote function {} does not exists on library {}",
+            job_name, lib_name
+        ));
+    }
+    Ok(library)
+}
+
 #[derive(Clone, Serialize, Deserialize, BaseObject)]
 pub(crate) struct GearsRemoteTask {
     lib_name: String,
@@ -115,27 +195,18 @@ impl RemoteTask for GearsRemoteTask {
         r: Self::InRecord,
         on_done: Box<dyn FnOnce(Result<Self::OutRecord, RustMRError>) + Send>,
     ) {
-        let library = {
-            let libraries = get_libraries();
-            let library = libraries.get(&self.lib_name);
-            if library.is_none() {
-                on_done(Err(format!(
-                    "Library {} does not exists on remote shard",
-                    self.lib_name
-                )));
+        let library = match get_remote_function_library(&self.lib_name, &self.job_name) {
+            Ok(l) => l,
+            Err(e) => {
+                on_done(Err(e));
                 return;
             }
-            Arc::clone(library.unwrap()) // make sure the library will not be free while in use
         };
-        let remote_function = library.gears_lib_ctx.remote_functions.get(&self.job_name);
-        if remote_function.is_none() {
-            on_done(Err(format!(
-                "Remote function {} does not exists on library {}",
-                self.job_name, self.lib_name
-            )));
-            return;
-        }
-        let remote_function = remote_function.unwrap();
+        let remote_function = library
+            .gears_lib_ctx
+            .remote_functions
+            .get(&self.job_name)
+            .unwrap();
         remote_function(
             r.inputs,
             Box::new(BackgroundRunCtx::new(
@@ -154,6 +225,518 @@ impl RemoteTask for GearsRemoteTask {
     }
 }
 
+/// Runs a remote function for each of the keys (out of a given list of keys)
+/// that belongs to the current shard.
+#[derive(Clone, Serialize, Deserialize, BaseObject)]
+pub(crate) struct GearsRemoteBatchTask {
+    lib_name: String,
+    job_name: String,
+    user: RedisString,
+}
+
+impl RemoteTask for GearsRemoteBatchTask {
+    type InRecord = GearsRemoteFunctionBatchInputsRecord;
+    type OutRecord = GearsRemoteFunctionBatchOutputRecord;
+
+    fn task(
+        self,
+        r: Self::InRecord,
+        on_done: Box<dyn FnOnce(Result<Self::OutRecord, RustMRError>) + Send>,
+    ) {
+        let is_cluster = is_cluster_in_cluster_mode();
+        let keys: Vec<(usize, RemoteFunctionKey)> = r
+            .keys
+            .into_iter()
+            .enumerate()
+            .filter(|(_, k)| !is_cluster || is_my_slot(calc_slot(&k.name)))
+            .collect();
+        if keys.is_empty() {
+            on_done(Ok(GearsRemoteFunctionBatchOutputRecord {
+                results: Vec::new(),
+            }));
+            return;
+        }
+
+        let library = match get_remote_function_library(&self.lib_name, &self.job_name) {
+            Ok(l) => l,
+            Err(e) => {
+                on_done(Err(e));
+                return;
+            }
+        };
+        let remote_function = library
+            .gears_lib_ctx
+            .remote_functions
+            .get(&self.job_name)
+            .unwrap();
+
+        let keys_count = keys.len();
+        let results = Arc::new(Mutex::new((Vec::with_capacity(keys_count), Some(on_done))));
+        for (index, key) in keys {
+            let mut inputs = Vec::with_capacity(r.inputs.len() + 1);
+            inputs.push(key.arg);
+            inputs.extend(r.inputs.iter().cloned());
+            let results = Arc::clone(&results);
+            remote_function(
+                inputs,
+                Box::new(BackgroundRunCtx::new(
+                    self.user.clone(),
+                    &library.gears_lib_ctx.meta_data,
+                    RedisClientCallOptions::new(FunctionFlags::NO_WRITES),
+                )),
+                Box::new(move |result| {
+                    let mut results = results.lock().unwrap();
+                    results
+                        .0
+                        .push((index, result.map_err(|e| e.get_msg().to_string())));
+                    if results.0.len() < keys_count {
+                        return;
+                    }
+                    let output = GearsRemoteFunctionBatchOutputRecord {
+                        results: std::mem::take(&mut results.0),
+                    };
+                    let on_done = results.1.take().unwrap();
+                    drop(results);
+                    on_done(Ok(output));
+                }),
+            );
+        }
+    }
+}
+
+/// The `on_done` callback of a remote function that runs on the current shard.
+/// The remote function API requires the callback to be [`Send`], the callback
+/// is invoked at most once (either with the result or with a timeout error),
+/// just like the callbacks we give to LibMR.
+struct LocalRemoteFunctionDone(Box<dyn FnOnce(Result<RemoteFunctionData, GearsApiError>)>);
+
+unsafe impl Send for LocalRemoteFunctionDone {}
+
+/// The `on_done` callback of a remote function that runs on the current
+/// shard, shared with its deadline. Whichever comes first takes it.
+type SharedLocalRemoteFunctionDone = Arc<Mutex<Option<LocalRemoteFunctionDone>>>;
+
+impl LocalRemoteFunctionDone {
+    fn call(
+        on_done: &SharedLocalRemoteFunctionDone,
+        res: Result<RemoteFunctionData, GearsApiError>,
+    ) {
+        if let Some(on_done) = on_done.lock().unwrap().take() {
+            (on_done.0)(res);
+        }
+    }
+}
+
+/// A deadline armed by [`LocalRemoteFunctionsDeadlines::arm`].
+type DeadlineKey = (Instant, u64);
+
+/// The deadlines of the remote functions that run on the current shard.
+/// Arming and cancelling a deadline does not require the Redis GIL, a
+/// dedicated thread sleeps until the nearest deadline and fails the
+/// invocations whose deadline passed.
+struct LocalRemoteFunctionsDeadlines {
+    deadlines: Mutex<BTreeMap<DeadlineKey, SharedLocalRemoteFunctionDone>>,
+    condvar: Condvar,
+    next_id: AtomicU64,
+    thread_started: Once,
+}
+
+lazy_static::lazy_static! {
+    static ref LOCAL_REMOTE_FUNCTIONS_DEADLINES: LocalRemoteFunctionsDeadlines =
+        LocalRemoteFunctionsDeadlines {
+            deadlines: Mutex::new(BTreeMap::new()),
+            condvar: Condvar::new(),
+            next_id: AtomicU64::new(0),
+            thread_started: Once::new(),
+        };
+}
+
+impl LocalRemoteFunctionsDeadlines {
+    /// Fail the given invocation with a timeout error once the given timeout
+    /// has passed, unless the deadline is cancelled before that.
+    fn arm(
+        &'static self,
+        timeout: Duration,
+        on_done: &SharedLocalRemoteFunctionDone,
+    ) -> DeadlineKey {
+        self.thread_started.call_once(|| {
+            std::thread::Builder::new()
+                .name("RGRemoteDeadlines".to_owned())
+                .spawn(move || self.run())
+                .expect("Failed starting the remote functions deadlines thread");
+        });
+        let key = (
+            Instant::now() + timeout,
+            self.next_id.fetch_add(1, Ordering::Relaxed),
+        );
+        let mut deadlines = self.deadlines.lock().unwrap();
+        let is_nearest = deadlines.keys().next().map_or(true, |v| key < *v);
+        deadlines.insert(key, Arc::clone(on_done));
+        if is_nearest {
+            self.condvar.notify_one();
+        }
+        key
+    }
+
+    fn cancel(&self, key: &DeadlineKey) {
+        self.deadlines.lock().unwrap().remove(key);
+    }
+
+    fn run(&self) {
+        let mut deadlines = self.deadlines.lock().unwrap();
+        loop {
+            let now = Instant::now();
+            deadlines = match deadlines.keys().next().copied() {
+                None => self.condvar.wait(deadlines).unwrap(),
+                Some((deadline, _)) if deadline > now => {
+                    self.condvar
+                        .wait_timeout(deadlines, deadline - now)
+                        .unwrap()
+                        .0
+                }
+                Some(key) => {
+                    let on_done = deadlines.remove(&key).unwrap();
+                    drop(deadlines);
+                    LocalRemoteFunctionDone::call(
+                        &on_done,
+                        Err(GearsApiError::new("Remote task timeout")),
+                    );
+                    self.deadlines.lock().unwrap()
+                }
+            };
+        }
+    }
+}
+
+impl BackgroundRunCtx {
+    /// Runs the remote function on the current shard. The invocation is handed
+    /// to the module thread pool, the caller might hold the V8 isolate lock and
+    /// we must not take the libraries lock (or the Redis GIL) while holding it.
+    /// The invocation is bounded by the same timeout as a remote task, the
+    /// deadline is cancelled once the invocation is done.
+    fn run_remote_function_locally(
+        &self,
+        job_name: &str,
+        inputs: Vec<RemoteFunctionData>,
+        on_done: Box<dyn FnOnce(Result<RemoteFunctionData, GearsApiError>)>,
+    ) {
+        let on_done = Arc::new(Mutex::new(Some(LocalRemoteFunctionDone(on_done))));
+        let deadline = LOCAL_REMOTE_FUNCTIONS_DEADLINES.arm(
+            Duration::from_millis(REMOTE_TASK_DEFAULT_TIMEOUT.load(Ordering::Relaxed) as u64),
+            &on_done,
+        );
+        let job_name = job_name.to_string();
+        let run_ctx = BackgroundRunCtx::new(
+            self.user.clone(),
+            &self.lib_meta_data,
+            self.call_options.clone(),
+        );
+        execute_on_pool(move || {
+            let library = match get_remote_function_library(&run_ctx.lib_meta_data.name, &job_name)
+            {
+                Ok(l) => l,
+                Err(e) => {
+                    LOCAL_REMOTE_FUNCTIONS_DEADLINES.cancel(&deadline);
+                    LocalRemoteFunctionDone::call(&on_done, Err(GearsApiError::new(e)));
+                    return;
+                }
+            };
+            let remote_function = library
+                .gears_lib_ctx
+                .remote_functions
+                .get(&job_name)
+                .unwrap();
+            remote_function(
+                inputs,
+                Box::new(BackgroundRunCtx::new(
+                    run_ctx.user,
+                    &library.gears_lib_ctx.meta_data,
+                    RedisClientCallOptions::new(FunctionFlags::NO_WRITES),
+                )),
+                Box::new(move |result| {
+                    LOCAL_REMOTE_FUNCTIONS_DEADLINES.cancel(&deadline);
+                    LocalRemoteFunctionDone::call(&on_done, result);
+                }),
+            );
+        });
+    }
+}
+
+/// The `on_done` callback of `runOnKeys`, see [`LocalRemoteFunctionDone`].
+struct RunOnKeysDone(Box<dyn FnOnce(Vec<Result<RemoteFunctionData, GearsApiError>>)>);
+
+unsafe impl Send for RunOnKeysDone {}
+
+/// The results of a `runOnKeys` invocation, collected from the shards.
+struct RunOnKeysState {
+    results: Vec<Option<Result<RemoteFunctionData, GearsApiError>>>,
+    pending_groups: usize,
+    on_done: Option<RunOnKeysDone>,
+}
+
+impl RunOnKeysState {
+    /// Set the results of a group of keys that was sent to a single shard,
+    /// `indexes` are the indexes of the keys in the original keys list. If
+    /// the shard failed, its error is set as the result of all its keys.
+    fn group_done(
+        &mut self,
+        indexes: &[usize],
+        result: Result<GearsRemoteFunctionBatchOutputRecord, RustMRError>,
+    ) {
+        match result {
+            Ok(output) => output.results.into_iter().for_each(|(index, res)| {
+                if let Some(r) = indexes.get(index).and_then(|i| self.results.get_mut(*i)) {
+                    *r = Some(res.map_err(GearsApiError::new));
+                }
+            }),
+            Err(e) => indexes.iter().for_each(|i| {
+                self.results[*i] = Some(Err(GearsApiError::new(&e)));
+            }),
+        }
+        self.pending_groups -= 1;
+        if self.pending_groups > 0 {
+            return;
+        }
+        self.finish(None);
+    }
+
+    /// Set the results of the keys that were sent to all the shards, used when
+    /// the cluster topology is not known. Each shard handles only the keys it owns.
+    fn all_shards_done(
+        &mut self,
+        outputs: Vec<GearsRemoteFunctionBatchOutputRecord>,
+        errors: Vec<RustMRError>,
+    ) {
+        for output in outputs {
+            output.results.into_iter().for_each(|(index, res)| {
+                if let Some(r) = self.results.get_mut(index) {
+                    *r = Some(res.map_err(GearsApiError::new));
+                }
+            });
+        }
+        // we can not tell which keys belong to a shard that failed, a key
+        // with no result is failed with the shard error.
+        self.finish(errors.into_iter().next());
+    }
+
+    fn finish(&mut self, shard_error: Option<RustMRError>) {
+        let mut unhandled = false;
+        let results = std::mem::take(&mut self.results)
+            .into_iter()
+            .map(|r| {
+                r.unwrap_or_else(|| {
+                    unhandled = true;
+                    Err(GearsApiError::new(
+                        shard_error
+                            .as_deref()
+                            .unwrap_or("Key was not handled by any shard"),
+                    ))
+                })
+            })
+            .collect();
+        if unhandled {
+            // A key with no result was not owned by the shard it was sent to
+            // (for example, during resharding), the slots map is outdated.
+            SLOTS_MAP.invalidate();
+        }
+        if let Some(on_done) = self.on_done.take() {
+            (on_done.0)(results);
+        }
+    }
+}
+
+/// The callbacks of `run_on_all_shards_incremental`, see [`LocalRemoteFunctionDone`].
+struct RunOnShardsCallbacks {
+    on_shard_done: Box<dyn FnMut(Result<RemoteFunctionData, GearsApiError>)>,
+    on_done: Option<Box<dyn FnOnce()>>,
+    pending_shards: usize,
+}
+
+unsafe impl Send for RunOnShardsCallbacks {}
+
+impl RunOnShardsCallbacks {
+    fn shard_done(&mut self, result: Result<RemoteFunctionData, GearsApiError>) {
+        (self.on_shard_done)(result);
+        self.pending_shards -= 1;
+        if self.pending_shards > 0 {
+            return;
+        }
+        if let Some(on_done) = self.on_done.take() {
+            on_done();
+        }
+    }
+}
+
+/// Returns a key that hashes into the given slot, used to route a remote
+/// task to the shard that serves the slot.
+fn routing_key_for_slot(slot: usize) -> Vec<u8> {
+    (0usize..)
+        .map(|i| i.to_string().into_bytes())
+        .find(|k| calc_slot(k) == slot)
+        .unwrap()
+}
+
+/// The slots ranges of the cluster and the id of the node that serves each range.
+type SlotsRanges = Arc<Vec<(usize, usize, String)>>;
+
+/// How often the cached slots map is refreshed, in case the topology changed
+/// without us noticing it.
+const SLOTS_MAP_REFRESH_INTERVAL: Duration = Duration::from_secs(1);
+
+/// A cache of the cluster slots map. Taking the slots map runs `CLUSTER SLOTS`
+/// under the Redis GIL, so it is not done for each remote function invocation.
+/// The cache is refreshed from the cron, periodically or as soon as it is
+/// invalidated because a key was sent to a shard that does not own it.
+struct SlotsMap {
+    ranges: Mutex<Option<(SlotsRanges, Instant)>>,
+    invalidated: AtomicBool,
+}
+
+lazy_static::lazy_static! {
+    static ref SLOTS_MAP: SlotsMap = SlotsMap {
+        ranges: Mutex::new(None),
+        invalidated: AtomicBool::new(false),
+    };
+}
+
+impl SlotsMap {
+    /// Returns the cached slots map, take it (under the Redis GIL) if it was
+    /// never taken. Must not be called while holding the Redis GIL.
+    fn get(&self) -> SlotsRanges {
+        if let Some((ranges, _)) = self.ranges.lock().unwrap().as_ref() {
+            return Arc::clone(ranges);
+        }
+        // do not hold the cache lock while waiting for the GIL, the cron
+        // takes them in the opposite order.
+        let ranges = {
+            let ctx_guard = ThreadSafeContext::new().lock();
+            Arc::new(get_slots_ranges(&ctx_guard))
+        };
+        *self.ranges.lock().unwrap() = Some((Arc::clone(&ranges), Instant::now()));
+        ranges
+    }
+
+    fn invalidate(&self) {
+        self.invalidated.store(true, Ordering::Relaxed);
+    }
+
+    /// Refresh the cached slots map if it was invalidated or is too old.
+    fn refresh(&self, ctx: &Context) {
+        let expired = self
+            .ranges
+            .lock()
+            .unwrap()
+            .as_ref()
+            .map_or(false, |(_, taken)| {
+                taken.elapsed() >= SLOTS_MAP_REFRESH_INTERVAL
+            });
+        if !expired && !self.invalidated.swap(false, Ordering::Relaxed) {
+            return;
+        }
+        let ranges = Arc::new(get_slots_ranges(ctx));
+        *self.ranges.lock().unwrap() = Some((ranges, Instant::now()));
+    }
+}
+
+/// Refresh the cached cluster slots map if needed, called from the cron.
+pub(crate) fn refresh_slots_map(ctx: &Context) {
+    if is_cluster_in_cluster_mode() {
+        SLOTS_MAP.refresh(ctx);
+    }
+}
+
+/// Returns a routing key for each of the shards of the cluster, or [`None`]
+/// if the cluster topology is not available.
+fn shards_routing_keys() -> Option<Vec<Vec<u8>>> {
+    let ranges = SLOTS_MAP.get();
+    if ranges.is_empty() {
+        return None;
+    }
+    let mut shards_slots: HashMap<&str, usize> = HashMap::new();
+    for (start, _, node_id) in ranges.iter() {
+        shards_slots.entry(node_id.as_str()).or_insert(*start);
+    }
+    Some(
+        shards_slots
+            .into_values()
+            .map(routing_key_for_slot)
+            .collect(),
+    )
+}
+
+/// Returns the slots ranges of the cluster and the id of the node that
+/// serves each range, as reported by `CLUSTER SLOTS`.
+fn get_slots_ranges(ctx: &Context) -> Vec<(usize, usize, String)> {
+    let reply = match ctx.call("CLUSTER", &["SLOTS"]) {
+        Ok(RedisValue::Array(r)) => r,
+        _ => return Vec::new(),
+    };
+    let as_usize = |v: &RedisValue| match v {
+        RedisValue::Integer(v) => usize::try_from(*v).ok(),
+        _ => None,
+    };
+    let mut ranges: Vec<(usize, usize, String)> = reply
+        .iter()
+        .filter_map(|range| {
+            let range = match range {
+                RedisValue::Array(r) => r,
+                _ => return None,
+            };
+            let node = match range.get(2)? {
+                RedisValue::Array(n) => n,
+                _ => return None,
+            };
+            let node_id = match node.get(2)? {
+                RedisValue::SimpleString(s) | RedisValue::BulkString(s) => s.clone(),
+                RedisValue::StringBuffer(s) => String::from_utf8_lossy(s).into_owned(),
+                _ => return None,
+            };
+            Some((as_usize(range.first()?)?, as_usize(range.get(1)?)?, node_id))
+        })
+        .collect();
+    ranges.sort_unstable();
+    ranges
+}
+
+/// Group the given keys by the shard that owns them, each group holds the
+/// indexes of its keys in the given list, and the keys themselves. Return
+/// the keys back if the owner of any of them is not known (the topology is
+/// not available, or a slot is not served by any node).
+fn group_keys_by_shard(
+    keys: Vec<RemoteFunctionKey>,
+) -> Result<Vec<(Vec<usize>, Vec<RemoteFunctionKey>)>, Vec<RemoteFunctionKey>> {
+    if !is_cluster_in_cluster_mode() {
+        return Ok(vec![((0..keys.len()).collect(), keys)]);
+    }
+    let ranges = SLOTS_MAP.get();
+    let owners = keys
+        .iter()
+        .map(|key| {
+            let slot = calc_slot(&key.name);
+            ranges
+                .partition_point(|(start, _, _)| *start <= slot)
+                .checked_sub(1)
+                .map(|i| &ranges[i])
+                .filter(|(_, end, _)| slot <= *end)
+                .map(|(_, _, node_id)| node_id.as_str())
+        })
+        .collect::<Option<Vec<&str>>>();
+    let owners = match owners {
+        Some(o) => o,
+        None => {
+            SLOTS_MAP.invalidate();
+            return Err(keys);
+        }
+    };
+    let mut groups: HashMap<&str, (Vec<usize>, Vec<RemoteFunctionKey>)> = HashMap::new();
+    for (index, (key, owner)) in keys.into_iter().zip(owners).enumerate() {
+        let group = groups.entry(owner).or_default();
+        group.0.push(index);
+        group.1.push(key);
+    }
+    Ok(groups.into_values().collect())
+}
+
 impl BackgroundRunFunctionCtxInterface for BackgroundRunCtx {
     fn lock(&self) -> Result<Box<dyn RedisClientCtxInterface>, GearsApiError> {
         let detached_ctx_guard = redis_module::MODULE_CONTEXT.lock();
@@ -183,6 +766,14 @@ impl BackgroundRunFunctionCtxInterface for BackgroundRunCtx {
         inputs: Vec<RemoteFunctionData>,
         on_done: Box<dyn FnOnce(Result<RemoteFunctionData, GearsApiError>)>,
     ) {
+        if !is_cluster_in_cluster_mode() || is_my_slot(calc_slot(key)) {
+            // The key belongs to the current shard, no need to serialize the inputs and
+            // go through the cluster messaging, call the remote function directly.
+            RUN_ON_KEY_LOCAL_EXECUTIONS.fetch_add(1, Ordering::Relaxed);
+            self.run_remote_function_locally(job_name, inputs, on_done);
+            return;
+        }
+        RUN_ON_KEY_REMOTE_EXECUTIONS.fetch_add(1, Ordering::Relaxed);
         let task = GearsRemoteTask {
             lib_name: self.lib_meta_data.name.clone(),
             job_name: job_name.to_string(),
@@ -229,4 +820,161 @@ impl BackgroundRunFunctionCtxInterface for BackgroundRunCtx {
             REMOTE_TASK_DEFAULT_TIMEOUT.load(Ordering::Relaxed) as usize,
         )
     }
+
+    fn run_on_all_shards_incremental(
+        &self,
+        job_name: &str,
+        inputs: Vec<RemoteFunctionData>,
+        on_shard_done: Box<dyn FnMut(Result<RemoteFunctionData, GearsApiError>)>,
+        on_done: Box<dyn FnOnce()>,
+    ) {
+        let task = GearsRemoteTask {
+            lib_name: self.lib_meta_data.name.clone(),
+            job_name: job_name.to_string(),
+            user: self.user.clone(),
+        };
+        let mut callbacks = RunOnShardsCallbacks {
+            on_shard_done,
+            on_done: Some(on_done),
+            pending_shards: 1,
+        };
+        if !is_cluster_in_cluster_mode() {
+            self.run_remote_function_locally(
+                job_name,
+                inputs,
+                Box::new(move |result| callbacks.shard_done(result)),
+            );
+            return;
+        }
+        let input_record = GearsRemoteFunctionInputsRecord { inputs };
+        // Listing the shards requires the cluster topology, which is taken under
+        // the Redis GIL. The caller might hold the V8 isolate lock so this is done
+        // on the module thread pool.
+        execute_on_pool(move || {
+            let routing_keys = shards_routing_keys();
+            let timeout = REMOTE_TASK_DEFAULT_TIMEOUT.load(Ordering::Relaxed) as usize;
+            let routing_keys = match routing_keys {
+                Some(k) => k,
+                None => {
+                    // The topology is not known, fall back to collecting the results.
+                    mr::libmr::remote_task::run_on_all_shards(
+                        task,
+                        input_record,
+                        move |results: Vec<GearsRemoteFunctionOutputRecord>, errors| {
+                            let mut callbacks = callbacks;
+                            results
+                                .into_iter()
+                                .for_each(|r| (callbacks.on_shard_done)(Ok(r.output)));
+                            errors.into_iter().for_each(|e| {
+                                (callbacks.on_shard_done)(Err(GearsApiError::new(e)))
+                            });
+                            if let Some(on_done) = callbacks.on_done.take() {
+                                on_done();
+                            }
+                        },
+                        timeout,
+                    );
+                    return;
+                }
+            };
+            let callbacks = Arc::new(Mutex::new(RunOnShardsCallbacks {
+                pending_shards: routing_keys.len(),
+                ..callbacks
+            }));
+            // Each shard gets its own message so its result is handed over as
+            // soon as it arrives, a shard that does not reply in time fails with
+            // a timeout error without failing the other shards.
+            for routing_key in routing_keys {
+                let callbacks = Arc::clone(&callbacks);
+                mr::libmr::remote_task::run_on_key(
+                    &routing_key,
+                    task.clone(),
+                    input_record.clone(),
+                    move |result: Result<GearsRemoteFunctionOutputRecord, RustMRError>| {
+                        let result = result.map(|r| r.output).map_err(GearsApiError::new);
+                        callbacks.lock().unwrap().shard_done(result);
+                    },
+                    timeout,
+                );
+            }
+        });
+    }
+
+    fn run_on_keys(
+        &self,
+        keys: Vec<RemoteFunctionKey>,
+        job_name: &str,
+        inputs: Vec<RemoteFunctionData>,
+        on_done: Box<dyn FnOnce(Vec<Result<RemoteFunctionData, GearsApiError>>)>,
+    ) {
+        let keys_count = keys.len();
+        if keys_count == 0 {
+            on_done(Vec::new());
+            return;
+        }
+        let task = GearsRemoteBatchTask {
+            lib_name: self.lib_meta_data.name.clone(),
+            job_name: job_name.to_string(),
+            user: self.user.clone(),
+        };
+        let on_done = RunOnKeysDone(on_done);
+        // Grouping the keys requires the cluster topology, which might need to be
+        // taken under the Redis GIL. The caller might hold the V8 isolate lock so
+        // this is done on the module thread pool.
+        execute_on_pool(move || {
+            let timeout = REMOTE_TASK_DEFAULT_TIMEOUT.load(Ordering::Relaxed) as usize;
+            let groups = match group_keys_by_shard(keys) {
+                Ok(g) => g,
+                Err(keys) => {
+                    // The owners of the keys are not known, send all the keys to all
+                    // the shards, each shard handles only the keys it owns.
+                    let mut state = RunOnKeysState {
+                        results: (0..keys_count).map(|_| None).collect(),
+                        pending_groups: 1,
+                        on_done: Some(on_done),
+                    };
+                    mr::libmr::remote_task::run_on_all_shards(
+                        task,
+                        GearsRemoteFunctionBatchInputsRecord { keys, inputs },
+                        move |outputs: Vec<GearsRemoteFunctionBatchOutputRecord>, errors| {
+                            state.all_shards_done(outputs, errors);
+                        },
+                        timeout,
+                    );
+                    return;
+                }
+            };
+            let state = Arc::new(Mutex::new(RunOnKeysState {
+                results: (0..keys_count).map(|_| None).collect(),
+                pending_groups: groups.len(),
+                on_done: Some(on_done),
+            }));
+            // A single message is sent to each shard with only the keys it owns.
+            for (indexes, keys) in groups {
+                let state = Arc::clone(&state);
+                let routing_key = keys[0].name.clone();
+                let input_record = GearsRemoteFunctionBatchInputsRecord {
+                    keys,
+                    inputs: inputs.clone(),
+                };
+                mr::libmr::remote_task::run_on_key(
+                    &routing_key,
+                    task.clone(),
+                    input_record,
+                    move |result: Result<GearsRemoteFunctionBatchOutputRecord, RustMRError>| {
+                        state.lock().unwrap().group_done(&indexes, result);
+                    },
+                    timeout,
+                );
+            }
+        });
+    }
+
+    fn scan(&self, options: KeysScanOptions) -> Box<dyn KeysScanInterface> {
+        Box::new(KeysScan::new(
+            options,
+            self.user.clone(),
+            self.call_options.clone(),
+        ))
+    }
 }
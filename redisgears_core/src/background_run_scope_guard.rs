@@ -19,14 +19,11 @@ use crate::call_redis_command_async;
 use crate::run_ctx::RedisClientCallOptions;
 use crate::{
     background_run_ctx::BackgroundRunCtx, call_redis_command, get_notification_blocker,
-    GearsLibraryMetaData, NotificationBlocker,
+    get_redisai_handles_cache, GearsLibraryMetaData, NotificationBlocker,
 };
 
 use std::sync::Arc;
 
-use redisai_rs::redisai::redisai_model::RedisAIModel;
-use redisai_rs::redisai::redisai_script::RedisAIScript;
-
 pub(crate) struct BackgroundRunScopeGuardCtx {
     _notification_blocker: NotificationBlocker,
     pub(crate) detached_ctx_guard: DetachedContextGuard,
@@ -86,21 +83,15 @@ impl RedisClientCtxInterface for BackgroundRunScopeGuardCtx {
     }
 
     fn open_ai_model(&self, name: &str) -> Result<Box<dyn AIModelInterface>, GearsApiError> {
-        let ctx = &self.detached_ctx_guard;
-        let _authenticate_scope = ctx
-            .authenticate_user(&self.user)
-            .map_err(|e| GearsApiError::new(e.to_string()))?;
-        RedisAIModel::open_from_key(ctx, name)
+        get_redisai_handles_cache(&self.lib_meta_data.name)
+            .open_model(&self.detached_ctx_guard, &self.user, name)
             .map(|v| Box::new(v) as Box<dyn AIModelInterface>)
             .map_err(GearsApiError::new)
     }
 
     fn open_ai_script(&self, name: &str) -> Result<Box<dyn AIScriptInterface>, GearsApiError> {
-        let ctx = &self.detached_ctx_guard;
-        let _authenticate_scope = ctx
-            .authenticate_user(&self.user)
-            .map_err(|e| GearsApiError::new(e.to_string()))?;
-        RedisAIScript::open_from_key(ctx, name)
+        get_redisai_handles_cache(&self.lib_meta_data.name)
+            .open_script(&self.detached_ctx_guard, &self.user, name)
             .map(|v| Box::new(v) as Box<dyn AIScriptInterface>)
             .map_err(GearsApiError::new)
     }
@@ -5,21 +5,28 @@
  */
 
 use crate::execute_on_pool;
+use redisai_rs::redisai::redisai_dag::RedisAIDAGRunCtx;
 use redisai_rs::redisai::redisai_tensor::RedisAITensor;
 use redisgears_plugin_api::redisgears_plugin_api::backend_ctx::CompiledLibraryInterface;
-use redisgears_plugin_api::redisgears_plugin_api::redisai_interface::AITensorInterface;
+use redisgears_plugin_api::redisgears_plugin_api::redisai_interface::{
+    AIDAGRunnerInterface, AITensorInterface,
+};
 use redisgears_plugin_api::redisgears_plugin_api::GearsApiError;
 use std::collections::LinkedList;
 use std::sync::{Arc, Mutex, TryLockError};
 
 pub(crate) struct CompiledLibraryInternals {
     jobs: Mutex<LinkedList<Box<dyn FnOnce() + Send>>>,
+    /// The internals of the library isolate replicas, each replica
+    /// runs its background jobs on its own queue.
+    replicas: Mutex<Vec<Arc<CompiledLibraryInternals>>>,
 }
 
 impl CompiledLibraryInternals {
     fn new() -> CompiledLibraryInternals {
         CompiledLibraryInternals {
             jobs: Mutex::new(LinkedList::new()),
+            replicas: Mutex::new(Vec::new()),
         }
     }
 
@@ -56,9 +63,17 @@ impl CompiledLibraryInternals {
         }
     }
 
+    /// Returns the number of pending jobs of the library, including
+    /// the jobs of its isolate replicas.
     pub(crate) fn pending_jobs(&self) -> usize {
-        let queue = self.jobs.lock().unwrap();
-        queue.len()
+        let replicas_pending_jobs: usize = self
+            .replicas
+            .lock()
+            .unwrap()
+            .iter()
+            .map(|v| v.pending_jobs())
+            .sum();
+        self.jobs.lock().unwrap().len() + replicas_pending_jobs
     }
 }
 
@@ -134,6 +149,16 @@ impl CompiledLibraryInterface for CompiledLibraryAPI {
         self.add_job(job);
     }
 
+    fn create_replica_api(&self) -> Box<dyn CompiledLibraryInterface + Send + Sync> {
+        let replica = CompiledLibraryAPI::new(self.log_scirpt_msg_for_debug);
+        self.internals
+            .replicas
+            .lock()
+            .unwrap()
+            .push(replica.take_internals());
+        Box::new(replica)
+    }
+
     fn redisai_create_tensor(
         &self,
         data_type: &str,
@@ -146,4 +171,10 @@ impl CompiledLibraryInterface for CompiledLibraryAPI {
             .map(|_| Box::new(tensor))
             .map_err(GearsApiError::new)?)
     }
+
+    fn redisai_create_dag(&self) -> Result<Box<dyn AIDAGRunnerInterface>, GearsApiError> {
+        RedisAIDAGRunCtx::create()
+            .map(|v| Box::new(v) as Box<dyn AIDAGRunnerInterface>)
+            .map_err(GearsApiError::new)
+    }
 }
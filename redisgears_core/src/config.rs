@@ -4,7 +4,7 @@
  * the Server Side Public License v1 (SSPLv1).
  */
 
-use std::sync::atomic::AtomicI64;
+use std::sync::atomic::{AtomicBool, AtomicI64};
 use std::sync::Mutex;
 
 use lazy_static::lazy_static;
@@ -100,6 +100,29 @@ lazy_static! {
     /// Configuration value indicates the timeout for remote tasks that runs on a remote shard.
     pub(crate) static ref REMOTE_TASK_DEFAULT_TIMEOUT: AtomicI64 = AtomicI64::default();
 
+    /// Configuration value indicates the default maximum amount of time (in MS)
+    /// a background key space scan keeps Redis locked for each batch of keys.
+    pub(crate) static ref BACKGROUND_SCAN_TIME_BUDGET: AtomicI64 = AtomicI64::default();
+
+    /// Configuration value indicates the maximum number of async function
+    /// invocations of a library that can be in flight at the same time.
+    /// Value of 0 means no limit.
+    pub(crate) static ref ASYNC_CALLS_MAX_IN_FLIGHT: AtomicI64 = AtomicI64::default();
+
+    /// Configuration value indicates the maximum background backlog (pending
+    /// background jobs and pending async Redis calls) of a library above which
+    /// new async function invocations are not admitted. Value of 0 means no limit.
+    pub(crate) static ref BACKGROUND_QUEUE_MAX_DEPTH: AtomicI64 = AtomicI64::default();
+
+    /// Configuration value indicates the maximum number of async function
+    /// invocations of a library that can wait for the library to admit them.
+    /// Value of 0 means invocations are rejected at once.
+    pub(crate) static ref ASYNC_CALLS_QUEUE_SIZE: AtomicI64 = AtomicI64::default();
+
+    /// Configuration value indicates the maximum amount of time (in MS) an
+    /// async function invocation waits to be admitted before it is rejected.
+    pub(crate) static ref ASYNC_CALLS_QUEUE_TIMEOUT: AtomicI64 = AtomicI64::default();
+
     /// Configuration value indicates the timeout for locking Redis (except
     /// for the loading from RDB. For that, see the [`DB_LOADING_LOCK_REDIS_TIMEOUT`]).
     pub(crate) static ref LOCK_REDIS_TIMEOUT: LoadLockTimeout = LoadLockTimeout::default();
@@ -118,6 +141,19 @@ lazy_static! {
     /// Configuration value indicates if it is allowed to run debug commands.
     pub(crate) static ref ENABLE_DEBUG_COMMAND: RedisGILGuard<bool> = RedisGILGuard::default();
 
+    /// Configuration value indicates if libraries that only register functions
+    /// should be loaded lazily from persistence, that is, only compiled and
+    /// evaluated on first use.
+    pub(crate) static ref LAZY_LIBRARY_LOADING: RedisGILGuard<bool> = RedisGILGuard::default();
+
+    /// Configuration value indicates if lazily loaded libraries should be
+    /// materialized in the background, one library on each cron cycle.
+    pub(crate) static ref LAZY_LIBRARY_WARMUP: RedisGILGuard<bool> = RedisGILGuard::default();
+
+    /// Configuration value indicates if the libraries code should be
+    /// compressed when saved to the RDB.
+    pub(crate) static ref RDB_COMPRESSION: RedisGILGuard<bool> = RedisGILGuard::default();
+
     // V8 specific configuration
 
     /// Configuration value indicates the path to the V8 plugin.
@@ -145,6 +181,27 @@ lazy_static! {
     /// `V8_LIBRARY_MEMORY_USAGE_DELTA`.
     pub(crate) static ref V8_LIBRARY_MEMORY_USAGE_DELTA: AtomicI64 = AtomicI64::default();
 
+    /// Configuration value indicates the maximum amount of time (in MS) to spend
+    /// on garbage collecting V8 isolates on each cron cycle in which the JS engine
+    /// was idle. Value of 0 disables idle garbage collection.
+    pub(crate) static ref V8_IDLE_GC_BUDGET: AtomicI64 = AtomicI64::default();
+
+    /// Configuration value indicates the maximum number of libraries that can
+    /// share a single V8 isolate, each library with its own V8 context. Value
+    /// of 0 disables isolate sharing and each library gets a dedicated isolate.
+    pub(crate) static ref V8_SHARED_ISOLATE_MAX_LIBRARIES: AtomicI64 = AtomicI64::default();
+
+    /// Configuration value indicates if the arguments and results of remote
+    /// functions should be sent using the structured binary encoding. Shards
+    /// that do not know the encoding can not read it, so it should only be
+    /// enabled once all the shards in the cluster were upgraded.
+    pub(crate) static ref REMOTE_FUNCTIONS_STRUCTURED_ENCODING: AtomicBool = AtomicBool::default();
+
+    /// Configuration value indicates the maximum amount of memory (in bytes)
+    /// used to cache the replies of each function that was registered with
+    /// the `cache-results` flag.
+    pub(crate) static ref FUNCTION_RESULTS_CACHE_MAX_MEMORY: AtomicI64 = AtomicI64::default();
+
     /// The V8 inspector debug server address.
     pub(crate) static ref V8_DEBUG_SERVER_ADDRESS: RedisGILGuard<String> = RedisGILGuard::default();
 }
@@ -8,7 +8,7 @@ use redis_module::{Context, RedisError, RedisResult, RedisValue, ThreadSafeConte
 use std::iter::Skip;
 use std::vec::IntoIter;
 
-use crate::{get_libraries, Deserialize, Serialize};
+use crate::{admission_control, get_globals_mut, get_libraries, rdb, Deserialize, Serialize};
 
 use mr_derive::BaseObject;
 
@@ -61,6 +61,9 @@ impl RemoteTask for GearsFunctionDelRemoteTask {
         let mut libraries = get_libraries();
         let res = match libraries.remove(&r.lib_name) {
             Some(_) => {
+                rdb::libraries_code_changed();
+                get_globals_mut().redisai_handles_caches.remove(&r.lib_name);
+                admission_control::remove_library_admission(&r.lib_name);
                 ctx_guard.replicate(
                     "_rg_internals.function",
                     &["del".as_bytes(), r.lib_name.as_bytes()],
@@ -111,7 +114,10 @@ pub(crate) fn function_del_on_replica(
         })?;
     let mut libraries = get_libraries();
     // On replica there is no need to return an error if the function does not exists.
-    // So there is not need to check the return value of the function.
-    libraries.remove(lib_name);
+    if libraries.remove(lib_name).is_some() {
+        rdb::libraries_code_changed();
+    }
+    get_globals_mut().redisai_handles_caches.remove(lib_name);
+    admission_control::remove_library_admission(lib_name);
     Ok(RedisValue::SimpleStringStatic("OK"))
 }
@@ -7,8 +7,8 @@
 use redis_module::{Context, NextArg, RedisError, RedisResult, RedisString, RedisValue};
 use redis_module_macros::RedisValue;
 use redisgears_plugin_api::redisgears_plugin_api::load_library_ctx::{
-    FunctionFlags, FUNCTION_FLAG_ALLOW_OOM_GLOBAL_VALUE, FUNCTION_FLAG_NO_WRITES_GLOBAL_VALUE,
-    FUNCTION_FLAG_RAW_ARGUMENTS_GLOBAL_VALUE,
+    FunctionFlags, FUNCTION_FLAG_ALLOW_OOM_GLOBAL_VALUE, FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_VALUE,
+    FUNCTION_FLAG_NO_WRITES_GLOBAL_VALUE, FUNCTION_FLAG_RAW_ARGUMENTS_GLOBAL_VALUE,
 };
 use std::sync::Arc;
 
@@ -43,6 +43,7 @@ struct StreamTriggersInfoVerbose1 {
     prefix: Vec<u8>,
     window: usize,
     trim: bool,
+    partition_key: Option<Vec<u8>>,
     description: Option<String>,
 }
 
@@ -76,6 +77,17 @@ enum TriggersInfo {
     Verbose1(TriggersInfoVerbose1),
 }
 
+/// Contains the statistics of a function results cache.
+#[derive(RedisValue)]
+struct FunctionResultsCacheInfo {
+    cached_replies: usize,
+    used_memory: usize,
+    hits: usize,
+    misses: usize,
+    invalidations: usize,
+    evictions: usize,
+}
+
 /// Contains all relevant information about RedisGears function.
 #[derive(RedisValue)]
 struct FunctionInfoVerbose {
@@ -83,6 +95,7 @@ struct FunctionInfoVerbose {
     flags: RedisValue,
     is_async: bool,
     description: Option<String>,
+    results_cache: Option<FunctionResultsCacheInfo>,
 }
 
 /// A struct that allows to translate a [RequestedFunctionInfo] into
@@ -148,6 +161,11 @@ fn function_list_command_flags(flags: FunctionFlags) -> RedisValue {
             FUNCTION_FLAG_RAW_ARGUMENTS_GLOBAL_VALUE.to_string(),
         ));
     }
+    if flags.contains(FunctionFlags::CACHE_RESULTS) {
+        res.push(RedisValue::BulkString(
+            FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_VALUE.to_string(),
+        ));
+    }
     RedisValue::Array(res)
 }
 
@@ -182,6 +200,17 @@ fn get_library_info(
                         flags: function_list_command_flags(val.flags),
                         is_async: val.is_async,
                         description: val.description.to_owned(),
+                        results_cache: val.results_cache.as_ref().map(|v| {
+                            let v = v.borrow();
+                            FunctionResultsCacheInfo {
+                                cached_replies: v.len(),
+                                used_memory: v.used_memory,
+                                hits: v.hits,
+                                misses: v.misses,
+                                invalidations: v.invalidations,
+                                evictions: v.evictions,
+                            }
+                        }),
                     })
                 }
             })
@@ -232,6 +261,7 @@ fn get_library_info(
                     prefix: val.prefix.clone(),
                     window: val.window,
                     trim: val.trim,
+                    partition_key: val.partition_key.clone(),
                     description: val.description.clone(),
                 };
                 if verbosity_level == 1 {
@@ -9,12 +9,15 @@ use redis_module::{
 };
 use redisgears_plugin_api::redisgears_plugin_api::backend_ctx::BackendCtxInterfaceInitialised;
 use redisgears_plugin_api::redisgears_plugin_api::backend_ctx::DebuggerBackend;
+use redisgears_plugin_api::redisgears_plugin_api::backend_ctx::LibraryCompilationArgs;
+use redisgears_plugin_api::redisgears_plugin_api::backend_ctx::LibraryCompiler;
 use redisgears_plugin_api::redisgears_plugin_api::load_library_ctx::LibraryCtxInterface;
 use redisgears_plugin_api::redisgears_plugin_api::{GearsApiError, GearsApiResult};
 
 use crate::compiled_library_api::{CompiledLibraryAPI, CompiledLibraryInternals};
 use crate::config::V8_DEBUG_SERVER_ADDRESS;
 use crate::get_globals;
+use crate::rdb;
 use crate::GILBackendStorage;
 use crate::{verify_name, Deserialize, Serialize};
 
@@ -143,7 +146,7 @@ pub(crate) fn function_load_revert(
     libraries: &mut HashMap<String, Arc<GearsLibrary>>,
 ) {
     if let Some(old_lib) = gears_library.old_lib.take() {
-        for (name, old_ctx, old_window, old_trim, description) in
+        for (name, old_ctx, old_window, old_trim, description, partition_key) in
             gears_library.revert_stream_consumers
         {
             let stream_data = gears_library.stream_consumers.get(&name).unwrap();
@@ -152,6 +155,7 @@ pub(crate) fn function_load_revert(
             s_d.set_window(old_window);
             s_d.set_trim(old_trim);
             s_d.set_description(description);
+            s_d.set_partition_key(partition_key);
         }
 
         for (name, key, callback, description) in gears_library.revert_notifications_consumers {
@@ -232,11 +236,18 @@ pub(crate) fn function_evaluate_and_store(
         function_load_revert(gears_library_ctx, &mut libraries);
         return Err("Neither function nor other registrations were found.".to_owned());
     }
+    let code_changed = gears_library_ctx.old_lib.as_ref().map_or(true, |old_lib| {
+        old_lib.gears_lib_ctx.meta_data.code != gears_library_ctx.meta_data.code
+    });
+    if code_changed {
+        rdb::libraries_code_changed();
+    }
     gears_library_ctx.old_lib = None;
     let gears_library = Arc::new(GearsLibrary {
         gears_lib_ctx: gears_library_ctx,
         lib_ctx,
         compile_lib_internals,
+        lazy: None,
     });
     libraries.insert(
         gears_library.gears_lib_ctx.meta_data.name.clone(),
@@ -274,6 +285,149 @@ pub(crate) fn function_compile(
     })
 }
 
+/// Compiles multiple libraries at once (without evaluating them). The
+/// libraries are grouped by their backend so each backend can compile
+/// its libraries concurrently. The result at each index belongs to the
+/// compilation arguments at the same index.
+pub(crate) fn function_compile_multiple(
+    context: &Context,
+    compilation_arguments: Vec<CompilationArguments>,
+) -> Vec<Result<CompiledLibraryInfo, String>> {
+    let globals = get_globals();
+    let mut results: Vec<Option<Result<CompiledLibraryInfo, String>>> =
+        compilation_arguments.iter().map(|_| None).collect();
+    let mut per_backend: HashMap<String, Vec<(usize, GearsLibraryMetaData)>> = HashMap::new();
+    for (index, args) in compilation_arguments.iter().enumerate() {
+        match args.get_metadata() {
+            Ok(meta_data) => per_backend
+                .entry(meta_data.engine.clone())
+                .or_default()
+                .push((index, meta_data)),
+            Err(e) => {
+                results[index] = Some(Err(format!(
+                    "Failed to compile library: {}",
+                    GearsApiError::from(e).get_msg()
+                )))
+            }
+        }
+    }
+
+    for (engine, libraries) in per_backend {
+        let backend = match context.get_backend(&engine) {
+            Ok(b) => b,
+            Err(e) => {
+                let msg = GearsApiError::from(e).get_msg().to_owned();
+                libraries.into_iter().for_each(|(index, _)| {
+                    results[index] = Some(Err(format!("Failed to compile library: {msg}")))
+                });
+                continue;
+            }
+        };
+        let compile_lib_ctxs = libraries
+            .iter()
+            .map(|_| CompiledLibraryAPI::new(globals.redis_version.is_enterprise))
+            .collect::<Vec<_>>();
+        let internals = compile_lib_ctxs
+            .iter()
+            .map(|v| v.take_internals())
+            .collect::<Vec<_>>();
+        let compiled = backend.compile_libraries(
+            libraries
+                .iter()
+                .zip(compile_lib_ctxs)
+                .map(|((_, meta_data), compile_lib_ctx)| LibraryCompilationArgs {
+                    module_name: &meta_data.name,
+                    code: &meta_data.code,
+                    api_version: meta_data.api_version,
+                    config: meta_data.config.as_ref(),
+                    compiled_library_api: Box::new(compile_lib_ctx),
+                })
+                .collect(),
+        );
+        libraries.into_iter().zip(internals).zip(compiled).for_each(
+            |(((index, meta_data), internals), library_context)| {
+                results[index] = Some(
+                    library_context
+                        .map(|library_context| CompiledLibraryInfo {
+                            meta_data,
+                            library_context,
+                            internals,
+                        })
+                        .map_err(|e| format!("Failed to compile library: {}", e.get_msg())),
+                );
+            },
+        );
+    }
+
+    results.into_iter().map(|r| r.unwrap()).collect()
+}
+
+/// A library that is ready to be compiled without holding the GIL,
+/// see [`function_prepare_compile`].
+pub(crate) struct PreparedLibraryCompilation {
+    meta_data: GearsLibraryMetaData,
+    internals: Arc<CompiledLibraryInternals>,
+    compiler: LibraryCompiler,
+}
+
+impl PreparedLibraryCompilation {
+    /// Compiles the library, should be called without holding the GIL.
+    /// The returned value holds Redis objects and so it must be dropped
+    /// while the GIL is held.
+    pub(crate) fn compile(self) -> Result<CompiledLibraryInfo, (GearsLibraryMetaData, String)> {
+        match (self.compiler)() {
+            Ok(library_context) => Ok(CompiledLibraryInfo {
+                meta_data: self.meta_data,
+                library_context,
+                internals: self.internals,
+            }),
+            Err(e) => Err((
+                self.meta_data,
+                format!("Failed to compile library: {}", e.get_msg()),
+            )),
+        }
+    }
+}
+
+/// Prepares the library compilation, must be called while the GIL is held.
+/// Fails early if the library already exists and no upgrade was requested,
+/// the final check is done when the library is stored.
+pub(crate) fn function_prepare_compile(
+    context: &Context,
+    compilation_arguments: &CompilationArguments,
+    upgrade: bool,
+) -> Result<PreparedLibraryCompilation, String> {
+    let meta_data = compilation_arguments.get_metadata().map_err(|e| {
+        format!(
+            "Failed to compile library: {}",
+            GearsApiError::from(e).get_msg()
+        )
+    })?;
+    if !upgrade && get_libraries().contains_key(&meta_data.name) {
+        return Err(format!("Library {} already exists.", &meta_data.name));
+    }
+    let backend = context.get_backend(&meta_data.engine).map_err(|e| {
+        format!(
+            "Failed to compile library: {}",
+            GearsApiError::from(e).get_msg()
+        )
+    })?;
+    let compile_lib_ctx = CompiledLibraryAPI::new(get_globals().redis_version.is_enterprise);
+    let internals = compile_lib_ctx.take_internals();
+    let compiler = backend.get_library_compiler(
+        meta_data.name.clone(),
+        meta_data.code.clone(),
+        meta_data.api_version,
+        meta_data.config.clone(),
+        Box::new(compile_lib_ctx),
+    );
+    Ok(PreparedLibraryCompilation {
+        meta_data,
+        internals,
+        compiler,
+    })
+}
+
 pub(crate) fn function_load_internal(
     context: &Context,
     compilation_arguments: CompilationArguments,
@@ -390,21 +544,32 @@ impl RemoteTask for GearsFunctionLoadRemoteTask {
         r: Self::InRecord,
         on_done: Box<dyn FnOnce(Result<Self::OutRecord, RustMRError>) + Send>,
     ) {
-        let res = {
+        let user = r.args.user.unwrap();
+        let prepared = {
             let ctx_guard = ThreadSafeContext::new().lock();
-            let user = r.args.user.unwrap();
             let compilation_arguments = CompilationArguments::new(
                 user.safe_clone(&ctx_guard),
                 r.args.code.clone(),
                 r.args.config.clone(),
             );
-            let res = function_load_internal(
-                &ctx_guard,
-                compilation_arguments,
-                false,
-                r.args.upgrade,
-                false,
-            );
+            function_prepare_compile(&ctx_guard, &compilation_arguments, r.args.upgrade)
+        };
+        // The isolate creation and the code compilation are the heavy part
+        // of the load, they are done without holding the GIL. Only storing
+        // the library (and reverting on failure) is done under the GIL.
+        let compiled = prepared.map(|v| v.compile());
+        let res = {
+            let ctx_guard = ThreadSafeContext::new().lock();
+            let res = match compiled {
+                Ok(Ok(compiled_library_info)) => function_evaluate_and_store(
+                    &ctx_guard,
+                    compiled_library_info,
+                    r.args.upgrade,
+                    false,
+                ),
+                Ok(Err((_meta_data, e))) => Err(e),
+                Err(e) => Err(e),
+            };
             if res.is_ok() {
                 let mut replicate_args = Vec::new();
                 replicate_args.push("load".as_bytes());
@@ -420,6 +585,8 @@ impl RemoteTask for GearsFunctionLoadRemoteTask {
                 replicate_args.push(r.args.code.as_bytes());
                 ctx_guard.replicate("_rg_internals.function", replicate_args.as_slice());
             }
+            // the user must be freed while the GIL is held.
+            drop(user);
             res
         };
         on_done(res.map(|_v| GearsFunctionLoadOutputRecord));
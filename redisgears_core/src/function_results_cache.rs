@@ -0,0 +1,305 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+//! A per function cache of replies, for functions registered with the
+//! `no-writes` and the `cache-results` flags. A reply is cached by the
+//! calling user, the selected database and the function arguments.
+//!
+//! A cached reply is dropped when any of the keys it might depend on is
+//! touched (key space notification). Those are the keys given to the
+//! function and every argument of every command the function invoked
+//! while computing the reply, which is a superset of the keys it read.
+//! Replies that depend on data that is not named by a command (like the
+//! reply of `SCAN` or `TIME`) are never cached.
+//!
+//! Before a cached reply is served its keys are opened, so a key whose TTL
+//! has passed is expired (and the reply dropped) even if the active expiry
+//! did not reach it yet. All the cached replies are dropped on `SWAPDB`,
+//! as the database index they are cached by holds another dataset.
+
+use redis_module::redisvalue::RedisValueKey;
+use redis_module::{RedisString, RedisValue};
+
+use std::cell::RefCell;
+use std::collections::{BTreeMap, HashMap, HashSet};
+
+/// Commands whose reply depends on more than the keys they name.
+const UNCACHEABLE_COMMANDS: &[&str] = &[
+    "dbsize",
+    "hrandfield",
+    "info",
+    "keys",
+    "lastsave",
+    "randomkey",
+    "scan",
+    "srandmember",
+    "time",
+    "zrandmember",
+];
+
+/// A rough per entry overhead, for the memory accounting.
+const ENTRY_OVERHEAD: usize = 128;
+
+struct CachedReply {
+    reply: RedisValue,
+    keys: Vec<Vec<u8>>,
+    last_used: u64,
+    size: usize,
+}
+
+#[derive(Default)]
+pub(crate) struct FunctionResultsCache {
+    entries: HashMap<Vec<u8>, CachedReply>,
+    lru: BTreeMap<u64, Vec<u8>>,
+    keys_index: HashMap<Vec<u8>, HashSet<Vec<u8>>>,
+    clock: u64,
+    pub(crate) used_memory: usize,
+    pub(crate) hits: usize,
+    pub(crate) misses: usize,
+    pub(crate) invalidations: usize,
+    pub(crate) evictions: usize,
+}
+
+fn redis_value_key_size(key: &RedisValueKey) -> usize {
+    std::mem::size_of::<RedisValueKey>()
+        + match key {
+            RedisValueKey::String(s) => s.len(),
+            RedisValueKey::BulkString(s) => s.len(),
+            _ => 0,
+        }
+}
+
+fn redis_value_size(value: &RedisValue) -> usize {
+    std::mem::size_of::<RedisValue>()
+        + match value {
+            RedisValue::SimpleString(s) | RedisValue::BulkString(s) => s.len(),
+            RedisValue::StringBuffer(s) => s.len(),
+            RedisValue::VerbatimString((_, s)) => s.len(),
+            RedisValue::Array(a) => a.iter().map(redis_value_size).sum(),
+            RedisValue::Map(m) => m
+                .iter()
+                .map(|(k, v)| redis_value_key_size(k) + redis_value_size(v))
+                .sum(),
+            RedisValue::Set(s) => s.iter().map(redis_value_key_size).sum(),
+            _ => 0,
+        }
+}
+
+impl FunctionResultsCache {
+    /// Returns the cache entry key of an invocation.
+    pub(crate) fn entry_key(user: &[u8], db: i32, args: &[RedisString]) -> Vec<u8> {
+        let mut key =
+            Vec::with_capacity(user.len() + 8 + args.iter().map(|v| v.len() + 4).sum::<usize>());
+        key.extend_from_slice(&(user.len() as u32).to_le_bytes());
+        key.extend_from_slice(user);
+        key.extend_from_slice(&db.to_le_bytes());
+        for arg in args {
+            key.extend_from_slice(&(arg.len() as u32).to_le_bytes());
+            key.extend_from_slice(arg.as_slice());
+        }
+        key
+    }
+
+    /// Returns the keys the cached reply of the given entry key depends on,
+    /// if the reply is cached.
+    pub(crate) fn entry_keys(&self, entry_key: &[u8]) -> Option<Vec<Vec<u8>>> {
+        self.entries.get(entry_key).map(|e| e.keys.clone())
+    }
+
+    /// Returns the cached reply of the given entry key, if any, and counts
+    /// the lookup as a hit or a miss.
+    pub(crate) fn get(&mut self, entry_key: &[u8]) -> Option<RedisValue> {
+        let entry = match self.entries.get_mut(entry_key) {
+            Some(e) => e,
+            None => {
+                self.misses += 1;
+                return None;
+            }
+        };
+        self.hits += 1;
+        self.clock += 1;
+        let entry_key = self
+            .lru
+            .remove(&entry.last_used)
+            .expect("Cached reply is missing from the LRU");
+        entry.last_used = self.clock;
+        self.lru.insert(self.clock, entry_key);
+        Some(entry.reply.clone())
+    }
+
+    /// Counts a lookup whose cached reply could not be served.
+    pub(crate) fn count_miss(&mut self) {
+        self.misses += 1;
+    }
+
+    /// Cache the given reply, evicting the least recently used replies
+    /// to keep the cache within the given memory limit.
+    pub(crate) fn insert(
+        &mut self,
+        entry_key: Vec<u8>,
+        reply: RedisValue,
+        mut keys: Vec<Vec<u8>>,
+        max_memory: usize,
+    ) {
+        keys.sort_unstable();
+        keys.dedup();
+        let size = ENTRY_OVERHEAD
+            + entry_key.len() * (2 + keys.len())
+            + keys.iter().map(|v| v.len() * 2).sum::<usize>()
+            + redis_value_size(&reply);
+        if size > max_memory {
+            return;
+        }
+        self.remove_entry(&entry_key);
+        while self.used_memory + size > max_memory {
+            let (_, oldest) = match self.lru.iter().next() {
+                Some((tick, key)) => (*tick, key.clone()),
+                None => break,
+            };
+            self.remove_entry(&oldest);
+            self.evictions += 1;
+        }
+        for key in keys.iter() {
+            self.keys_index
+                .entry(key.clone())
+                .or_default()
+                .insert(entry_key.clone());
+        }
+        self.clock += 1;
+        self.lru.insert(self.clock, entry_key.clone());
+        self.used_memory += size;
+        self.entries.insert(
+            entry_key,
+            CachedReply {
+                reply,
+                keys,
+                last_used: self.clock,
+                size,
+            },
+        );
+    }
+
+    fn remove_entry(&mut self, entry_key: &[u8]) {
+        let entry = match self.entries.remove(entry_key) {
+            Some(e) => e,
+            None => return,
+        };
+        self.lru.remove(&entry.last_used);
+        self.used_memory -= entry.size;
+        for key in entry.keys {
+            if let Some(entries) = self.keys_index.get_mut(&key) {
+                entries.remove(entry_key);
+                if entries.is_empty() {
+                    self.keys_index.remove(&key);
+                }
+            }
+        }
+    }
+
+    /// Drops the cached replies that might depend on the given key.
+    pub(crate) fn invalidate(&mut self, key: &[u8]) {
+        if let Some(entries) = self.keys_index.remove(key) {
+            for entry_key in entries {
+                self.remove_entry(&entry_key);
+                self.invalidations += 1;
+            }
+        }
+    }
+
+    /// Drops all the cached replies.
+    pub(crate) fn clear(&mut self) {
+        self.entries.clear();
+        self.lru.clear();
+        self.keys_index.clear();
+        self.used_memory = 0;
+    }
+
+    pub(crate) fn len(&self) -> usize {
+        self.entries.len()
+    }
+}
+
+/// The keys a function reply might depend on, collected while the
+/// function runs.
+struct Recording {
+    keys: Vec<Vec<u8>>,
+    cacheable: bool,
+}
+
+thread_local! {
+    static RECORDING: RefCell<Option<Recording>> = RefCell::new(None);
+}
+
+/// Records the keys touched by a function invocation whose reply is
+/// about to be cached, until dropped or finished.
+pub(crate) struct RecordingGuard {
+    prev: Option<Recording>,
+    finished: bool,
+}
+
+/// Start recording the keys a function invocation depends on, starting
+/// with the keys given to the function.
+pub(crate) fn start_recording(keys: &[RedisString]) -> RecordingGuard {
+    let recording = Recording {
+        keys: keys.iter().map(|v| v.as_slice().to_vec()).collect(),
+        cacheable: true,
+    };
+    RecordingGuard {
+        prev: RECORDING.with(|v| v.borrow_mut().replace(recording)),
+        finished: false,
+    }
+}
+
+impl RecordingGuard {
+    /// Stop recording and return the recorded keys, or [`None`] if the
+    /// reply of the invocation can not be cached.
+    pub(crate) fn finish(mut self) -> Option<Vec<Vec<u8>>> {
+        self.finished = true;
+        let recording = RECORDING.with(|v| {
+            let mut v = v.borrow_mut();
+            std::mem::replace(&mut *v, self.prev.take())
+        })?;
+        recording.cacheable.then_some(recording.keys)
+    }
+}
+
+impl Drop for RecordingGuard {
+    fn drop(&mut self) {
+        if !self.finished {
+            let prev = self.prev.take();
+            RECORDING.with(|v| *v.borrow_mut() = prev);
+        }
+    }
+}
+
+/// Record a command invoked by the function, if its keys are recorded.
+pub(crate) fn record_command(command: &str, args: &[&[u8]]) {
+    RECORDING.with(|v| {
+        if let Some(recording) = v.borrow_mut().as_mut() {
+            if !recording.cacheable {
+                return;
+            }
+            if UNCACHEABLE_COMMANDS
+                .iter()
+                .any(|v| v.eq_ignore_ascii_case(command))
+            {
+                recording.cacheable = false;
+                return;
+            }
+            recording.keys.extend(args.iter().map(|v| v.to_vec()));
+        }
+    });
+}
+
+/// Mark the reply of the recorded invocation as not cacheable, used when
+/// the function depends on data which is not tracked by the cache.
+pub(crate) fn mark_not_cacheable() {
+    RECORDING.with(|v| {
+        if let Some(recording) = v.borrow_mut().as_mut() {
+            recording.cacheable = false;
+        }
+    });
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+//! A key space scan for background tasks. Each batch locks Redis, scans
+//! until the batch is full or the time budget is exhausted, and releases
+//! Redis before returning. The scan cursor is kept between the batches so
+//! the scan resumes where the previous batch stopped. The pattern, type and
+//! ACL filters are applied while scanning so only the matching keys are
+//! passed to the backend.
+//!
+//! A single scan step might find more keys than the batch can take, or than
+//! the time budget allows to read. The keys that were not returned are kept
+//! and returned first by the next batch.
+
+use redis_module::raw::KeyType;
+use redis_module::{AclPermissions, Context, KeysCursor, RedisString};
+
+use redisgears_plugin_api::redisgears_plugin_api::{
+    run_function_ctx::KeysScanInterface, run_function_ctx::KeysScanOptions,
+    run_function_ctx::ScannedKey, GearsApiError,
+};
+
+use crate::call_redis_command;
+use crate::config::BACKGROUND_SCAN_TIME_BUDGET;
+use crate::run_ctx::RedisClientCallOptions;
+
+use std::cell::RefCell;
+use std::collections::VecDeque;
+use std::sync::atomic::Ordering;
+use std::time::{Duration, Instant};
+
+/// Glob style matching, with the same semantics as the `MATCH` option of
+/// the `SCAN` command.
+fn string_match(pattern: &[u8], string: &[u8]) -> bool {
+    let mut skip_longer_matches = false;
+    string_match_impl(pattern, string, &mut skip_longer_matches)
+}
+
+/// Same as Redis `stringmatchlen_impl`. Once a `*` tried every suffix of the
+/// string without a match, `skip_longer_matches` is set so the enclosing `*`
+/// stops trying as well: it can only offer shorter suffixes, which were
+/// already tried. Without it, patterns such as `*a*a*a*a*b` match in
+/// exponential time.
+fn string_match_impl(pattern: &[u8], string: &[u8], skip_longer_matches: &mut bool) -> bool {
+    let mut p = 0;
+    let mut s = 0;
+    while p < pattern.len() {
+        match pattern[p] {
+            b'*' => {
+                while p + 1 < pattern.len() && pattern[p + 1] == b'*' {
+                    p += 1;
+                }
+                if p + 1 == pattern.len() {
+                    return true;
+                }
+                for i in s..=string.len() {
+                    if string_match_impl(&pattern[p + 1..], &string[i..], skip_longer_matches) {
+                        return true;
+                    }
+                    if *skip_longer_matches {
+                        return false;
+                    }
+                }
+                *skip_longer_matches = true;
+                return false;
+            }
+            b'?' => {
+                if s == string.len() {
+                    return false;
+                }
+                s += 1;
+            }
+            b'[' => {
+                if s == string.len() {
+                    return false;
+                }
+                p += 1;
+                let not = pattern.get(p) == Some(&b'^');
+                if not {
+                    p += 1;
+                }
+                let mut matched = false;
+                loop {
+                    if p >= pattern.len() {
+                        // Unterminated range, treated as if it was terminated.
+                        p = pattern.len() - 1;
+                        break;
+                    }
+                    if pattern[p] == b']' {
+                        break;
+                    }
+                    if pattern[p] == b'\\' && p + 1 < pattern.len() {
+                        p += 1;
+                        matched |= pattern[p] == string[s];
+                    } else if p + 2 < pattern.len() && pattern[p + 1] == b'-' {
+                        let start = pattern[p].min(pattern[p + 2]);
+                        let end = pattern[p].max(pattern[p + 2]);
+                        p += 2;
+                        matched |= string[s] >= start && string[s] <= end;
+                    } else {
+                        matched |= pattern[p] == string[s];
+                    }
+                    p += 1;
+                }
+                if matched == not {
+                    return false;
+                }
+                s += 1;
+            }
+            b'\\' if p + 1 < pattern.len() => {
+                p += 1;
+                if s == string.len() || pattern[p] != string[s] {
+                    return false;
+                }
+                s += 1;
+            }
+            c => {
+                if s == string.len() || c != string[s] {
+                    return false;
+                }
+                s += 1;
+            }
+        }
+        p += 1;
+    }
+    s == string.len()
+}
+
+/// A command, and its arguments after the key, used to read a key value.
+type ReadCommand = (&'static str, &'static [&'static [u8]]);
+
+const GET: ReadCommand = ("get", &[]);
+const LRANGE: ReadCommand = ("lrange", &[b"0", b"-1"]);
+const HGETALL: ReadCommand = ("hgetall", &[]);
+const SMEMBERS: ReadCommand = ("smembers", &[]);
+const ZRANGE: ReadCommand = ("zrange", &[b"0", b"-1", b"withscores"]);
+const XRANGE: ReadCommand = ("xrange", &[b"-", b"+"]);
+
+/// Returns the key type name, as returned by the `TYPE` command, and the
+/// command used to read the key value.
+fn key_type_info(key_type: KeyType) -> Option<(&'static str, Option<ReadCommand>)> {
+    Some(match key_type {
+        KeyType::Empty => return None,
+        KeyType::String => ("string", Some(GET)),
+        KeyType::List => ("list", Some(LRANGE)),
+        KeyType::Hash => ("hash", Some(HGETALL)),
+        KeyType::Set => ("set", Some(SMEMBERS)),
+        KeyType::ZSet => ("zset", Some(ZRANGE)),
+        KeyType::Stream => ("stream", Some(XRANGE)),
+        KeyType::Module => ("module", None),
+    })
+}
+
+/// A key that was found by the scan and was not yet returned.
+struct PendingKey {
+    name: Vec<u8>,
+    key_type: &'static str,
+    read_command: Option<ReadCommand>,
+}
+
+pub(crate) struct KeysScan {
+    cursor: KeysCursor,
+    options: KeysScanOptions,
+    user: RedisString,
+    call_options: RedisClientCallOptions,
+    pending: VecDeque<PendingKey>,
+    /// The entire key space was scanned, only pending keys are left.
+    cursor_done: bool,
+    done: bool,
+}
+
+impl KeysScan {
+    pub(crate) fn new(
+        options: KeysScanOptions,
+        user: RedisString,
+        call_options: RedisClientCallOptions,
+    ) -> KeysScan {
+        KeysScan {
+            cursor: KeysCursor::new(),
+            options,
+            user,
+            call_options,
+            pending: VecDeque::new(),
+            cursor_done: false,
+            done: false,
+        }
+    }
+
+    /// Scan a single step of the key space and add the matching keys to the
+    /// pending keys, returns `false` once the entire key space was scanned.
+    fn scan_step(&mut self, ctx: &Context) -> bool {
+        let keys = RefCell::new(Vec::new());
+        let res = self.cursor.scan(ctx, &|ctx, key_name, key| {
+            if let Some(pattern) = self.options.pattern.as_ref() {
+                if !string_match(pattern, key_name.as_slice()) {
+                    return;
+                }
+            }
+            let key_type = match key {
+                Some(k) => k.key_type(),
+                None => ctx.open_key(&key_name).key_type(),
+            };
+            let (type_name, read_command) = match key_type_info(key_type) {
+                Some(v) => v,
+                None => return,
+            };
+            if let Some(t) = self.options.key_type.as_ref() {
+                if !t.eq_ignore_ascii_case(type_name) {
+                    return;
+                }
+            }
+            if ctx
+                .acl_check_key_permission(&self.user, &key_name, &AclPermissions::ACCESS)
+                .is_err()
+            {
+                return;
+            }
+            keys.borrow_mut().push(PendingKey {
+                name: key_name.as_slice().to_vec(),
+                key_type: type_name,
+                read_command,
+            });
+        });
+        self.pending.extend(keys.into_inner());
+        res
+    }
+
+    /// Turn a pending key into a scanned key, reading its value if needed.
+    /// The values are read after the scan step, as running commands from
+    /// within the scan callback might modify the key space.
+    fn read_key(&self, ctx: &Context, key: PendingKey) -> ScannedKey {
+        let value = if self.options.with_values {
+            key.read_command.map(|(command, args)| {
+                let args: Vec<&[u8]> = std::iter::once(key.name.as_slice())
+                    .chain(args.iter().copied())
+                    .collect();
+                call_redis_command(
+                    ctx,
+                    &self.user,
+                    command,
+                    &self.call_options.call_options,
+                    &args,
+                )
+            })
+        } else {
+            None
+        };
+        ScannedKey {
+            name: key.name,
+            key_type: key.key_type,
+            value,
+        }
+    }
+
+    /// Returns `true` if the given key, that was kept from a previous batch,
+    /// still exists with the same type. Redis was released since it was
+    /// scanned, so it might have been deleted or replaced.
+    fn is_unchanged(ctx: &Context, key: &PendingKey) -> bool {
+        let name = RedisString::create_from_slice(ctx.ctx, &key.name);
+        key_type_info(ctx.open_key(&name).key_type()).map(|v| v.0) == Some(key.key_type)
+    }
+}
+
+impl KeysScanInterface for KeysScan {
+    fn next_batch(&mut self) -> Result<Option<Vec<ScannedKey>>, GearsApiError> {
+        if self.done {
+            return Ok(None);
+        }
+        let time_budget = self.options.time_budget.unwrap_or_else(|| {
+            Duration::from_millis(BACKGROUND_SCAN_TIME_BUDGET.load(Ordering::Relaxed) as u64)
+        });
+        let mut batch = Vec::new();
+        let ctx_guard = redis_module::MODULE_CONTEXT.lock();
+        let start = Instant::now();
+        let mut carried_over = self.pending.len();
+        // the budget is checked before each key is read, so a scan step
+        // that found many keys does not keep Redis locked past the budget.
+        while batch.len() < self.options.count && start.elapsed() < time_budget {
+            let key = match self.pending.pop_front() {
+                Some(k) => k,
+                None if self.cursor_done => break,
+                None => {
+                    self.cursor_done = !self.scan_step(&ctx_guard);
+                    continue;
+                }
+            };
+            if carried_over > 0 {
+                carried_over -= 1;
+                if !Self::is_unchanged(&ctx_guard, &key) {
+                    continue;
+                }
+            }
+            batch.push(self.read_key(&ctx_guard, key));
+        }
+        if self.cursor_done && self.pending.is_empty() {
+            self.done = true;
+        }
+        if self.done && batch.is_empty() {
+            return Ok(None);
+        }
+        Ok(Some(batch))
+    }
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+//! Lazy libraries support. When loading from persistence with the
+//! `lazy-library-loading` configuration enabled, libraries that only
+//! register functions are not compiled nor evaluated. Instead, they are
+//! registered using the manifest that was saved to the RDB alongside
+//! the library code. The library is materialized (compiled and
+//! evaluated) on first use or by the background warm-up.
+
+use redis_module::{Context, RedisError};
+use redisgears_plugin_api::redisgears_plugin_api::{
+    backend_ctx::DebuggerBackendPayload, function_ctx::FunctionCtxInterface,
+    load_library_ctx::FunctionFlags, load_library_ctx::LibraryCtxInterface,
+    load_library_ctx::LoadLibraryCtxInterface, load_library_ctx::ModuleInfo,
+    run_function_ctx::BackgroundRunFunctionCtxInterface, run_function_ctx::RemoteFunctionData,
+    run_function_ctx::RunFunctionCtxInterface, FunctionCallResult, GearsApiError, GearsApiResult,
+};
+
+use crate::compiled_library_api::CompiledLibraryAPI;
+use crate::function_load_command::{function_load_internal, CompilationArguments};
+use crate::{get_globals, get_libraries, rdb, GearsFunctionCtx, GearsLibrary, GearsLibraryCtx};
+use crate::{GearsLibraryMetaData, LazyLibraryState};
+
+use std::sync::atomic::Ordering;
+use std::sync::Arc;
+
+/// The registration information of a single function.
+pub(crate) struct FunctionManifest {
+    pub(crate) name: String,
+    pub(crate) flags: FunctionFlags,
+    pub(crate) is_async: bool,
+    pub(crate) description: Option<String>,
+}
+
+/// The registrations of a library, this is all we need in order to
+/// register a library without evaluating its code.
+pub(crate) struct LibraryManifest {
+    pub(crate) functions: Vec<FunctionManifest>,
+    pub(crate) remote_functions: Vec<String>,
+    pub(crate) notifications_consumers_count: usize,
+}
+
+impl LibraryManifest {
+    /// Creates the manifest of the given library.
+    pub(crate) fn from_library(library: &GearsLibrary) -> LibraryManifest {
+        LibraryManifest {
+            functions: library
+                .gears_lib_ctx
+                .functions
+                .iter()
+                .map(|(name, f)| FunctionManifest {
+                    name: name.clone(),
+                    flags: f.flags,
+                    is_async: f.is_async,
+                    description: f.description.clone(),
+                })
+                .collect(),
+            remote_functions: library
+                .gears_lib_ctx
+                .remote_functions
+                .keys()
+                .cloned()
+                .collect(),
+            notifications_consumers_count: library.gears_lib_ctx.notifications_consumers.len(),
+        }
+    }
+
+    /// Returns `true` if a library with this manifest can be loaded lazily.
+    /// Only libraries that register nothing but functions are allowed to be
+    /// lazy, triggers must be registered in order to get the events.
+    pub(crate) fn can_be_lazy(&self, stream_consumers_count: usize) -> bool {
+        !self.functions.is_empty()
+            && self.notifications_consumers_count == 0
+            && stream_consumers_count == 0
+    }
+}
+
+/// A placeholder for a function of a library that was not yet materialized.
+/// The library is always materialized before a function is invoked so this
+/// function is not expected to ever be called.
+struct LazyFunctionCtx;
+
+impl FunctionCtxInterface for LazyFunctionCtx {
+    fn call(&self, run_ctx: &dyn RunFunctionCtxInterface) -> FunctionCallResult {
+        run_ctx.reply_with_error(GearsApiError::new("Library was not yet materialized"));
+        FunctionCallResult::Done
+    }
+}
+
+/// A placeholder for the context of a library that was not yet materialized.
+struct LazyLibraryCtx;
+
+impl LibraryCtxInterface for LazyLibraryCtx {
+    fn load_library(
+        &self,
+        _load_library_ctx: &dyn LoadLibraryCtxInterface,
+        _is_being_loaded_from_rdb: bool,
+    ) -> Result<(), GearsApiError> {
+        Err(GearsApiError::new(
+            "Can not load a library that was not yet materialized",
+        ))
+    }
+
+    fn get_info(&self) -> Option<ModuleInfo> {
+        None
+    }
+
+    fn get_debug_payload(&self) -> GearsApiResult<DebuggerBackendPayload> {
+        Err(GearsApiError::new(
+            "Can not debug a library that was not yet materialized",
+        ))
+    }
+}
+
+/// Registers a library using its manifest without compiling or evaluating
+/// its code.
+pub(crate) fn store_lazy_library(
+    compilation_arguments: &CompilationArguments,
+    manifest: LibraryManifest,
+    upgrade: bool,
+) -> Result<(), String> {
+    let meta_data: GearsLibraryMetaData = compilation_arguments.get_metadata().map_err(|e| {
+        format!(
+            "Failed to compile library: {}",
+            GearsApiError::from(e).get_msg()
+        )
+    })?;
+    let mut libraries = get_libraries();
+    if !upgrade && libraries.contains_key(&meta_data.name) {
+        return Err(format!("Library {} already exists.", &meta_data.name));
+    }
+
+    let mut gears_library_ctx = GearsLibraryCtx::new(Arc::new(meta_data), None);
+    manifest.functions.into_iter().for_each(|f| {
+        gears_library_ctx.functions.insert(
+            f.name,
+            GearsFunctionCtx::new(
+                Box::new(LazyFunctionCtx),
+                f.flags,
+                f.is_async,
+                f.description,
+            ),
+        );
+    });
+    manifest.remote_functions.into_iter().for_each(|name| {
+        gears_library_ctx.remote_functions.insert(
+            name,
+            Box::new(
+                |_inputs: Vec<RemoteFunctionData>,
+                 _background_ctx: Box<dyn BackgroundRunFunctionCtxInterface>,
+                 on_done: Box<dyn FnOnce(Result<RemoteFunctionData, GearsApiError>) + Send>| {
+                    on_done(Err(GearsApiError::new("Library was not yet materialized")))
+                },
+            ),
+        );
+    });
+
+    let compile_lib_ctx = CompiledLibraryAPI::new(get_globals().redis_version.is_enterprise);
+    let gears_library = Arc::new(GearsLibrary {
+        gears_lib_ctx: gears_library_ctx,
+        lib_ctx: Box::new(LazyLibraryCtx),
+        compile_lib_internals: compile_lib_ctx.take_internals(),
+        lazy: Some(LazyLibraryState::default()),
+    });
+    rdb::libraries_code_changed();
+    libraries.insert(
+        gears_library.gears_lib_ctx.meta_data.name.clone(),
+        gears_library,
+    );
+    Ok(())
+}
+
+/// Compiles and evaluates the given library if it was loaded lazily.
+/// Does nothing if the library does not exist or was already materialized.
+pub(crate) fn materialize_library(ctx: &Context, name: &str) -> Result<(), RedisError> {
+    let meta_data = {
+        let libraries = get_libraries();
+        match libraries.get(name) {
+            Some(l) if l.lazy.is_some() => Arc::clone(&l.gears_lib_ctx.meta_data),
+            _ => return Ok(()),
+        }
+    };
+    let compilation_arguments = CompilationArguments::new(
+        meta_data.user.clone(),
+        meta_data.code.clone(),
+        meta_data.config.clone(),
+    );
+    function_load_internal(ctx, compilation_arguments, false, true, false)
+        .map(|_| ())
+        .map_err(|e| RedisError::String(format!("Failed materializing library {name}, {e}")))
+}
+
+/// Materializes the next lazy library (if such exists). A library that
+/// failed to materialize will not be attempted again by the warm-up, it
+/// will only be retried when it is actually used.
+pub(crate) fn warmup_next_lazy_library(ctx: &Context) {
+    let name = {
+        let libraries = get_libraries();
+        let lib = libraries.values().find(|l| {
+            l.lazy
+                .as_ref()
+                .map_or(false, |v| !v.warmup_failed.load(Ordering::Relaxed))
+        });
+        match lib {
+            Some(l) => l.gears_lib_ctx.meta_data.name.clone(),
+            None => return,
+        }
+    };
+    if let Err(e) = materialize_library(ctx, &name) {
+        log::warn!("Lazy library warm-up failed, {e}.");
+        if let Some(lazy) = get_libraries().get(&name).and_then(|l| l.lazy.as_ref()) {
+            lazy.warmup_failed.store(true, Ordering::Relaxed);
+        }
+    }
+}
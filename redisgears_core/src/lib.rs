@@ -18,19 +18,24 @@ use redis_module::{
 };
 use redisgears_plugin_api::redisgears_plugin_api::backend_ctx::BackendCtxInterfaceInitialised;
 use redisgears_plugin_api::redisgears_plugin_api::load_library_ctx::{
-    FunctionFlags, InfoSectionData, ModuleInfo,
+    FunctionFlags, InfoSectionData, ModuleInfo, FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_VALUE,
+    FUNCTION_FLAG_NO_WRITES_GLOBAL_VALUE,
 };
 use redisgears_plugin_api::redisgears_plugin_api::prologue::ApiVersion;
-use redisgears_plugin_api::redisgears_plugin_api::run_function_ctx::PromiseReply;
+use redisgears_plugin_api::redisgears_plugin_api::run_function_ctx::{
+    PromiseReply, ReplyCtxInterface,
+};
 use serde::{Deserialize, Serialize};
 
 use config::{
     FatalFailurePolicyConfiguration, DB_LOADING_LOCK_REDIS_TIMEOUT, ENABLE_DEBUG_COMMAND,
-    ERROR_VERBOSITY, EXECUTION_THREADS, FATAL_FAILURE_POLICY, LOCK_REDIS_TIMEOUT, V8_FLAGS,
-    V8_LIBRARY_INITIAL_MEMORY_LIMIT, V8_LIBRARY_INITIAL_MEMORY_USAGE,
-    V8_LIBRARY_MEMORY_USAGE_DELTA, V8_MAX_MEMORY, V8_PLUGIN_PATH,
+    ERROR_VERBOSITY, EXECUTION_THREADS, FATAL_FAILURE_POLICY, FUNCTION_RESULTS_CACHE_MAX_MEMORY,
+    LAZY_LIBRARY_WARMUP, LOCK_REDIS_TIMEOUT, REMOTE_FUNCTIONS_STRUCTURED_ENCODING, V8_FLAGS,
+    V8_IDLE_GC_BUDGET, V8_LIBRARY_INITIAL_MEMORY_LIMIT, V8_LIBRARY_INITIAL_MEMORY_USAGE,
+    V8_LIBRARY_MEMORY_USAGE_DELTA, V8_MAX_MEMORY, V8_PLUGIN_PATH, V8_SHARED_ISOLATE_MAX_LIBRARIES,
 };
 
+use redis_module::raw;
 use redis_module::raw::RedisModule__Assert;
 use threadpool::ThreadPool;
 
@@ -60,14 +65,18 @@ use redisgears_plugin_api::redisgears_plugin_api::{
 
 use redisgears_plugin_api::redisgears_plugin_api::{FunctionCallResult, RefCellWrapper};
 
-use crate::run_ctx::RunCtx;
+use crate::admission_control::{Admission, InFlightGuard, LibraryAdmission, WaitingCall};
+use crate::allocation_stats::InvocationKind;
+use crate::function_results_cache::FunctionResultsCache;
+use crate::run_ctx::{AdmittedRunCtx, BackgroundClientCtx, RunCtx};
 
 use libloading::{Library, Symbol};
 
 use std::collections::HashMap;
 
-use std::sync::atomic::Ordering;
+use std::sync::atomic::{AtomicBool, Ordering};
 use std::sync::{Arc, Mutex, MutexGuard, Weak};
+use std::time::Duration;
 
 use crate::stream_reader::{ConsumerData, StreamReaderCtx};
 use std::iter::Skip;
@@ -79,10 +88,14 @@ use crate::stream_run_ctx::{GearsStreamConsumer, GearsStreamRecord};
 
 use std::cell::RefCell;
 
+use crate::background_run_ctx::{RUN_ON_KEY_LOCAL_EXECUTIONS, RUN_ON_KEY_REMOTE_EXECUTIONS};
 use crate::keys_notifications::ConsumerKey;
+use crate::redisai_handles_cache::RedisAIHandlesCache;
 
-use mr::libmr::mr_init;
+use mr::libmr::{calc_slot, is_cluster_in_cluster_mode, is_my_slot, mr_init};
 
+mod admission_control;
+mod allocation_stats;
 mod background_run_ctx;
 mod background_run_scope_guard;
 mod compiled_library_api;
@@ -91,9 +104,13 @@ mod debugging;
 mod function_del_command;
 mod function_list_command;
 mod function_load_command;
+mod function_results_cache;
 mod keys_notifications;
 mod keys_notifications_ctx;
+mod keys_scan;
+mod lazy_library;
 mod rdb;
+mod redisai_handles_cache;
 mod run_ctx;
 mod stream_reader;
 mod stream_run_ctx;
@@ -208,6 +225,9 @@ struct GearsFunctionCtx {
     flags: FunctionFlags,
     is_async: bool,
     description: Option<String>,
+    /// The cached replies of the function, set if the function was
+    /// registered with [`FunctionFlags::CACHE_RESULTS`].
+    results_cache: Option<Arc<RefCell<FunctionResultsCache>>>,
 }
 
 impl GearsFunctionCtx {
@@ -217,11 +237,15 @@ impl GearsFunctionCtx {
         is_async: bool,
         description: Option<String>,
     ) -> GearsFunctionCtx {
+        let results_cache = flags
+            .contains(FunctionFlags::CACHE_RESULTS)
+            .then(|| Arc::new(RefCell::new(FunctionResultsCache::default())));
         GearsFunctionCtx {
             func,
             flags,
             is_async,
             description,
+            results_cache,
         }
     }
 }
@@ -246,7 +270,14 @@ struct GearsLibraryCtx {
     remote_functions: HashMap<String, RemoteFunctionCtx>,
     stream_consumers:
         HashMap<String, Arc<RefCellWrapper<ConsumerData<GearsStreamRecord, GearsStreamConsumer>>>>,
-    revert_stream_consumers: Vec<(String, GearsStreamConsumer, usize, bool, Option<String>)>,
+    revert_stream_consumers: Vec<(
+        String,
+        GearsStreamConsumer,
+        usize,
+        bool,
+        Option<String>,
+        Option<Vec<u8>>,
+    )>,
     notifications_consumers: HashMap<String, Arc<RefCell<NotificationConsumer>>>,
     revert_notifications_consumers:
         Vec<(String, ConsumerKey, NotificationCallback, Option<String>)>,
@@ -300,10 +331,18 @@ struct GearsLoadLibraryCtx<'ctx, 'lib_ctx> {
     gears_lib_ctx: &'lib_ctx mut GearsLibraryCtx,
 }
 
+/// The state of a library that was loaded lazily and was not yet
+/// materialized, see [lazy_library].
+#[derive(Debug, Default)]
+struct LazyLibraryState {
+    warmup_failed: AtomicBool,
+}
+
 struct GearsLibrary {
     gears_lib_ctx: GearsLibraryCtx,
     lib_ctx: Box<dyn LibraryCtxInterface>,
     compile_lib_internals: Arc<CompiledLibraryInternals>,
+    lazy: Option<LazyLibraryState>,
 }
 
 impl std::fmt::Debug for GearsLibrary {
@@ -312,6 +351,7 @@ impl std::fmt::Debug for GearsLibrary {
             .field("gears_lib_ctx", &self.gears_lib_ctx)
             .field("lib_ctx", &format!("{:p}", &self.lib_ctx))
             .field("compile_lib_internals", &self.compile_lib_internals)
+            .field("lazy", &self.lazy)
             .finish()
     }
 }
@@ -331,6 +371,22 @@ impl<'ctx, 'lib_ctx> GearsLoadLibraryCtx<'ctx, 'lib_ctx> {
                 name
             )));
         }
+        if let Some(results_cache) = func_ctx.results_cache.as_ref() {
+            if !func_ctx.flags.contains(FunctionFlags::NO_WRITES) {
+                return Err(GearsApiError::new(format!(
+                    "Function {name} can not cache its results as it might perform writes, the '{}' flag requires the '{}' flag",
+                    FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_VALUE, FUNCTION_FLAG_NO_WRITES_GLOBAL_VALUE
+                )));
+            }
+            if func_ctx.is_async {
+                return Err(GearsApiError::new(format!(
+                    "Function {name} can not cache its results as it is declared as async"
+                )));
+            }
+            get_globals_mut()
+                .function_results_caches
+                .push(Arc::downgrade(results_cache));
+        }
         self.gears_lib_ctx
             .functions
             .insert(name.to_string(), func_ctx);
@@ -397,6 +453,7 @@ impl<'ctx, 'lib_ctx> LoadLibraryCtxInterface for GearsLoadLibraryCtx<'ctx, 'lib_
         window: usize,
         trim: bool,
         description: Option<String>,
+        partition_key: Option<&[u8]>,
     ) -> Result<(), GearsApiError> {
         verify_name(name).map_err(|e| {
             GearsApiError::new(format!("Unallowed stream trigger name '{name}', {e}."))
@@ -429,12 +486,14 @@ impl<'ctx, 'lib_ctx> LoadLibraryCtxInterface for GearsLoadLibraryCtx<'ctx, 'lib_
             let old_window = o_c.set_window(window);
             let old_trim = o_c.set_trim(trim);
             let old_description = o_c.set_description(description);
+            let old_partition_key = o_c.set_partition_key(partition_key.map(|v| v.to_vec()));
             self.gears_lib_ctx.revert_stream_consumers.push((
                 name.to_string(),
                 old_ctx,
                 old_window,
                 old_trim,
                 old_description,
+                old_partition_key,
             ));
             Arc::clone(old_consumer)
         } else {
@@ -464,6 +523,7 @@ impl<'ctx, 'lib_ctx> LoadLibraryCtxInterface for GearsLoadLibraryCtx<'ctx, 'lib_
                     );
                 })),
                 description,
+                partition_key.map(|v| v.to_vec()),
             );
             if is_master(self.ctx) {
                 // trigger a key scan
@@ -516,6 +576,9 @@ impl<'ctx, 'lib_ctx> LoadLibraryCtxInterface for GearsLoadLibraryCtx<'ctx, 'lib_
                     return;
                 }
                 let _notification_blocker = get_notification_blocker();
+                let _allocations_guard = allocation_stats::count_invocation_allocations(
+                    InvocationKind::KeySpaceNotification,
+                );
                 keys_notifications_consumer_ctx.on_notification_fired(
                     event,
                     key,
@@ -622,6 +685,13 @@ struct GlobalCtx {
     future_handlers: HashMap<String, Vec<Weak<RedisGILGuard<FutureHandlerContext>>>>,
     avoid_replication_traffic: bool,
     debugger_server: Option<debugging::Server>,
+    /// The RedisAI models and scripts opened by each library, by library name.
+    redisai_handles_caches: HashMap<String, RedisAIHandlesCache>,
+    /// The results caches of the functions registered with the
+    /// `cache-results` flag, used to invalidate them on key changes.
+    function_results_caches: Vec<Weak<RefCell<FunctionResultsCache>>>,
+    /// The admission state of the async functions of each library, by library name.
+    library_admissions: HashMap<String, LibraryAdmission>,
 }
 
 static mut GLOBALS: Option<GlobalCtx> = None;
@@ -658,6 +728,47 @@ fn get_uninitialised_backends_mut(
     &mut get_globals_mut().uninitialised_backends
 }
 
+/// Returns the RedisAI handles cache of the given library.
+pub(crate) fn get_redisai_handles_cache(lib_name: &str) -> &'static mut RedisAIHandlesCache {
+    get_globals_mut()
+        .redisai_handles_caches
+        .entry(lib_name.to_owned())
+        .or_default()
+}
+
+/// Returns the admission state of the async functions of the given library.
+pub(crate) fn get_library_admission(lib_name: &str) -> &'static mut LibraryAdmission {
+    get_globals_mut()
+        .library_admissions
+        .entry(lib_name.to_owned())
+        .or_default()
+}
+
+/// Returns the background backlog of the given library, the pending
+/// background jobs and the pending async Redis calls.
+fn library_backlog(lib: &GearsLibrary) -> usize {
+    let pending_async_calls = get_globals()
+        .future_handlers
+        .get(&lib.gears_lib_ctx.meta_data.name)
+        .map_or(0, |v| v.iter().filter(|v| v.strong_count() > 0).count());
+    lib.compile_lib_internals.pending_jobs() + pending_async_calls
+}
+
+/// Runs the given closure on the results cache of each function that
+/// caches its replies, dropping the caches of functions that no longer
+/// exist.
+fn for_each_function_results_cache<F: FnMut(&mut FunctionResultsCache)>(mut f: F) {
+    get_globals_mut()
+        .function_results_caches
+        .retain(|v| match v.upgrade() {
+            Some(v) => {
+                f(&mut v.borrow_mut());
+                true
+            }
+            None => false,
+        });
+}
+
 fn get_libraries() -> MutexGuard<'static, HashMap<String, Arc<GearsLibrary>>> {
     get_globals().libraries.lock().unwrap()
 }
@@ -977,6 +1088,23 @@ fn js_init(ctx: &Context, _args: &[RedisString]) -> Status {
         return Status::Err;
     }
 
+    let swapdb_event = raw::RedisModuleEvent {
+        id: raw::REDISMODULE_EVENT_SWAPDB as u64,
+        dataver: 1,
+    };
+    unsafe {
+        raw::RedisModule_SubscribeToServerEvent.unwrap()(
+            ctx.ctx,
+            swapdb_event,
+            Some(on_swapdb_event),
+        )
+    };
+
+    if *(ENABLE_DEBUG_COMMAND.lock(ctx)) {
+        // the allocation statistics are only reported by the debug command.
+        allocation_stats::enable_allocation_stats();
+    }
+
     std::panic::set_hook(Box::new(|panic_info| {
         log::error!("Application panicked, {}", panic_info);
         let (file, line) = match panic_info.location() {
@@ -1003,7 +1131,7 @@ fn js_init(ctx: &Context, _args: &[RedisString]) -> Status {
     let v8_flags = V8_FLAGS.lock(ctx).to_owned();
     let is_enterprise = redis_version.is_enterprise;
     let backend_ctx = BackendCtx {
-        allocator: &RedisAlloc,
+        allocator: &allocation_stats::CountingAlloc(RedisAlloc),
         log_info: Box::new(|msg| log::info!("{msg}")),
         log_trace: Box::new(|msg| log::trace!("{msg}")),
         log_debug: Box::new(|msg| log::debug!("{msg}")),
@@ -1035,6 +1163,12 @@ fn js_init(ctx: &Context, _args: &[RedisString]) -> Status {
             V8_LIBRARY_MEMORY_USAGE_DELTA.load(Ordering::Relaxed) as usize
         }),
         get_v8_flags: Box::new(move || v8_flags.to_owned()),
+        get_v8_shared_isolate_max_libraries: Box::new(|| {
+            V8_SHARED_ISOLATE_MAX_LIBRARIES.load(Ordering::Relaxed) as usize
+        }),
+        get_remote_functions_structured_encoding: Box::new(|| {
+            REMOTE_FUNCTIONS_STRUCTURED_ENCODING.load(Ordering::Relaxed)
+        }),
     };
 
     let on_load_res = v8_backend.on_load(backend_ctx);
@@ -1109,6 +1243,9 @@ fn js_init(ctx: &Context, _args: &[RedisString]) -> Status {
         future_handlers: HashMap::new(),
         avoid_replication_traffic: false,
         debugger_server: None,
+        redisai_handles_caches: HashMap::new(),
+        function_results_caches: Vec::new(),
+        library_admissions: HashMap::new(),
     };
 
     unsafe { GLOBALS = Some(global_ctx) };
@@ -1240,11 +1377,69 @@ fn build_per_library_info(ctx: &InfoContext) -> RedisResult<()> {
                 .to_string(),
         );
 
+        if let Some(admission) = get_globals()
+            .library_admissions
+            .get(&library.1.gears_lib_ctx.meta_data.name)
+        {
+            library_info.insert(
+                "async_calls_in_flight".to_owned(),
+                admission.in_flight().to_string(),
+            );
+            library_info.insert(
+                "async_calls_waiting".to_owned(),
+                admission.waiting().to_string(),
+            );
+            library_info.insert(
+                "async_calls_rejected".to_owned(),
+                admission.rejected.to_string(),
+            );
+            library_info.insert(
+                "async_calls_timed_out".to_owned(),
+                admission.timed_out.to_string(),
+            );
+            library_info.insert(
+                "async_calls_waited".to_owned(),
+                admission.waited.to_string(),
+            );
+            library_info.insert(
+                "async_calls_total_wait_time_ms".to_owned(),
+                admission.total_wait_time.as_millis().to_string(),
+            );
+            library_info.insert(
+                "async_calls_max_wait_time_ms".to_owned(),
+                admission.max_wait_time.as_millis().to_string(),
+            );
+        }
+
         library_info.insert(
             "cluster_functions_count".to_owned(),
             library.1.gears_lib_ctx.remote_functions.len().to_string(),
         );
 
+        if let Some(cache) = get_globals()
+            .redisai_handles_caches
+            .get(&library.1.gears_lib_ctx.meta_data.name)
+        {
+            library_info.insert(
+                "redisai_handles_cache_hits".to_owned(),
+                cache.hits.to_string(),
+            );
+            library_info.insert(
+                "redisai_handles_cache_misses".to_owned(),
+                cache.misses.to_string(),
+            );
+        }
+
+        library_info.insert(
+            "materialized".to_owned(),
+            if library.1.lazy.is_some() {
+                "no"
+            } else {
+                "yes"
+            }
+            .to_owned(),
+        );
+
         if let Some(info) = library.1.lib_ctx.get_info() {
             if let Some(first_level) = info.sections.into_iter().next() {
                 if let InfoSectionData::KeyValuePairs(key_value_pairs) = first_level.1 {
@@ -1274,11 +1469,55 @@ fn build_per_library_info(ctx: &InfoContext) -> RedisResult<()> {
     Ok(())
 }
 
+fn build_remote_functions_info(ctx: &InfoContext) -> RedisResult<()> {
+    let _ = ctx
+        .builder()
+        .add_section("RemoteFunctions")
+        .field(
+            "run_on_key_local_executions",
+            RUN_ON_KEY_LOCAL_EXECUTIONS
+                .load(Ordering::Relaxed)
+                .to_string(),
+        )?
+        .field(
+            "run_on_key_remote_executions",
+            RUN_ON_KEY_REMOTE_EXECUTIONS
+                .load(Ordering::Relaxed)
+                .to_string(),
+        )?
+        .build_section()?
+        .build_info()?;
+
+    Ok(())
+}
+
+fn build_rdb_info(ctx: &InfoContext) -> RedisResult<()> {
+    let encoded_code = rdb::ENCODED_LIBRARIES_CODE.lock()?;
+    let (code_size, stored_size) = encoded_code
+        .as_ref()
+        .map_or((0, 0), |v| (v.code_size, v.stored_size()));
+    let _ = ctx
+        .builder()
+        .add_section("RDB")
+        .field("libraries_code_bytes", code_size.to_string())?
+        .field("libraries_code_stored_bytes", stored_size.to_string())?
+        .field(
+            "libraries_code_saved_bytes",
+            code_size.saturating_sub(stored_size).to_string(),
+        )?
+        .build_section()?
+        .build_info()?;
+
+    Ok(())
+}
+
 #[info_command_handler]
 fn module_info(ctx: &InfoContext, _for_crash_report: bool) -> RedisResult<()> {
     build_uninitialised_backends_info(ctx)?;
     build_initialised_backends_info(ctx)?;
     build_per_library_info(ctx)?;
+    build_remote_functions_info(ctx)?;
+    build_rdb_info(ctx)?;
 
     Ok(())
 }
@@ -1312,12 +1551,10 @@ pub(crate) fn verify_ok_on_replica(ctx: &Context, flags: FunctionFlags) -> bool
         || flags.contains(FunctionFlags::NO_WRITES)
 }
 
-fn function_call_command(
-    ctx: &Context,
-    mut args: Skip<IntoIter<redis_module::RedisString>>,
-    allow_block: bool,
-) -> RedisResult {
-    let mut lib_func_name = args.next_arg()?.try_as_str()?.split('.');
+/// Splits the `<library>.<function>` argument into the library name and
+/// the function name.
+fn parse_function_name(lib_func_name: &str) -> Result<(&str, &str), RedisError> {
+    let mut lib_func_name = lib_func_name.split('.');
 
     let library_name = lib_func_name
         .next()
@@ -1325,10 +1562,16 @@ fn function_call_command(
     let function_name = lib_func_name
         .next()
         .ok_or(RedisError::Str("Failed extracting function name"))?;
+    Ok((library_name, function_name))
+}
 
-    let num_keys = args.next_arg()?.try_as_str()?.parse::<usize>()?;
-    let libraries = get_libraries();
-
+/// Returns the requested function, verifying that it can currently run.
+fn get_function_to_call<'a>(
+    ctx: &Context,
+    libraries: &'a HashMap<String, Arc<GearsLibrary>>,
+    library_name: &str,
+    function_name: &str,
+) -> Result<(&'a Arc<GearsLibrary>, &'a GearsFunctionCtx), RedisError> {
     let lib = libraries
         .get(library_name)
         .ok_or_else(|| RedisError::String(format!("Unknown library {}", library_name)))?;
@@ -1351,6 +1594,123 @@ fn function_call_command(
         ));
     }
 
+    Ok((lib, function))
+}
+
+/// Opens the given key without touching it or counting it in the key space
+/// statistics, so a key whose TTL has passed is expired by Redis.
+fn expire_key_if_needed(ctx: &Context, key: &RedisString) {
+    let mode = raw::REDISMODULE_READ
+        | raw::REDISMODULE_OPEN_KEY_NOTOUCH
+        | raw::REDISMODULE_OPEN_KEY_NONOTIFY
+        | raw::REDISMODULE_OPEN_KEY_NOSTATS;
+    unsafe {
+        let key = raw::RedisModule_OpenKey.unwrap()(ctx.ctx, key.inner, mode as i32);
+        if !key.is_null() {
+            raw::RedisModule_CloseKey.unwrap()(key);
+        }
+    }
+}
+
+/// Drops the cached function replies on `SWAPDB`, the replies are cached
+/// by the database index which now holds another dataset.
+extern "C" fn on_swapdb_event(
+    _ctx: *mut raw::RedisModuleCtx,
+    _eid: raw::RedisModuleEvent,
+    _subevent: u64,
+    _data: *mut std::os::raw::c_void,
+) {
+    for_each_function_results_cache(|v| v.clear());
+}
+
+/// Invokes the given function. If the function caches its results, the
+/// reply is taken from the cache when possible, and otherwise the reply
+/// of the invocation is added to the cache (unless it depends on data that
+/// the cache can not track).
+fn invoke_function(
+    ctx: &Context,
+    lib: &GearsLibrary,
+    function: &GearsFunctionCtx,
+    args: Vec<RedisString>,
+    allow_block: bool,
+) -> FunctionCallResult {
+    let results_cache = match function.results_cache.as_ref() {
+        Some(v) => v,
+        None => {
+            return function.func.call(&RunCtx {
+                ctx,
+                args,
+                flags: function.flags,
+                lib_meta_data: Arc::clone(&lib.gears_lib_ctx.meta_data),
+                allow_block,
+                captured_reply: None,
+            })
+        }
+    };
+
+    let db = unsafe { raw::RedisModule_GetSelectedDb.unwrap()(ctx.ctx) };
+    let user = ctx.get_current_user();
+    let entry_key = FunctionResultsCache::entry_key(user.as_slice(), db, &args);
+    // The user permissions might have changed since the reply was cached,
+    // the reply is only served if the user can still read all its keys.
+    // The keys are opened before the cache is borrowed, as expiring a key
+    // drops the replies that depend on it.
+    let cached_keys = results_cache.borrow().entry_keys(&entry_key);
+    let servable = cached_keys.map_or(false, |keys| {
+        keys.iter().all(|key| {
+            let key_redis_str = RedisString::create_from_slice(std::ptr::null_mut(), key);
+            if ctx
+                .acl_check_key_permission(&user, &key_redis_str, &AclPermissions::ACCESS)
+                .is_err()
+            {
+                return false;
+            }
+            expire_key_if_needed(ctx, &key_redis_str);
+            true
+        })
+    });
+    if servable {
+        if let Some(reply) = results_cache.borrow_mut().get(&entry_key) {
+            ctx.reply(Ok(reply));
+            return FunctionCallResult::Done;
+        }
+    } else {
+        results_cache.borrow_mut().count_miss();
+    }
+
+    let recording = function_results_cache::start_recording(&args);
+    let run_ctx = RunCtx {
+        ctx,
+        args,
+        flags: function.flags,
+        lib_meta_data: Arc::clone(&lib.gears_lib_ctx.meta_data),
+        allow_block,
+        captured_reply: Some(RefCell::new(None)),
+    };
+    let res = function.func.call(&run_ctx);
+    let keys = recording.finish();
+    let reply = run_ctx.captured_reply.and_then(|v| v.into_inner());
+    if let (FunctionCallResult::Done, Some(keys), Some(reply)) = (&res, keys, reply) {
+        let max_memory = FUNCTION_RESULTS_CACHE_MAX_MEMORY.load(Ordering::Relaxed) as usize;
+        results_cache
+            .borrow_mut()
+            .insert(entry_key, reply, keys, max_memory);
+    }
+    res
+}
+
+fn function_call_command(
+    ctx: &Context,
+    mut args: Skip<IntoIter<redis_module::RedisString>>,
+    allow_block: bool,
+) -> RedisResult {
+    let (library_name, function_name) = parse_function_name(args.next_arg()?.try_as_str()?)?;
+
+    let num_keys = args.next_arg()?.try_as_str()?.parse::<usize>()?;
+    lazy_library::materialize_library(ctx, library_name)?;
+    let libraries = get_libraries();
+    let (lib, function) = get_function_to_call(ctx, &libraries, library_name, function_name)?;
+
     let args = args.collect::<Vec<redis_module::RedisString>>();
     if args.len() < num_keys {
         return Err(RedisError::String(format!(
@@ -1365,15 +1725,31 @@ fn function_call_command(
         return Err(RedisError::Str("The function is declared as async and was called while blocking was not allowed; note that you cannot invoke async functions from within Lua or MULTI, and you must use TFCALLASYNC instead."));
     }
 
+    if function.is_async {
+        let admission = get_library_admission(library_name);
+        let can_wait = !ctx.get_flags().contains(ContextFlags::DENY_BLOCKING);
+        match admission.admit(can_wait, || library_backlog(lib)) {
+            Admission::Admitted => {}
+            Admission::Wait => {
+                admission.wait(
+                    ctx,
+                    library_name,
+                    function_name,
+                    args.iter().map(|v| v.as_slice().to_vec()).collect(),
+                    ctx.get_current_user().safe_clone(ctx),
+                    ctx.block_client(),
+                );
+                return Ok(RedisValue::NoReply);
+            }
+            Admission::Rejected => return Err(admission_control::rejected_error(library_name)),
+        }
+    }
+
     {
         let _notification_blocker = get_notification_blocker();
-        let res = function.func.call(&RunCtx {
-            ctx,
-            args,
-            flags: function.flags,
-            lib_meta_data: Arc::clone(&lib.gears_lib_ctx.meta_data),
-            allow_block,
-        });
+        let _allocations_guard =
+            allocation_stats::count_invocation_allocations(InvocationKind::Function);
+        let res = invoke_function(ctx, lib, function, args, allow_block);
         if matches!(res, FunctionCallResult::Hold) && !allow_block {
             // If we reach here, it means that the plugin violates the API, it blocked the client even though it is not allow to.
             log::warn!(
@@ -1387,6 +1763,165 @@ fn function_call_command(
     }
 }
 
+/// Runs an async function invocation that waited for the library to admit
+/// it. The client was blocked when the invocation was queued and the reply
+/// is sent to it once the invocation is done.
+fn invoke_admitted_function(
+    ctx: &Context,
+    library_name: &str,
+    call: WaitingCall,
+    in_flight: InFlightGuard,
+) {
+    let client = BackgroundClientCtx::new(call.blocked_client, in_flight);
+    if let Err(e) = lazy_library::materialize_library(ctx, library_name) {
+        client.send_reply(Err(e));
+        return;
+    }
+    let libraries = get_libraries();
+    let (lib, function) =
+        match get_function_to_call(ctx, &libraries, library_name, &call.function_name) {
+            Ok(v) => v,
+            Err(e) => {
+                client.send_reply(Err(e));
+                return;
+            }
+        };
+    let _notification_blocker = get_notification_blocker();
+    let _allocations_guard =
+        allocation_stats::count_invocation_allocations(InvocationKind::Function);
+    let run_ctx = AdmittedRunCtx::new(
+        ctx,
+        call.args,
+        function.flags,
+        &lib.gears_lib_ctx.meta_data,
+        call.user,
+        client,
+    );
+    // if the function did not take the client to the background, it already
+    // replied and the client is unblocked when the run context is dropped.
+    function.func.call(&run_ctx);
+}
+
+/// Verifies that the keys of a single `TFCALLMULTI` invocation can be
+/// accessed by the current user and, in cluster mode, that they all belong
+/// to a slot served by this shard.
+fn verify_invocation_keys(ctx: &Context, keys: &[RedisString]) -> Result<(), RedisError> {
+    let user = ctx.get_current_user();
+    for key in keys {
+        ctx.acl_check_key_permission(
+            &user,
+            key,
+            &(AclPermissions::ACCESS | AclPermissions::UPDATE),
+        )
+        .map_err(|_| {
+            RedisError::String(format!(
+                "NOPERM No permissions to access the '{}' key",
+                key.to_string_lossy()
+            ))
+        })?;
+    }
+
+    if !is_cluster_in_cluster_mode() {
+        return Ok(());
+    }
+    let mut slots = keys.iter().map(|v| calc_slot(v.as_slice()));
+    if let Some(slot) = slots.next() {
+        if slots.any(|v| v != slot) {
+            return Err(RedisError::Str(
+                "CROSSSLOT Keys in request don't hash to the same slot",
+            ));
+        }
+        if !is_my_slot(slot) {
+            return Err(RedisError::String(format!(
+                "Err slot {slot} is not served by this shard"
+            )));
+        }
+    }
+    Ok(())
+}
+
+/// Runs the same function over multiple arguments sets:
+/// `TFCALLMULTI <library>.<function> <invocations> [<numkeys> <key>... <numargs> <arg>...]...`
+///
+/// The function lookup, the verifications and the backend setup are done
+/// once for all the invocations. The reply is an array with the reply of
+/// each invocation, an invocation that fails (including its keys
+/// verification) does not stop the following invocations.
+fn function_call_multi_command(
+    ctx: &Context,
+    mut args: Skip<IntoIter<redis_module::RedisString>>,
+) -> RedisResult {
+    let (library_name, function_name) = parse_function_name(args.next_arg()?.try_as_str()?)?;
+    let num_invocations = args.next_arg()?.try_as_str()?.parse::<usize>()?;
+
+    // Parse all the invocations first, a syntax error fails the command
+    // before any invocation runs.
+    // The number of invocations is given by the client, do not trust it
+    // for preallocation. Each invocation takes at least 2 arguments.
+    let mut invocations = Vec::with_capacity(num_invocations.min(args.len() / 2));
+    for i in 0..num_invocations {
+        let num_keys = args.next_arg()?.try_as_str()?.parse::<usize>()?;
+        let mut invocation_args = args.by_ref().take(num_keys).collect::<Vec<_>>();
+        let num_args = args
+            .next_arg()
+            .map_err(|_| {
+                RedisError::String(format!(
+                    "Not enough arguments was given for invocation {i}, expected {num_keys} keys followed by the number of arguments."
+                ))
+            })?
+            .try_as_str()?
+            .parse::<usize>()?;
+        invocation_args.extend(args.by_ref().take(num_args));
+        if invocation_args.len() < num_keys + num_args {
+            return Err(RedisError::String(format!(
+                "Not enough arguments was given for invocation {i}, expected {} arguments, got {} arguments.",
+                num_keys + num_args,
+                invocation_args.len()
+            )));
+        }
+        invocations.push((num_keys, invocation_args));
+    }
+    if args.next().is_some() {
+        return Err(RedisError::Str(
+            "Too many arguments were given, the number of invocations does not match the arguments.",
+        ));
+    }
+
+    lazy_library::materialize_library(ctx, library_name)?;
+    let libraries = get_libraries();
+    let (lib, function) = get_function_to_call(ctx, &libraries, library_name, function_name)?;
+
+    if function.is_async {
+        return Err(RedisError::Str(
+            "The function is declared as async, async functions can not be invoked using TFCALLMULTI.",
+        ));
+    }
+
+    let _notification_blocker = get_notification_blocker();
+    let _batch_scope = function.func.enter_batch();
+    raw::reply_with_array(ctx.ctx, invocations.len() as std::os::raw::c_long);
+    for (num_keys, args) in invocations {
+        if let Err(e) = verify_invocation_keys(ctx, &args[..num_keys]) {
+            ctx.reply(Err(e));
+            continue;
+        }
+        let _allocations_guard =
+            allocation_stats::count_invocation_allocations(InvocationKind::Function);
+        let res = invoke_function(ctx, lib, function, args, false);
+        if matches!(res, FunctionCallResult::Hold) {
+            // The plugin blocked the client even though blocking is forbidden,
+            // reply with an error so the reply array keeps an element per invocation.
+            log::warn!(
+                "Plugin API violation, plugin blocked the client even though blocking is forbiden."
+            );
+            ctx.reply(Err(RedisError::Str(
+                "Clien got blocked when blocking is not allow",
+            )));
+        }
+    }
+    Ok(RedisValue::NoReply)
+}
+
 /// Backend-related functionality.
 pub(crate) trait GILBackendStorage {
     /// Returns a reference to an initialised backend found by name.
@@ -1469,9 +2004,18 @@ fn function_debug_command(
                     .collect(),
             ))
         }
+        "allocation_stats" => {
+            return Ok(allocation_stats::get_allocation_stats());
+        }
+        "reset_allocation_stats" => {
+            allocation_stats::reset_allocation_stats();
+            return Ok(RedisValue::SimpleStringStatic("OK"));
+        }
         "help" => {
             return Ok(RedisValue::Array(
                 vec![
+                    RedisValue::BulkString("allocation_stats - heap allocations performed by functions, key space notifications and stream records invocations.".to_string()),
+                    RedisValue::BulkString("reset_allocation_stats - reset the allocation statistics.".to_string()),
                     RedisValue::BulkString("allow_unsafe_redis_commands - enable the option to execute unsafe redis commands from within a function.".to_string()),
                     RedisValue::BulkString("panic_on_thread_pool - panic on thread pool to check panic reaction.".to_string()),
                     RedisValue::BulkString("help - print this message.".to_string()),
@@ -1530,6 +2074,17 @@ fn generic_notification(ctx: &Context, _event_type: NotifyEvent, event: &str, ke
 }
 
 fn key_space_notification(ctx: &Context, _event_type: NotifyEvent, event: &str, key: &[u8]) {
+    // The cached RedisAI handles must be dropped on replica as well.
+    get_globals_mut()
+        .redisai_handles_caches
+        .values_mut()
+        .for_each(|v| v.invalidate(key));
+
+    // A key miss does not change the data, all other events might.
+    if event != "keymiss" {
+        for_each_function_results_cache(|v| v.invalidate(key));
+    }
+
     if !is_master(ctx) {
         // do not fire notifications on slave
         return;
@@ -1600,8 +2155,13 @@ fn on_loading_event(ctx: &Context, loading_sub_event: LoadingSubevent) {
             // clean the entire functions data
             ctx.log_notice("Got a loading start event, clear the entire functions data.");
             let globals = get_globals_mut();
-            globals.libraries.lock().unwrap().clear();
+            let mut libraries = globals.libraries.lock().unwrap();
+            libraries.clear();
+            rdb::libraries_code_changed();
+            drop(libraries);
             globals.stream_ctx.clear();
+            globals.redisai_handles_caches.clear();
+            for_each_function_results_cache(|v| v.clear());
 
             // During loading we do not want to get any key space notifications
             globals.avoid_key_space_notifications = true;
@@ -1636,6 +2196,11 @@ fn on_flush_event(ctx: &Context, flush_event: FlushSubevent) {
             }
         }
         globals.stream_ctx.clear_tracked_streams();
+        globals
+            .redisai_handles_caches
+            .values_mut()
+            .for_each(|v| v.clear());
+        for_each_function_results_cache(|v| v.clear());
     }
 }
 
@@ -1682,6 +2247,30 @@ fn cron_event_handler(ctx: &Context, _hz: u64) {
     }
     globals.avoid_replication_traffic = ctx.avoid_replication_traffic();
 
+    if *LAZY_LIBRARY_WARMUP.lock(ctx) {
+        lazy_library::warmup_next_lazy_library(ctx);
+    }
+
+    background_run_ctx::refresh_slots_map(ctx);
+
+    // Keep the encoded libraries code up to date, so a forked child that
+    // saves the RDB can reuse it instead of encoding the code again. The
+    // code is only encoded again if it changed since the last encoding.
+    let libraries = get_libraries();
+    if !libraries.is_empty() {
+        let _ = rdb::get_encoded_libraries_code(ctx, &libraries);
+    }
+    drop(libraries);
+
+    let idle_gc_budget = V8_IDLE_GC_BUDGET.load(Ordering::Relaxed);
+    if idle_gc_budget > 0 {
+        // only consider backends that were already initialised.
+        globals
+            .backends
+            .values_mut()
+            .for_each(|b| b.on_idle(Duration::from_millis(idle_gc_budget as u64)));
+    }
+
     let mut should_stop_debugger = false;
     if let Some(debugger_backend) = globals.debugger_server.as_mut() {
         match debugger_backend.process_events(ctx) {
@@ -1778,6 +2367,19 @@ fn function_call_async(ctx: &Context, args: Vec<RedisString>) -> RedisResult {
     function_call_command(ctx, args, true)
 }
 
+#[command(
+    {
+        name: "tfcallmulti",
+        flags: [MayReplicate, DenyScript, NoMandatoryKeys],
+        arity: -3,
+        key_spec: [],
+    }
+)]
+fn function_call_multi(ctx: &Context, args: Vec<RedisString>) -> RedisResult {
+    let args = args.into_iter().skip(1);
+    function_call_multi_command(ctx, args)
+}
+
 #[command(
     {
         name: "_rg_internals.function",
@@ -1887,8 +2489,10 @@ macro_rules! get_allocator {
 mod gears_module {
     use super::*;
     use config::{
-        GEARS_BOX_ADDRESS, REMOTE_TASK_DEFAULT_TIMEOUT, V8_DEBUG_SERVER_ADDRESS,
-        V8_LIBRARY_INITIAL_MEMORY_LIMIT, V8_LIBRARY_INITIAL_MEMORY_USAGE,
+        ASYNC_CALLS_MAX_IN_FLIGHT, ASYNC_CALLS_QUEUE_SIZE, ASYNC_CALLS_QUEUE_TIMEOUT,
+        BACKGROUND_QUEUE_MAX_DEPTH, BACKGROUND_SCAN_TIME_BUDGET, GEARS_BOX_ADDRESS,
+        LAZY_LIBRARY_LOADING, RDB_COMPRESSION, REMOTE_TASK_DEFAULT_TIMEOUT,
+        V8_DEBUG_SERVER_ADDRESS, V8_LIBRARY_INITIAL_MEMORY_LIMIT, V8_LIBRARY_INITIAL_MEMORY_USAGE,
         V8_LIBRARY_MEMORY_USAGE_DELTA, V8_MAX_MEMORY,
     };
     use rdb::REDIS_GEARS_TYPE;
@@ -1897,7 +2501,10 @@ mod gears_module {
     redis_module::redis_module! {
         name: "redisgears_2",
         version: VERSION_NUM.unwrap().parse::<i32>().unwrap(),
-        allocator: (get_allocator!(), get_allocator!()),
+        allocator: (
+            allocation_stats::CountingAlloc<get_allocator!()>,
+            allocation_stats::CountingAlloc(get_allocator!())
+        ),
         data_types: [REDIS_GEARS_TYPE],
         init: js_init,
         commands: [],
@@ -1911,6 +2518,11 @@ mod gears_module {
                 ["error-verbosity", &*ERROR_VERBOSITY ,1, 1, 2, ConfigurationFlags::DEFAULT, None],
                 ["execution-threads", &*EXECUTION_THREADS ,1, 1, 32, ConfigurationFlags::IMMUTABLE, None],
                 ["remote-task-default-timeout", &*REMOTE_TASK_DEFAULT_TIMEOUT , 500, 1, i64::MAX, ConfigurationFlags::DEFAULT, None],
+                ["background-scan-time-budget", &*BACKGROUND_SCAN_TIME_BUDGET , 1, 1, 1000, ConfigurationFlags::DEFAULT, None],
+                ["library-max-async-calls-in-flight", &*ASYNC_CALLS_MAX_IN_FLIGHT , 0, 0, 1000000, ConfigurationFlags::DEFAULT, None],
+                ["library-max-background-queue-depth", &*BACKGROUND_QUEUE_MAX_DEPTH , 0, 0, 1000000, ConfigurationFlags::DEFAULT, None],
+                ["library-async-calls-queue-size", &*ASYNC_CALLS_QUEUE_SIZE , 0, 0, 1000000, ConfigurationFlags::DEFAULT, None],
+                ["library-async-calls-queue-timeout", &*ASYNC_CALLS_QUEUE_TIMEOUT , 1000, 1, 3600000, ConfigurationFlags::DEFAULT, None],
                 ["lock-redis-timeout", &*LOCK_REDIS_TIMEOUT , 500, 100, 1000000000, ConfigurationFlags::DEFAULT, None],
                 ["db-loading-lock-redis-timeout", &*DB_LOADING_LOCK_REDIS_TIMEOUT , 30000, 100, 1000000000, ConfigurationFlags::DEFAULT, None],
 
@@ -1950,6 +2562,17 @@ mod gears_module {
                     ConfigurationFlags::MEMORY | ConfigurationFlags::IMMUTABLE,
                     None
                 ],
+                ["v8-idle-gc-budget", &*V8_IDLE_GC_BUDGET , 1, 0, 100, ConfigurationFlags::DEFAULT, None],
+                ["v8-shared-isolate-max-libraries", &*V8_SHARED_ISOLATE_MAX_LIBRARIES , 0, 0, 1000, ConfigurationFlags::DEFAULT, None],
+                [
+                    "function-results-cache-max-memory",
+                    &*FUNCTION_RESULTS_CACHE_MAX_MEMORY,
+                    byte_unit::n_mb_bytes!(1) as i64,
+                    0,
+                    byte_unit::n_gb_bytes!(1) as i64,
+                    ConfigurationFlags::MEMORY,
+                    None
+                ],
             ],
             string: [
                 ["gearsbox-address", &*GEARS_BOX_ADDRESS , "http://localhost:3000", ConfigurationFlags::DEFAULT, None],
@@ -1959,6 +2582,10 @@ mod gears_module {
             ],
             bool: [
                 ["enable-debug-command", &*ENABLE_DEBUG_COMMAND , false, ConfigurationFlags::IMMUTABLE, None],
+                ["lazy-library-loading", &*LAZY_LIBRARY_LOADING , false, ConfigurationFlags::DEFAULT, None],
+                ["lazy-library-warmup", &*LAZY_LIBRARY_WARMUP , false, ConfigurationFlags::DEFAULT, None],
+                ["rdb-compression", &*RDB_COMPRESSION , true, ConfigurationFlags::DEFAULT, None],
+                ["remote-functions-structured-encoding", &*REMOTE_FUNCTIONS_STRUCTURED_ENCODING , false, ConfigurationFlags::DEFAULT, None],
             ],
             enum: [
                 ["library-fatal-failure-policy", &*FATAL_FAILURE_POLICY , config::FatalFailurePolicyConfiguration::Abort, ConfigurationFlags::DEFAULT, None],
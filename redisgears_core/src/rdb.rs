@@ -5,9 +5,15 @@
  */
 
 use crate::{
-    function_load_command::{function_load_internal, CompilationArguments},
+    config::{LAZY_LIBRARY_LOADING, RDB_COMPRESSION},
+    function_load_command::{
+        function_compile_multiple, function_evaluate_and_store, CompilationArguments,
+    },
     get_globals, get_globals_mut, get_libraries,
+    lazy_library::{store_lazy_library, FunctionManifest, LibraryManifest},
+    GearsLibrary,
 };
+use redisgears_plugin_api::redisgears_plugin_api::load_library_ctx::FunctionFlags;
 
 use mr::libmr::{calc_slot, is_my_slot};
 use redis_module::{
@@ -15,9 +21,424 @@ use redis_module::{
     RedisModuleTypeMethods,
 };
 
+use std::collections::HashMap;
 use std::os::raw::c_int;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+
+/// The current encoding version. Version 2 adds the libraries manifest
+/// (which allows loading libraries lazily), saves the libraries code as
+/// deduplicated, optionally compressed, chunks and saves the stream consumers
+/// checkpoints as a compact, delta encoded, section.
+pub(crate) static REDIS_GEARS_VERSION: i32 = 2;
+
+/// The encoding version that saves each library code, and each stream
+/// consumer checkpoints, as plain strings and has no libraries manifest.
+const V1_ENCVER: i32 = 1;
+
+/// Content defined chunking parameters, the average chunk size is 4KB.
+const CHUNK_MIN_SIZE: usize = 1024;
+const CHUNK_MAX_SIZE: usize = 64 * 1024;
+const CHUNK_BOUNDARY_MASK: u64 = ((1 << 12) - 1) << 52;
+
+/// The chunks data compression types.
+const CHUNKS_NOT_COMPRESSED: u64 = 0;
+const CHUNKS_LZ4_COMPRESSED: u64 = 1;
+
+/// Appends the value to the buffer as a LEB128 varint.
+fn write_varint(buf: &mut Vec<u8>, mut val: u64) {
+    while val >= 0x80 {
+        buf.push((val as u8) | 0x80);
+        val >>= 7;
+    }
+    buf.push(val as u8);
+}
+
+/// Reads a LEB128 varint from the given position and advance the position,
+/// return [`None`] if the data is truncated or the value is too big.
+fn read_varint(data: &[u8], pos: &mut usize) -> Option<u64> {
+    let mut val: u64 = 0;
+    let mut shift = 0;
+    loop {
+        let b = *data.get(*pos)?;
+        *pos += 1;
+        if shift > 63 || (shift == 63 && b > 1) {
+            return None;
+        }
+        val |= ((b & 0x7f) as u64) << shift;
+        if b & 0x80 == 0 {
+            return Some(val);
+        }
+        shift += 7;
+    }
+}
+
+/// Random values (generated with splitmix64) used by the gear rolling hash.
+const fn gear_table() -> [u64; 256] {
+    let mut table = [0u64; 256];
+    let mut state: u64 = 0;
+    let mut i = 0;
+    while i < table.len() {
+        state = state.wrapping_add(0x9E37_79B9_7F4A_7C15);
+        let mut z = state;
+        z = (z ^ (z >> 30)).wrapping_mul(0xBF58_476D_1CE4_E5B9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94D0_49BB_1331_11EB);
+        table[i] = z ^ (z >> 31);
+        i += 1;
+    }
+    table
+}
+
+static GEAR_TABLE: [u64; 256] = gear_table();
+
+/// Splits the data into content defined chunks, the chunks boundaries are
+/// decided by the content (using a rolling hash) and not by the offset, so
+/// the same content results in the same chunks even if it appears in a
+/// different offset on a different library.
+fn split_to_chunks(mut data: &[u8]) -> Vec<&[u8]> {
+    let mut chunks = Vec::new();
+    while !data.is_empty() {
+        let limit = data.len().min(CHUNK_MAX_SIZE);
+        let mut end = limit;
+        let mut hash: u64 = 0;
+        for (i, b) in data[..limit].iter().enumerate() {
+            hash = (hash << 1).wrapping_add(GEAR_TABLE[*b as usize]);
+            if i + 1 >= CHUNK_MIN_SIZE && hash & CHUNK_BOUNDARY_MASK == 0 {
+                end = i + 1;
+                break;
+            }
+        }
+        let (chunk, rest) = data.split_at(end);
+        chunks.push(chunk);
+        data = rest;
+    }
+    chunks
+}
+
+/// The code of all the libraries, split into content defined chunks. Each
+/// distinct chunk is kept once, so code that is shared between libraries
+/// (vendored dependencies for example) is saved only once.
+pub(crate) struct EncodedLibrariesCode {
+    /// The [`LIBRARIES_CODE_GENERATION`] the code was encoded on.
+    generation: u64,
+    /// Whether compression was requested when encoding the code.
+    compress: bool,
+    compression: u64,
+    /// The distinct chunks, concatenated and compressed according to `compression`.
+    chunks_data: Vec<u8>,
+    chunks_sizes: Vec<u64>,
+    /// The chunks that compose each library code, by library name.
+    libraries_chunks: HashMap<String, Vec<u64>>,
+    /// The total size of the libraries code.
+    pub(crate) code_size: usize,
+}
+
+impl EncodedLibrariesCode {
+    fn new(
+        libraries: &HashMap<String, Arc<GearsLibrary>>,
+        generation: u64,
+        compress: bool,
+    ) -> EncodedLibrariesCode {
+        let mut chunks_indexes: HashMap<&[u8], u64> = HashMap::new();
+        let mut chunks_data = Vec::new();
+        let mut chunks_sizes = Vec::new();
+        let mut code_size = 0;
+        let libraries_chunks: HashMap<String, Vec<u64>> = libraries
+            .iter()
+            .map(|(name, lib)| {
+                let code = lib.gears_lib_ctx.meta_data.code.as_bytes();
+                code_size += code.len();
+                let chunks = split_to_chunks(code)
+                    .into_iter()
+                    .map(|chunk| {
+                        *chunks_indexes.entry(chunk).or_insert_with(|| {
+                            chunks_data.extend_from_slice(chunk);
+                            chunks_sizes.push(chunk.len() as u64);
+                            chunks_sizes.len() as u64 - 1
+                        })
+                    })
+                    .collect::<Vec<u64>>();
+                (name.clone(), chunks)
+            })
+            .collect();
+
+        let (compression, chunks_data) = if compress {
+            let compressed = lz4_flex::compress_prepend_size(&chunks_data);
+            if compressed.len() < chunks_data.len() {
+                (CHUNKS_LZ4_COMPRESSED, compressed)
+            } else {
+                (CHUNKS_NOT_COMPRESSED, chunks_data)
+            }
+        } else {
+            (CHUNKS_NOT_COMPRESSED, chunks_data)
+        };
+
+        EncodedLibrariesCode {
+            generation,
+            compress,
+            compression,
+            chunks_data,
+            chunks_sizes,
+            libraries_chunks,
+            code_size,
+        }
+    }
+
+    /// The amount of bytes the libraries code takes on the RDB.
+    pub(crate) fn stored_size(&self) -> usize {
+        self.chunks_data.len()
+    }
+}
+
+/// The last encoding of the libraries code. It is updated on cron when the
+/// libraries code changes, so a forked child that saves the RDB can usually
+/// reuse it instead of encoding the code again. It is also used to report the
+/// encoding stats on `INFO`.
+pub(crate) static ENCODED_LIBRARIES_CODE: Mutex<Option<EncodedLibrariesCode>> = Mutex::new(None);
+
+/// Incremented each time a library is added, removed or replaced by a library
+/// with a different code. Must only be changed while holding the libraries lock.
+static LIBRARIES_CODE_GENERATION: AtomicU64 = AtomicU64::new(0);
+
+/// Marks the libraries code as changed, the code will be encoded again on the
+/// next cron or RDB save. Materializing a lazy library or upgrading a library
+/// with the same code does not change the encoded code and should not call it.
+pub(crate) fn libraries_code_changed() {
+    LIBRARIES_CODE_GENERATION.fetch_add(1, Ordering::Relaxed);
+}
+
+/// Returns the encoding of the given libraries code, encode the code only
+/// if the libraries code (or the compression configuration) changed since the
+/// last time it was encoded. The caller must hold the libraries lock.
+pub(crate) fn get_encoded_libraries_code(
+    ctx: &Context,
+    libraries: &HashMap<String, Arc<GearsLibrary>>,
+) -> std::sync::MutexGuard<'static, Option<EncodedLibrariesCode>> {
+    let compress = *RDB_COMPRESSION.lock(ctx);
+    let generation = LIBRARIES_CODE_GENERATION.load(Ordering::Relaxed);
+    let mut encoded = ENCODED_LIBRARIES_CODE.lock().unwrap();
+    let is_valid = encoded.as_ref().map_or(false, |v| {
+        v.compress == compress && v.generation == generation
+    });
+    if !is_valid {
+        *encoded = Some(EncodedLibrariesCode::new(libraries, generation, compress));
+    }
+    encoded
+}
+
+/// The distinct code chunks as read from the RDB.
+struct LoadedChunks {
+    data: Vec<u8>,
+    offsets: Vec<(usize, usize)>,
+}
+
+impl LoadedChunks {
+    fn load(rdb: *mut raw::RedisModuleIO) -> Result<LoadedChunks, Error> {
+        let compression = raw::load_unsigned(rdb).map_err(|e| {
+            Error::generic(&format!("Failed loading code compression from rdb, {e}."))
+        })?;
+        let data = raw::load_string_buffer(rdb)
+            .map_err(|e| Error::generic(&format!("Failed loading code chunks from rdb, {e}.")))?;
+        let data = match compression {
+            CHUNKS_NOT_COMPRESSED => data.as_ref().to_vec(),
+            CHUNKS_LZ4_COMPRESSED => {
+                lz4_flex::decompress_size_prepended(data.as_ref()).map_err(|e| {
+                    Error::generic(&format!("Failed decompressing code chunks from rdb, {e}."))
+                })?
+            }
+            _ => {
+                return Err(Error::generic(&format!(
+                    "Unknown code compression type {compression}."
+                )))
+            }
+        };
+        let num_of_chunks = raw::load_unsigned(rdb).map_err(|e| {
+            Error::generic(&format!(
+                "Failed loading number of code chunks from rdb, {e}."
+            ))
+        })?;
+        let mut offset = 0;
+        let offsets = (0..num_of_chunks)
+            .map(|_| {
+                let size = raw::load_unsigned(rdb).map_err(|e| {
+                    Error::generic(&format!("Failed loading code chunk size from rdb, {e}."))
+                })? as usize;
+                let res = (offset, offset + size);
+                offset += size;
+                Ok(res)
+            })
+            .collect::<Result<Vec<_>, Error>>()?;
+        if offset > data.len() {
+            return Err(Error::generic("Code chunks sizes exceed the chunks data."));
+        }
+        Ok(LoadedChunks { data, offsets })
+    }
+
+    /// Loads the chunks indexes of a library from the RDB and returns the library code.
+    fn load_code(&self, rdb: *mut raw::RedisModuleIO) -> Result<String, Error> {
+        let num_of_chunks = raw::load_unsigned(rdb).map_err(|e| {
+            Error::generic(&format!(
+                "Failed loading number of library code chunks from rdb, {e}."
+            ))
+        })?;
+        let mut code = Vec::new();
+        for _ in 0..num_of_chunks {
+            let index = raw::load_unsigned(rdb).map_err(|e| {
+                Error::generic(&format!("Failed loading code chunk index from rdb, {e}."))
+            })?;
+            let (start, end) = self
+                .offsets
+                .get(index as usize)
+                .ok_or_else(|| Error::generic(&format!("Invalid code chunk index {index}.")))?;
+            code.extend_from_slice(&self.data[*start..*end]);
+        }
+        String::from_utf8(code)
+            .map_err(|e| Error::generic(&format!("Failed parsing code from rdb as string, {e}.")))
+    }
+}
+
+/// The streams names dictionary as read from the RDB, the stream consumers
+/// checkpoints refer to the streams by their index in the dictionary.
+#[derive(Default)]
+struct LoadedStreamNames {
+    data: Vec<u8>,
+    offsets: Vec<(usize, usize)>,
+}
 
-pub(crate) static REDIS_GEARS_VERSION: i32 = 1;
+impl LoadedStreamNames {
+    fn load(rdb: *mut raw::RedisModuleIO) -> Result<LoadedStreamNames, Error> {
+        let data = raw::load_string_buffer(rdb)
+            .map_err(|e| Error::generic(&format!("Failed loading streams names from rdb, {e}.")))?
+            .as_ref()
+            .to_vec();
+        let sizes = raw::load_string_buffer(rdb).map_err(|e| {
+            Error::generic(&format!(
+                "Failed loading streams names sizes from rdb, {e}."
+            ))
+        })?;
+        let sizes = sizes.as_ref();
+        let mut offsets = Vec::new();
+        let mut offset = 0;
+        let mut pos = 0;
+        while pos < sizes.len() {
+            let size = read_varint(sizes, &mut pos)
+                .ok_or_else(|| Error::generic("Failed parsing streams names sizes from rdb."))?
+                as usize;
+            offsets.push((offset, offset + size));
+            offset += size;
+        }
+        if offset > data.len() {
+            return Err(Error::generic(
+                "Streams names sizes exceed the streams names data.",
+            ));
+        }
+        Ok(LoadedStreamNames { data, offsets })
+    }
+
+    /// Adds a stream name to the dictionary and return its index, used
+    /// when loading an old encoding version which saves the names per consumer.
+    fn push(&mut self, name: &[u8]) -> usize {
+        self.offsets
+            .push((self.data.len(), self.data.len() + name.len()));
+        self.data.extend_from_slice(name);
+        self.offsets.len() - 1
+    }
+
+    fn len(&self) -> usize {
+        self.offsets.len()
+    }
+
+    fn get(&self, index: usize) -> &[u8] {
+        let (start, end) = self.offsets[index];
+        &self.data[start..end]
+    }
+
+    fn iter(&self) -> impl Iterator<Item = &[u8]> {
+        self.offsets
+            .iter()
+            .map(|(start, end)| &self.data[*start..*end])
+    }
+}
+
+/// Saves the streams names dictionary shared by all the stream consumers and
+/// return the index of each stream name. The names are written as a single
+/// buffer followed by a buffer of their varint encoded sizes.
+fn save_stream_names<'a>(
+    rdb: *mut raw::RedisModuleIO,
+    names: impl Iterator<Item = &'a [u8]>,
+) -> HashMap<&'a [u8], u64> {
+    let mut names_data = Vec::new();
+    let mut names_sizes = Vec::new();
+    let mut names_indexes = HashMap::new();
+    for name in names {
+        let next_index = names_indexes.len() as u64;
+        names_indexes.entry(name).or_insert_with(|| {
+            names_data.extend_from_slice(name);
+            write_varint(&mut names_sizes, name.len() as u64);
+            next_index
+        });
+    }
+    raw::save_slice(rdb, &names_data);
+    raw::save_slice(rdb, &names_sizes);
+    names_indexes
+}
+
+/// Saves the streams checkpoints of a stream consumer as a single buffer.
+/// The checkpoints are sorted by their id and each one is written as the
+/// varint encoded stream name index, the delta of the id `ms` part from the
+/// previous checkpoint, and the id `seq` part.
+fn save_stream_checkpoints<'a>(
+    rdb: *mut raw::RedisModuleIO,
+    names_indexes: &HashMap<&[u8], u64>,
+    checkpoints: impl Iterator<Item = (&'a [u8], u64, u64)>,
+) {
+    let mut checkpoints = checkpoints
+        .map(|(name, ms, seq)| (ms, seq, names_indexes[name]))
+        .collect::<Vec<_>>();
+    checkpoints.sort_unstable();
+    let mut buf = Vec::with_capacity(checkpoints.len() * 8);
+    let mut last_ms = 0;
+    for (ms, seq, index) in checkpoints {
+        write_varint(&mut buf, index);
+        write_varint(&mut buf, ms - last_ms);
+        write_varint(&mut buf, seq);
+        last_ms = ms;
+    }
+    raw::save_slice(rdb, &buf);
+}
+
+/// Loads the streams checkpoints of a stream consumer saved by [`save_stream_checkpoints`].
+fn load_stream_checkpoints(
+    rdb: *mut raw::RedisModuleIO,
+    stream_names: &LoadedStreamNames,
+    consumer_name: &str,
+) -> Result<Vec<(usize, u64, u64)>, Error> {
+    let data = raw::load_string_buffer(rdb).map_err(|e| {
+        Error::generic(&format!(
+            "Failed loading streams checkpoints for consumer '{consumer_name}', {e}."
+        ))
+    })?;
+    let data = data.as_ref();
+    let parse_error = || {
+        Error::generic(&format!(
+            "Failed parsing streams checkpoints for consumer '{consumer_name}'."
+        ))
+    };
+    let mut checkpoints = Vec::new();
+    let mut pos = 0;
+    let mut ms: u64 = 0;
+    while pos < data.len() {
+        let index = read_varint(data, &mut pos).ok_or_else(parse_error)? as usize;
+        let ms_delta = read_varint(data, &mut pos).ok_or_else(parse_error)?;
+        let seq = read_varint(data, &mut pos).ok_or_else(parse_error)?;
+        if index >= stream_names.len() {
+            return Err(parse_error());
+        }
+        ms = ms.checked_add(ms_delta).ok_or_else(parse_error)?;
+        checkpoints.push((index, ms, seq));
+    }
+    Ok(checkpoints)
+}
 pub(crate) static REDIS_GEARS_TYPE: RedisType = RedisType::new(
     "GearsType",
     REDIS_GEARS_VERSION,
@@ -49,6 +470,93 @@ pub(crate) static REDIS_GEARS_TYPE: RedisType = RedisType::new(
     },
 );
 
+fn save_manifest(rdb: *mut raw::RedisModuleIO, manifest: &LibraryManifest) {
+    raw::save_unsigned(rdb, manifest.functions.len() as u64);
+    for function in manifest.functions.iter() {
+        raw::save_string(rdb, &function.name);
+        raw::save_unsigned(rdb, function.flags.bits() as u64);
+        raw::save_unsigned(rdb, function.is_async as u64);
+        if let Some(description) = function.description.as_ref() {
+            raw::save_unsigned(rdb, 1); // description exists
+            raw::save_string(rdb, description);
+        } else {
+            raw::save_unsigned(rdb, 0); // no description
+        }
+    }
+    raw::save_unsigned(rdb, manifest.remote_functions.len() as u64);
+    for name in manifest.remote_functions.iter() {
+        raw::save_string(rdb, name);
+    }
+    raw::save_unsigned(rdb, manifest.notifications_consumers_count as u64);
+}
+
+fn load_rdb_string(rdb: *mut raw::RedisModuleIO, what: &str) -> Result<String, Error> {
+    raw::load_string_buffer(rdb)
+        .map_err(|e| Error::generic(&format!("Failed loading {what} from rdb, {e}.")))?
+        .to_string()
+        .map_err(|e| Error::generic(&format!("Failed parsing {what} from rdb as string, {e}.")))
+}
+
+fn load_manifest(rdb: *mut raw::RedisModuleIO) -> Result<LibraryManifest, Error> {
+    let num_of_functions = raw::load_unsigned(rdb).map_err(|e| {
+        Error::generic(&format!(
+            "Failed loading number of functions from rdb, {}.",
+            e
+        ))
+    })?;
+    let functions = (0..num_of_functions)
+        .map(|_| {
+            let name = load_rdb_string(rdb, "function name")?;
+            let flags = raw::load_unsigned(rdb).map_err(|e| {
+                Error::generic(&format!("Failed loading function flags from rdb, {}.", e))
+            })?;
+            let is_async = raw::load_unsigned(rdb).map_err(|e| {
+                Error::generic(&format!(
+                    "Failed loading function async indicator from rdb, {}.",
+                    e
+                ))
+            })?;
+            let has_description = raw::load_unsigned(rdb).map_err(|e| {
+                Error::generic(&format!(
+                    "Failed loading function description indicator from rdb, {}.",
+                    e
+                ))
+            })?;
+            let description = if has_description > 0 {
+                Some(load_rdb_string(rdb, "function description")?)
+            } else {
+                None
+            };
+            Ok(FunctionManifest {
+                name,
+                flags: FunctionFlags::from_bits_truncate(flags as u8),
+                is_async: is_async > 0,
+                description,
+            })
+        })
+        .collect::<Result<Vec<_>, Error>>()?;
+    let num_of_remote_functions = raw::load_unsigned(rdb).map_err(|e| {
+        Error::generic(&format!(
+            "Failed loading number of cluster functions from rdb, {}.",
+            e
+        ))
+    })?;
+    let remote_functions = (0..num_of_remote_functions)
+        .map(|_| load_rdb_string(rdb, "cluster function name"))
+        .collect::<Result<Vec<_>, Error>>()?;
+    let notifications_consumers_count = raw::load_unsigned(rdb).map_err(|e| {
+        Error::generic(&format!(
+            "Failed loading number of keyspace triggers from rdb, {}.",
+            e
+        ))
+    })?;
+    Ok(LibraryManifest {
+        functions,
+        remote_functions,
+        notifications_consumers_count: notifications_consumers_count as usize,
+    })
+}
+
 extern "C" fn aux_save(rdb: *mut raw::RedisModuleIO, _when: c_int) {
     let libraries = get_libraries();
     if libraries.is_empty() {
@@ -60,9 +568,41 @@ extern "C" fn aux_save(rdb: *mut raw::RedisModuleIO, _when: c_int) {
     // save the number of libraries
     raw::save_unsigned(rdb, libraries.len() as u64);
 
+    let inner_ctx = unsafe { raw::RedisModule_GetContextFromIO.unwrap()(rdb) };
+    let ctx = Context::new(inner_ctx);
+    let encoded_code = get_encoded_libraries_code(&ctx, &libraries);
+    let encoded_code = encoded_code.as_ref().unwrap();
+
+    // save the distinct code chunks
+    raw::save_unsigned(rdb, encoded_code.compression);
+    raw::save_slice(rdb, &encoded_code.chunks_data);
+    raw::save_unsigned(rdb, encoded_code.chunks_sizes.len() as u64);
+    for size in encoded_code.chunks_sizes.iter() {
+        raw::save_unsigned(rdb, *size);
+    }
+
+    // save the streams names once, the consumers refer to them by index.
+    let consumers_data = libraries
+        .values()
+        .flat_map(|l| l.gears_lib_ctx.stream_consumers.values())
+        .map(|c| c.ref_cell.borrow())
+        .collect::<Vec<_>>();
+    let names_indexes = save_stream_names(
+        rdb,
+        consumers_data
+            .iter()
+            .flat_map(|c| c.get_streams_checkpoints())
+            .map(|(name, ..)| name),
+    );
+
     for val in libraries.values() {
         raw::save_string(rdb, &val.gears_lib_ctx.meta_data.name);
-        raw::save_string(rdb, &val.gears_lib_ctx.meta_data.code);
+        // save the library code as indexes of the distinct chunks
+        let chunks = &encoded_code.libraries_chunks[&val.gears_lib_ctx.meta_data.name];
+        raw::save_unsigned(rdb, chunks.len() as u64);
+        for index in chunks {
+            raw::save_unsigned(rdb, *index);
+        }
         raw::save_redis_string(rdb, &val.gears_lib_ctx.meta_data.user);
         if let Some(config) = &val.gears_lib_ctx.meta_data.config.as_ref() {
             raw::save_unsigned(rdb, 1); // config exists
@@ -70,142 +610,233 @@ extern "C" fn aux_save(rdb: *mut raw::RedisModuleIO, _when: c_int) {
         } else {
             raw::save_unsigned(rdb, 0); // no config
         }
+        save_manifest(rdb, &LibraryManifest::from_library(val));
         // save the number of streams consumer
         raw::save_unsigned(rdb, val.gears_lib_ctx.stream_consumers.len() as u64);
         for (name, stream_consumer) in val.gears_lib_ctx.stream_consumers.iter() {
             // save the consumer name
             raw::save_string(rdb, name);
-            let streams_info = stream_consumer
-                .ref_cell
-                .borrow()
-                .get_streams_info()
-                .collect::<Vec<(Vec<u8>, u64, u64)>>();
-            // save the number of streams for this consumer
-            raw::save_unsigned(rdb, streams_info.len() as u64);
-            for (stream, ms, seq) in streams_info {
-                // save the stream name
-                raw::save_slice(rdb, &stream);
-                // save last read id
-                raw::save_unsigned(rdb, ms);
-                raw::save_unsigned(rdb, seq);
-            }
+            save_stream_checkpoints(
+                rdb,
+                &names_indexes,
+                stream_consumer.ref_cell.borrow().get_streams_checkpoints(),
+            );
         }
     }
 }
 
-fn aux_load_internals(ctx: &Context, rdb: *mut raw::RedisModuleIO) -> Result<(), Error> {
-    let num_of_libs = raw::load_unsigned(rdb)?;
+/// The data of a stream consumer as it was read from the RDB, the streams
+/// are given by their index in the [`LoadedStreamNames`] dictionary.
+struct StreamConsumerRdbData {
+    name: String,
+    streams: Vec<(usize, u64, u64)>,
+}
 
-    for _ in 0..num_of_libs {
-        let name = raw::load_string_buffer(rdb)
-            .map_err(|e| Error::generic(&format!("Failed loading name from rdb, {}.", e)))?
-            .to_string()
-            .map_err(|e| {
-                Error::generic(&format!("Failed parsing name from rdb as string, {}.", e))
-            })?;
-        let code = raw::load_string_buffer(rdb)
+/// The data of a library as it was read from the RDB.
+struct LibraryRdbData {
+    compilation_arguments: CompilationArguments,
+    manifest: Option<LibraryManifest>,
+    stream_consumers: Vec<StreamConsumerRdbData>,
+}
+
+fn load_library_data(
+    rdb: *mut raw::RedisModuleIO,
+    encver: i32,
+    chunks: Option<&LoadedChunks>,
+    stream_names: &mut LoadedStreamNames,
+) -> Result<LibraryRdbData, Error> {
+    // the name is also part of the code prologue, it is not needed here.
+    let _name = raw::load_string_buffer(rdb)
+        .map_err(|e| Error::generic(&format!("Failed loading name from rdb, {}.", e)))?
+        .to_string()
+        .map_err(|e| Error::generic(&format!("Failed parsing name from rdb as string, {}.", e)))?;
+    let code = match chunks {
+        Some(chunks) => chunks.load_code(rdb)?,
+        None => raw::load_string_buffer(rdb)
             .map_err(|e| Error::generic(&format!("Failed loading code from rdb, {}.", e)))?
             .to_string()
             .map_err(|e| {
                 Error::generic(&format!("Failed parsing code from rdb as string, {}.", e))
-            })?;
-        let user = raw::load_string(rdb)
-            .map_err(|e| Error::generic(&format!("Failed loading user from rdb, {}.", e)))?;
+            })?,
+    };
+    let user = raw::load_string(rdb)
+        .map_err(|e| Error::generic(&format!("Failed loading user from rdb, {}.", e)))?;
 
-        let has_config = raw::load_unsigned(rdb).map_err(|e| {
-            Error::generic(&format!("Failed loading config indicator from rdb, {}.", e))
-        })?;
+    let has_config = raw::load_unsigned(rdb).map_err(|e| {
+        Error::generic(&format!("Failed loading config indicator from rdb, {}.", e))
+    })?;
 
-        let config = if has_config > 0 {
-            Some(
-                raw::load_string_buffer(rdb)
-                    .map_err(|e| Error::generic(&format!("Failed loading user from rdb, {}.", e)))?
-                    .to_string()
-                    .map_err(|e| {
-                        Error::generic(&format!("Failed parsing user from rdb as string, {}.", e))
-                    })?,
-            )
-        } else {
-            None
-        };
+    let config = if has_config > 0 {
+        Some(
+            raw::load_string_buffer(rdb)
+                .map_err(|e| Error::generic(&format!("Failed loading user from rdb, {}.", e)))?
+                .to_string()
+                .map_err(|e| {
+                    Error::generic(&format!("Failed parsing user from rdb as string, {}.", e))
+                })?,
+        )
+    } else {
+        None
+    };
 
-        // allow upgrade on pseudo_slave (replica-of) because we might get the same function multiple time from different source shards.
-        let is_pseudo_slave = get_globals().db_policy.is_pseudo_slave();
-        let compilation_arguments = CompilationArguments::new(user, code, config);
-        match function_load_internal(ctx, compilation_arguments, false, is_pseudo_slave, true) {
-            Ok(_) => {}
-            Err(e) => return Err(Error::generic(&format!("Failed loading librart, {}", e))),
-        }
+    let manifest = if encver > V1_ENCVER {
+        Some(load_manifest(rdb)?)
+    } else {
+        None
+    };
 
-        // library was load, we must be able to find it
-        let libraries = get_libraries();
-        let lib = libraries.get(&name).unwrap();
+    // load stream consumers data
+    let num_of_streams_consumers = raw::load_unsigned(rdb).map_err(|e| {
+        Error::generic(&format!(
+            "Failed loading number of streams from rdb, {}.",
+            e
+        ))
+    })?;
 
-        // load stream consumers data
-        let num_of_streams_consumers = raw::load_unsigned(rdb).map_err(|e| {
+    let mut stream_consumers = Vec::new();
+    for _ in 0..num_of_streams_consumers {
+        let consumer_name = raw::load_string_buffer(rdb)
+            .map_err(|e| Error::generic(&format!("Failed loading consumer name from rdb, {}.", e)))?
+            .to_string()
+            .map_err(|e| {
+                Error::generic(&format!(
+                    "Failed parsing consumer name from rdb as string, {}.",
+                    e
+                ))
+            })?;
+        if encver > V1_ENCVER {
+            let streams = load_stream_checkpoints(rdb, stream_names, &consumer_name)?;
+            stream_consumers.push(StreamConsumerRdbData {
+                name: consumer_name,
+                streams,
+            });
+            continue;
+        }
+        // read the number of streams for this consumer
+        let num_of_streams = raw::load_unsigned(rdb).map_err(|e| {
             Error::generic(&format!(
-                "Failed loading number of streams from rdb, {}.",
-                e
+                "Failed loading number of streams for a consumer '{}', {}.",
+                consumer_name, e
             ))
         })?;
+        let mut streams = Vec::new();
+        for _ in 0..num_of_streams {
+            let stream_name = raw::load_string_buffer(rdb).map_err(|e| {
+                Error::generic(&format!(
+                    "Failed loading stream name for consumer '{}', {}.",
+                    consumer_name, e
+                ))
+            })?;
+            let ms = raw::load_unsigned(rdb).map_err(|e| {
+                Error::generic(&format!(
+                    "Failed loading ms value for consumer '{}', {}.",
+                    consumer_name, e
+                ))
+            })?;
+            let seq = raw::load_unsigned(rdb).map_err(|e| {
+                Error::generic(&format!(
+                    "Failed loading seq value for consumer '{}', {}.",
+                    consumer_name, e
+                ))
+            })?;
+            streams.push((stream_names.push(stream_name.as_ref()), ms, seq));
+        }
+        stream_consumers.push(StreamConsumerRdbData {
+            name: consumer_name,
+            streams,
+        });
+    }
 
-        for _ in 0..num_of_streams_consumers {
-            let consumer_name = raw::load_string_buffer(rdb)
-                .map_err(|e| {
-                    Error::generic(&format!("Failed loading consumer name from rdb, {}.", e))
-                })?
-                .to_string()
-                .map_err(|e| {
-                    Error::generic(&format!(
-                        "Failed parsing consumer name from rdb as string, {}.",
-                        e
-                    ))
-                })?;
+    Ok(LibraryRdbData {
+        compilation_arguments: CompilationArguments::new(user, code, config),
+        manifest,
+        stream_consumers,
+    })
+}
+
+fn aux_load_internals(
+    ctx: &Context,
+    rdb: *mut raw::RedisModuleIO,
+    encver: i32,
+) -> Result<(), Error> {
+    let num_of_libs = raw::load_unsigned(rdb)?;
+
+    let chunks = if encver > V1_ENCVER {
+        Some(LoadedChunks::load(rdb)?)
+    } else {
+        None
+    };
+
+    let mut stream_names = if encver > V1_ENCVER {
+        LoadedStreamNames::load(rdb)?
+    } else {
+        LoadedStreamNames::default()
+    };
+
+    // Read all the libraries first, this allows compiling them concurrently.
+    let libraries = (0..num_of_libs)
+        .map(|_| load_library_data(rdb, encver, chunks.as_ref(), &mut stream_names))
+        .collect::<Result<Vec<_>, Error>>()?;
+    drop(chunks);
+
+    // allow upgrade on pseudo_slave (replica-of) because we might get the same function multiple time from different source shards.
+    let is_pseudo_slave = get_globals().db_policy.is_pseudo_slave();
+
+    // Add the streams only if they belong to our slot range, each stream
+    // name is checked once, no matter how many consumers track it.
+    let streams_in_my_slots = is_pseudo_slave.then(|| {
+        stream_names
+            .iter()
+            .map(|name| is_my_slot(calc_slot(name)))
+            .collect::<Vec<bool>>()
+    });
+
+    // Libraries that only register functions can be loaded lazily, using their manifest.
+    let lazy_loading = *LAZY_LIBRARY_LOADING.lock(ctx);
+    let (lazy_libraries, libraries): (Vec<_>, Vec<_>) = libraries.into_iter().partition(|l| {
+        lazy_loading
+            && l.manifest
+                .as_ref()
+                .map_or(false, |m| m.can_be_lazy(l.stream_consumers.len()))
+    });
+    for library in lazy_libraries {
+        store_lazy_library(
+            &library.compilation_arguments,
+            library.manifest.unwrap(),
+            is_pseudo_slave,
+        )
+        .map_err(|e| Error::generic(&format!("Failed loading librart, {}", e)))?;
+    }
+
+    let (compilation_arguments, stream_consumers): (Vec<_>, Vec<_>) = libraries
+        .into_iter()
+        .map(|v| (v.compilation_arguments, v.stream_consumers))
+        .unzip();
+
+    // Evaluate and register the libraries by their original order.
+    let compiled_libraries = function_compile_multiple(ctx, compilation_arguments);
+    for (compiled_library, stream_consumers) in compiled_libraries.into_iter().zip(stream_consumers)
+    {
+        let lib = compiled_library
+            .and_then(|compiled_library| {
+                function_evaluate_and_store(ctx, compiled_library, is_pseudo_slave, true)
+            })
+            .map_err(|e| Error::generic(&format!("Failed loading librart, {}", e)))?;
+
+        for consumer_data in stream_consumers {
             let consumer = lib
                 .gears_lib_ctx
                 .stream_consumers
-                .get(&consumer_name)
+                .get(&consumer_data.name)
                 .unwrap();
-            // read the number of streams for this consumer
-            let num_of_streams = raw::load_unsigned(rdb).map_err(|e| {
-                Error::generic(&format!(
-                    "Failed loading number of streams for a consumer '{}', {}.",
-                    consumer_name, e
-                ))
-            })?;
-            for _ in 0..num_of_streams {
-                let stream_name = raw::load_string_buffer(rdb).map_err(|e| {
-                    Error::generic(&format!(
-                        "Failed loading stream name for consumer '{}', {}.",
-                        consumer_name, e
-                    ))
-                })?;
-                let ms = raw::load_unsigned(rdb).map_err(|e| {
-                    Error::generic(&format!(
-                        "Failed loading ms value for consumer '{}', {}.",
-                        consumer_name, e
-                    ))
-                })?;
-                let seq = raw::load_unsigned(rdb).map_err(|e| {
-                    Error::generic(&format!(
-                        "Failed loading seq value for consumer '{}', {}.",
-                        consumer_name, e
-                    ))
-                })?;
-                // Add the stream only if it belong to our slot range.
-                if is_pseudo_slave {
-                    let slot = calc_slot(stream_name.as_ref());
-                    if !is_my_slot(slot) {
-                        continue;
-                    }
-                }
-                get_globals_mut().stream_ctx.update_stream_for_consumer(
-                    stream_name.as_ref(),
-                    consumer,
-                    ms,
-                    seq,
-                );
-            }
+            let streams = consumer_data
+                .streams
+                .iter()
+                .filter(|(index, ..)| streams_in_my_slots.as_ref().map_or(true, |v| v[*index]))
+                .map(|(index, ms, seq)| (stream_names.get(*index), *ms, *seq));
+            get_globals_mut()
+                .stream_ctx
+                .update_streams_for_consumer(consumer, streams);
         }
     }
 
@@ -225,7 +856,7 @@ unsafe extern "C" fn aux_load(rdb: *mut raw::RedisModuleIO, encver: c_int, _when
     let inner_ctx = unsafe { raw::RedisModule_GetContextFromIO.unwrap()(rdb) };
     let ctx = Context::new(inner_ctx);
 
-    match aux_load_internals(&ctx, rdb) {
+    match aux_load_internals(&ctx, rdb, encver) {
         Ok(_) => raw::REDISMODULE_OK as i32,
         Err(e) => {
             log::warn!("Failed loading functions from rdb, {}.", e);
@@ -0,0 +1,145 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+//! A per library cache of the RedisAI models and scripts opened by the
+//! library functions. Opening a cached model or script only verifies the
+//! user permissions and that the key still holds the same object, and
+//! takes another reference to it. Entries are dropped when the key is
+//! touched (key space notification), on flush and when the library is
+//! deleted.
+
+use redis_module::{AclPermissions, Context, RedisString};
+
+use redisai_rs::redisai::redisai_model::RedisAIModel;
+use redisai_rs::redisai::redisai_script::RedisAIScript;
+
+use std::collections::HashMap;
+
+/// An object that can be kept in the [`RedisAIHandlesCache`].
+trait RedisAIHandle: Sized {
+    fn open_from_key(ctx: &Context, key_name: &str) -> Result<Self, String>;
+    fn shallow_copy(&self) -> Self;
+    fn is_stored_in_key(&self, ctx: &Context, key_name: &str) -> bool;
+}
+
+impl RedisAIHandle for RedisAIModel {
+    fn open_from_key(ctx: &Context, key_name: &str) -> Result<Self, String> {
+        RedisAIModel::open_from_key(ctx, key_name)
+    }
+
+    fn shallow_copy(&self) -> Self {
+        RedisAIModel::shallow_copy(self)
+    }
+
+    fn is_stored_in_key(&self, ctx: &Context, key_name: &str) -> bool {
+        RedisAIModel::is_stored_in_key(self, ctx, key_name)
+    }
+}
+
+impl RedisAIHandle for RedisAIScript {
+    fn open_from_key(ctx: &Context, key_name: &str) -> Result<Self, String> {
+        RedisAIScript::open_from_key(ctx, key_name)
+    }
+
+    fn shallow_copy(&self) -> Self {
+        RedisAIScript::shallow_copy(self)
+    }
+
+    fn is_stored_in_key(&self, ctx: &Context, key_name: &str) -> bool {
+        RedisAIScript::is_stored_in_key(self, ctx, key_name)
+    }
+}
+
+#[derive(Default)]
+pub(crate) struct RedisAIHandlesCache {
+    models: HashMap<String, RedisAIModel>,
+    scripts: HashMap<String, RedisAIScript>,
+    pub(crate) hits: usize,
+    pub(crate) misses: usize,
+}
+
+impl RedisAIHandlesCache {
+    fn open<T: RedisAIHandle>(
+        handles: &mut HashMap<String, T>,
+        hits: &mut usize,
+        misses: &mut usize,
+        ctx: &Context,
+        user: &RedisString,
+        key_name: &str,
+    ) -> Result<T, String> {
+        if let Some(handle) = handles.get(key_name) {
+            // The user permissions might have changed since the handle was cached.
+            let key_redis_str = ctx.create_string(key_name);
+            ctx.acl_check_key_permission(user, &key_redis_str, &AclPermissions::ACCESS)
+                .map_err(|e| e.to_string())?;
+            // RedisAI does not notify when a model or a script is overwritten,
+            // so make sure the key still holds the cached object.
+            if handle.is_stored_in_key(ctx, key_name) {
+                *hits += 1;
+                return Ok(handle.shallow_copy());
+            }
+            handles.remove(key_name);
+        }
+        *misses += 1;
+        let _authenticate_scope = ctx.authenticate_user(user).map_err(|e| e.to_string())?;
+        let handle = T::open_from_key(ctx, key_name)?;
+        handles.insert(key_name.to_owned(), handle.shallow_copy());
+        Ok(handle)
+    }
+
+    /// Returns the model stored in the given key, opened with the permissions
+    /// of the given user.
+    pub(crate) fn open_model(
+        &mut self,
+        ctx: &Context,
+        user: &RedisString,
+        key_name: &str,
+    ) -> Result<RedisAIModel, String> {
+        Self::open(
+            &mut self.models,
+            &mut self.hits,
+            &mut self.misses,
+            ctx,
+            user,
+            key_name,
+        )
+    }
+
+    /// Returns the script stored in the given key, opened with the permissions
+    /// of the given user.
+    pub(crate) fn open_script(
+        &mut self,
+        ctx: &Context,
+        user: &RedisString,
+        key_name: &str,
+    ) -> Result<RedisAIScript, String> {
+        Self::open(
+            &mut self.scripts,
+            &mut self.hits,
+            &mut self.misses,
+            ctx,
+            user,
+            key_name,
+        )
+    }
+
+    /// Drops the cached handles of the given key.
+    pub(crate) fn invalidate(&mut self, key_name: &[u8]) {
+        if self.models.is_empty() && self.scripts.is_empty() {
+            return;
+        }
+        if let Ok(key_name) = std::str::from_utf8(key_name) {
+            self.models.remove(key_name);
+            self.scripts.remove(key_name);
+        }
+    }
+
+    /// Drops all the cached handles.
+    pub(crate) fn clear(&mut self) {
+        self.models.clear();
+        self.scripts.clear();
+    }
+}
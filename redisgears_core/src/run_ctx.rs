@@ -5,8 +5,8 @@
  */
 
 use redis_module::{
-    CallResult, Context, ContextFlags, RedisError, RedisResult, RedisString, ThreadSafeContext,
-    {BlockingCallOptions, CallOptionResp, CallOptions, CallOptionsBuilder},
+    CallResult, Context, ContextFlags, RedisError, RedisResult, RedisString, RedisValue,
+    ThreadSafeContext, {BlockingCallOptions, CallOptionResp, CallOptions, CallOptionsBuilder},
 };
 
 use redisgears_plugin_api::redisgears_plugin_api::{
@@ -21,32 +21,44 @@ use redisgears_plugin_api::redisgears_plugin_api::{
 };
 
 use crate::{
-    call_redis_command, call_redis_command_async, get_globals, get_msg_verbose,
-    GearsLibraryMetaData,
+    call_redis_command, call_redis_command_async, get_globals, get_library_admission,
+    get_msg_verbose, get_redisai_handles_cache, GearsLibraryMetaData,
 };
 
+use crate::admission_control::InFlightGuard;
+
 use crate::background_run_ctx::BackgroundRunCtx;
+use crate::function_results_cache;
 
+use std::cell::RefCell;
+use std::collections::HashMap;
 use std::sync::Arc;
 
-use redisai_rs::redisai::redisai_model::RedisAIModel;
-use redisai_rs::redisai::redisai_script::RedisAIScript;
+/// The call options are built once for each combination of function flags
+/// and `allow_unsafe_redis_commands`, and shared by all the invocations
+/// running on the same thread, so creating a client (or cloning it to
+/// a background task) does not allocate.
+type CallOptionsCacheKey = (FunctionFlags, bool);
+
+thread_local! {
+    static CALL_OPTIONS_CACHE: RefCell<HashMap<CallOptionsCacheKey, (Arc<CallOptions>, Arc<BlockingCallOptions>)>> = RefCell::new(HashMap::new());
+}
 
 #[derive(Clone)]
 pub(crate) struct RedisClientCallOptions {
-    pub(crate) call_options: CallOptions,
-    pub(crate) blocking_call_options: BlockingCallOptions,
+    pub(crate) call_options: Arc<CallOptions>,
+    pub(crate) blocking_call_options: Arc<BlockingCallOptions>,
     pub(crate) flags: FunctionFlags,
 }
 
 impl RedisClientCallOptions {
-    fn get_builder(flags: FunctionFlags) -> CallOptionsBuilder {
+    fn get_builder(flags: FunctionFlags, allow_unsafe_redis_commands: bool) -> CallOptionsBuilder {
         let call_options = CallOptionsBuilder::new()
             .replicate()
             .verify_acl()
             .errors_as_replies()
             .resp(CallOptionResp::Resp3);
-        let call_options = if !get_globals().allow_unsafe_redis_commands {
+        let call_options = if !allow_unsafe_redis_commands {
             call_options.script_mode()
         } else {
             call_options
@@ -58,9 +70,24 @@ impl RedisClientCallOptions {
         }
     }
     pub(crate) fn new(flags: FunctionFlags) -> RedisClientCallOptions {
+        let allow_unsafe_redis_commands = get_globals().allow_unsafe_redis_commands;
+        let (call_options, blocking_call_options) = CALL_OPTIONS_CACHE.with(|cache| {
+            cache
+                .borrow_mut()
+                .entry((flags, allow_unsafe_redis_commands))
+                .or_insert_with(|| {
+                    (
+                        Arc::new(Self::get_builder(flags, allow_unsafe_redis_commands).build()),
+                        Arc::new(
+                            Self::get_builder(flags, allow_unsafe_redis_commands).build_blocking(),
+                        ),
+                    )
+                })
+                .clone()
+        });
         RedisClientCallOptions {
-            call_options: Self::get_builder(flags).build(),
-            blocking_call_options: Self::get_builder(flags).build_blocking(),
+            call_options,
+            blocking_call_options,
             flags,
         }
     }
@@ -94,6 +121,7 @@ impl<'ctx> RedisClient<'ctx> {
 
 impl<'ctx> RedisClientCtxInterface for RedisClient<'ctx> {
     fn call(&self, command: &str, args: &[&[u8]]) -> CallResult {
+        function_results_cache::record_command(command, args);
         call_redis_command(
             self.ctx,
             &self.user,
@@ -104,6 +132,7 @@ impl<'ctx> RedisClientCtxInterface for RedisClient<'ctx> {
     }
 
     fn call_async(&self, command: &str, args: &[&[u8]]) -> PromiseReply<'static, '_> {
+        function_results_cache::mark_not_cacheable();
         call_redis_command_async(
             self.ctx,
             &self.lib_meta_data.name,
@@ -115,6 +144,7 @@ impl<'ctx> RedisClientCtxInterface for RedisClient<'ctx> {
     }
 
     fn get_background_redis_client(&self) -> Box<dyn BackgroundRunFunctionCtxInterface> {
+        function_results_cache::mark_not_cacheable();
         Box::new(BackgroundRunCtx::new(
             self.user.safe_clone(self.ctx),
             &self.lib_meta_data,
@@ -123,21 +153,17 @@ impl<'ctx> RedisClientCtxInterface for RedisClient<'ctx> {
     }
 
     fn open_ai_model(&self, name: &str) -> Result<Box<dyn AIModelInterface>, GearsApiError> {
-        let _authenticate_scope = self
-            .ctx
-            .authenticate_user(&self.user)
-            .map_err(|e| GearsApiError::new(e.to_string()))?;
-        RedisAIModel::open_from_key(self.ctx, name)
+        function_results_cache::mark_not_cacheable();
+        get_redisai_handles_cache(&self.lib_meta_data.name)
+            .open_model(self.ctx, &self.user, name)
             .map(|v| Box::new(v) as Box<dyn AIModelInterface>)
             .map_err(GearsApiError::new)
     }
 
     fn open_ai_script(&self, name: &str) -> Result<Box<dyn AIScriptInterface>, GearsApiError> {
-        let _authenticate_scope = self
-            .ctx
-            .authenticate_user(&self.user)
-            .map_err(|e| GearsApiError::new(e.to_string()))?;
-        RedisAIScript::open_from_key(self.ctx, name)
+        function_results_cache::mark_not_cacheable();
+        get_redisai_handles_cache(&self.lib_meta_data.name)
+            .open_script(self.ctx, &self.user, name)
             .map(|v| Box::new(v) as Box<dyn AIScriptInterface>)
             .map_err(GearsApiError::new)
     }
@@ -149,10 +175,15 @@ pub(crate) struct RunCtx<'a> {
     pub(crate) flags: FunctionFlags,
     pub(crate) lib_meta_data: Arc<GearsLibraryMetaData>,
     pub(crate) allow_block: bool,
+    /// If set, a successful reply is also kept here so it can be cached.
+    pub(crate) captured_reply: Option<RefCell<Option<RedisValue>>>,
 }
 
 impl<'a> ReplyCtxInterface for RunCtx<'a> {
     fn send_reply(&self, reply: RedisResult) {
+        if let (Some(captured_reply), Ok(reply)) = (self.captured_reply.as_ref(), reply.as_ref()) {
+            *captured_reply.borrow_mut() = Some(reply.clone());
+        }
         self.ctx.reply(reply);
     }
 
@@ -180,9 +211,12 @@ impl<'a> RunFunctionCtxInterface for RunCtx<'a> {
                     .to_string(),
             ));
         }
-        let blocked_client = self.ctx.block_client();
-        let thread_ctx = ThreadSafeContext::with_blocked_client(blocked_client);
-        Ok(Box::new(BackgroundClientCtx { thread_ctx }))
+        let in_flight = get_library_admission(&self.lib_meta_data.name)
+            .in_flight_guard(&self.lib_meta_data.name);
+        Ok(Box::new(BackgroundClientCtx::new(
+            self.ctx.block_client(),
+            in_flight,
+        )))
     }
 
     fn get_redis_client(&self) -> Box<dyn RedisClientCtxInterface + '_> {
@@ -199,8 +233,103 @@ impl<'a> RunFunctionCtxInterface for RunCtx<'a> {
     }
 }
 
+/// The run context of an async function invocation that waited for the
+/// library to admit it (see [crate::admission_control]). The client was
+/// blocked when the invocation was queued, so the replies are sent to the
+/// blocked client and the invocation runs with the user that invoked it.
+pub(crate) struct AdmittedRunCtx<'a> {
+    ctx: &'a Context,
+    args: Vec<Vec<u8>>,
+    flags: FunctionFlags,
+    lib_meta_data: Arc<GearsLibraryMetaData>,
+    user: RedisString,
+    client: RefCell<Option<BackgroundClientCtx>>,
+}
+
+impl<'a> AdmittedRunCtx<'a> {
+    pub(crate) fn new(
+        ctx: &'a Context,
+        args: Vec<Vec<u8>>,
+        flags: FunctionFlags,
+        lib_meta_data: &Arc<GearsLibraryMetaData>,
+        user: RedisString,
+        client: BackgroundClientCtx,
+    ) -> AdmittedRunCtx<'a> {
+        AdmittedRunCtx {
+            ctx,
+            args,
+            flags,
+            lib_meta_data: Arc::clone(lib_meta_data),
+            user,
+            client: RefCell::new(Some(client)),
+        }
+    }
+}
+
+impl<'a> ReplyCtxInterface for AdmittedRunCtx<'a> {
+    fn send_reply(&self, reply: RedisResult) {
+        if let Some(client) = self.client.borrow().as_ref() {
+            client.send_reply(reply);
+        }
+    }
+
+    fn reply_with_error(&self, val: GearsApiError) {
+        if let Some(client) = self.client.borrow().as_ref() {
+            client.reply_with_error(val);
+        }
+    }
+
+    fn as_client(&self) -> &dyn ReplyCtxInterface {
+        self
+    }
+}
+
+unsafe impl<'a> Sync for AdmittedRunCtx<'a> {}
+unsafe impl<'a> Send for AdmittedRunCtx<'a> {}
+
+impl<'a> RunFunctionCtxInterface for AdmittedRunCtx<'a> {
+    fn get_args_iter(&self) -> Box<dyn Iterator<Item = &[u8]> + '_> {
+        Box::new(self.args.iter().map(|v| v.as_slice()))
+    }
+
+    fn get_background_client(&self) -> Result<Box<dyn ReplyCtxInterface>, GearsApiError> {
+        self.client
+            .borrow_mut()
+            .take()
+            .map(|v| Box::new(v) as Box<dyn ReplyCtxInterface>)
+            .ok_or_else(|| GearsApiError::new("The client was already taken to the background"))
+    }
+
+    fn get_redis_client(&self) -> Box<dyn RedisClientCtxInterface + '_> {
+        Box::new(RedisClient::new(
+            self.ctx,
+            self.lib_meta_data.clone(),
+            self.user.safe_clone(self.ctx),
+            self.flags,
+        ))
+    }
+
+    fn allow_block(&self) -> bool {
+        true
+    }
+}
+
 pub(crate) struct BackgroundClientCtx {
     thread_ctx: ThreadSafeContext<redis_module::BlockedClient>,
+    /// The invocation is counted as in flight as long as the client is blocked.
+    _in_flight: InFlightGuard,
+}
+
+impl BackgroundClientCtx {
+    pub(crate) fn new(
+        blocked_client: redis_module::BlockedClient,
+        in_flight: InFlightGuard,
+    ) -> BackgroundClientCtx {
+        BackgroundClientCtx {
+            thread_ctx: ThreadSafeContext::with_blocked_client(blocked_client),
+            _in_flight: in_flight,
+        }
+    }
 }
 
 unsafe impl Sync for BackgroundClientCtx {}
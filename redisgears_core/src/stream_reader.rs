@@ -12,12 +12,16 @@ use std::collections::HashMap;
 
 use std::cell::RefCell;
 use std::collections::LinkedList;
+use std::collections::VecDeque;
 use std::sync::{Arc, Weak};
 
-use std::time::{SystemTime, UNIX_EPOCH};
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
 
 use crate::RefCellWrapper;
 
+/// How long to wait before retrying partitions whose waiting record could not be read.
+const STALLED_PARTITIONS_RETRY_INTERVAL: Duration = Duration::from_millis(100);
+
 pub type RecordAcknowledgeCallback = dyn Fn(&Context, &[u8], u64, u64);
 pub type StreamReaderCallback<T> = dyn Fn(&Context, &[u8], Option<RedisModuleStreamID>, bool) -> Result<Option<T>, String>
     + Sync
@@ -27,6 +31,7 @@ pub(crate) type AcknowledgeCallback = dyn FnOnce(&Context, StreamReaderAck) + Se
 
 pub(crate) trait StreamReaderRecord {
     fn get_id(&self) -> RedisModuleStreamID;
+    fn get_field(&self, name: &[u8]) -> Option<&[u8]>;
 }
 
 pub(crate) trait StreamReader<R>
@@ -119,6 +124,16 @@ pub(crate) struct ConsumerInfo {
     pub(crate) pending_ids: LinkedList<RedisModuleStreamID>,
     pub(crate) last_read_id: Option<RedisModuleStreamID>,
     pub(crate) last_error: Option<GearsApiError>,
+    // partition key value to the records waiting for the in flight record with the same
+    // partition key value, a partition key value is in the map as long as it has a record in flight.
+    pub(crate) partitions: HashMap<Vec<u8>, VecDeque<RedisModuleStreamID>>,
+    // amount of pending records that wait for their partition, they are not in flight
+    // and so they do not count against the window.
+    pub(crate) waiting_records: usize,
+    // partition key values whose next waiting record could not be read, they have no record
+    // in flight and are retried from a timer (or on the next notification of the stream).
+    pub(crate) stalled_partitions: Vec<Vec<u8>>,
+    pub(crate) stalled_partitions_retry_armed: bool,
 }
 
 impl ConsumerInfo {
@@ -133,7 +148,10 @@ impl ConsumerInfo {
         self.total_processed_time += self.last_processed_time;
         self.last_lag = lag;
         self.total_lag += lag;
+        self.remove_pending_id(id)
+    }
 
+    fn remove_pending_id(&mut self, id: RedisModuleStreamID) -> bool {
         let mut temp_list = LinkedList::new();
         while let Some(curr) = self.pending_ids.pop_front() {
             if curr.ms == id.ms && curr.seq == id.seq {
@@ -147,6 +165,12 @@ impl ConsumerInfo {
         self.pending_ids.append(&mut temp_list);
         false
     }
+
+    /// Amount of records that are currently processed, records waiting for
+    /// their partition are pending but not in flight.
+    fn in_flight(&self) -> usize {
+        self.pending_ids.len() - self.waiting_records
+    }
 }
 
 pub(crate) struct ConsumerData<T: StreamReaderRecord, C: StreamConsumer<T>> {
@@ -157,6 +181,7 @@ pub(crate) struct ConsumerData<T: StreamReaderRecord, C: StreamConsumer<T>> {
     pub(crate) trim: bool,
     pub(crate) on_record_acked: Option<Box<RecordAcknowledgeCallback>>,
     pub(crate) description: Option<String>,
+    pub(crate) partition_key: Option<Vec<u8>>, // field name by which records are ordered, if set
     phantom: std::marker::PhantomData<T>,
 }
 
@@ -182,6 +207,7 @@ where
                 &self.on_record_acked.as_ref().map(|e| format!("{e:p}")),
             )
             .field("description", &self.description)
+            .field("partition_key", &self.partition_key)
             .finish()
     }
 }
@@ -209,6 +235,12 @@ where
         old_trim
     }
 
+    pub(crate) fn set_partition_key(&mut self, partition_key: Option<Vec<u8>>) -> Option<Vec<u8>> {
+        let old_partition_key = self.partition_key.take();
+        self.partition_key = partition_key;
+        old_partition_key
+    }
+
     pub(crate) fn set_description(&mut self, description: Option<String>) -> Option<String> {
         let old_description = self.description.take();
         self.description = description;
@@ -235,27 +267,28 @@ where
                         pending_ids: LinkedList::new(),
                         last_error: None,
                         last_read_id: None,
+                        partitions: HashMap::new(),
+                        waiting_records: 0,
+                        stalled_partitions: Vec::new(),
+                        stalled_partitions_retry_armed: false,
                     }),
                 })
             });
         (Arc::clone(res), is_new)
     }
 
-    pub(crate) fn get_streams_info<'a>(
-        &'a self,
-    ) -> Box<dyn Iterator<Item = (Vec<u8>, u64, u64)> + 'a> {
-        Box::new(
-            self.consumed_streams
-                .iter()
-                .filter_map(|(s, v)| {
-                    let v = v.ref_cell.borrow();
-                    v.last_read_id?;
-                    let v = v.last_read_id.as_ref().unwrap();
-                    Some((s.clone(), v.ms, v.seq))
-                })
-                .collect::<Vec<(Vec<u8>, u64, u64)>>()
-                .into_iter(),
-        )
+    /// Returns the last read id of each of the consumed streams, without
+    /// copying the streams names.
+    pub(crate) fn get_streams_checkpoints(&self) -> impl Iterator<Item = (&[u8], u64, u64)> + '_ {
+        self.consumed_streams.iter().filter_map(|(s, v)| {
+            let (ms, seq) = v
+                .ref_cell
+                .borrow()
+                .last_read_id
+                .as_ref()
+                .map(|id| (id.ms, id.seq))?;
+            Some((s.as_slice(), ms, seq))
+        })
     }
 
     pub(crate) fn clear_streams_info(&mut self) {
@@ -296,6 +329,144 @@ fn read_next_data<T: StreamReaderRecord>(
     r
 }
 
+/// Called when the processing of a record with the given partition key value is done.
+/// Returns the next record that waits for this partition key value, if any, otherwise
+/// the partition key value is released so the next record with this value can run at once.
+fn resume_partition<T: StreamReaderRecord>(
+    ctx: &Context,
+    name: &[u8],
+    partition: &[u8],
+    consumer_info: &Arc<RefCellWrapper<ConsumerInfo>>,
+    stream_reader: &Arc<Box<StreamReaderCallback<T>>>,
+) -> Option<T> {
+    loop {
+        let id = {
+            let mut c_i = consumer_info.ref_cell.borrow_mut();
+            let waiting = c_i.partitions.get_mut(partition)?;
+            match waiting.pop_front() {
+                Some(id) => {
+                    c_i.waiting_records -= 1;
+                    id
+                }
+                None => {
+                    c_i.partitions.remove(partition);
+                    return None;
+                }
+            }
+        };
+        // waiting records are not kept in memory, read the record again by its id.
+        match stream_reader(ctx, name, Some(id), true) {
+            Ok(Some(record)) => {
+                let record_id = record.get_id();
+                if record_id.ms == id.ms && record_id.seq == id.seq {
+                    return Some(record);
+                }
+            }
+            Ok(None) => {}
+            Err(e) => {
+                // we can not read right now, keep the record waiting (like any other
+                // record we failed to read) so the stream will not be trimmed after it.
+                // Nothing is in flight for this partition any more, so it is retried
+                // from a timer, see `arm_stalled_partitions_retry`.
+                let mut c_i = consumer_info.ref_cell.borrow_mut();
+                if let Some(waiting) = c_i.partitions.get_mut(partition) {
+                    waiting.push_front(id);
+                    c_i.waiting_records += 1;
+                }
+                c_i.stalled_partitions.push(partition.to_vec());
+                c_i.last_error = Some(GearsApiError::new(format!(
+                    "Failed reading records waiting for their partition, {e}"
+                )));
+                return None;
+            }
+        }
+        // the record was deleted while waiting, nothing to process.
+        consumer_info.ref_cell.borrow_mut().remove_pending_id(id);
+    }
+}
+
+type StalledPartitionsRetryData<T, C> = (
+    Arc<RefCellWrapper<TrackedStream>>,
+    Weak<RefCellWrapper<ConsumerData<T, C>>>,
+    Weak<RefCellWrapper<ConsumerInfo>>,
+    Arc<Box<StreamReaderCallback<T>>>,
+);
+
+/// Resume the partitions whose waiting record could not be read, the resumed records
+/// are already pending so they are not limited by the window.
+fn retry_stalled_partitions<T: StreamReaderRecord + 'static, C: StreamConsumer<T> + 'static>(
+    ctx: &Context,
+    stream: &Arc<RefCellWrapper<TrackedStream>>,
+    consumer_weak: &Weak<RefCellWrapper<ConsumerData<T, C>>>,
+    consumer_info: &Arc<RefCellWrapper<ConsumerInfo>>,
+    stream_reader: &Arc<Box<StreamReaderCallback<T>>>,
+) {
+    let stalled_partitions =
+        std::mem::take(&mut consumer_info.ref_cell.borrow_mut().stalled_partitions);
+    if stalled_partitions.is_empty() {
+        return;
+    }
+    let name = stream.ref_cell.borrow().name.clone();
+    let resumed = stalled_partitions
+        .iter()
+        .filter_map(|p| resume_partition(ctx, &name, p, consumer_info, stream_reader))
+        .collect::<Vec<T>>();
+    for r in resumed {
+        send_new_data(
+            ctx,
+            Arc::clone(stream),
+            Weak::clone(consumer_weak),
+            Ok(Some(r)),
+            Arc::clone(consumer_info),
+            Arc::clone(stream_reader),
+            true,
+        );
+    }
+    arm_stalled_partitions_retry(ctx, stream, consumer_weak, consumer_info, stream_reader);
+}
+
+fn on_stalled_partitions_retry<T: StreamReaderRecord + 'static, C: StreamConsumer<T> + 'static>(
+    ctx: &Context,
+    (stream, consumer_weak, consumer_info, stream_reader): StalledPartitionsRetryData<T, C>,
+) {
+    // if weak ref returns None it means that stream was deleted
+    if let Some(consumer_info) = consumer_info.upgrade() {
+        consumer_info
+            .ref_cell
+            .borrow_mut()
+            .stalled_partitions_retry_armed = false;
+        retry_stalled_partitions(ctx, &stream, &consumer_weak, &consumer_info, &stream_reader);
+    }
+}
+
+/// A stalled partition has no record in flight, so no acknowledgement will ever resume it.
+/// Arm a timer that retries the stalled partitions, unless one is already armed.
+fn arm_stalled_partitions_retry<T: StreamReaderRecord + 'static, C: StreamConsumer<T> + 'static>(
+    ctx: &Context,
+    stream: &Arc<RefCellWrapper<TrackedStream>>,
+    consumer_weak: &Weak<RefCellWrapper<ConsumerData<T, C>>>,
+    consumer_info: &Arc<RefCellWrapper<ConsumerInfo>>,
+    stream_reader: &Arc<Box<StreamReaderCallback<T>>>,
+) {
+    {
+        let mut c_i = consumer_info.ref_cell.borrow_mut();
+        if c_i.stalled_partitions.is_empty() || c_i.stalled_partitions_retry_armed {
+            return;
+        }
+        c_i.stalled_partitions_retry_armed = true;
+    }
+    ctx.create_timer(
+        STALLED_PARTITIONS_RETRY_INTERVAL,
+        on_stalled_partitions_retry::<T, C>,
+        (
+            Arc::clone(stream),
+            Weak::clone(consumer_weak),
+            Arc::downgrade(consumer_info),
+            Arc::clone(stream_reader),
+        ),
+    );
+}
+
 fn send_new_data<T: StreamReaderRecord + 'static, C: StreamConsumer<T> + 'static>(
     ctx: &Context,
     stream: Arc<RefCellWrapper<TrackedStream>>,
@@ -303,14 +474,19 @@ fn send_new_data<T: StreamReaderRecord + 'static, C: StreamConsumer<T> + 'static
     mut actual_record: Result<Option<T>, String>,
     consumer_info: Arc<RefCellWrapper<ConsumerInfo>>,
     stream_reader: Arc<Box<StreamReaderCallback<T>>>,
+    mut resumed: bool, // the record was waiting for its partition and is already pending
 ) {
     let consumer = match consumer_weak.upgrade() {
         Some(c) => c,
         None => return,
     };
-    let trim = { consumer.ref_cell.borrow().trim };
+    arm_stalled_partitions_retry(ctx, &stream, &consumer_weak, &consumer_info, &stream_reader);
+    let (trim, partition_key) = {
+        let c = consumer.ref_cell.borrow();
+        (c.trim, c.partition_key.clone())
+    };
     loop {
-        let (id, record) = {
+        let (id, record, partition, wait) = {
             let mut c_i = consumer_info.ref_cell.borrow_mut();
             if actual_record.is_err() {
                 return;
@@ -321,20 +497,42 @@ fn send_new_data<T: StreamReaderRecord + 'static, C: StreamConsumer<T> + 'static
             }
             let record = record.unwrap();
             let id = record.get_id();
-            c_i.pending_ids.push_back(id);
-            (id, record)
+            // records without the partition key field are ordered among themselves.
+            let partition = partition_key
+                .as_ref()
+                .map(|f| record.get_field(f).unwrap_or_default().to_vec());
+            let mut wait = false;
+            if !resumed {
+                c_i.pending_ids.push_back(id);
+                if let Some(partition) = partition.as_ref() {
+                    if let Some(waiting) = c_i.partitions.get_mut(partition) {
+                        // a record with the same partition key value is in flight,
+                        // this record will be processed once it is done.
+                        waiting.push_back(id);
+                        c_i.waiting_records += 1;
+                        wait = true;
+                    } else {
+                        c_i.partitions.insert(partition.clone(), VecDeque::new());
+                    }
+                }
+            }
+            resumed = false;
+            (id, record, partition, wait)
         };
         let start_time = SystemTime::now()
             .duration_since(UNIX_EPOCH)
             .unwrap()
             .as_millis();
-        let res = {
+        let res = if wait {
+            None
+        } else {
             let t_s = stream.ref_cell.borrow();
             let c = consumer.ref_cell.borrow();
             let clone_consumer_weak = Weak::clone(&consumer_weak);
             let clone_consumer_info = Arc::downgrade(&consumer_info);
             let clone_stream = Arc::clone(&stream);
             let clone_stream_reader = Arc::clone(&stream_reader);
+            let clone_partition = partition.clone();
             c.consumer.as_ref().unwrap().new_data(
                 ctx,
                 &t_s.name,
@@ -342,7 +540,7 @@ fn send_new_data<T: StreamReaderRecord + 'static, C: StreamConsumer<T> + 'static
                 Box::new(move |ctx, ack| {
                     // if weak ref returns None it means that stream was deleted
                     if let Some(clone_consumer_info) = clone_consumer_info.upgrade() {
-                        let record = {
+                        let (record, resumed) = {
                             let mut t_s = clone_stream.ref_cell.borrow_mut();
                             let last_read_id = {
                                 let (trimmed_first, last_read_id) = {
@@ -376,14 +574,31 @@ fn send_new_data<T: StreamReaderRecord + 'static, C: StreamConsumer<T> + 'static
                                 }
                                 last_read_id
                             };
-                            read_next_data(
-                                ctx,
-                                &t_s.name,
-                                last_read_id,
-                                false,
-                                &clone_consumer_info,
-                                &clone_stream_reader,
-                            )
+                            let resumed_record = clone_partition.as_ref().and_then(|p| {
+                                resume_partition(
+                                    ctx,
+                                    &t_s.name,
+                                    p,
+                                    &clone_consumer_info,
+                                    &clone_stream_reader,
+                                )
+                            });
+                            match resumed_record {
+                                // the resumed record takes the place of the acked
+                                // record, no need to read a new one.
+                                Some(r) => (Ok(Some(r)), true),
+                                None => (
+                                    read_next_data(
+                                        ctx,
+                                        &t_s.name,
+                                        last_read_id,
+                                        false,
+                                        &clone_consumer_info,
+                                        &clone_stream_reader,
+                                    ),
+                                    false,
+                                ),
+                            }
                         };
                         send_new_data(
                             ctx,
@@ -392,6 +607,7 @@ fn send_new_data<T: StreamReaderRecord + 'static, C: StreamConsumer<T> + 'static
                             record,
                             clone_consumer_info,
                             clone_stream_reader,
+                            resumed,
                         );
                     }
                 }),
@@ -430,12 +646,26 @@ fn send_new_data<T: StreamReaderRecord + 'static, C: StreamConsumer<T> + 'static
                 if trimmed_first && trim {
                     t_s.trim(ctx);
                 }
+                if let Some(r) = partition.as_ref().and_then(|p| {
+                    resume_partition(ctx, &t_s.name, p, &consumer_info, &stream_reader)
+                }) {
+                    actual_record = Ok(Some(r));
+                    resumed = true;
+                    continue;
+                }
+                arm_stalled_partitions_retry(
+                    ctx,
+                    &stream,
+                    &consumer_weak,
+                    &consumer_info,
+                    &stream_reader,
+                );
                 last_read_id
             }
             None => {
                 let window = { consumer.ref_cell.borrow().window };
                 let c_i = consumer_info.ref_cell.borrow();
-                if c_i.pending_ids.len() >= window {
+                if c_i.in_flight() >= window {
                     return;
                 }
                 c_i.last_read_id
@@ -491,6 +721,7 @@ where
         trim: bool,
         on_record_acked: Option<Box<RecordAcknowledgeCallback>>,
         description: Option<String>,
+        partition_key: Option<Vec<u8>>,
     ) -> Arc<RefCellWrapper<ConsumerData<T, C>>> {
         let consumer_data = Arc::new(RefCellWrapper {
             ref_cell: RefCell::new(ConsumerData {
@@ -502,6 +733,7 @@ where
                 trim,
                 on_record_acked,
                 description,
+                partition_key,
             }),
         });
         self.consumers.push(Arc::downgrade(&consumer_data));
@@ -529,13 +761,15 @@ where
     ) -> &std::sync::Arc<RefCellWrapper<TrackedStream>> {
         self.tracked_streams
             .entry(name.to_vec())
-            .or_insert(Arc::new(RefCellWrapper {
-                ref_cell: RefCell::new(TrackedStream {
-                    name: name.to_vec(),
-                    consumers_data: Vec::new(),
-                    stream_trimmer: Arc::clone(&self.stream_trimmer),
-                }),
-            }))
+            .or_insert_with(|| {
+                Arc::new(RefCellWrapper {
+                    ref_cell: RefCell::new(TrackedStream {
+                        name: name.to_vec(),
+                        consumers_data: Vec::new(),
+                        stream_trimmer: Arc::clone(&self.stream_trimmer),
+                    }),
+                })
+            })
     }
 
     pub(crate) fn update_stream_for_consumer(
@@ -544,17 +778,29 @@ where
         consumer_data: &Arc<RefCellWrapper<ConsumerData<T, C>>>,
         ms: u64,
         seq: u64,
+    ) {
+        self.update_streams_for_consumer(consumer_data, std::iter::once((stream_name, ms, seq)));
+    }
+
+    /// Sets the last read id of multiple streams of the given consumer,
+    /// borrowing the consumer only once.
+    pub(crate) fn update_streams_for_consumer<'a>(
+        &mut self,
+        consumer_data: &Arc<RefCellWrapper<ConsumerData<T, C>>>,
+        streams: impl Iterator<Item = (&'a [u8], u64, u64)>,
     ) {
         let mut c_d = consumer_data.ref_cell.borrow_mut();
-        let (stream_info, is_new) = c_d.get_or_create_consumed_stream(stream_name);
-        if is_new {
-            let mut t_s = self
-                .get_or_create_tracked_stream(stream_name)
-                .ref_cell
-                .borrow_mut();
-            t_s.consumers_data.push(Arc::downgrade(&stream_info));
+        for (stream_name, ms, seq) in streams {
+            let (stream_info, is_new) = c_d.get_or_create_consumed_stream(stream_name);
+            if is_new {
+                let mut t_s = self
+                    .get_or_create_tracked_stream(stream_name)
+                    .ref_cell
+                    .borrow_mut();
+                t_s.consumers_data.push(Arc::downgrade(&stream_info));
+            }
+            stream_info.ref_cell.borrow_mut().last_read_id = Some(RedisModuleStreamID { ms, seq });
         }
-        stream_info.ref_cell.borrow_mut().last_read_id = Some(RedisModuleStreamID { ms, seq });
     }
 
     pub(crate) fn clear_tracked_streams(&mut self) {
@@ -591,14 +837,15 @@ where
                     }
                     let last_read_id = {
                         let c_i = consumer_info.ref_cell.borrow();
-                        if c_i.pending_ids.len() >= c.window {
-                            return None;
+                        if c_i.in_flight() >= c.window {
+                            None
+                        } else {
+                            Some(c_i.last_read_id)
                         }
-                        c_i.last_read_id
                     };
 
-                    (
-                        read_next_data(
+                    let record = match last_read_id {
+                        Some(last_read_id) => read_next_data(
                             ctx,
                             key,
                             last_read_id,
@@ -606,8 +853,9 @@ where
                             &consumer_info,
                             &self.stream_reader,
                         ),
-                        Arc::clone(&consumer_info),
-                    )
+                        None => Ok(None),
+                    };
+                    (record, Arc::clone(&consumer_info))
                 };
                 let res = (Weak::clone(v), record, consumer_info);
                 Some(res)
@@ -622,6 +870,14 @@ where
             .into_iter()
             .map(|res| {
                 if let Some((consumer_weak, record, consumer_info)) = res {
+                    // do not wait for the retry timer, the stream is readable right now.
+                    retry_stalled_partitions(
+                        ctx,
+                        &tracked_stream,
+                        &consumer_weak,
+                        &consumer_info,
+                        &self.stream_reader,
+                    );
                     let stream_reader = Arc::clone(&self.stream_reader);
                     let tracked_stream = Arc::clone(&tracked_stream);
                     send_new_data(
@@ -631,6 +887,7 @@ where
                         record,
                         consumer_info,
                         stream_reader,
+                        false,
                     );
                 }
             })
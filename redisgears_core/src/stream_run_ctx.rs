@@ -24,6 +24,7 @@ use crate::{
 
 use crate::stream_reader::{StreamConsumer, StreamReaderAck};
 
+use crate::allocation_stats::{count_invocation_allocations, InvocationKind};
 use crate::get_notification_blocker;
 
 use std::sync::Arc;
@@ -81,6 +82,14 @@ impl crate::stream_reader::StreamReaderRecord for GearsStreamRecord {
     fn get_id(&self) -> RedisModuleStreamID {
         self.record.id
     }
+
+    fn get_field(&self, name: &[u8]) -> Option<&[u8]> {
+        self.record
+            .fields
+            .iter()
+            .find(|(k, _)| k.as_slice() == name)
+            .map(|(_, v)| v.as_slice())
+    }
 }
 
 impl StreamRecordInterface for GearsStreamRecord {
@@ -89,13 +98,12 @@ impl StreamRecordInterface for GearsStreamRecord {
     }
 
     fn fields<'a>(&'a self) -> Box<dyn Iterator<Item = (&'a [u8], &'a [u8])> + 'a> {
-        let res = self
-            .record
-            .fields
-            .iter()
-            .map(|(k, v)| (k.as_slice(), v.as_slice()))
-            .collect::<Vec<(&'a [u8], &'a [u8])>>();
-        Box::new(res.into_iter())
+        Box::new(
+            self.record
+                .fields
+                .iter()
+                .map(|(k, v)| (k.as_slice(), v.as_slice())),
+        )
     }
 }
 
@@ -154,6 +162,7 @@ impl StreamConsumer<GearsStreamRecord> for GearsStreamConsumer {
 
         let res = {
             let _notification_blocker = get_notification_blocker();
+            let _allocations_guard = count_invocation_allocations(InvocationKind::StreamRecord);
             self.ctx.process_record(
                 stream_name,
                 Box::new(record),
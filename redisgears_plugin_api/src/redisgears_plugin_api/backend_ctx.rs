@@ -7,11 +7,12 @@
 use std::alloc::GlobalAlloc;
 use std::any::Any;
 use std::sync::Arc;
+use std::time::Duration;
 
 use redis_module::RedisValue;
 
 use crate::redisgears_plugin_api::load_library_ctx::LibraryCtxInterface;
-use crate::redisgears_plugin_api::redisai_interface::AITensorInterface;
+use crate::redisgears_plugin_api::redisai_interface::{AIDAGRunnerInterface, AITensorInterface};
 use crate::redisgears_plugin_api::GearsApiError;
 
 use super::load_library_ctx::ModuleInfo;
@@ -26,12 +27,18 @@ pub trait CompiledLibraryInterface {
     fn log_error(&self, msg: &str);
     fn log_script_message(&self, msg: &str);
     fn run_on_background(&self, job: Box<dyn FnOnce() + Send>);
+    /// Returns an API for an isolate replica of the library (another
+    /// isolate that evaluates the same code). The background jobs of the
+    /// replica run on their own queue, concurrently with the jobs of the
+    /// library and of its other replicas.
+    fn create_replica_api(&self) -> Box<dyn CompiledLibraryInterface + Send + Sync>;
     fn redisai_create_tensor(
         &self,
         data_type: &str,
         dims: &[i64],
         data: &[u8],
     ) -> Result<Box<dyn AITensorInterface>, GearsApiError>;
+    fn redisai_create_dag(&self) -> Result<Box<dyn AIDAGRunnerInterface>, GearsApiError>;
 }
 
 #[derive(Clone)]
@@ -97,8 +104,24 @@ pub struct BackendCtx {
     pub get_v8_library_initial_memory_limit: Box<dyn Fn() -> usize + 'static>,
     pub get_v8_library_memory_delta: Box<dyn Fn() -> usize + 'static>,
     pub get_v8_flags: Box<dyn Fn() -> String + 'static>,
+    pub get_v8_shared_isolate_max_libraries: Box<dyn Fn() -> usize + 'static>,
+    pub get_remote_functions_structured_encoding: Box<dyn Fn() -> bool + 'static>,
 }
 
+/// The arguments needed to compile a single library as part of
+/// [`BackendCtxInterfaceInitialised::compile_libraries`].
+pub struct LibraryCompilationArgs<'a> {
+    pub module_name: &'a str,
+    pub code: &'a str,
+    pub api_version: ApiVersion,
+    pub config: Option<&'a String>,
+    pub compiled_library_api: Box<dyn CompiledLibraryInterface + Send + Sync>,
+}
+
+/// Compiles a single library, returned by
+/// [`BackendCtxInterfaceInitialised::get_library_compiler`].
+pub type LibraryCompiler = Box<dyn FnOnce() -> Result<Box<dyn LibraryCtxInterface>, GearsApiError>>;
+
 /// The trait which is only implemented for a successfully initialised
 /// backend.
 pub trait BackendCtxInterfaceInitialised {
@@ -114,9 +137,55 @@ pub trait BackendCtxInterfaceInitialised {
         config: Option<&String>,
         compiled_library_api: Box<dyn CompiledLibraryInterface + Send + Sync>,
     ) -> Result<Box<dyn LibraryCtxInterface>, GearsApiError>;
+
+    /// Compiles multiple libraries at once (without debugging support).
+    /// The result at each index belongs to the library at the same
+    /// index of the given vector. The default implementation compiles
+    /// the libraries one after the other, a backend that is able to
+    /// compile libraries concurrently should override it.
+    fn compile_libraries(
+        &mut self,
+        libraries: Vec<LibraryCompilationArgs>,
+    ) -> Vec<Result<Box<dyn LibraryCtxInterface>, GearsApiError>> {
+        libraries
+            .into_iter()
+            .map(|l| {
+                self.compile_library(
+                    false,
+                    l.module_name,
+                    l.code,
+                    l.api_version,
+                    l.config,
+                    l.compiled_library_api,
+                )
+            })
+            .collect()
+    }
+
+    /// Returns a function that compiles the given library (without
+    /// debugging support). Unlike [`BackendCtxInterfaceInitialised::compile_library`],
+    /// only getting the compiler requires the Redis GIL. The compiler itself
+    /// is called without holding the GIL so compiling a big library does
+    /// not block Redis.
+    fn get_library_compiler(
+        &mut self,
+        module_name: String,
+        code: String,
+        api_version: ApiVersion,
+        config: Option<String>,
+        compiled_library_api: Box<dyn CompiledLibraryInterface + Send + Sync>,
+    ) -> LibraryCompiler;
+
     fn debug(&mut self, args: &[&str]) -> Result<RedisValue, GearsApiError>;
     fn get_info(&mut self) -> Option<ModuleInfo>;
 
+    /// Called periodically (from the Redis cron) with the Redis GIL held,
+    /// allowing the backend to perform maintenance work such as garbage
+    /// collection at a time of its choosing rather than in the middle of
+    /// a function invocation. The backend should not spend more than the
+    /// given budget. The default implementation does nothing.
+    fn on_idle(&mut self, _budget: Duration) {}
+
     /// Starts a server for remote debugging. The server listens to
     /// connections but doesn't start a debugging session yet. See
     /// [DebuggerBackend] for more information about debugging.
@@ -8,6 +8,18 @@ use crate::redisgears_plugin_api::run_function_ctx::RunFunctionCtxInterface;
 
 use super::FunctionCallResult;
 
+/// A scope that keeps a function ready for running a batch of invocations,
+/// see [`FunctionCtxInterface::enter_batch`].
+pub trait FunctionBatchScope {}
+
 pub trait FunctionCtxInterface {
     fn call(&self, run_ctx: &dyn RunFunctionCtxInterface) -> FunctionCallResult;
+
+    /// Called before running a batch of synchronous invocations of the
+    /// function. The returned scope is dropped after the last invocation,
+    /// so the backend can share the invocations setup (like entering the
+    /// engine) between them.
+    fn enter_batch(&self) -> Option<Box<dyn FunctionBatchScope + '_>> {
+        None
+    }
 }
@@ -25,6 +25,9 @@ pub const FUNCTION_FLAG_ALLOW_OOM_GLOBAL_VALUE: &str = "allow-oom";
 pub const FUNCTION_FLAG_RAW_ARGUMENTS_GLOBAL_NAME: &str = "RAW_ARGUMENTS";
 pub const FUNCTION_FLAG_RAW_ARGUMENTS_GLOBAL_VALUE: &str = "raw-arguments";
 
+pub const FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_NAME: &str = "CACHE_RESULTS";
+pub const FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_VALUE: &str = "cache-results";
+
 /// The type of information we can get from a backend that is useful to
 /// a user.
 #[derive(Debug, Clone)]
@@ -75,6 +78,10 @@ bitflags::bitflags! {
         const ALLOW_OOM = 0x02;
         /// TODO
         const RAW_ARGUMENTS = 0x04;
+        /// The function replies are cached and reused as long as the
+        /// keys the function depends on are not modified. Only allowed
+        /// together with [`FunctionFlags::NO_WRITES`].
+        const CACHE_RESULTS = 0x08;
     }
 }
 
@@ -114,6 +121,7 @@ pub trait LoadLibraryCtxInterface {
         window: usize,
         trim: bool,
         description: Option<String>,
+        partition_key: Option<&[u8]>,
     ) -> Result<(), GearsApiError>;
     fn register_key_space_notification_consumer(
         &mut self,
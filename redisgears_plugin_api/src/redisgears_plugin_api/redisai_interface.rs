@@ -6,6 +6,8 @@
 
 use crate::redisgears_plugin_api::GearsApiError;
 
+use std::time::Duration;
+
 type RedisAIOnDoneCallback =
     Box<dyn FnOnce(Result<Vec<Box<dyn AITensorInterface + Send>>, GearsApiError>)>;
 
@@ -21,6 +23,9 @@ pub trait AIModelRunnerInterface {
         name: &str,
         tensor: &dyn AITensorInterface,
     ) -> Result<(), GearsApiError>;
+    /// Add the operations described by the given string, using the
+    /// `AI.DAGEXECUTE` syntax (`|> AI.MODELEXECUTE ...`), to the DAG.
+    fn add_ops_from_string(&mut self, ops: &str) -> Result<(), GearsApiError>;
     fn add_output(&mut self, name: &str) -> Result<(), GearsApiError>;
     fn run(&mut self, on_done: RedisAIOnDoneCallback);
 }
@@ -31,8 +36,45 @@ pub trait AIScriptRunnerInterface {
     fn run(&mut self, on_done: RedisAIOnDoneCallback);
 }
 
+/// A DAG of model and script runs that is executed as a single RedisAI
+/// execution. Tensors are referenced by their names inside the DAG.
+pub trait AIDAGRunnerInterface {
+    fn add_input(
+        &mut self,
+        name: &str,
+        tensor: &dyn AITensorInterface,
+    ) -> Result<(), GearsApiError>;
+    fn add_model_run(
+        &mut self,
+        model: &dyn AIModelInterface,
+        inputs: &[&str],
+        outputs: &[&str],
+    ) -> Result<(), GearsApiError>;
+    fn add_script_run(
+        &mut self,
+        script: &dyn AIScriptInterface,
+        func_name: &str,
+        inputs: &[&str],
+        outputs: &[&str],
+    ) -> Result<(), GearsApiError>;
+    /// Add the operations described by the given string, using the
+    /// `AI.DAGEXECUTE` syntax (`|> AI.MODELEXECUTE ...`), to the DAG.
+    fn add_ops_from_string(&mut self, ops: &str) -> Result<(), GearsApiError>;
+    fn add_output(&mut self, name: &str) -> Result<(), GearsApiError>;
+    fn run(&mut self, on_done: RedisAIOnDoneCallback);
+}
+
 pub trait AIModelInterface {
     fn get_model_runner(&self) -> Box<dyn AIModelRunnerInterface>;
+    /// Returns a model runner whose run is batched together with concurrent
+    /// runs of the same model. A batch is executed once the sum of its runs
+    /// inputs first dimension reaches `max_batch_size` or after `max_wait`
+    /// passed since its first run.
+    fn get_batched_model_runner(
+        &self,
+        max_batch_size: usize,
+        max_wait: Duration,
+    ) -> Box<dyn AIModelRunnerInterface>;
 }
 
 pub trait AIScriptInterface {
@@ -11,6 +11,8 @@ use crate::{Deserialize, Serialize};
 use crate::redisgears_plugin_api::redisai_interface::{AIModelInterface, AIScriptInterface};
 use crate::redisgears_plugin_api::GearsApiError;
 
+use std::time::Duration;
+
 type OnDoneCallback<'ctx> = Box<dyn FnOnce(&Context, CallResult<'static>)>;
 type SetOnDoneCallback<'ctx> = Box<dyn FnOnce(OnDoneCallback<'ctx>) + 'ctx>;
 
@@ -52,6 +54,66 @@ pub trait ReplyCtxInterface: Send + Sync {
 pub enum RemoteFunctionData {
     Binary(Vec<u8>),
     String(String),
+    /// A structured value encoded in a backend specific binary format.
+    Structured(Vec<u8>),
+}
+
+impl RemoteFunctionData {
+    /// Returns the raw bytes of the data.
+    pub fn as_bytes(&self) -> &[u8] {
+        match self {
+            RemoteFunctionData::Binary(b) | RemoteFunctionData::Structured(b) => b,
+            RemoteFunctionData::String(s) => s.as_bytes(),
+        }
+    }
+}
+
+/// A key to run a remote function on, see
+/// [`BackgroundRunFunctionCtxInterface::run_on_keys`].
+#[derive(Clone, Serialize, Deserialize)]
+pub struct RemoteFunctionKey {
+    /// The key name, used to find the shard that owns the key.
+    pub name: Vec<u8>,
+    /// The key as it should be given to the remote function (as its first argument).
+    pub arg: RemoteFunctionData,
+}
+
+/// The options of a key space scan, see [`BackgroundRunFunctionCtxInterface::scan`].
+pub struct KeysScanOptions {
+    /// Only return the keys that match the given glob style pattern.
+    pub pattern: Option<Vec<u8>>,
+    /// Only return the keys of the given type (as returned by the `TYPE` command).
+    pub key_type: Option<String>,
+    /// The number of keys after which a batch is returned, even if the
+    /// time budget was not reached.
+    pub count: usize,
+    /// The maximum amount of time to keep Redis locked for each batch,
+    /// [`None`] to use the configured default.
+    pub time_budget: Option<Duration>,
+    /// Also return the value of each key.
+    pub with_values: bool,
+}
+
+/// A key returned by a key space scan.
+pub struct ScannedKey {
+    /// The key name.
+    pub name: Vec<u8>,
+    /// The key type, as returned by the `TYPE` command.
+    pub key_type: &'static str,
+    /// The key value, if requested and the key type has a value that can
+    /// be read with a command.
+    pub value: Option<CallResult<'static>>,
+}
+
+/// A key space scan that locks Redis only while a batch of keys is
+/// collected, see [`BackgroundRunFunctionCtxInterface::scan`].
+pub trait KeysScanInterface {
+    /// Lock Redis and return the next batch of keys, or [`None`] once the
+    /// entire key space was scanned. Redis is released before returning,
+    /// so a key that was modified during the scan might be returned more
+    /// than once. A batch might be empty if no key matched the filters
+    /// within the time budget.
+    fn next_batch(&mut self) -> Result<Option<Vec<ScannedKey>>, GearsApiError>;
 }
 
 pub trait BackgroundRunFunctionCtxInterface: Send + Sync {
@@ -69,6 +131,32 @@ pub trait BackgroundRunFunctionCtxInterface: Send + Sync {
         inputs: Vec<RemoteFunctionData>,
         on_done: Box<dyn FnOnce(Vec<RemoteFunctionData>, Vec<GearsApiError>)>,
     );
+    /// Run the remote function on all the shards without collecting the
+    /// results. `on_shard_done` is called with the result (or error) of each
+    /// shard as soon as it arrives, and `on_done` once all the shards replied
+    /// or timed out.
+    fn run_on_all_shards_incremental(
+        &self,
+        job_name: &str,
+        inputs: Vec<RemoteFunctionData>,
+        on_shard_done: Box<dyn FnMut(Result<RemoteFunctionData, GearsApiError>)>,
+        on_done: Box<dyn FnOnce()>,
+    );
+    /// Run the remote function once for each of the given keys, on the shard
+    /// that owns the key. Each key is given to the remote function as the first
+    /// argument, followed by the given inputs. A single message is sent to each
+    /// shard regardless of the number of keys. The results given to `on_done`
+    /// are ordered the same as the given keys.
+    fn run_on_keys(
+        &self,
+        keys: Vec<RemoteFunctionKey>,
+        job_name: &str,
+        inputs: Vec<RemoteFunctionData>,
+        on_done: Box<dyn FnOnce(Vec<Result<RemoteFunctionData, GearsApiError>>)>,
+    );
+    /// Start a scan of the local key space, the keys are filtered natively
+    /// according to the given options.
+    fn scan(&self, options: KeysScanOptions) -> Box<dyn KeysScanInterface>;
 }
 
 pub trait RunFunctionCtxInterface: ReplyCtxInterface {
@@ -14,6 +14,7 @@ use redisgears_plugin_api::redisgears_plugin_api::{
     backend_ctx::BackendCtxInterfaceUninitialised,
     load_library_ctx::{
         FunctionFlags, FUNCTION_FLAG_ALLOW_OOM_GLOBAL_NAME, FUNCTION_FLAG_ALLOW_OOM_GLOBAL_VALUE,
+        FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_NAME, FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_VALUE,
         FUNCTION_FLAG_NO_WRITES_GLOBAL_NAME, FUNCTION_FLAG_NO_WRITES_GLOBAL_VALUE,
         FUNCTION_FLAG_RAW_ARGUMENTS_GLOBAL_NAME, FUNCTION_FLAG_RAW_ARGUMENTS_GLOBAL_VALUE,
     },
@@ -23,10 +24,14 @@ use redisgears_plugin_api::redisgears_plugin_api::{
 mod v8_backend;
 mod v8_function_ctx;
 mod v8_native_functions;
+mod v8_native_reducers;
 mod v8_notifications_ctx;
 mod v8_redisai;
 mod v8_script_ctx;
 mod v8_stream_ctx;
+mod v8_strings_cache;
+mod v8_value_serializer;
+mod v8_watchdog;
 
 use crate::v8_backend::V8Backend;
 use std::sync::{Arc, Mutex};
@@ -96,6 +101,9 @@ pub(crate) fn get_function_flags_from_strings(
             FUNCTION_FLAG_RAW_ARGUMENTS_GLOBAL_VALUE => {
                 flags_val.insert(FunctionFlags::RAW_ARGUMENTS)
             }
+            FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_VALUE => {
+                flags_val.insert(FunctionFlags::CACHE_RESULTS)
+            }
             _ => return Err(format!("Unknow flag '{}' was given", flag_str.as_str())),
         }
     }
@@ -134,6 +142,15 @@ pub(crate) fn get_function_flags_globals<'isolate_scope, 'isolate>(
             .new_string(FUNCTION_FLAG_RAW_ARGUMENTS_GLOBAL_VALUE)
             .to_value(),
     );
+    function_flags.set(
+        ctx_scope,
+        &isolate_scope
+            .new_string(FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_NAME)
+            .to_value(),
+        &isolate_scope
+            .new_string(FUNCTION_FLAG_CACHE_RESULTS_GLOBAL_VALUE)
+            .to_value(),
+    );
     function_flags.to_value()
 }
 
@@ -143,5 +160,7 @@ pub extern "C" fn initialize_plugin(ctx: &Context) -> *mut dyn BackendCtxInterfa
     init_api(ctx);
     Box::into_raw(Box::new(V8Backend {
         script_ctx_vec: Arc::new(Mutex::new(Vec::new())),
+        last_js_activity: 0,
+        idle_gc_cursor: 0,
     }))
 }
@@ -13,16 +13,18 @@ use redisgears_plugin_api::redisgears_plugin_api::backend_ctx::{
     BackendCtxInterfaceInitialised, DebuggerBackend, DebuggerBackendPayload,
 };
 use redisgears_plugin_api::redisgears_plugin_api::load_library_ctx::{InfoSectionData, ModuleInfo};
-use redisgears_plugin_api::redisgears_plugin_api::prologue::ApiVersion;
+use redisgears_plugin_api::redisgears_plugin_api::prologue::{parse_prologue, ApiVersion};
 use redisgears_plugin_api::redisgears_plugin_api::GearsApiResult;
 use redisgears_plugin_api::redisgears_plugin_api::{
     backend_ctx::BackendCtx, backend_ctx::BackendCtxInterfaceUninitialised,
-    backend_ctx::CompiledLibraryInterface, backend_ctx::LibraryFatalFailurePolicy,
+    backend_ctx::CompiledLibraryInterface, backend_ctx::LibraryCompilationArgs,
+    backend_ctx::LibraryCompiler, backend_ctx::LibraryFatalFailurePolicy,
     load_library_ctx::LibraryCtxInterface, GearsApiError,
 };
 use v8_rs::v8::inspector::server::{DebuggerSession, TcpServer, WebSocketServer};
 use v8_rs::v8::inspector::Inspector;
-use v8_rs::v8::isolate_scope::GarbageCollectionJobType;
+use v8_rs::v8::isolate_scope::{GarbageCollectionJobType, V8IsolateScope};
+use v8_rs::v8::v8_context_scope::V8ContextScope;
 use v8_rs::v8::{v8_init_platform, v8_version};
 
 use crate::v8_native_functions::{initialize_globals_for_version, ApiVersionSupported};
@@ -32,14 +34,15 @@ use v8_rs::v8::{isolate::V8Isolate, v8_init_with_error_handlers};
 
 use crate::get_exception_msg;
 use crate::v8_redisai::get_tensor_object_template;
-use crate::v8_script_ctx::V8LibraryCtx;
+use crate::v8_script_ctx::{V8LibraryCtx, V8LibraryIsolate};
+use crate::v8_watchdog;
 
 use std::alloc::{GlobalAlloc, Layout, System};
 use std::collections::{HashMap, HashSet};
 
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
 use std::sync::{Arc, Mutex, Weak};
-use std::time::Duration;
+use std::time::{Duration, Instant};
 lazy_static::lazy_static! {
     static ref GLOBALS_ALLOW_DENY_LISTS: (HashSet<String>, HashSet<String>) = get_allow_deny_lists!({
         allow_list: [
@@ -120,6 +123,71 @@ fn deny_list() -> &'static HashSet<String> {
     &GLOBALS_ALLOW_DENY_LISTS.1
 }
 
+lazy_static::lazy_static! {
+    /// The names of the globals that should be removed from a newly
+    /// created context. A fresh V8 context always comes with the same
+    /// set of globals, so the list is calculated once, on the first
+    /// library compilation, and then reused. This saves walking all the
+    /// global properties and matching them against the allow and deny
+    /// lists on each library load.
+    static ref GLOBALS_TO_REMOVE: Mutex<Option<Arc<Vec<String>>>> = Mutex::new(None);
+}
+
+/// Calculate the list of globals that should be removed from the given
+/// context, those are all the globals which are not on the allow list.
+fn calc_globals_to_remove(
+    ctx_scope: &V8ContextScope,
+    compiled_library_api: &(dyn CompiledLibraryInterface + Send + Sync),
+) -> Result<Vec<String>, GearsApiError> {
+    let globals = ctx_scope.get_globals();
+    let propeties = globals.get_own_property_names(ctx_scope);
+    propeties
+        .iter(ctx_scope)
+        .try_fold(Vec::new(), |mut res, v| {
+            let s = v.to_utf8().ok_or(GearsApiError::new(
+                "Failed converting global property name to string",
+            ))?;
+            if !allow_list().contains(s.as_str()) {
+                if !deny_list().contains(s.as_str()) {
+                    compiled_library_api.log_warning(&format!(
+                        "Found global '{}' which is not on the allowed list nor on the deny list.",
+                        s.as_str()
+                    ));
+                }
+                res.push(s.as_str().to_owned());
+            }
+            Ok(res)
+        })
+}
+
+/// Remove all the globals which are not on the allow list from the given context.
+fn filter_globals(
+    isolate_scope: &V8IsolateScope,
+    ctx_scope: &V8ContextScope,
+    compiled_library_api: &(dyn CompiledLibraryInterface + Send + Sync),
+) -> Result<(), GearsApiError> {
+    let globals_to_remove = {
+        let mut globals_to_remove = GLOBALS_TO_REMOVE.lock().unwrap();
+        match globals_to_remove.as_ref() {
+            Some(g) => Arc::clone(g),
+            None => {
+                let g = Arc::new(calc_globals_to_remove(ctx_scope, compiled_library_api)?);
+                *globals_to_remove = Some(Arc::clone(&g));
+                g
+            }
+        }
+    };
+
+    let globals = ctx_scope.get_globals();
+    globals_to_remove.iter().try_for_each(|name| {
+        // property does not exists on the allow list. lets drop it.
+        if !globals.delete(ctx_scope, &isolate_scope.new_string(name).to_value()) {
+            return Err(GearsApiError::new(format!("Failed deleting global '{}' which is not on the allowed list, can not load the library.", name)));
+        }
+        Ok(())
+    })
+}
+
 /// A "noop" logger that doesn't log anything.
 /// This logger exists only to satisfy the static requirement of the
 /// logging facility. An external logger is set for this crate in
@@ -373,12 +441,91 @@ pub(crate) fn memory_delta() -> usize {
     0usize
 }
 
-/// Scan all active isolate and return to total heap memory usage.
+/// Return the maximum number of libraries that can share a single isolate,
+/// `0` means that each library gets a dedicated isolate.
+pub(crate) fn shared_isolate_max_libraries() -> usize {
+    #[cfg(not(test))]
+    unsafe {
+        (GLOBAL
+            .backend_ctx
+            .as_ref()
+            .unwrap()
+            .get_v8_shared_isolate_max_libraries)()
+    }
+    #[cfg(test)]
+    0usize
+}
+
+/// Return `true` if the arguments and results of remote functions should
+/// be sent using the structured binary encoding.
+pub(crate) fn remote_functions_structured_encoding() -> bool {
+    #[cfg(not(test))]
+    unsafe {
+        (GLOBAL
+            .backend_ctx
+            .as_ref()
+            .unwrap()
+            .get_remote_functions_structured_encoding)()
+    }
+    #[cfg(test)]
+    false
+}
+
+/// The combined total heap size of all the active isolates, as last
+/// accounted by each isolate (see [`account_isolate_heap_size`]).
+static ISOLATES_USED_MEMORY: AtomicUsize = AtomicUsize::new(0);
+
+/// Update the combined heap size of all the isolates with a change
+/// of a single isolate heap size from `prev` to `curr`.
+pub(crate) fn account_isolate_heap_size(prev: usize, curr: usize) {
+    if curr >= prev {
+        ISOLATES_USED_MEMORY.fetch_add(curr - prev, Ordering::Relaxed);
+    } else {
+        ISOLATES_USED_MEMORY.fetch_sub(prev - curr, Ordering::Relaxed);
+    }
+}
+
+/// Counts the number of top level JS runs, used to detect when the
+/// JS engine is idle.
+static JS_ACTIVITY: AtomicU64 = AtomicU64::new(0);
+
+/// Record that a top level JS run was finished.
+pub(crate) fn record_js_activity() {
+    JS_ACTIVITY.fetch_add(1, Ordering::Relaxed);
+}
+
+/// Return the total heap memory usage of all the active isolates.
 pub(crate) fn calc_isolates_used_memory() -> usize {
+    ISOLATES_USED_MEMORY.load(Ordering::Relaxed)
+}
+
+/// Scan all active isolates, re-account their heap size and return
+/// the total heap memory usage. Unlike [`calc_isolates_used_memory`]
+/// this also catches memory that was freed by GC while the isolates
+/// were idle, and so it is used when we are in an OOM state.
+pub(crate) fn refresh_isolates_used_memory() -> usize {
     let script_ctxs = unsafe { GLOBAL.script_ctx_vec.as_ref().unwrap() };
-    script_ctxs.lock().unwrap().iter().fold(0, |agg, v| {
-        agg + v.upgrade().map_or(0, |v| v.isolate.total_heap_size())
-    })
+    script_ctxs
+        .lock()
+        .unwrap()
+        .iter()
+        .filter_map(|v| v.upgrade())
+        .for_each(|v| v.update_heap_size_accounting());
+    calc_isolates_used_memory()
+}
+
+/// Return an error if the isolates reached the memory limit. The accounted
+/// memory might be stale (the GC might have freed memory since it was last
+/// accounted), so the heap statistics are re-read before failing.
+pub(crate) fn verify_not_oom() -> Result<(), GearsApiError> {
+    if calc_isolates_used_memory() >= max_memory_limit()
+        && refresh_isolates_used_memory() >= max_memory_limit()
+    {
+        return Err(GearsApiError::new(
+            "JS engine reached OOM state and can not run any more code",
+        ));
+    }
+    Ok(())
 }
 
 /// Return `true` if we bypass the memory limit otherwise `false`.
@@ -390,7 +537,7 @@ pub(crate) fn bypass_memory_limit() -> bool {
     if !bypassed_memory_limit {
         return false;
     }
-    if calc_isolates_used_memory() >= max_memory_limit() {
+    if refresh_isolates_used_memory() >= max_memory_limit() {
         return true;
     }
     unsafe { GLOBAL.bypassed_memory_limit.as_ref().unwrap() }.store(false, Ordering::Relaxed);
@@ -557,6 +704,11 @@ impl DebuggerBackend for DebuggerServer {
 
 pub(crate) struct V8Backend {
     pub(crate) script_ctx_vec: ScriptCtxVec,
+    /// The value of the JS activity counter on the last idle callback.
+    pub(crate) last_js_activity: u64,
+    /// The index of the next isolate to be garbage collected when idle,
+    /// used to spread the garbage collection work across the isolates.
+    pub(crate) idle_gc_cursor: usize,
 }
 
 impl V8Backend {
@@ -564,52 +716,67 @@ impl V8Backend {
     const NAME: &'static str = "js";
 }
 
-fn scan_for_isolates_timeout(script_ctx_vec: &ScriptCtxVec) {
-    let l: std::sync::MutexGuard<Vec<Weak<V8ScriptCtx>>> = script_ctx_vec.lock().unwrap();
-    for script_ctx_weak in l.iter() {
-        let script_ctx = match script_ctx_weak.upgrade() {
-            Some(s) => s,
-            None => continue,
-        };
-        if !script_ctx.is_being_debugged()
-            && script_ctx
-                .is_running
-                .compare_exchange(true, false, Ordering::Relaxed, Ordering::Relaxed)
-                .is_ok()
-        {
-            let interrupt_script_ctx_clone = Weak::clone(script_ctx_weak);
-            script_ctx.isolate.request_interrupt(move|isolate|{
-                let script_ctx = match interrupt_script_ctx_clone.upgrade() {
-                    Some(s) => s,
-                    None => return,
-                };
-                if script_ctx.is_gil_locked() && !script_ctx.is_lock_timedout() {
-                    // gil is current locked. we should check for timeout.
-                    // todo: call Redis back to reply to pings and some other commands.
-                    let gil_lock_duration = script_ctx.gil_lock_duration_ms();
-                    let gil_lock_configured_timeout = if script_ctx.is_being_loaded_from_rdb() {
-                        gil_rdb_lock_timeout()
-                    } else {
-                        gil_lock_timeout()
-                    };
-                    if gil_lock_duration > gil_lock_configured_timeout {
-                        script_ctx.set_lock_timedout();
-                        script_ctx.compiled_library_api.log_warning(&format!("Script locks Redis for about {}ms which is more then the configured timeout {}ms.", gil_lock_duration, gil_lock_configured_timeout));
-                        match get_fatal_failure_policy() {
-                            LibraryFatalFailurePolicy::Kill => {
-                                script_ctx.compiled_library_api.log_warning("Fatal error policy do not allow to abort the script, we will allow the script to continue running, best effort approach.");
-                            }
-                            LibraryFatalFailurePolicy::Abort => {
-                                script_ctx.compiled_library_api.log_warning("Aborting script with timeout error.");
-                                isolate.terminate_execution();
-                            }
+/// The interval in which we keep checking a script that bypassed its
+/// GIL lock timeout but could not yet be interrupted.
+const EXPIRED_DEADLINE_RETRY_MS: u64 = 10;
+
+/// Called by the watchdog thread when the deadline of a script was reached.
+/// If the script still holds the GIL for longer than the configured timeout,
+/// request an interrupt that will check for the timeout. Otherwise, re-arm
+/// a deadline for the current GIL lock (if there is one).
+fn on_isolate_deadline(script_ctx_weak: Weak<V8ScriptCtx>) {
+    let script_ctx = match script_ctx_weak.upgrade() {
+        Some(s) => s,
+        None => return,
+    };
+    script_ctx.watchdog_armed.store(false, Ordering::SeqCst);
+    let locked_at = script_ctx.gil_locked_at.load(Ordering::SeqCst);
+    if locked_at == 0 {
+        // GIL was released, a new deadline will be armed on next lock.
+        return;
+    }
+    let timeout = u64::try_from(script_ctx.gil_lock_configured_timeout()).unwrap_or(u64::MAX);
+    let deadline = locked_at.saturating_add(timeout);
+    let now = v8_watchdog::now_ms();
+    if now < deadline {
+        script_ctx.arm_watchdog(deadline);
+        return;
+    }
+
+    if script_ctx
+        .is_running
+        .compare_exchange(true, false, Ordering::Relaxed, Ordering::Relaxed)
+        .is_ok()
+    {
+        script_ctx.isolate.request_interrupt(move|isolate|{
+            let script_ctx = match script_ctx_weak.upgrade() {
+                Some(s) => s,
+                None => return,
+            };
+            if script_ctx.is_gil_locked() && !script_ctx.is_lock_timedout() {
+                // gil is current locked. we should check for timeout.
+                // todo: call Redis back to reply to pings and some other commands.
+                let gil_lock_duration = script_ctx.gil_lock_duration_ms();
+                let gil_lock_configured_timeout = script_ctx.gil_lock_configured_timeout();
+                if gil_lock_duration > gil_lock_configured_timeout {
+                    script_ctx.set_lock_timedout();
+                    script_ctx.compiled_library_api.log_warning(&format!("Script locks Redis for about {}ms which is more then the configured timeout {}ms.", gil_lock_duration, gil_lock_configured_timeout));
+                    match get_fatal_failure_policy() {
+                        LibraryFatalFailurePolicy::Kill => {
+                            script_ctx.compiled_library_api.log_warning("Fatal error policy do not allow to abort the script, we will allow the script to continue running, best effort approach.");
+                        }
+                        LibraryFatalFailurePolicy::Abort => {
+                            script_ctx.compiled_library_api.log_warning("Aborting script with timeout error.");
+                            isolate.terminate_execution();
                         }
                     }
                 }
-                script_ctx.before_run();
-            });
-        }
+            }
+            script_ctx.before_run();
+        });
     }
+    // Keep watching the script as long as it holds the GIL.
+    script_ctx.arm_watchdog(now + EXPIRED_DEADLINE_RETRY_MS);
 }
 
 fn check_isolates_memory_limit(
@@ -635,6 +802,320 @@ fn check_isolates_memory_limit(
     }
 }
 
+/// An isolate that is shared between libraries, and the number of libraries
+/// it hosts (including libraries that are still being created).
+struct SharedIsolate {
+    isolate: Weak<V8LibraryIsolate>,
+    libraries: usize,
+}
+
+/// The isolates that are shared between libraries.
+static SHARED_ISOLATES: Mutex<Vec<SharedIsolate>> = Mutex::new(Vec::new());
+
+/// The place of a library on a shared isolate, released when dropped.
+pub(crate) struct SharedIsolateSlot {
+    isolate: Weak<V8LibraryIsolate>,
+}
+
+impl Drop for SharedIsolateSlot {
+    fn drop(&mut self) {
+        let mut shared_isolates = SHARED_ISOLATES.lock().unwrap();
+        if let Some(index) = shared_isolates
+            .iter()
+            .position(|v| Weak::ptr_eq(&v.isolate, &self.isolate))
+        {
+            shared_isolates[index].libraries -= 1;
+            if shared_isolates[index].libraries == 0 {
+                shared_isolates.swap_remove(index);
+            }
+        }
+    }
+}
+
+/// Return the isolate on which a new library should run. If `can_share` is
+/// [`true`] and isolate sharing is enabled, the library is placed on a shared
+/// isolate that hosts less than [`shared_isolate_max_libraries`] libraries,
+/// a new shared isolate is created if there is no such isolate. In this case
+/// the library place on the isolate is also returned.
+fn get_library_isolate(can_share: bool) -> (Arc<V8LibraryIsolate>, Option<SharedIsolateSlot>) {
+    let max_libraries = if can_share {
+        shared_isolate_max_libraries()
+    } else {
+        0
+    };
+    if max_libraries == 0 {
+        return (new_library_isolate(false), None);
+    }
+    let mut shared_isolates = SHARED_ISOLATES.lock().unwrap();
+    let isolate = shared_isolates
+        .iter_mut()
+        .filter(|v| v.libraries < max_libraries)
+        .find_map(|v| {
+            let isolate = v.isolate.upgrade()?;
+            v.libraries += 1;
+            Some(isolate)
+        });
+    let isolate = match isolate {
+        Some(isolate) => isolate,
+        None => {
+            let isolate = new_library_isolate(true);
+            shared_isolates.push(SharedIsolate {
+                isolate: Arc::downgrade(&isolate),
+                libraries: 1,
+            });
+            isolate
+        }
+    };
+    let slot = SharedIsolateSlot {
+        isolate: Arc::downgrade(&isolate),
+    };
+    (isolate, Some(slot))
+}
+
+/// Creates a new isolate for libraries to run on.
+fn new_library_isolate(shared: bool) -> Arc<V8LibraryIsolate> {
+    let isolate = Arc::new(V8LibraryIsolate::new(
+        V8Isolate::new_with_limits(initial_memory_usage(), initial_memory_limit()),
+        shared,
+    ));
+    {
+        let _isolate_scope = isolate.enter();
+        let oom_isolate = Arc::downgrade(&isolate);
+        isolate.set_near_oom_callback(move |curr_limit, initial_limit| {
+            on_near_oom(&oom_isolate, curr_limit, initial_limit)
+        });
+    }
+    isolate
+}
+
+/// Called by V8 when the isolate heap is close to its limit. Returns the
+/// new heap limit. On a shared isolate, the library that is currently
+/// running is considered as the one that caused the OOM.
+fn on_near_oom(isolate: &Weak<V8LibraryIsolate>, curr_limit: usize, initial_limit: usize) -> usize {
+    let msg = format!(
+        "V8 near OOM notification arrive, curr_limit={curr_limit}, initial_limit={initial_limit}",
+    );
+    let libraries = isolate.upgrade().map(|v| v.libraries()).unwrap_or_default();
+    let script_ctx = match libraries
+        .iter()
+        .find(|v| v.is_running.load(Ordering::Relaxed))
+        .or_else(|| libraries.first())
+    {
+        Some(s_c) => s_c,
+        None => {
+            log_warning("V8 near OOM notification arrive after script was deleted");
+            log_warning(&msg);
+            panic!("{}", msg);
+        }
+    };
+
+    let msg = format!(
+        "{msg}, library={}, used_heap_size={}, total_heap_size={}",
+        script_ctx.name,
+        script_ctx.isolate.used_heap_size(),
+        script_ctx.isolate.total_heap_size()
+    );
+    let memory_delta = memory_delta();
+    let new_isolate_limit =
+        usize::max(script_ctx.isolate.total_heap_size(), curr_limit) + memory_delta;
+
+    script_ctx.update_heap_size_accounting();
+    if calc_isolates_used_memory() + memory_delta >= max_memory_limit() {
+        unsafe { GLOBAL.bypassed_memory_limit.as_ref().unwrap() }.store(true, Ordering::Relaxed);
+        // wake up the watchdog so it will start monitoring the OOM state.
+        v8_watchdog::notify();
+        script_ctx.compiled_library_api.log_warning(&msg);
+        // we are going to bypass the total memory limit, lets try to abort.
+        match get_fatal_failure_policy() {
+            LibraryFatalFailurePolicy::Kill => {
+                script_ctx.compiled_library_api.log_warning("Fatal error policy do not allow to abort the script, server will be killed shortly.");
+            }
+            LibraryFatalFailurePolicy::Abort => {
+                script_ctx.isolate.request_interrupt(|isolate| {
+                    isolate.memory_pressure_notification();
+                });
+                script_ctx.isolate.terminate_execution();
+                script_ctx.compiled_library_api.log_warning(&format!(
+                    "Temporarily increasing max memory to {new_isolate_limit} and aborting the script"
+                ));
+            }
+        }
+    } else {
+        script_ctx.compiled_library_api.log_trace(&msg);
+        script_ctx
+            .compiled_library_api
+            .log_trace(&format!("Increasing max memory to {new_isolate_limit}"));
+    }
+    new_isolate_limit
+}
+
+/// Creates a new V8 context for the library, compiles the library code and
+/// installs the API globals. The code is not evaluated, this is done
+/// later when the library is loaded. If `primary` is given, the created
+/// isolate is a replica of the given primary library isolate. If
+/// `share_isolate` is [`true`], the library might be placed on an isolate
+/// that is shared with other libraries, otherwise a new isolate is created.
+#[allow(clippy::too_many_arguments)]
+fn create_library_script_ctx(
+    script_ctx_vec: &ScriptCtxVec,
+    debug: bool,
+    module_name: &str,
+    code: &str,
+    api_version: ApiVersion,
+    config: Option<&String>,
+    compiled_library_api: Box<dyn CompiledLibraryInterface + Send + Sync>,
+    primary: Option<&Arc<V8ScriptCtx>>,
+    share_isolate: bool,
+) -> Result<Arc<V8ScriptCtx>, GearsApiError> {
+    verify_not_oom()?;
+
+    let (isolate, shared_isolate_slot) = get_library_isolate(share_isolate);
+    let start_heap_size = isolate.used_heap_size();
+
+    let script_ctx = {
+        let (ctx, script, tensor_obj_template, inspector) = {
+            let isolate_scope = isolate.enter();
+            let ctx = isolate_scope.new_context(None);
+            let ctx_scope = ctx.enter(&isolate_scope);
+            let inspector = if debug {
+                Some(Inspector::new(&ctx_scope))
+            } else {
+                None
+            };
+
+            if !(get_global_option().contains(GlobalOptions::AVOID_GLOBALS_ALLOW_LIST)) {
+                filter_globals(&isolate_scope, &ctx_scope, compiled_library_api.as_ref())?;
+            }
+
+            let v8code_str = isolate_scope.new_string(code);
+
+            let trycatch = isolate_scope.new_try_catch();
+            let script = ctx_scope
+                .compile(&v8code_str)
+                .ok_or_else(|| get_exception_msg(&isolate, trycatch, &ctx_scope))?;
+
+            let script = script.persist();
+            let tensor_obj_template = get_tensor_object_template(&isolate_scope);
+            (ctx, script, tensor_obj_template, inspector)
+        };
+
+        let script_ctx = Arc::new_cyclic(|script_ctx_weak| {
+            V8ScriptCtx::new(
+                Weak::clone(script_ctx_weak),
+                module_name.to_owned(),
+                isolate,
+                shared_isolate_slot,
+                ctx,
+                script,
+                inspector.map(Arc::new),
+                tensor_obj_template,
+                compiled_library_api,
+                primary,
+            )
+        });
+
+        script_ctx_vec
+            .lock()
+            .unwrap()
+            .push(Arc::downgrade(&script_ctx));
+        {
+            let isolate_scope = script_ctx.isolate.enter();
+            let ctx_scope = script_ctx.context.enter(&isolate_scope);
+            let globals = ctx_scope.get_globals();
+
+            script_ctx.isolate.add_library(&script_ctx);
+
+            let api_version_supported: ApiVersionSupported = api_version.try_into()?;
+
+            api_version_supported
+                .validate_code(code)
+                .iter()
+                .enumerate()
+                .map(|(index, error)| format!("\t{}. {}", index + 1, error.get_msg()))
+                .for_each(|message| {
+                    script_ctx
+                        .compiled_library_api
+                        .log_info(&format!("Module \"{module_name}\": {message}"))
+                });
+
+            let api_version_supported = api_version_supported.into_latest_compatible();
+            initialize_globals_for_version(
+                api_version_supported,
+                &script_ctx,
+                &globals,
+                &isolate_scope,
+                &ctx_scope,
+                config,
+            )?;
+        }
+
+        if script_ctx.isolate.is_shared() {
+            script_ctx.attribute_heap_growth(start_heap_size);
+        }
+        script_ctx.update_heap_size_accounting();
+        script_ctx
+    };
+
+    Ok(script_ctx)
+}
+
+/// Creates the library context, the number of isolates is taken from the
+/// library prologue. The first isolate is the primary one, the rest are
+/// replicas that evaluate the same code and share the async functions
+/// invocations with the primary isolate. Debugging always uses a single,
+/// dedicated, isolate. A library that runs on a single isolate might share
+/// it with other libraries.
+fn create_library_ctx(
+    script_ctx_vec: &ScriptCtxVec,
+    debug: bool,
+    module_name: &str,
+    code: &str,
+    api_version: ApiVersion,
+    config: Option<&String>,
+    compiled_library_api: Box<dyn CompiledLibraryInterface + Send + Sync>,
+) -> Result<V8LibraryCtx, GearsApiError> {
+    let isolates = if debug {
+        1
+    } else {
+        parse_prologue(code).map_or(1, |v| v.isolates)
+    };
+    let replicas_apis = (1..isolates)
+        .map(|_| compiled_library_api.create_replica_api())
+        .collect::<Vec<_>>();
+    let script_ctx = create_library_script_ctx(
+        script_ctx_vec,
+        debug,
+        module_name,
+        code,
+        api_version,
+        config,
+        compiled_library_api,
+        None,
+        // only libraries that run on a single isolate can share it.
+        !debug && isolates == 1,
+    )?;
+    let replicas = replicas_apis
+        .into_iter()
+        .map(|replica_api| {
+            create_library_script_ctx(
+                script_ctx_vec,
+                false,
+                module_name,
+                code,
+                api_version,
+                config,
+                replica_api,
+                Some(&script_ctx),
+                false,
+            )
+        })
+        .collect::<Result<Vec<_>, GearsApiError>>()?;
+    Ok(V8LibraryCtx {
+        script_ctx,
+        replicas,
+    })
+}
+
 impl V8Backend {
     fn isolates_gc(&mut self) {
         let mut l = self.script_ctx_vec.lock().unwrap();
@@ -649,6 +1130,13 @@ impl V8Backend {
         }
     }
 
+    fn gc_isolates_if_needed(&mut self) {
+        if self.script_ctx_vec.lock().unwrap().len() > 100 {
+            // let try to do some gc
+            self.isolates_gc();
+        }
+    }
+
     fn initialize_v8_engine(&self) -> Result<(), GearsApiError> {
         v8_init_with_error_handlers(
             Box::new(|line, msg| {
@@ -680,8 +1168,16 @@ impl V8Backend {
             .spawn(move || {
                 let mut detected_memory_pressure = false;
                 loop {
-                    std::thread::sleep(std::time::Duration::from_millis(100));
-                    scan_for_isolates_timeout(&script_ctxs);
+                    // Sleep until the nearest GIL lock deadline. While in an OOM
+                    // state we also need to periodically check if we can exit it.
+                    let max_wait = if detected_memory_pressure {
+                        Some(Duration::from_millis(100))
+                    } else {
+                        None
+                    };
+                    v8_watchdog::wait_for_expired(max_wait)
+                        .into_iter()
+                        .for_each(on_isolate_deadline);
                     detected_memory_pressure =
                         check_isolates_memory_limit(&script_ctxs, detected_memory_pressure);
                 }
@@ -771,156 +1267,165 @@ impl BackendCtxInterfaceInitialised for V8Backend {
         config: Option<&String>,
         compiled_library_api: Box<dyn CompiledLibraryInterface + Send + Sync>,
     ) -> Result<Box<dyn LibraryCtxInterface>, GearsApiError> {
-        if calc_isolates_used_memory() >= max_memory_limit() {
-            return Err(GearsApiError::new(
-                "JS engine reached OOM state and can not run any more code",
-            ));
-        }
+        let library_ctx = create_library_ctx(
+            &self.script_ctx_vec,
+            debug,
+            module_name,
+            code,
+            api_version,
+            config,
+            compiled_library_api,
+        )?;
+        self.gc_isolates_if_needed();
+        Ok(Box::new(library_ctx))
+    }
 
-        let isolate = V8Isolate::new_with_limits(initial_memory_usage(), initial_memory_limit());
+    fn get_library_compiler(
+        &mut self,
+        module_name: String,
+        code: String,
+        api_version: ApiVersion,
+        config: Option<String>,
+        compiled_library_api: Box<dyn CompiledLibraryInterface + Send + Sync>,
+    ) -> LibraryCompiler {
+        self.gc_isolates_if_needed();
+        let script_ctx_vec = Arc::clone(&self.script_ctx_vec);
+        Box::new(move || {
+            let library_ctx = create_library_ctx(
+                &script_ctx_vec,
+                false,
+                &module_name,
+                &code,
+                api_version,
+                config.as_ref(),
+                compiled_library_api,
+            )?;
+            Ok(Box::new(library_ctx) as Box<dyn LibraryCtxInterface>)
+        })
+    }
 
-        let script_ctx = {
-            let (ctx, script, tensor_obj_template, inspector) = {
-                let isolate_scope = isolate.enter();
-                let ctx = isolate_scope.new_context(None);
-                let ctx_scope = ctx.enter(&isolate_scope);
-                let inspector = if debug {
-                    Some(Inspector::new(&ctx_scope))
-                } else {
-                    None
-                };
+    fn compile_libraries(
+        &mut self,
+        libraries: Vec<LibraryCompilationArgs>,
+    ) -> Vec<Result<Box<dyn LibraryCtxInterface>, GearsApiError>> {
+        let threads = std::thread::available_parallelism()
+            .map_or(1, |v| v.get())
+            .min(libraries.len());
+        let script_ctx_vec = &self.script_ctx_vec;
+        let next_library = AtomicUsize::new(0);
+        let libraries = libraries
+            .into_iter()
+            .map(|v| Mutex::new(Some(v)))
+            .collect::<Vec<_>>();
+        let results = libraries
+            .iter()
+            .map(|_| Mutex::new(None))
+            .collect::<Vec<Mutex<Option<Result<V8LibraryCtx, GearsApiError>>>>>();
+
+        // Each isolate is independent so the libraries can be compiled
+        // concurrently, each thread takes the next library that was not
+        // yet compiled until all the libraries are compiled. Only the
+        // compilation runs here, the libraries are evaluated later, one by
+        // one under the Redis GIL, as the evaluation registers the library
+        // functions. The memory limit is verified before each compilation
+        // and again before each evaluation, so libraries compiled before
+        // the limit was reached are still rejected if evaluating the
+        // previous ones reached it. Compiling might log (for example,
+        // unknown globals), which is safe from any thread as the logger
+        // writes to the Redis log without a context.
+        let compile_next = || loop {
+            let index = next_library.fetch_add(1, Ordering::Relaxed);
+            let library = match libraries.get(index) {
+                Some(l) => l.lock().unwrap().take().unwrap(),
+                None => break,
+            };
+            let res = create_library_ctx(
+                script_ctx_vec,
+                false,
+                library.module_name,
+                library.code,
+                library.api_version,
+                library.config,
+                library.compiled_library_api,
+            );
+            *results[index].lock().unwrap() = Some(res);
+        };
 
-                let globals = ctx_scope.get_globals();
-                if !(get_global_option().contains(GlobalOptions::AVOID_GLOBALS_ALLOW_LIST)) {
-                    let propeties = globals.get_own_property_names(&ctx_scope);
-                    propeties.iter(&ctx_scope).try_for_each(|v| {
-                        let s = v.to_utf8().ok_or(GearsApiError::new("Failed converting global property name to string"))?;
-                        if !allow_list().contains(s.as_str()) {
-                            if !deny_list().contains(s.as_str()) {
-                                compiled_library_api.log_warning(&format!(
-                                    "Found global '{}' which is not on the allowed list nor on the deny list.",
-                                    s.as_str()
-                                ));
-                            }
-                            // property does not exists on the allow list. lets drop it.
-                            if !globals.delete(&ctx_scope, &v) {
-                                return Err(GearsApiError::new(format!("Failed deleting global '{}' which is not on the allowed list, can not load the library.", s.as_str())));
-                            }
-                        }
-                        Ok(())
-                    })?;
+        std::thread::scope(|s| {
+            // the current thread is also compiling so we need one thread less.
+            for _ in 1..threads {
+                if let Err(e) = std::thread::Builder::new()
+                    .name("v8compiler".to_string())
+                    .spawn_scoped(s, compile_next)
+                {
+                    log_warning(&format!("Failed spawning library compilation thread, {e}"));
+                    break;
                 }
+            }
+            compile_next();
+        });
+
+        let results = results
+            .into_iter()
+            .map(|r| {
+                r.into_inner()
+                    .unwrap()
+                    .unwrap()
+                    .map(|library_ctx| Box::new(library_ctx) as Box<dyn LibraryCtxInterface>)
+            })
+            .collect();
+        self.gc_isolates_if_needed();
+        results
+    }
 
-                let v8code_str = isolate_scope.new_string(code);
-
-                let trycatch = isolate_scope.new_try_catch();
-                let script = ctx_scope
-                    .compile(&v8code_str)
-                    .ok_or_else(|| get_exception_msg(&isolate, trycatch, &ctx_scope))?;
-
-                let script = script.persist();
-                let tensor_obj_template = get_tensor_object_template(&isolate_scope);
-                (ctx, script, tensor_obj_template, inspector)
-            };
-
-            let script_ctx = Arc::new(V8ScriptCtx::new(
-                module_name.to_owned(),
-                isolate,
-                ctx,
-                script,
-                inspector.map(Arc::new),
-                tensor_obj_template,
-                compiled_library_api,
-            ));
+    fn on_idle(&mut self, budget: Duration) {
+        let js_activity = JS_ACTIVITY.load(Ordering::Relaxed);
+        let is_idle = js_activity == self.last_js_activity;
+        self.last_js_activity = js_activity;
+        // When getting close to the memory limit we collect even if not idle,
+        // better to do it now then on the next function invocation.
+        let low_memory = calc_isolates_used_memory() >= max_memory_limit() / 10 * 8;
+        if !is_idle && !low_memory {
+            return;
+        }
 
-            let len = {
-                let mut l = self.script_ctx_vec.lock().unwrap();
-                l.push(Arc::downgrade(&script_ctx));
-                l.len()
-            };
-            if len > 100 {
-                // let try to do some gc
-                self.isolates_gc();
+        self.isolates_gc();
+        let script_ctxs = self
+            .script_ctx_vec
+            .lock()
+            .unwrap()
+            .iter()
+            .filter_map(|v| v.upgrade())
+            .collect::<Vec<_>>();
+        let start = Instant::now();
+        // a shared isolate is collected at most once.
+        let mut collected_shared_isolates = HashSet::new();
+        for i in 0..script_ctxs.len() {
+            if start.elapsed() >= budget {
+                break;
             }
+            let index = (self.idle_gc_cursor + i) % script_ctxs.len();
+            self.idle_gc_cursor = index + 1;
+            let script_ctx = &script_ctxs[index];
+            if script_ctx.isolate.is_running() || script_ctx.is_being_debugged() {
+                // running on a background thread, we do not want to wait for it.
+                continue;
+            }
+            if !low_memory && !script_ctx.heap_dirty.load(Ordering::Relaxed) {
+                // nothing ran since last collection.
+                continue;
+            }
+            if script_ctx.isolate.is_shared()
+                && !collected_shared_isolates.insert(Arc::as_ptr(&script_ctx.isolate))
             {
-                let isolate_scope = script_ctx.isolate.enter();
-                let ctx_scope = script_ctx.context.enter(&isolate_scope);
-                let globals = ctx_scope.get_globals();
-
-                let oom_script_ctx = Arc::downgrade(&script_ctx);
-
-                script_ctx
-                    .isolate
-                    .set_near_oom_callback(move |curr_limit, initial_limit| {
-                        let msg = format!(
-                            "V8 near OOM notification arrive, curr_limit={curr_limit}, initial_limit={initial_limit}",
-                        );
-                        let script_ctx = match oom_script_ctx.upgrade() {
-                            Some(s_c) => s_c,
-                            None => {
-                                log_warning("V8 near OOM notification arrive after script was deleted");
-                                log_warning(&msg);
-                                panic!("{}", msg);
-                            }
-                        };
-
-                        let msg = format!("{msg}, library={}, used_heap_size={}, total_heap_size={}", script_ctx.name, script_ctx.isolate.used_heap_size(), script_ctx.isolate.total_heap_size());
-                        let memory_delta = memory_delta();
-                        let new_isolate_limit = usize::max(script_ctx.isolate.total_heap_size(), curr_limit) + memory_delta;
-
-                        if calc_isolates_used_memory() + memory_delta >= max_memory_limit() {
-                            unsafe { GLOBAL.bypassed_memory_limit.as_ref().unwrap() }.store(true, Ordering::Relaxed);
-                            script_ctx.compiled_library_api.log_warning(&msg);
-                            // we are going to bypass the total memory limit, lets try to abort.
-                            match get_fatal_failure_policy() {
-                                LibraryFatalFailurePolicy::Kill => {
-                                    script_ctx.compiled_library_api.log_warning("Fatal error policy do not allow to abort the script, server will be killed shortly.");
-                                }
-                                LibraryFatalFailurePolicy::Abort => {
-                                    script_ctx.isolate.request_interrupt(|isolate| {
-                                        isolate.memory_pressure_notification();
-                                    });
-                                    script_ctx.isolate.terminate_execution();
-                                    script_ctx
-                                        .compiled_library_api
-                                        .log_warning(&format!("Temporarily increasing max memory to {new_isolate_limit} and aborting the script"));
-                                }
-                            }
-                        } else {
-                            script_ctx.compiled_library_api.log_trace(&msg);
-                            script_ctx.compiled_library_api.log_trace(&format!("Increasing max memory to {new_isolate_limit}"));
-                        }
-                        new_isolate_limit
-                    });
-
-                let api_version_supported: ApiVersionSupported = api_version.try_into()?;
-
-                api_version_supported
-                    .validate_code(code)
-                    .iter()
-                    .enumerate()
-                    .map(|(index, error)| format!("\t{}. {}", index + 1, error.get_msg()))
-                    .for_each(|message| {
-                        script_ctx
-                            .compiled_library_api
-                            .log_info(&format!("Module \"{module_name}\": {message}"))
-                    });
-
-                let api_version_supported = api_version_supported.into_latest_compatible();
-                initialize_globals_for_version(
-                    api_version_supported,
-                    &script_ctx,
-                    &globals,
-                    &isolate_scope,
-                    &ctx_scope,
-                    config,
-                )?;
+                continue;
             }
-
-            script_ctx
-        };
-
-        Ok(Box::new(V8LibraryCtx { script_ctx }))
+            script_ctx.idle_gc();
+        }
+        // The GC might have shrunk the heap of isolates we did not collect (or the
+        // heap of a collected isolate after we accounted it), re-account all of them
+        // so the memory limit checks will not rely on a stale total.
+        refresh_isolates_used_memory();
     }
 
     fn debug(&mut self, args: &[&str]) -> Result<RedisValue, GearsApiError> {
@@ -954,7 +1459,7 @@ impl BackendCtxInterfaceInitialised for V8Backend {
                     RedisValue::BulkString("not_active".to_string()),
                     RedisValue::Integer(not_active),
                     RedisValue::BulkString("combined_memory_limit".to_string()),
-                    RedisValue::Integer(calc_isolates_used_memory() as i64),
+                    RedisValue::Integer(refresh_isolates_used_memory() as i64),
                 ]))
             }
             "isolates_strong_count" => {
@@ -1031,20 +1536,43 @@ impl BackendCtxInterfaceInitialised for V8Backend {
                     "combined_memory_limit".to_owned(),
                     calc_isolates_used_memory().to_string(),
                 );
+                data.insert(
+                    "shared_isolates".to_owned(),
+                    SHARED_ISOLATES
+                        .lock()
+                        .unwrap()
+                        .iter()
+                        .filter(|v| v.isolate.strong_count() > 0)
+                        .count()
+                        .to_string(),
+                );
 
                 {
                     let l = self.script_ctx_vec.lock().unwrap();
-                    let (total_heap_size, used_heap_size) = l
+                    // shared isolates heap sizes should only be counted once.
+                    let mut shared_isolates = HashSet::new();
+                    let (total_heap_size, used_heap_size, idle_gc_count, idle_gc_time_us) = l
                         .iter()
                         .filter_map(|v| v.upgrade())
-                        .fold((0, 0), |mut acc, v| {
-                            acc.0 += v.isolate.total_heap_size();
-                            acc.1 += v.isolate.used_heap_size();
+                        .fold((0, 0, 0, 0), |mut acc, v| {
+                            if !v.isolate.is_shared()
+                                || shared_isolates.insert(Arc::as_ptr(&v.isolate))
+                            {
+                                acc.0 += v.isolate.total_heap_size();
+                                acc.1 += v.isolate.used_heap_size();
+                            }
+                            acc.2 += v.gc_stats.count();
+                            acc.3 += v.gc_stats.total_time_us();
                             acc
                         });
 
                     data.insert("total_heap_size".to_owned(), total_heap_size.to_string());
                     data.insert("used_heap_size".to_owned(), used_heap_size.to_string());
+                    data.insert("idle_gc_count".to_owned(), idle_gc_count.to_string());
+                    data.insert(
+                        "idle_gc_time_holding_gil_us".to_owned(),
+                        idle_gc_time_us.to_string(),
+                    );
                 }
 
                 data
@@ -8,9 +8,9 @@ use redis_module::redisvalue::RedisValueKey;
 use redis_module::{RedisError, RedisResult, RedisValue};
 use redisgears_plugin_api::redisgears_plugin_api::GearsApiError;
 use redisgears_plugin_api::redisgears_plugin_api::{
-    function_ctx::FunctionCtxInterface, run_function_ctx::BackgroundRunFunctionCtxInterface,
-    run_function_ctx::ReplyCtxInterface, run_function_ctx::RunFunctionCtxInterface,
-    FunctionCallResult,
+    function_ctx::FunctionBatchScope, function_ctx::FunctionCtxInterface,
+    run_function_ctx::BackgroundRunFunctionCtxInterface, run_function_ctx::ReplyCtxInterface,
+    run_function_ctx::RunFunctionCtxInterface, FunctionCallResult,
 };
 
 use v8_rs::v8::v8_array::V8LocalArray;
@@ -20,12 +20,14 @@ use v8_rs::v8::{
 };
 
 use crate::v8_native_functions::{get_backgrounnd_client, RedisClient};
-use crate::v8_script_ctx::{GilStatus, V8ScriptCtx};
+use crate::v8_script_ctx::{GilStatus, V8LibraryIsolateScope, V8ScriptCtx};
+use crate::v8_strings_cache::{V8CachedString, V8StringsCache};
 use crate::{get_exception_msg, v8_backend::bypass_memory_limit};
 
 use std::cell::RefCell;
 use std::collections::{HashMap, HashSet};
-use std::sync::Arc;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, Weak};
 
 use std::str;
 
@@ -59,6 +61,7 @@ fn v8_value_to_call_result(
     nesting_level: usize,
     isolate_scope: &V8IsolateScope,
     ctx_scope: &V8ContextScope,
+    strings_cache: &V8StringsCache,
     val: V8LocalValue,
 ) -> RedisResult {
     if nesting_level > 100 {
@@ -75,7 +78,7 @@ fn v8_value_to_call_result(
         let obj_reply = val.as_object();
         let reply_type = obj_reply.get(
             ctx_scope,
-            &isolate_scope.new_string("__reply_type").to_value(),
+            &strings_cache.get(isolate_scope, V8CachedString::ReplyType),
         );
         if let Some(t) = reply_type {
             if let Some(reply_type_v8_str) = t.to_utf8() {
@@ -85,7 +88,10 @@ fn v8_value_to_call_result(
                     ));
                 } else if reply_type_v8_str.as_str() == "verbatim" {
                     let format = obj_reply
-                        .get_str_field(ctx_scope, "__format")
+                        .get(
+                            ctx_scope,
+                            &strings_cache.get(isolate_scope, V8CachedString::Format),
+                        )
                         .and_then(|v| v.to_utf8());
                     return Ok(RedisValue::VerbatimString((
                         format
@@ -118,7 +124,15 @@ fn v8_value_to_call_result(
         let arr = val.as_array();
         let res: Result<Vec<RedisValue>, RedisError> = arr
             .iter(ctx_scope)
-            .map(|v| v8_value_to_call_result(nesting_level + 1, isolate_scope, ctx_scope, v))
+            .map(|v| {
+                v8_value_to_call_result(
+                    nesting_level + 1,
+                    isolate_scope,
+                    ctx_scope,
+                    strings_cache,
+                    v,
+                )
+            })
             .collect();
         RedisValue::Array(res?)
     } else if val.is_object() {
@@ -130,7 +144,13 @@ fn v8_value_to_call_result(
                 let obj = res.get(ctx_scope, &key).unwrap();
                 Ok((
                     v8_value_to_redis_value_key(key)?,
-                    v8_value_to_call_result(nesting_level + 1, isolate_scope, ctx_scope, obj)?,
+                    v8_value_to_call_result(
+                        nesting_level + 1,
+                        isolate_scope,
+                        ctx_scope,
+                        strings_cache,
+                        obj,
+                    )?,
                 ))
             })
             .collect();
@@ -143,10 +163,16 @@ fn v8_value_to_call_result(
 fn send_reply(
     isolate_scope: &V8IsolateScope,
     ctx_scope: &V8ContextScope,
+    script_ctx: &Weak<V8ScriptCtx>,
     client: &dyn ReplyCtxInterface,
     val: V8LocalValue,
 ) {
-    let reply = v8_value_to_call_result(0, isolate_scope, ctx_scope, val);
+    let reply = match script_ctx.upgrade() {
+        Some(script_ctx) => {
+            v8_value_to_call_result(0, isolate_scope, ctx_scope, &script_ctx.strings_cache, val)
+        }
+        None => Err(RedisError::Str("Library was already deleted")),
+    };
     client.send_reply(reply);
 }
 
@@ -207,6 +233,7 @@ impl V8InternalFunction {
         match res {
             Some(r) => {
                 if r.is_promise() {
+                    let script_ctx = Arc::downgrade(&self.script_ctx);
                     return self
                         .script_ctx
                         .handle_promise(&isolate_scope, &ctx_scope, &r.as_promise(), move |res| {
@@ -218,6 +245,7 @@ impl V8InternalFunction {
                                     send_reply(
                                         v.isolate_scope,
                                         v.ctx_scope,
+                                        &script_ctx,
                                         bg_client.as_ref(),
                                         v.res,
                                     );
@@ -226,7 +254,13 @@ impl V8InternalFunction {
                         })
                         .map_or(FunctionCallResult::Hold, |_| FunctionCallResult::Done);
                 } else {
-                    send_reply(&isolate_scope, &ctx_scope, bg_client.as_ref(), r);
+                    send_reply(
+                        &isolate_scope,
+                        &ctx_scope,
+                        &Arc::downgrade(&self.script_ctx),
+                        bg_client.as_ref(),
+                        r,
+                    );
                 }
             }
             None => {
@@ -288,6 +322,7 @@ impl V8InternalFunction {
             Some(r) => {
                 if r.is_promise() {
                     let promise = r.as_promise();
+                    let script_ctx = Arc::downgrade(&self.script_ctx);
                     return self
                         .script_ctx
                         .promise_rejected_or_fulfilled(
@@ -301,6 +336,7 @@ impl V8InternalFunction {
                                         send_reply(
                                             v.isolate_scope,
                                             v.ctx_scope,
+                                            &Arc::downgrade(&self.script_ctx),
                                             run_ctx.as_client(),
                                             v.res,
                                         )
@@ -329,6 +365,7 @@ impl V8InternalFunction {
                                                     send_reply(
                                                         v.isolate_scope,
                                                         v.ctx_scope,
+                                                        &script_ctx,
                                                         bc.as_ref(),
                                                         v.res,
                                                     )
@@ -341,7 +378,13 @@ impl V8InternalFunction {
                             )
                         });
                 } else {
-                    send_reply(&isolate_scope, &ctx_scope, run_ctx.as_client(), r);
+                    send_reply(
+                        &isolate_scope,
+                        &ctx_scope,
+                        &Arc::downgrade(&self.script_ctx),
+                        run_ctx.as_client(),
+                        r,
+                    );
                 }
             }
             None => {
@@ -353,11 +396,39 @@ impl V8InternalFunction {
     }
 }
 
+/// The copies of an async function that were registered by the library
+/// isolate replicas. The function invocations are distributed in a round
+/// robin manner between the function and its replicas.
+#[derive(Default)]
+pub(crate) struct V8FunctionReplicas {
+    functions: Mutex<Vec<Arc<V8InternalFunction>>>,
+    next: AtomicUsize,
+}
+
+impl V8FunctionReplicas {
+    /// Adds the function, registered by an isolate replica, as a replica.
+    pub(crate) fn add(&self, function: V8Function) {
+        self.functions.lock().unwrap().push(function.inner_function);
+    }
+
+    /// Returns the replica that should run the next invocation,
+    /// [`None`] means that the invocation should run on the primary function.
+    fn next(&self) -> Option<Arc<V8InternalFunction>> {
+        let functions = self.functions.lock().unwrap();
+        if functions.is_empty() {
+            return None;
+        }
+        let index = self.next.fetch_add(1, Ordering::Relaxed) % (functions.len() + 1);
+        index.checked_sub(1).map(|i| Arc::clone(&functions[i]))
+    }
+}
+
 pub struct V8Function {
     inner_function: Arc<V8InternalFunction>,
     client: Arc<RefCell<RedisClient>>,
     is_async: bool,
     decode_arguments: bool,
+    replicas: Arc<V8FunctionReplicas>,
 }
 
 impl V8Function {
@@ -380,11 +451,39 @@ impl V8Function {
             client: Arc::clone(client),
             is_async,
             decode_arguments,
+            replicas: Arc::new(V8FunctionReplicas::default()),
         }
     }
+
+    pub(crate) fn is_async(&self) -> bool {
+        self.is_async
+    }
+
+    pub(crate) fn get_replicas(&self) -> Arc<V8FunctionReplicas> {
+        Arc::clone(&self.replicas)
+    }
+}
+
+/// Keeps the function isolate entered for a batch of invocations. Each
+/// invocation still enters the isolate, which is cheap when the isolate
+/// is already locked by the current thread.
+struct V8FunctionBatchScope<'isolate> {
+    _isolate_scope: V8LibraryIsolateScope<'isolate>,
 }
 
+impl<'isolate> FunctionBatchScope for V8FunctionBatchScope<'isolate> {}
+
 impl FunctionCtxInterface for V8Function {
+    fn enter_batch(&self) -> Option<Box<dyn FunctionBatchScope + '_>> {
+        if self.is_async {
+            // async invocations run on the background.
+            return None;
+        }
+        Some(Box::new(V8FunctionBatchScope {
+            _isolate_scope: self.inner_function.script_ctx.isolate.enter(),
+        }))
+    }
+
     fn call(&self, run_ctx: &dyn RunFunctionCtxInterface) -> FunctionCallResult {
         if bypass_memory_limit() {
             run_ctx.send_reply(Err(RedisError::Str(
@@ -404,7 +503,10 @@ impl FunctionCtxInterface for V8Function {
                     return FunctionCallResult::Done;
                 }
             };
-            let inner_function = Arc::clone(&self.inner_function);
+            let inner_function = self
+                .replicas
+                .next()
+                .unwrap_or_else(|| Arc::clone(&self.inner_function));
             // if we are going to the background we must consume all the arguments
             let args = run_ctx
                 .get_args_iter()
@@ -412,8 +514,9 @@ impl FunctionCtxInterface for V8Function {
                 .collect::<Vec<_>>();
             let bg_redis_client = run_ctx.get_redis_client().get_background_redis_client();
             let decode_arguments = self.decode_arguments;
-            self.inner_function
-                .script_ctx
+            // each isolate has its own background jobs queue.
+            let script_ctx = Arc::clone(&inner_function.script_ctx);
+            script_ctx
                 .compiled_library_api
                 .run_on_background(Box::new(move || {
                     inner_function.call_async(args, bg_client, bg_redis_client, decode_arguments);
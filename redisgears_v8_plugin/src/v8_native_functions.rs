@@ -10,26 +10,31 @@ use redisgears_plugin_api::redisgears_plugin_api::prologue::{self, ApiVersion};
 use redisgears_plugin_api::redisgears_plugin_api::run_function_ctx::PromiseReply;
 use redisgears_plugin_api::redisgears_plugin_api::{
     load_library_ctx::LoadLibraryCtxInterface, load_library_ctx::RegisteredKeys,
-    run_function_ctx::BackgroundRunFunctionCtxInterface, run_function_ctx::RedisClientCtxInterface,
-    run_function_ctx::RemoteFunctionData, GearsApiError, RefCellWrapper,
+    run_function_ctx::BackgroundRunFunctionCtxInterface, run_function_ctx::KeysScanOptions,
+    run_function_ctx::RedisClientCtxInterface, run_function_ctx::RemoteFunctionData,
+    run_function_ctx::RemoteFunctionKey, GearsApiError, RefCellWrapper,
 };
 
 use v8_rs::v8::v8_array::V8LocalArray;
 use v8_rs::v8::{
     isolate_scope::V8IsolateScope, v8_array_buffer::V8LocalArrayBuffer,
     v8_context_scope::V8ContextScope, v8_native_function_template::V8LocalNativeFunctionArgsIter,
-    v8_object::V8LocalObject, v8_utf8::V8LocalUtf8, v8_value::V8LocalValue, v8_version,
+    v8_object::V8LocalObject, v8_utf8::V8LocalUtf8, v8_value::V8LocalValue,
+    v8_value::V8PersistValue, v8_version,
 };
 
 use v8_derive::{new_native_function, NativeFunctionArgument};
 
 use crate::v8_redisai::{get_redisai_api, get_redisai_client};
 
-use crate::v8_backend::log_warning;
+use crate::v8_backend::{log_warning, remote_functions_structured_encoding};
 use crate::v8_function_ctx::V8Function;
+use crate::v8_native_reducers::NativeReducer;
 use crate::v8_notifications_ctx::V8NotificationsCtx;
 use crate::v8_script_ctx::{GilStatus, V8ScriptCtx};
 use crate::v8_stream_ctx::V8StreamCtx;
+use crate::v8_strings_cache::{V8CachedString, V8StringsCache};
+use crate::v8_value_serializer::{deserialize_value, serialize_value, SerializeError};
 use crate::{
     get_exception_msg, get_exception_v8_value, get_function_flags_from_strings,
     get_function_flags_globals,
@@ -37,7 +42,8 @@ use crate::{
 
 use std::cell::RefCell;
 use std::ptr::NonNull;
-use std::sync::{Arc, Weak};
+use std::sync::{Arc, Mutex, Weak};
+use std::time::Duration;
 
 const REGISTER_NOTIFICATIONS_CONSUMER: &str = "registerKeySpaceTrigger";
 const FUNCTION_FLAGS_GLOBAL_NAME: &str = "functionFlags";
@@ -52,6 +58,9 @@ const REDIS_GLOBAL_NAME: &str = "redis";
 const BLOCK_GLOBAL_NAME: &str = "block";
 const RUN_ON_KEY_GLOBAL_NAME: &str = "runOnKey";
 const RUN_ON_SHARDS_GLOBAL_NAME: &str = "runOnShards";
+const RUN_ON_KEYS_GLOBAL_NAME: &str = "runOnKeys";
+const SCAN_GLOBAL_NAME: &str = "scan";
+const REDUCE_ON_SHARDS_GLOBAL_NAME: &str = "reduceOnShards";
 const CALL_GLOBAL_NAME: &str = "call";
 const CALL_RAW_GLOBAL_NAME: &str = "callRaw";
 const CALL_ASYNC_GLOBAL_NAME: &str = "callAsync";
@@ -62,6 +71,7 @@ const EXECUTE_ASYNC_GLOBAL_NAME: &str = "executeAsync";
 pub(crate) fn call_result_to_js_object<'isolate_scope, 'isolate>(
     isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
     ctx_scope: &V8ContextScope,
+    strings_cache: &V8StringsCache,
     res: CallResult,
     decode_responses: bool,
 ) -> Result<V8LocalValue<'isolate_scope, 'isolate>, String> {
@@ -100,13 +110,13 @@ pub(crate) fn call_result_to_js_object<'isolate_scope, 'isolate>(
             let obj = val.as_object();
             obj.set(
                 ctx_scope,
-                &isolate_scope.new_string("__reply_type").to_value(),
-                &isolate_scope.new_string("verbatim").to_value(),
+                &strings_cache.get(isolate_scope, V8CachedString::ReplyType),
+                &strings_cache.get(isolate_scope, V8CachedString::Verbatim),
             );
             obj.set(
                 ctx_scope,
-                &isolate_scope.new_string("__format").to_value(),
-                &isolate_scope.new_string(format).to_value(),
+                &strings_cache.get(isolate_scope, V8CachedString::Format),
+                &strings_cache.get_recurring(isolate_scope, format),
             );
             obj.to_value()
         }
@@ -117,8 +127,8 @@ pub(crate) fn call_result_to_js_object<'isolate_scope, 'isolate>(
             let s = isolate_scope.new_string(&s).to_string_object();
             s.set(
                 ctx_scope,
-                &isolate_scope.new_string("__reply_type").to_value(),
-                &isolate_scope.new_string("big_number").to_value(),
+                &strings_cache.get(isolate_scope, V8CachedString::ReplyType),
+                &strings_cache.get(isolate_scope, V8CachedString::BigNumber),
             );
             s.to_value()
         }
@@ -128,6 +138,7 @@ pub(crate) fn call_result_to_js_object<'isolate_scope, 'isolate>(
                 agg.push(call_result_to_js_object(
                     isolate_scope,
                     ctx_scope,
+                    strings_cache,
                     v,
                     decode_responses,
                 )?);
@@ -143,7 +154,13 @@ pub(crate) fn call_result_to_js_object<'isolate_scope, 'isolate>(
                 let agg = agg?;
                 agg.add(
                     ctx_scope,
-                    &call_result_to_js_object(isolate_scope, ctx_scope, v, decode_responses)?,
+                    &call_result_to_js_object(
+                        isolate_scope,
+                        ctx_scope,
+                        strings_cache,
+                        v,
+                        decode_responses,
+                    )?,
                 );
                 Ok(agg)
             })?
@@ -163,10 +180,11 @@ pub(crate) fn call_result_to_js_object<'isolate_scope, 'isolate>(
                         let agg = agg?;
                         agg.set(
                             ctx_scope,
-                            &isolate_scope.new_string(&key).to_value(),
+                            &strings_cache.get_recurring(isolate_scope, &key),
                             &call_result_to_js_object(
                                 isolate_scope,
                                 ctx_scope,
+                                strings_cache,
                                 v,
                                 decode_responses,
                             )?,
@@ -181,6 +199,7 @@ pub(crate) fn call_result_to_js_object<'isolate_scope, 'isolate>(
                             &call_result_to_js_object(
                                 isolate_scope,
                                 ctx_scope,
+                                strings_cache,
                                 v,
                                 decode_responses,
                             )?,
@@ -233,27 +252,278 @@ impl RedisClient {
     }
 }
 
-fn js_value_to_remote_function_data(
-    ctx_scope: &V8ContextScope,
-    val: V8LocalValue,
-) -> Option<RemoteFunctionData> {
+fn js_value_to_remote_function_data<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    val: V8LocalValue<'isolate_scope, 'isolate>,
+) -> Result<RemoteFunctionData, String> {
     if val.is_array_buffer() {
         let array_buff = val.as_array_buffer();
         let data = array_buff.data();
-        Some(RemoteFunctionData::Binary(data.to_vec()))
-    } else {
-        let arg_str = ctx_scope.json_stringify(&val);
+        return Ok(RemoteFunctionData::Binary(data.to_vec()));
+    }
+    if remote_functions_structured_encoding() {
+        match serialize_value(ctx_scope, &val) {
+            Ok(data) => return Ok(RemoteFunctionData::Structured(data)),
+            Err(SerializeError::Unsupported(msg)) => return Err(msg),
+            // the value can not be represented by the binary encoding, fallback to JSON.
+            Err(SerializeError::NotRepresentable) => (),
+        }
+    }
+    // JSON.stringify fails on BigInt values and on values such as Symbols
+    // or functions that have no JSON representation.
+    let arg_str = ctx_scope
+        .json_stringify(&val)
+        .ok_or("the value can not be serialized as JSON (BigInt, Symbol, ...)")?;
+    let arg_str_utf8 = arg_str.to_value().to_utf8().unwrap();
+    Ok(RemoteFunctionData::String(
+        arg_str_utf8.as_str().to_string(),
+    ))
+}
+
+fn remote_function_data_to_js_value<'isolate_scope, 'isolate>(
+    isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    data: &RemoteFunctionData,
+) -> Option<V8LocalValue<'isolate_scope, 'isolate>> {
+    match data {
+        RemoteFunctionData::Binary(b) => Some(isolate_scope.new_array_buffer(b).to_value()),
+        RemoteFunctionData::Structured(b) => deserialize_value(isolate_scope, ctx_scope, b),
+        RemoteFunctionData::String(s) => {
+            let v8_str = isolate_scope.new_string(s);
+            ctx_scope.new_object_from_json(&v8_str)
+        }
+    }
+}
 
-        // if None return None
-        arg_str.as_ref()?;
+/// How to reduce the results of `reduceOnShards`.
+enum ShardsReducer {
+    /// Reduce the results without entering V8.
+    Native(NativeReducer),
+    /// Reduce the results using a JS function.
+    Js {
+        reducer: V8PersistValue,
+        /// The accumulated value, the first result if no initial value was given.
+        acc: Option<V8PersistValue>,
+    },
+}
 
-        let arg_str_utf8 = arg_str.unwrap().to_value().to_utf8().unwrap();
-        Some(RemoteFunctionData::String(
-            arg_str_utf8.as_str().to_string(),
-        ))
+impl ShardsReducer {
+    /// Forget the persisted JS values, used when the script context is gone
+    /// and the values can not be freed.
+    fn forget(&mut self) {
+        if let ShardsReducer::Js { reducer, acc } = self {
+            reducer.forget();
+            if let Some(v) = acc.as_mut() {
+                v.forget();
+            }
+        }
     }
 }
 
+/// The state of a `reduceOnShards` invocation. Each shard result is reduced
+/// as soon as it arrives and then freed, so only the accumulated value is
+/// kept. A native reducer combines the result on the thread that received
+/// it, a JS reducer on the library background queue (one result at a time).
+struct ShardsReduction {
+    /// Taken once the promise is settled.
+    reducer: Option<ShardsReducer>,
+    /// Taken once the promise is settled.
+    resolver: Option<V8PersistValue>,
+    errors: Vec<GearsApiError>,
+    allow_partial_results: bool,
+}
+
+impl ShardsReduction {
+    /// Forget the persisted JS values, see [`ShardsReducer::forget`].
+    fn forget(&mut self) {
+        if let Some(r) = self.resolver.as_mut() {
+            r.forget();
+        }
+        if let Some(r) = self.reducer.as_mut() {
+            r.forget();
+        }
+    }
+
+    /// Add a shard error, returns `true` if the promise should be rejected
+    /// right away without waiting for the other shards.
+    fn add_error(&mut self, error: GearsApiError) -> bool {
+        self.errors.push(error);
+        !self.allow_partial_results && self.errors.len() == 1
+    }
+
+    /// Combine a shard result into a native reduction, returns `true` if the
+    /// promise should be rejected right away.
+    fn add_native_result(&mut self, result: Result<RemoteFunctionData, GearsApiError>) -> bool {
+        if self.resolver.is_none() {
+            return false;
+        }
+        let res = match (result, self.reducer.as_mut()) {
+            (Ok(data), Some(ShardsReducer::Native(reducer))) => {
+                reducer.add(&data).map_err(GearsApiError::new)
+            }
+            (Ok(_), _) => Ok(()),
+            (Err(e), _) => Err(e),
+        };
+        match res {
+            Ok(()) => false,
+            Err(e) => self.add_error(e),
+        }
+    }
+
+    /// Combine a shard result into a JS reduction.
+    fn add_js_result<'isolate_scope, 'isolate>(
+        &mut self,
+        script_ctx: &V8ScriptCtx,
+        isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+        ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+        result: Result<RemoteFunctionData, GearsApiError>,
+    ) {
+        if self.resolver.is_none() {
+            return;
+        }
+        let val = result.and_then(|data| {
+            remote_function_data_to_js_value(isolate_scope, ctx_scope, &data).ok_or_else(|| {
+                GearsApiError::new(format!(
+                    "Failed deserializing remote function result '{}'",
+                    String::from_utf8_lossy(data.as_bytes())
+                ))
+            })
+        });
+        let val = match val {
+            Ok(v) => v,
+            Err(e) => {
+                if self.add_error(e) {
+                    self.settle(script_ctx, isolate_scope, ctx_scope);
+                }
+                return;
+            }
+        };
+        let (reducer, acc) = match self.reducer.as_mut() {
+            Some(ShardsReducer::Js { reducer, acc }) => (reducer, acc),
+            _ => return,
+        };
+        let acc_val = match acc.take() {
+            None => {
+                *acc = Some(val.persist());
+                return;
+            }
+            Some(v) => v.take_local(isolate_scope),
+        };
+        let trycatch = isolate_scope.new_try_catch();
+        let reducer = reducer.as_local(isolate_scope);
+        match script_ctx.call(
+            &reducer,
+            ctx_scope,
+            Some(&[&acc_val, &val]),
+            GilStatus::Unlocked,
+        ) {
+            Some(v) => *acc = Some(v.persist()),
+            None => {
+                let error = get_exception_v8_value(&script_ctx.isolate, isolate_scope, trycatch);
+                self.reducer = None;
+                if let Some(resolver) = self.resolver.take() {
+                    let resolver = resolver.take_local(isolate_scope).as_resolver();
+                    script_ctx.reject(&resolver, ctx_scope, &error);
+                }
+            }
+        }
+    }
+
+    /// Settle the promise with the reduced value and the errors, or reject it
+    /// with the first error if partial results are not allowed.
+    fn settle<'isolate_scope, 'isolate>(
+        &mut self,
+        script_ctx: &V8ScriptCtx,
+        isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+        ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    ) {
+        let resolver = match self.resolver.take() {
+            Some(r) => r.take_local(isolate_scope).as_resolver(),
+            None => return,
+        };
+        let reducer = self.reducer.take();
+        if !self.allow_partial_results && !self.errors.is_empty() {
+            script_ctx.reject(
+                &resolver,
+                ctx_scope,
+                &isolate_scope
+                    .new_string(self.errors[0].get_msg())
+                    .to_value(),
+            );
+            return;
+        }
+        let res = match reducer {
+            Some(ShardsReducer::Native(reducer)) => reducer.to_js_value(isolate_scope),
+            Some(ShardsReducer::Js { acc, .. }) => acc
+                .map(|v| v.take_local(isolate_scope))
+                .unwrap_or_else(|| isolate_scope.new_null()),
+            None => isolate_scope.new_null(),
+        };
+        let errors: Vec<V8LocalValue> = self
+            .errors
+            .drain(..)
+            .map(|e| isolate_scope.new_string(e.get_msg()).to_value())
+            .collect();
+        let errors_array = isolate_scope
+            .new_array(&errors.iter().collect::<Vec<&V8LocalValue>>())
+            .to_value();
+        script_ctx.resolve(
+            &resolver,
+            ctx_scope,
+            &isolate_scope.new_array(&[&res, &errors_array]).to_value(),
+        );
+    }
+}
+
+/// Run a `reduceOnShards` step on the library background queue: reduce the
+/// given shard result with the JS reducer, or settle the promise if no
+/// result is given.
+fn run_reduction_step(
+    script_ctx_weak_ref: &Weak<V8ScriptCtx>,
+    reduction: &Arc<Mutex<ShardsReduction>>,
+    result: Option<Result<RemoteFunctionData, GearsApiError>>,
+) {
+    let script_ctx = match script_ctx_weak_ref.upgrade() {
+        Some(s) => s,
+        None => {
+            reduction.lock().unwrap().forget();
+            log_warning("Library was delete while not all the remote jobs were done");
+            return;
+        }
+    };
+    let script_ctx_weak_ref = Weak::clone(script_ctx_weak_ref);
+    let reduction = Arc::clone(reduction);
+    script_ctx
+        .compiled_library_api
+        .run_on_background(Box::new(move || {
+            let mut reduction = reduction.lock().unwrap();
+            let script_ctx = match script_ctx_weak_ref.upgrade() {
+                Some(s) => s,
+                None => {
+                    reduction.forget();
+                    log_warning("Library was delete while not all the remote jobs were done");
+                    return;
+                }
+            };
+            let isolate_scope = script_ctx.isolate.enter();
+            let ctx_scope = script_ctx.context.enter(&isolate_scope);
+            match result {
+                Some(r) => reduction.add_js_result(&script_ctx, &isolate_scope, &ctx_scope, r),
+                None => reduction.settle(&script_ctx, &isolate_scope, &ctx_scope),
+            }
+        }));
+}
+
+#[allow(non_snake_case)]
+#[derive(NativeFunctionArgument)]
+struct ScanOptionalArgs {
+    pattern: Option<String>,
+    keyType: Option<String>,
+    count: Option<i64>,
+    timeBudget: Option<i64>,
+    withValues: Option<bool>,
+}
+
 pub(crate) fn get_backgrounnd_client<'isolate_scope, 'isolate>(
     script_ctx: &Arc<V8ScriptCtx>,
     isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
@@ -320,7 +590,7 @@ pub(crate) fn get_backgrounnd_client<'isolate_scope, 'isolate>(
         remote_function_name: V8LocalUtf8,
         args: Vec<V8LocalValue>,
     | {
-        let args_vec:Vec<RemoteFunctionData> = args.into_iter().map(|v| js_value_to_remote_function_data(ctx_scope, v).ok_or("Failed serializing arguments")).collect::<Result<_,_>>()?;
+        let args_vec:Vec<RemoteFunctionData> = args.into_iter().map(|v| js_value_to_remote_function_data(ctx_scope, v).map_err(|e| format!("Failed serializing arguments, {e}"))).collect::<Result<_,_>>()?;
 
         let _ = script_ctx_weak_ref.upgrade().ok_or("Function were unregistered")?;
 
@@ -354,16 +624,11 @@ pub(crate) fn get_backgrounnd_client<'isolate_scope, 'isolate>(
                 let resolver = resolver.take_local(&isolate_scope).as_resolver();
                 match result {
                     Ok(r) => {
-                        let v = match &r {
-                            RemoteFunctionData::Binary(b) => isolate_scope.new_array_buffer(b).to_value(),
-                            RemoteFunctionData::String(s) => {
-                                let v8_str = isolate_scope.new_string(s);
-                                let v8_obj = ctx_scope.new_object_from_json(&v8_str);
-                                if v8_obj.is_none() {
-                                    script_ctx.reject(&resolver, &ctx_scope, &isolate_scope.new_string("Failed deserializing remote function result").to_value());
-                                    return;
-                                }
-                                v8_obj.unwrap()
+                        let v = match remote_function_data_to_js_value(&isolate_scope, &ctx_scope, &r) {
+                            Some(v) => v,
+                            None => {
+                                script_ctx.reject(&resolver, &ctx_scope, &isolate_scope.new_string("Failed deserializing remote function result").to_value());
+                                return;
                             }
                         };
                         script_ctx.resolve(&resolver, &ctx_scope, &v);
@@ -385,7 +650,7 @@ pub(crate) fn get_backgrounnd_client<'isolate_scope, 'isolate>(
         remote_function_name: V8LocalUtf8,
         args: Vec<V8LocalValue>,
     | {
-        let args_vec:Vec<RemoteFunctionData> = args.into_iter().map(|v| js_value_to_remote_function_data(ctx_scope, v).ok_or("Failed serializing arguments")).collect::<Result<_,_>>()?;
+        let args_vec:Vec<RemoteFunctionData> = args.into_iter().map(|v| js_value_to_remote_function_data(ctx_scope, v).map_err(|e| format!("Failed serializing arguments, {e}"))).collect::<Result<_,_>>()?;
 
         let _ = match script_ctx_weak_ref.upgrade() {
             Some(s) => s,
@@ -422,18 +687,12 @@ pub(crate) fn get_backgrounnd_client<'isolate_scope, 'isolate>(
                 let ctx_scope = script_ctx.context.enter(&isolate_scope);
 
                 let resolver = resolver.take_local(&isolate_scope).as_resolver();
-                let results: Vec<V8LocalValue> = results.into_iter().map(|v| {
-                    match v {
-                        RemoteFunctionData::Binary(b) => isolate_scope.new_array_buffer(&b).to_value(),
-                        RemoteFunctionData::String(s) => {
-                            let v8_str = isolate_scope.new_string(&s);
-                            let v8_obj = ctx_scope.new_object_from_json(&v8_str);
-                            if v8_obj.is_none() {
-                                errors.push(GearsApiError::new(format!("Failed deserializing remote function result '{}'", s)));
-                            }
-                            v8_obj.unwrap()
-                        }
+                let results: Vec<V8LocalValue> = results.into_iter().filter_map(|v| {
+                    let res = remote_function_data_to_js_value(&isolate_scope, &ctx_scope, &v);
+                    if res.is_none() {
+                        errors.push(GearsApiError::new(format!("Failed deserializing remote function result '{}'", String::from_utf8_lossy(v.as_bytes()))));
                     }
+                    res
                 }).collect();
                 let errors: Vec<V8LocalValue> = errors.into_iter().map(|e| isolate_scope.new_string(e.get_msg()).to_value()).collect();
                 let results_array = isolate_scope.new_array(&results.iter().collect::<Vec<&V8LocalValue>>()).to_value();
@@ -445,6 +704,282 @@ pub(crate) fn get_backgrounnd_client<'isolate_scope, 'isolate>(
         Ok(Some(promise.to_value()))
     }));
 
+    let redis_background_client_ref = Arc::clone(&redis_background_client);
+    let script_ctx_weak_ref = Arc::downgrade(script_ctx);
+    bg_client.set_native_function(
+        ctx_scope,
+        REDUCE_ON_SHARDS_GLOBAL_NAME,
+        new_native_function!(move |_isolate,
+                                   ctx_scope,
+                                   remote_function_name: V8LocalUtf8,
+                                   options: V8LocalValue,
+                                   args: Vec<V8LocalValue>| {
+            if !options.is_object() {
+                return Err("Second argument must be an object".to_string());
+            }
+            let options = options.as_object();
+            let reducer = options
+                .get_str_field(ctx_scope, "reducer")
+                .filter(|v| !v.is_undefined())
+                .ok_or("Reducer was not given")?;
+            let reducer = if reducer.is_function() {
+                let acc = options
+                    .get_str_field(ctx_scope, "initialValue")
+                    .filter(|v| !v.is_undefined())
+                    .map(|v| v.persist());
+                ShardsReducer::Js {
+                    reducer: reducer.persist(),
+                    acc,
+                }
+            } else if reducer.is_string() {
+                let reducer_name = reducer
+                    .to_utf8()
+                    .ok_or("Failed converting reducer name to string")?;
+                let reducer = if reducer_name.as_str() == "topk" {
+                    let k = options
+                        .get_str_field(ctx_scope, "k")
+                        .filter(|v| v.is_long() && v.get_long() > 0)
+                        .ok_or("The 'topk' reducer requires a positive integer 'k' option")?;
+                    NativeReducer::top_k(k.get_long() as usize)
+                } else {
+                    NativeReducer::from_name(reducer_name.as_str()).ok_or_else(|| {
+                        format!("Unknown native reducer '{}'", reducer_name.as_str())
+                    })?
+                };
+                ShardsReducer::Native(reducer)
+            } else {
+                return Err("Reducer must be a function or a native reducer name".to_string());
+            };
+            let allow_partial_results = options
+                .get_str_field(ctx_scope, "allowPartialResults")
+                .filter(|v| v.is_boolean())
+                .map_or(true, |v| v.get_boolean());
+
+            let args_vec: Vec<RemoteFunctionData> = args
+                .into_iter()
+                .map(|v| {
+                    js_value_to_remote_function_data(ctx_scope, v)
+                        .map_err(|e| format!("Failed serializing arguments, {e}"))
+                })
+                .collect::<Result<_, _>>()?;
+
+            let _ = script_ctx_weak_ref
+                .upgrade()
+                .ok_or("Function were unregistered")?;
+
+            let resolver = ctx_scope.new_resolver();
+            let promise = resolver.get_promise();
+            let is_native = matches!(reducer, ShardsReducer::Native(_));
+            let reduction = Arc::new(Mutex::new(ShardsReduction {
+                reducer: Some(reducer),
+                resolver: Some(resolver.to_value().persist()),
+                errors: Vec::new(),
+                allow_partial_results,
+            }));
+            let on_shard_done = {
+                let reduction = Arc::clone(&reduction);
+                let script_ctx_weak_ref = Weak::clone(&script_ctx_weak_ref);
+                move |result: Result<RemoteFunctionData, GearsApiError>| {
+                    if !is_native {
+                        run_reduction_step(&script_ctx_weak_ref, &reduction, Some(result));
+                        return;
+                    }
+                    // Native reducers do not need to enter V8, the result is combined
+                    // right away and freed.
+                    let reject_now = reduction.lock().unwrap().add_native_result(result);
+                    if reject_now {
+                        run_reduction_step(&script_ctx_weak_ref, &reduction, None);
+                    }
+                }
+            };
+            let script_ctx_weak_ref = Weak::clone(&script_ctx_weak_ref);
+            redis_background_client_ref.run_on_all_shards_incremental(
+                remote_function_name.as_str(),
+                args_vec,
+                Box::new(on_shard_done),
+                Box::new(move || {
+                    run_reduction_step(&script_ctx_weak_ref, &reduction, None);
+                }),
+            );
+            Ok(Some(promise.to_value()))
+        }),
+    );
+
+    let redis_background_client_ref = Arc::clone(&redis_background_client);
+    let script_ctx_weak_ref = Arc::downgrade(script_ctx);
+    bg_client.set_native_function(ctx_scope, RUN_ON_KEYS_GLOBAL_NAME, new_native_function!(move |
+        _isolate,
+        ctx_scope,
+        keys: V8LocalValue,
+        remote_function_name: V8LocalUtf8,
+        args: Vec<V8LocalValue>,
+    | {
+        if !keys.is_array() {
+            return Err("Keys argument must be an array");
+        }
+        let keys_vec: Vec<RemoteFunctionKey> = keys.as_array().iter(ctx_scope).map(|k| {
+            let name = if k.is_array_buffer() {
+                k.as_array_buffer().data().to_vec()
+            } else if k.is_string() || k.is_string_object() {
+                k.to_utf8().ok_or("Failed converting key to string")?.as_str().as_bytes().to_vec()
+            } else {
+                return Err("Keys must be strings or ArrayBuffers");
+            };
+            let arg = js_value_to_remote_function_data(ctx_scope, k).map_err(|e| format!("Failed serializing keys, {e}"))?;
+            Ok(RemoteFunctionKey { name, arg })
+        }).collect::<Result<_, &'static str>>()?;
+        let args_vec:Vec<RemoteFunctionData> = args.into_iter().map(|v| js_value_to_remote_function_data(ctx_scope, v).map_err(|e| format!("Failed serializing arguments, {e}"))).collect::<Result<_,_>>()?;
+
+        let _ = script_ctx_weak_ref.upgrade().ok_or("Function were unregistered")?;
+
+        let resolver = ctx_scope.new_resolver();
+        let promise = resolver.get_promise();
+        let mut resolver = resolver.to_value().persist();
+        let script_ctx_weak_ref = Weak::clone(&script_ctx_weak_ref);
+        redis_background_client_ref.run_on_keys(keys_vec, remote_function_name.as_str(), args_vec, Box::new(move |results|{
+            let script_ctx = match script_ctx_weak_ref.upgrade() {
+                Some(s) => s,
+                None => {
+                    resolver.forget();
+                    log_warning("Library was delete while not all the remote jobs were done");
+                    return;
+                }
+            };
+
+            script_ctx.compiled_library_api.run_on_background(Box::new(move||{
+                let script_ctx = match script_ctx_weak_ref.upgrade() {
+                    Some(s) => s,
+                    None => {
+                        resolver.forget();
+                        log_warning("Library was delete while not all the remote jobs were done");
+                        return;
+                    }
+                };
+
+                let isolate_scope = script_ctx.isolate.enter();
+                let ctx_scope = script_ctx.context.enter(&isolate_scope);
+
+                let resolver = resolver.take_local(&isolate_scope).as_resolver();
+                // results and errors are ordered the same as the keys, with null
+                // on the places that does not apply.
+                let (results, errors): (Vec<V8LocalValue>, Vec<V8LocalValue>) = results.into_iter().map(|r| {
+                    match r.and_then(|v| remote_function_data_to_js_value(&isolate_scope, &ctx_scope, &v).ok_or_else(|| GearsApiError::new("Failed deserializing remote function result"))) {
+                        Ok(v) => (v, isolate_scope.new_null()),
+                        Err(e) => (isolate_scope.new_null(), isolate_scope.new_string(e.get_msg()).to_value()),
+                    }
+                }).unzip();
+                let results_array = isolate_scope.new_array(&results.iter().collect::<Vec<&V8LocalValue>>()).to_value();
+                let errors_array = isolate_scope.new_array(&errors.iter().collect::<Vec<&V8LocalValue>>()).to_value();
+
+                script_ctx.resolve(&resolver, &ctx_scope, &isolate_scope.new_array(&[&results_array, &errors_array]).to_value());
+            }));
+        }));
+        Ok(Some(promise.to_value()))
+    }));
+
+    let redis_background_client_ref = Arc::clone(&redis_background_client);
+    let script_ctx_weak_ref = Arc::downgrade(script_ctx);
+    bg_client.set_native_function(ctx_scope, SCAN_GLOBAL_NAME, new_native_function!(move |
+        isolate_scope,
+        ctx_scope,
+        f: V8LocalValue,
+        optional_args: Option<ScanOptionalArgs>,
+    | {
+        if !f.is_function() {
+            return Err("First argument to 'scan' must be a function".to_owned());
+        }
+
+        let is_already_blocked = ctx_scope.get_private_data::<bool, _>(0);
+        if is_already_blocked.is_some() && *is_already_blocked.unwrap() {
+            return Err("Can not scan while Redis is locked, 'scan' locks Redis for each batch by itself".to_owned());
+        }
+
+        let count = optional_args.as_ref().and_then(|v| v.count).unwrap_or(100);
+        if count < 1 {
+            return Err("count argument must be a positive number".to_owned());
+        }
+        let time_budget = optional_args.as_ref().and_then(|v| v.timeBudget);
+        if time_budget.map_or(false, |v| v < 1) {
+            return Err("timeBudget argument must be a positive number".to_owned());
+        }
+        let options = KeysScanOptions {
+            pattern: optional_args.as_ref().and_then(|v| v.pattern.as_ref()).map(|v| v.as_bytes().to_vec()),
+            key_type: optional_args.as_ref().and_then(|v| v.keyType.clone()),
+            count: count as usize,
+            time_budget: time_budget.map(|v| Duration::from_millis(v as u64)),
+            with_values: optional_args.as_ref().and_then(|v| v.withValues).unwrap_or(false),
+        };
+
+        let script_ctx = script_ctx_weak_ref.upgrade().ok_or_else(|| "Function were unregistered".to_owned())?;
+        let strings_cache = &script_ctx.strings_cache;
+
+        let mut scan = redis_background_client_ref.scan(options);
+        let mut scanned = 0;
+        loop {
+            let batch = {
+                // Redis is locked (and released) by the scan itself, release the
+                // isolate while waiting for it.
+                let _unlocker = isolate_scope.new_unlocker();
+                scan.next_batch()
+            };
+            let batch = match batch {
+                Ok(Some(b)) => b,
+                Ok(None) => break,
+                Err(e) => return Err(format!("Failed scanning the key space, {}", e.get_msg())),
+            };
+            if batch.is_empty() {
+                continue;
+            }
+            scanned += batch.len();
+            let keys = batch.into_iter().map(|k| {
+                let key = isolate_scope.new_object();
+                key.set(
+                    ctx_scope,
+                    &strings_cache.get(isolate_scope, V8CachedString::Key),
+                    &std::str::from_utf8(&k.name).map_or(isolate_scope.new_null(), |v| {
+                        isolate_scope.new_string(v).to_value()
+                    }),
+                );
+                key.set(
+                    ctx_scope,
+                    &strings_cache.get(isolate_scope, V8CachedString::KeyRaw),
+                    &isolate_scope.new_array_buffer(&k.name).to_value(),
+                );
+                key.set(
+                    ctx_scope,
+                    &strings_cache.get(isolate_scope, V8CachedString::Type),
+                    &strings_cache.get_recurring(isolate_scope, k.key_type),
+                );
+                if let Some(value) = k.value {
+                    let value = call_result_to_js_object(isolate_scope, ctx_scope, strings_cache, value, true)?;
+                    key.set(
+                        ctx_scope,
+                        &strings_cache.get(isolate_scope, V8CachedString::Value),
+                        &value,
+                    );
+                }
+                Ok(key.to_value())
+            }).collect::<Result<Vec<V8LocalValue>, String>>()?;
+            let keys = isolate_scope.new_array(&keys.iter().collect::<Vec<&V8LocalValue>>()).to_value();
+
+            let trycatch = isolate_scope.new_try_catch();
+            match script_ctx.call(&f, ctx_scope, Some(&[&keys]), GilStatus::Unlocked) {
+                Some(res) => {
+                    // Returning false from the callback stops the scan.
+                    if res.is_boolean() && !res.get_boolean() {
+                        break;
+                    }
+                }
+                None => {
+                    let exception = get_exception_v8_value(&script_ctx.isolate, isolate_scope, trycatch);
+                    isolate_scope.raise_exception(exception);
+                    return Ok(None);
+                }
+            }
+        }
+        Ok(Some(isolate_scope.new_long(scanned as i64)))
+    }));
+
     bg_client
 }
 
@@ -567,6 +1102,7 @@ fn add_call_function(
                         let res = call_result_to_js_object(
                             &isolate_scope,
                             &ctx_scope,
+                            &script_ctx_ref.strings_cache,
                             res,
                             decode_response,
                         );
@@ -611,9 +1147,11 @@ fn add_call_function(
                             .collect::<Vec<&[u8]>>(),
                     );
 
+                    let script_ctx_ref = script_ctx_weak.upgrade().ok_or_else(|| "Library was already deleted".to_owned())?;
                     Ok(Some(call_result_to_js_object(
                         isolate_scope,
                         ctx_scope,
+                        &script_ctx_ref.strings_cache,
                         res,
                         decode_response,
                     )?))
@@ -1113,6 +1651,29 @@ fn add_register_function_api(
                     !function_flags.contains(FunctionFlags::RAW_ARGUMENTS),
                 );
 
+                if let Some(primary) = script_ctx_ref.primary.as_ref() {
+                    // An isolate replica, the registration is done by the primary
+                    // isolate. Only attach the async functions so their invocations
+                    // could also run on this isolate.
+                    if let Some(replicas) = primary.upgrade().and_then(|v| {
+                        v.functions_replicas
+                            .lock()
+                            .unwrap()
+                            .get(function_name_utf8.as_str())
+                            .cloned()
+                    }) {
+                        replicas.add(f);
+                    }
+                    return Ok(None);
+                }
+                if f.is_async() {
+                    script_ctx_ref
+                        .functions_replicas
+                        .lock()
+                        .unwrap()
+                        .insert(function_name_utf8.as_str().to_owned(), f.get_replicas());
+                }
+
                 let res = if is_async {
                     load_ctx.register_async_function(
                         function_name_utf8.as_str(),
@@ -1143,6 +1704,7 @@ struct StreamTriggerOptionalArgs {
     description: Option<String>,
     window: Option<i64>,
     isStreamTrimmed: Option<bool>,
+    partitionKey: Option<String>,
 }
 
 fn add_stream_trigger_api(
@@ -1173,15 +1735,19 @@ fn add_stream_trigger_api(
             return Err("window argument must be a positive number".into());
         }
         let trim = optional_args.as_ref().map_or(false, |v| v.isStreamTrimmed.as_ref().map_or(false, |v| *v));
+        let partition_key = optional_args.as_ref().and_then(|v| v.partitionKey.clone());
+        if partition_key.as_ref().map_or(false, |v| v.is_empty()) {
+            return Err("partitionKey argument must be a non empty string".into());
+        }
         let description = optional_args.and_then(|v| v.description);
 
         let v8_stream_ctx = V8StreamCtx::new(persisted_function, &script_ctx_ref, function_callback.is_async_function());
         let res = if prefix.is_string() {
             let prefix = prefix.to_utf8().unwrap();
-            load_ctx.register_stream_consumer(registration_name_utf8.as_str(), prefix.as_str().as_bytes(), Box::new(v8_stream_ctx), window as usize, trim, description)
+            load_ctx.register_stream_consumer(registration_name_utf8.as_str(), prefix.as_str().as_bytes(), Box::new(v8_stream_ctx), window as usize, trim, description, partition_key.as_deref().map(str::as_bytes))
         } else if prefix.is_array_buffer() {
             let prefix = prefix.as_array_buffer();
-            load_ctx.register_stream_consumer(registration_name_utf8.as_str(), prefix.data(), Box::new(v8_stream_ctx), window as usize, trim, description)
+            load_ctx.register_stream_consumer(registration_name_utf8.as_str(), prefix.data(), Box::new(v8_stream_ctx), window as usize, trim, description, partition_key.as_deref().map(str::as_bytes))
         } else {
             return Err(format!("Second argument to '{REGISTER_STREAM_TRIGGER_GLOBAL_NAME}' must be a String or ArrayBuffer representing the prefix"));
         };
@@ -1353,18 +1919,13 @@ pub(crate) fn initialize_globals_1_0(
                 let mut args = Vec::new();
                 args.push(get_backgrounnd_client(&script_ctx, &isolate_scope, &ctx_scope, Arc::new(background_ctx)).to_value());
                 for input in inputs {
-                    args.push(match input {
-                        RemoteFunctionData::Binary(b) => isolate_scope.new_array_buffer(&b).to_value(),
-                        RemoteFunctionData::String(s) => {
-                            let v8_str = isolate_scope.new_string(&s);
-                            let v8_obj = ctx_scope.new_object_from_json(&v8_str);
-                            if v8_obj.is_none() {
-                                on_done(Err(GearsApiError::new("Failed deserializing remote function argument".to_string())));
-                                return;
-                            }
-                            v8_obj.unwrap()
+                    match remote_function_data_to_js_value(&isolate_scope, &ctx_scope, &input) {
+                        Some(v) => args.push(v),
+                        None => {
+                            on_done(Err(GearsApiError::new("Failed deserializing remote function argument".to_string())));
+                            return;
                         }
-                    });
+                    }
                 }
                 let args_refs = args.iter().collect::<Vec<&V8LocalValue>>();
 
@@ -1376,13 +1937,12 @@ pub(crate) fn initialize_globals_1_0(
                             script_ctx.handle_promise(&isolate_scope, &ctx_scope, &r.as_promise(), move |res| {
                                 match res {
                                     Ok(v) => {
-                                        let trycatch = v.isolate_scope.new_try_catch();
+                                        // catch the exceptions raised while serializing the result.
+                                        let _trycatch = v.isolate_scope.new_try_catch();
                                         let r = js_value_to_remote_function_data(v.ctx_scope, v.res);
-                                        if let Some(v) = r {
-                                            on_done(Ok(v));
-                                        } else {
-                                            let error_utf8 = trycatch.get_exception().to_utf8().unwrap();
-                                            on_done(Err(GearsApiError::new(format!("Failed serializing result, {}.", error_utf8.as_str()))));
+                                        match r {
+                                            Ok(v) => on_done(Ok(v)),
+                                            Err(e) => on_done(Err(GearsApiError::new(format!("Failed serializing result, {e}.")))),
                                         }
                                     }
                                     Err(e) => on_done(Err(e)),
@@ -1390,10 +1950,9 @@ pub(crate) fn initialize_globals_1_0(
                             });
                         } else {
                             let r = js_value_to_remote_function_data(&ctx_scope, r);
-                            if let Some(v) = r {
-                                on_done(Ok(v));
-                            } else {
-                                on_done(Err(GearsApiError::new("Failed serializing result".to_string())));
+                            match r {
+                                Ok(v) => on_done(Ok(v)),
+                                Err(e) => on_done(Err(GearsApiError::new(format!("Failed serializing result, {e}")))),
                             }
                         }
                     }
@@ -0,0 +1,294 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+//! Native reducers for the results of remote functions. A native reducer
+//! combines the shards results without entering V8, so only the final
+//! value is converted into a JS value.
+
+use redisgears_plugin_api::redisgears_plugin_api::run_function_ctx::RemoteFunctionData;
+
+use v8_rs::v8::{isolate_scope::V8IsolateScope, v8_value::V8LocalValue};
+
+use crate::v8_value_serializer::{array_len, deserialize_scalars, ScalarValue};
+
+use std::collections::HashSet;
+
+#[derive(Clone, Copy)]
+pub(crate) enum Number {
+    Integer(i64),
+    Double(f64),
+}
+
+impl Number {
+    fn as_f64(self) -> f64 {
+        match self {
+            Number::Integer(v) => v as f64,
+            Number::Double(v) => v,
+        }
+    }
+
+    fn add(self, other: Number) -> Number {
+        match (self, other) {
+            (Number::Integer(a), Number::Integer(b)) => a
+                .checked_add(b)
+                .map_or_else(|| Number::Double(a as f64 + b as f64), Number::Integer),
+            (a, b) => Number::Double(a.as_f64() + b.as_f64()),
+        }
+    }
+
+    fn is_less_than(self, other: Number) -> bool {
+        match (self, other) {
+            (Number::Integer(a), Number::Integer(b)) => a < b,
+            (a, b) => a.as_f64() < b.as_f64(),
+        }
+    }
+
+    fn to_js_value<'isolate_scope, 'isolate>(
+        self,
+        isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+    ) -> V8LocalValue<'isolate_scope, 'isolate> {
+        match self {
+            Number::Integer(v) => isolate_scope.new_long(v),
+            Number::Double(v) => isolate_scope.new_double(v),
+        }
+    }
+}
+
+/// The state of a native reduction.
+pub(crate) enum NativeReducer {
+    /// Sum of all the numbers.
+    Sum(Number),
+    /// The total amount of values, an array counts as the number of its
+    /// elements and any other value counts as one.
+    Count(i64),
+    /// The minimal number.
+    Min(Option<Number>),
+    /// The maximal number.
+    Max(Option<Number>),
+    /// The distinct values, ordered by first appearance.
+    Union(Vec<ScalarValue>, HashSet<String>),
+    /// The `k` largest numbers, ordered from the largest. At most `k`
+    /// numbers are kept regardless of the amount of results.
+    TopK(usize, Vec<Number>),
+}
+
+fn to_scalars(data: &RemoteFunctionData) -> Option<Vec<ScalarValue>> {
+    match data {
+        RemoteFunctionData::Structured(b) => deserialize_scalars(b),
+        RemoteFunctionData::String(s) => {
+            let to_scalar = |v: &serde_json::Value| match v {
+                serde_json::Value::Number(n) => n
+                    .as_i64()
+                    .map(ScalarValue::Integer)
+                    .or_else(|| n.as_f64().map(ScalarValue::Double)),
+                serde_json::Value::String(s) => Some(ScalarValue::String(s.clone())),
+                _ => None,
+            };
+            match serde_json::from_str(s).ok()? {
+                serde_json::Value::Array(arr) => arr.iter().map(to_scalar).collect(),
+                v => Some(vec![to_scalar(&v)?]),
+            }
+        }
+        RemoteFunctionData::Binary(_) => None,
+    }
+}
+
+/// The number of values the given result counts as, an array counts as
+/// the number of its elements and any other value counts as one.
+fn count_values(data: &RemoteFunctionData) -> usize {
+    match data {
+        RemoteFunctionData::Structured(b) => array_len(b).unwrap_or(1),
+        RemoteFunctionData::String(s) => match serde_json::from_str(s) {
+            Ok(serde_json::Value::Array(arr)) => arr.len(),
+            _ => 1,
+        },
+        RemoteFunctionData::Binary(_) => 1,
+    }
+}
+
+fn to_number(val: &ScalarValue) -> Option<Number> {
+    match val {
+        ScalarValue::Integer(v) => Some(Number::Integer(*v)),
+        ScalarValue::Double(v) => Some(Number::Double(*v)),
+        ScalarValue::String(_) => None,
+    }
+}
+
+impl NativeReducer {
+    /// Create a native reducer by its name, return [`None`] if no such reducer.
+    pub(crate) fn from_name(name: &str) -> Option<NativeReducer> {
+        Some(match name {
+            "sum" => NativeReducer::Sum(Number::Integer(0)),
+            "count" => NativeReducer::Count(0),
+            "min" => NativeReducer::Min(None),
+            "max" => NativeReducer::Max(None),
+            "union" => NativeReducer::Union(Vec::new(), HashSet::new()),
+            _ => return None,
+        })
+    }
+
+    /// Create a reducer that keeps the `k` largest numbers.
+    pub(crate) fn top_k(k: usize) -> NativeReducer {
+        NativeReducer::TopK(k, Vec::with_capacity(k))
+    }
+
+    fn name(&self) -> &'static str {
+        match self {
+            NativeReducer::Sum(_) => "sum",
+            NativeReducer::Count(_) => "count",
+            NativeReducer::Min(_) => "min",
+            NativeReducer::Max(_) => "max",
+            NativeReducer::Union(..) => "union",
+            NativeReducer::TopK(..) => "topk",
+        }
+    }
+
+    /// Combine the given remote function result into the reduction.
+    pub(crate) fn add(&mut self, data: &RemoteFunctionData) -> Result<(), String> {
+        if let NativeReducer::Count(count) = self {
+            *count += count_values(data) as i64;
+            return Ok(());
+        }
+        let name = self.name();
+        let values = to_scalars(data).ok_or_else(|| {
+            format!("Native reducer '{name}' only accepts numbers, strings or arrays of them")
+        })?;
+        if let NativeReducer::Union(values_list, seen) = self {
+            for v in values {
+                let key = match &v {
+                    ScalarValue::String(s) => format!("s{s}"),
+                    // integers and doubles that represent the same number are the same value.
+                    v => format!("n{}", to_number(v).unwrap().as_f64()),
+                };
+                if seen.insert(key) {
+                    values_list.push(v);
+                }
+            }
+            return Ok(());
+        }
+        for v in values.iter() {
+            let n = to_number(v)
+                .ok_or_else(|| format!("Native reducer '{name}' only accepts numbers"))?;
+            match self {
+                NativeReducer::Sum(sum) => *sum = sum.add(n),
+                NativeReducer::Min(min) => {
+                    if min.map_or(true, |m| n.is_less_than(m)) {
+                        *min = Some(n);
+                    }
+                }
+                NativeReducer::Max(max) => {
+                    if max.map_or(true, |m| m.is_less_than(n)) {
+                        *max = Some(n);
+                    }
+                }
+                NativeReducer::TopK(k, top) => {
+                    let index = top.partition_point(|v| !v.is_less_than(n));
+                    if index < *k {
+                        top.insert(index, n);
+                        top.truncate(*k);
+                    }
+                }
+                NativeReducer::Count(_) | NativeReducer::Union(..) => unreachable!(),
+            }
+        }
+        Ok(())
+    }
+
+    /// Convert the reduction result into a JS value.
+    pub(crate) fn to_js_value<'isolate_scope, 'isolate>(
+        &self,
+        isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+    ) -> V8LocalValue<'isolate_scope, 'isolate> {
+        match self {
+            NativeReducer::Sum(v) => v.to_js_value(isolate_scope),
+            NativeReducer::Count(v) => isolate_scope.new_long(*v),
+            NativeReducer::Min(v) | NativeReducer::Max(v) => v.map_or_else(
+                || isolate_scope.new_null(),
+                |v| v.to_js_value(isolate_scope),
+            ),
+            NativeReducer::Union(values, _) => {
+                let values: Vec<V8LocalValue> = values
+                    .iter()
+                    .map(|v| match v {
+                        ScalarValue::Integer(v) => isolate_scope.new_long(*v),
+                        ScalarValue::Double(v) => isolate_scope.new_double(*v),
+                        ScalarValue::String(v) => isolate_scope.new_string(v).to_value(),
+                    })
+                    .collect();
+                isolate_scope
+                    .new_array(&values.iter().collect::<Vec<&V8LocalValue>>())
+                    .to_value()
+            }
+            NativeReducer::TopK(_, top) => {
+                let values: Vec<V8LocalValue> =
+                    top.iter().map(|v| v.to_js_value(isolate_scope)).collect();
+                isolate_scope
+                    .new_array(&values.iter().collect::<Vec<&V8LocalValue>>())
+                    .to_value()
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_sum_overflow_fallback_to_double() {
+        let mut reducer = NativeReducer::from_name("sum").unwrap();
+        reducer
+            .add(&RemoteFunctionData::String(i64::MAX.to_string()))
+            .unwrap();
+        reducer
+            .add(&RemoteFunctionData::String("[1, 2]".to_string()))
+            .unwrap();
+        match reducer {
+            NativeReducer::Sum(Number::Double(v)) => assert_eq!(v, i64::MAX as f64 + 3.0),
+            _ => panic!("sum should have overflowed into a double"),
+        }
+    }
+
+    #[test]
+    fn test_union_and_count() {
+        let mut union = NativeReducer::from_name("union").unwrap();
+        let mut count = NativeReducer::from_name("count").unwrap();
+        for data in ["[\"a\", 1]", "[1.0, \"b\", \"a\"]"] {
+            let data = RemoteFunctionData::String(data.to_string());
+            union.add(&data).unwrap();
+            count.add(&data).unwrap();
+        }
+        match union {
+            NativeReducer::Union(values, _) => assert_eq!(
+                values,
+                vec![
+                    ScalarValue::String("a".to_string()),
+                    ScalarValue::Integer(1),
+                    ScalarValue::String("b".to_string()),
+                ]
+            ),
+            _ => unreachable!(),
+        }
+        assert!(matches!(count, NativeReducer::Count(5)));
+    }
+
+    #[test]
+    fn test_top_k() {
+        let mut top_k = NativeReducer::top_k(3);
+        for data in ["[5, 1, 7]", "2", "[9.5, 7, 3]"] {
+            top_k
+                .add(&RemoteFunctionData::String(data.to_string()))
+                .unwrap();
+        }
+        match top_k {
+            NativeReducer::TopK(_, top) => assert_eq!(
+                top.iter().map(|v| v.as_f64()).collect::<Vec<f64>>(),
+                vec![9.5, 7.0, 7.0]
+            ),
+            _ => unreachable!(),
+        }
+    }
+}
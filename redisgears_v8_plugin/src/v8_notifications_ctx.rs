@@ -16,6 +16,7 @@ use v8_rs::v8::v8_value::V8PersistValue;
 
 use crate::v8_native_functions::{get_backgrounnd_client, get_redis_client, RedisClient};
 use crate::v8_script_ctx::{GilStatus, V8ScriptCtx};
+use crate::v8_strings_cache::V8CachedString;
 use crate::{get_exception_msg, v8_backend::bypass_memory_limit};
 
 use std::cell::RefCell;
@@ -212,16 +213,17 @@ impl KeysNotificationsConsumerCtxInterface for V8NotificationsCtx {
             let ctx_scope = self.internal.script_ctx.context.enter(&isolate_scope);
             let try_catch = isolate_scope.new_try_catch();
 
+            let strings_cache = &self.internal.script_ctx.strings_cache;
             let notification_data = isolate_scope.new_object();
             notification_data.set(
                 &ctx_scope,
-                &isolate_scope.new_string("event").to_value(),
-                &isolate_scope.new_string(event).to_value(),
+                &strings_cache.get(&isolate_scope, V8CachedString::Event),
+                &strings_cache.get_recurring(&isolate_scope, event),
             );
 
             notification_data.set(
                 &ctx_scope,
-                &isolate_scope.new_string("key").to_value(),
+                &strings_cache.get(&isolate_scope, V8CachedString::Key),
                 &std::str::from_utf8(key).map_or(isolate_scope.new_null(), |v| {
                     isolate_scope.new_string(v).to_value()
                 }),
@@ -229,7 +231,7 @@ impl KeysNotificationsConsumerCtxInterface for V8NotificationsCtx {
 
             notification_data.set(
                 &ctx_scope,
-                &isolate_scope.new_string("key_raw").to_value(),
+                &strings_cache.get(&isolate_scope, V8CachedString::KeyRaw),
                 &isolate_scope.new_array_buffer(key).to_value(),
             );
             let val = notification_data.to_value();
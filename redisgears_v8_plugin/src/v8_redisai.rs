@@ -5,21 +5,47 @@
  */
 
 use crate::v8_script_ctx::V8ScriptCtx;
+use std::ops::Range;
 use std::sync::{Arc, Mutex, Weak};
+use std::time::Duration;
 
 use v8_rs::v8::{
     isolate_scope::V8IsolateScope, v8_array::V8LocalArray, v8_array_buffer::V8LocalArrayBuffer,
     v8_context_scope::V8ContextScope, v8_object::V8LocalObject,
     v8_object_template::V8PersistedObjectTemplate, v8_utf8::V8LocalUtf8, v8_value::V8LocalValue,
+    v8_value::V8PersistValue,
 };
 
 use crate::v8_native_functions::RedisClient;
 
 use std::cell::RefCell;
+use std::collections::hash_map::Entry;
+use std::collections::HashMap;
 
-use redisgears_plugin_api::redisgears_plugin_api::redisai_interface::AITensorInterface;
+use redisgears_plugin_api::redisgears_plugin_api::redisai_interface::{
+    AIModelInterface, AITensorInterface,
+};
+use redisgears_plugin_api::redisgears_plugin_api::GearsApiError;
+
+use v8_derive::{new_native_function, NativeFunctionArgument};
+
+/// The default amount of time (in ms) a batched model run waits for
+/// other runs to join its batch.
+const DEFAULT_BATCH_TIMEOUT_MS: i64 = 1;
+
+/// Optional arguments of `get_model_runner`. When `batch_size` is given, the
+/// run is batched together with concurrent runs of the same model, up to
+/// `batch_size` rows (the inputs first dimension) or until `batch_timeout`
+/// (in ms) has passed.
+#[derive(NativeFunctionArgument)]
+struct ModelRunnerOptionalArgs {
+    batch_size: Option<i64>,
+    batch_timeout: Option<i64>,
+}
 
-use v8_derive::new_native_function;
+/// The internal fields of a JS tensor object.
+const TENSOR_INTERNAL_FIELD: usize = 0;
+const TENSOR_INTERNAL_FIELDS_COUNT: usize = 1;
 
 // Silenced due to actually having a need to return a reference to a
 // boxed trait object, as we store boxed trait objects. We could store
@@ -29,10 +55,10 @@ use v8_derive::new_native_function;
 pub(crate) fn get_tensor_from_js_tensor<'isolate_scope>(
     js_tensor: &'isolate_scope V8LocalObject<'isolate_scope, '_>,
 ) -> Result<&'isolate_scope Box<dyn AITensorInterface>, String> {
-    if js_tensor.get_internal_field_count() != 1 {
+    if js_tensor.get_internal_field_count() != TENSOR_INTERNAL_FIELDS_COUNT {
         return Err("Data is not a tensor".into());
     }
-    let external_data = js_tensor.get_internal_field(0);
+    let external_data = js_tensor.get_internal_field(TENSOR_INTERNAL_FIELD);
     if !external_data.is_external() {
         return Err("Data is not a tensor".into());
     }
@@ -51,7 +77,7 @@ pub(crate) fn get_js_tensor_from_tensor<'isolate, 'isolate_scope>(
         .tensor_object_template
         .to_local(isolate_scope)
         .new_instance(ctx_scope);
-    tensor_obj.set_internal_field(0, &tensor_external.to_value());
+    tensor_obj.set_internal_field(TENSOR_INTERNAL_FIELD, &tensor_external.to_value());
     tensor_obj
 }
 
@@ -62,9 +88,10 @@ pub(crate) fn get_tensor_object_template(
 
     obj_template.add_native_function("get_data", move |args, isolate_scope, _ctx_scope| {
         let curr_self = args.get_self();
+        // Each call returns a new copy of the data, the returned buffer is
+        // mutable and must not be shared between the callers.
         let tensor = get_tensor_from_js_tensor(&curr_self).ok()?;
-        let data = tensor.get_data();
-        Some(isolate_scope.new_array_buffer(data).to_value())
+        Some(isolate_scope.new_array_buffer(tensor.get_data()).to_value())
     });
 
     obj_template.add_native_function("dims", move |args, isolate_scope, _ctx_scope| {
@@ -89,10 +116,64 @@ pub(crate) fn get_tensor_object_template(
         Some(isolate_scope.new_long(element_size as i64))
     });
 
-    obj_template.set_internal_field_count(1);
+    obj_template.set_internal_field_count(TENSOR_INTERNAL_FIELDS_COUNT);
     obj_template.persist()
 }
 
+/// Returns `true` if the given value is an `ArrayBufferView` (a typed array
+/// or a `DataView`), as checked by `ArrayBuffer.isView`.
+fn is_array_buffer_view<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    data: &V8LocalValue<'isolate_scope, 'isolate>,
+) -> bool {
+    ctx_scope
+        .get_globals()
+        .get_str_field(ctx_scope, "ArrayBuffer")
+        .filter(|v| v.is_function())
+        .and_then(|v| v.as_object().get_str_field(ctx_scope, "isView"))
+        .filter(|v| v.is_function())
+        .and_then(|is_view| is_view.call(ctx_scope, Some(&[data])))
+        .map_or(false, |v| v.is_boolean() && v.get_boolean())
+}
+
+/// Returns the `ArrayBuffer` that holds the tensor data and the range of the
+/// data inside it. The data can be given as an `ArrayBuffer` or as a view on
+/// an `ArrayBuffer` (a typed array or a `DataView`). In the latter case only
+/// the viewed range is used, so the caller does not need to copy it into a
+/// new `ArrayBuffer` first.
+fn get_tensor_data_range<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    data: &V8LocalValue<'isolate_scope, 'isolate>,
+) -> Result<(V8LocalArrayBuffer<'isolate_scope, 'isolate>, Range<usize>), String> {
+    if data.is_array_buffer() {
+        let buffer = data.as_array_buffer();
+        let len = buffer.data().len();
+        return Ok((buffer, 0..len));
+    }
+    let err = || "Tensor data must be an ArrayBuffer or a view on an ArrayBuffer".to_string();
+    if !data.is_object() || !is_array_buffer_view(ctx_scope, data) {
+        return Err(err());
+    }
+    let view = data.as_object();
+    let buffer = view
+        .get_str_field(ctx_scope, "buffer")
+        .filter(|v| v.is_array_buffer())
+        .ok_or_else(err)?
+        .as_array_buffer();
+    let get_offset = |name| {
+        view.get_str_field(ctx_scope, name)
+            .filter(|v| v.is_long() && v.get_long() >= 0)
+            .map(|v| v.get_long() as usize)
+            .ok_or_else(err)
+    };
+    let offset = get_offset("byteOffset")?;
+    let len = get_offset("byteLength")?;
+    if offset + len > buffer.data().len() {
+        return Err(err());
+    }
+    Ok((buffer, offset..offset + len))
+}
+
 pub(crate) fn get_redisai_api<'isolate, 'isolate_scope>(
     script_ctx: &Arc<V8ScriptCtx>,
     isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
@@ -108,7 +189,7 @@ pub(crate) fn get_redisai_api<'isolate, 'isolate_scope>(
                                    ctx_scope,
                                    data_type_utf8: V8LocalUtf8,
                                    dims: V8LocalArray,
-                                   data: V8LocalArrayBuffer| {
+                                   data: V8LocalValue| {
             let mut dims_vec = Vec::new();
             for i in 0..dims.len() {
                 let val = dims.get(ctx_scope, i);
@@ -121,9 +202,10 @@ pub(crate) fn get_redisai_api<'isolate, 'isolate_scope>(
             let s = script_ctx_ref
                 .upgrade()
                 .ok_or("On redisai_create_tensor, use of invalid script ctx.".to_string())?;
+            let (buffer, range) = get_tensor_data_range(ctx_scope, &data)?;
             let tensor = s
                 .compiled_library_api
-                .redisai_create_tensor(data_type_utf8.as_str(), &dims_vec, data.data())
+                .redisai_create_tensor(data_type_utf8.as_str(), &dims_vec, &buffer.data()[range])
                 .map_err(|e| e.get_msg().to_string())?;
             let tensor_obj = get_js_tensor_from_tensor(&s, isolate_scope, ctx_scope, tensor);
             Ok(Some(tensor_obj.to_value()))
@@ -133,6 +215,90 @@ pub(crate) fn get_redisai_api<'isolate, 'isolate_scope>(
     redis_ai.to_value()
 }
 
+/// Returns a RedisAI run `on_done` callback that resolves the given persisted
+/// resolver with the output tensors (or rejects it on error).
+fn redisai_run_on_done(
+    script_ctx_ref: Weak<V8ScriptCtx>,
+    mut persisted_resolver: V8PersistValue,
+) -> Box<dyn FnOnce(Result<Vec<Box<dyn AITensorInterface + Send>>, GearsApiError>)> {
+    Box::new(move |res| {
+        let script_ctx_upgraded = match script_ctx_ref.upgrade() {
+            Some(s) => s,
+            None => {
+                persisted_resolver.forget();
+                crate::v8_backend::log_warning(
+                    "Use of invalid function context on redisai on_done",
+                );
+                return;
+            }
+        };
+
+        script_ctx_upgraded
+            .compiled_library_api
+            .run_on_background(Box::new(move || {
+                let script_ctx_ref = match script_ctx_ref.upgrade() {
+                    Some(s) => s,
+                    None => {
+                        persisted_resolver.forget();
+                        crate::v8_backend::log_warning(
+                            "Use of invalid function context on redisai on_done",
+                        );
+                        return;
+                    }
+                };
+                let isolate_scope = script_ctx_ref.isolate.enter();
+                let ctx_scope = script_ctx_ref.context.enter(&isolate_scope);
+                let resolver = persisted_resolver.take_local(&isolate_scope).as_resolver();
+
+                match res {
+                    Ok(res) => {
+                        let values = res
+                            .into_iter()
+                            .map(|v| {
+                                get_js_tensor_from_tensor(
+                                    &script_ctx_ref,
+                                    &isolate_scope,
+                                    &ctx_scope,
+                                    v,
+                                )
+                                .to_value()
+                            })
+                            .collect::<Vec<V8LocalValue>>();
+                        let res_js = isolate_scope
+                            .new_array(&values.iter().collect::<Vec<&V8LocalValue>>())
+                            .to_value();
+                        script_ctx_ref.resolve(&resolver, &ctx_scope, &res_js);
+                    }
+                    Err(e) => {
+                        script_ctx_ref.reject(
+                            &resolver,
+                            &ctx_scope,
+                            &isolate_scope.new_string(e.get_msg()).to_value(),
+                        );
+                    }
+                }
+            }));
+    })
+}
+
+/// Converts a JS array of tensor names into a list of strings.
+fn get_tensor_names(
+    ctx_scope: &V8ContextScope,
+    names: &V8LocalArray,
+) -> Result<Vec<String>, String> {
+    (0..names.len())
+        .map(|i| {
+            let name = names.get(ctx_scope, i);
+            if !name.is_string() {
+                return Err("Tensor names must be strings".to_string());
+            }
+            name.to_utf8()
+                .map(|v| v.as_str().to_string())
+                .ok_or_else(|| "Failed converting tensor name to string".to_string())
+        })
+        .collect()
+}
+
 pub(crate) fn get_redisai_client<'isolate, 'isolate_scope>(
     script_ctx: &Arc<V8ScriptCtx>,
     isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
@@ -143,181 +309,378 @@ pub(crate) fn get_redisai_client<'isolate, 'isolate_scope>(
 
     let script_ctx_ref = Arc::downgrade(script_ctx);
     let redis_client_ref = Arc::clone(redis_client);
-    redis_ai_client.set_native_function(ctx_scope, "open_model", new_native_function!(move |isolate_scope, ctx_scope, name_utf8: V8LocalUtf8| {
-        let client = redis_client_ref.borrow();
-        let client = client.get().ok_or_else(|| "Used on invalid client".to_owned())?;
-
-        let model = match client.open_ai_model(name_utf8.as_str()) {
-            Ok(model) => model,
-            Err(e) => {
-                isolate_scope.raise_exception_str(e.get_msg());
-                return Err(e.get_msg().to_string());
-            }
-        };
-
-        let model_object = isolate_scope.new_object();
-        let script_ctx_ref = Weak::clone(&script_ctx_ref);
-        model_object.set_native_function(ctx_scope, "get_model_runner", new_native_function!(move |isolate_scope, ctx_scope| {
-            let model_runner = Arc::new(Mutex::new(model.get_model_runner()));
-            let model_runner_clone = Arc::clone(&model_runner);
-            let model_runner_object = isolate_scope.new_object();
-            model_runner_object.set_native_function(ctx_scope, "add_input", new_native_function!(move |_isolate_scope, _ctx_scope, input_name_utf8: V8LocalUtf8, tensor_js: V8LocalObject| {
-                let tensor = get_tensor_from_js_tensor(&tensor_js)?;
-
-                let mut model_runner = model_runner_clone.lock().unwrap();
-                let res = model_runner.as_mut().add_input(input_name_utf8.as_str(), tensor.as_ref());
-                if let Err(e) = res {
-                    return Err(e.get_msg().to_string());
-                }
-                Ok(None)
-            }));
-
-            let model_runner_clone = Arc::clone(&model_runner);
-            model_runner_object.set_native_function(ctx_scope, "add_output", new_native_function!(move |_isolate_scope, _ctx_scope, output_name_utf8: V8LocalUtf8| {
-                let mut model_runner = model_runner_clone.lock().unwrap();
-                let res = model_runner.as_mut().add_output(output_name_utf8.as_str());
-                if let Err(e) = res {
+    redis_ai_client.set_native_function(
+        ctx_scope,
+        "open_model",
+        new_native_function!(move |isolate_scope, ctx_scope, name_utf8: V8LocalUtf8| {
+            let client = redis_client_ref.borrow();
+            let client = client
+                .get()
+                .ok_or_else(|| "Used on invalid client".to_owned())?;
+
+            let model = match client.open_ai_model(name_utf8.as_str()) {
+                Ok(model) => model,
+                Err(e) => {
+                    isolate_scope.raise_exception_str(e.get_msg());
                     return Err(e.get_msg().to_string());
                 }
-                Ok(None)
-            }));
+            };
 
+            let model_object = isolate_scope.new_object();
             let script_ctx_ref = Weak::clone(&script_ctx_ref);
-            model_runner_object.set_native_function(ctx_scope, "run", new_native_function!(move |_isolate_scope, ctx_scope| {
-                let mut model_runner = model_runner.lock().unwrap();
-                let resolver = ctx_scope.new_resolver();
-                let promise = resolver.get_promise();
-                let mut persisted_resolver = resolver.to_value().persist();
-                let script_ctx_ref = Weak::clone(&script_ctx_ref);
-                model_runner.run(Box::new(move |res|{
-                    let script_ctx_upgraded = match script_ctx_ref.upgrade() {
-                        Some(s) => s,
-                        None => {
-                            persisted_resolver.forget();
-                            crate::v8_backend::log_warning("Use of invalid function context on redisai on_done");
-                            return;
-                        }
-                    };
-
-                    script_ctx_upgraded.compiled_library_api.run_on_background(Box::new(move || {
-                        let script_ctx_ref = match script_ctx_ref.upgrade() {
-                            Some(s) => s,
-                            None => {
-                                persisted_resolver.forget();
-                                crate::v8_backend::log_warning("Use of invalid function context on redisai on_done");
-                                return;
-                            }
-                        };
-                        let isolate_scope = script_ctx_ref.isolate.enter();
-                        let ctx_scope = script_ctx_ref.context.enter(&isolate_scope);
-                        let resolver = persisted_resolver.take_local(&isolate_scope).as_resolver();
-
-                        match res {
-                            Ok(res) => {
-                                let values = res.into_iter().map(|v| get_js_tensor_from_tensor(&script_ctx_ref, &isolate_scope, &ctx_scope, v).to_value()).collect::<Vec<V8LocalValue>>();
-                                let res_js = isolate_scope.new_array(&values.iter().collect::<Vec<&V8LocalValue>>()).to_value();
-                                script_ctx_ref.resolve(&resolver, &ctx_scope, &res_js);
+            model_object.set_native_function(
+                ctx_scope,
+                "get_model_runner",
+                new_native_function!(
+                    move |isolate_scope,
+                          ctx_scope,
+                          optional_args: Option<ModelRunnerOptionalArgs>| {
+                        let (batch_size, batch_timeout) =
+                            optional_args.map_or((None, None), |v| (v.batch_size, v.batch_timeout));
+                        let model_runner = match batch_size {
+                            Some(batch_size) if batch_size > 1 => {
+                                let batch_timeout =
+                                    batch_timeout.unwrap_or(DEFAULT_BATCH_TIMEOUT_MS);
+                                if batch_timeout < 1 {
+                                    return Err(
+                                        "batch_timeout must be a positive number".to_string()
+                                    );
+                                }
+                                model.get_batched_model_runner(
+                                    batch_size as usize,
+                                    Duration::from_millis(batch_timeout as u64),
+                                )
                             }
-                            Err(e) => {
-                                script_ctx_ref.reject(&resolver, &ctx_scope, &isolate_scope.new_string(e.get_msg()).to_value());
+                            Some(batch_size) if batch_size < 1 => {
+                                return Err("batch_size must be a positive number".to_string());
                             }
-                        }
-
-                    }));
-                }));
-
-                Ok::<Option<_>, String>(Some(promise.to_value()))
-            }));
-            Ok::<Option<_>, String>(Some(model_runner_object.to_value()))
-        }));
-
-        model_object.freeze(ctx_scope);
-
-        Ok(Some(model_object.to_value()))
-    }));
+                            _ => model.get_model_runner(),
+                        };
+                        let model_runner = Arc::new(Mutex::new(model_runner));
+                        let model_runner_clone = Arc::clone(&model_runner);
+                        let model_runner_object = isolate_scope.new_object();
+                        model_runner_object.set_native_function(
+                            ctx_scope,
+                            "add_input",
+                            new_native_function!(
+                                move |_isolate_scope,
+                                      _ctx_scope,
+                                      input_name_utf8: V8LocalUtf8,
+                                      tensor_js: V8LocalObject| {
+                                    let tensor = get_tensor_from_js_tensor(&tensor_js)?;
+
+                                    let mut model_runner = model_runner_clone.lock().unwrap();
+                                    let res = model_runner
+                                        .as_mut()
+                                        .add_input(input_name_utf8.as_str(), tensor.as_ref());
+                                    if let Err(e) = res {
+                                        return Err(e.get_msg().to_string());
+                                    }
+                                    Ok(None)
+                                }
+                            ),
+                        );
+
+                        let model_runner_clone = Arc::clone(&model_runner);
+                        model_runner_object.set_native_function(
+                            ctx_scope,
+                            "add_output",
+                            new_native_function!(
+                                move |_isolate_scope, _ctx_scope, output_name_utf8: V8LocalUtf8| {
+                                    let mut model_runner = model_runner_clone.lock().unwrap();
+                                    let res =
+                                        model_runner.as_mut().add_output(output_name_utf8.as_str());
+                                    if let Err(e) = res {
+                                        return Err(e.get_msg().to_string());
+                                    }
+                                    Ok(None)
+                                }
+                            ),
+                        );
+
+                        let script_ctx_ref = Weak::clone(&script_ctx_ref);
+                        model_runner_object.set_native_function(
+                            ctx_scope,
+                            "run",
+                            new_native_function!(move |_isolate_scope, ctx_scope| {
+                                let mut model_runner = model_runner.lock().unwrap();
+                                let resolver = ctx_scope.new_resolver();
+                                let promise = resolver.get_promise();
+                                let persisted_resolver = resolver.to_value().persist();
+                                let script_ctx_ref = Weak::clone(&script_ctx_ref);
+                                model_runner
+                                    .run(redisai_run_on_done(script_ctx_ref, persisted_resolver));
+
+                                Ok::<Option<_>, String>(Some(promise.to_value()))
+                            }),
+                        );
+                        Ok::<Option<_>, String>(Some(model_runner_object.to_value()))
+                    }
+                ),
+            );
+
+            model_object.freeze(ctx_scope);
+
+            Ok(Some(model_object.to_value()))
+        }),
+    );
 
     let script_ctx_ref = Arc::downgrade(script_ctx);
     let redis_client_ref = Arc::clone(redis_client);
-    redis_ai_client.set_native_function(ctx_scope, "open_script", new_native_function!(move |isolate_scope, ctx_scope, name_utf8: V8LocalUtf8| {
-        let client = redis_client_ref.borrow();
-        let client = client.get().ok_or_else(|| "Used on invalid client".to_owned())?;
-
-        let script = client.open_ai_script(name_utf8.as_str()).map_err(|e| e.get_msg().to_string())?;
-
-        let script_object = isolate_scope.new_object();
-        let script_ctx_ref = Weak::clone(&script_ctx_ref);
-        script_object.set_native_function(ctx_scope, "get_script_runner", new_native_function!(move |isolate_scope, ctx_scope, name_utf8: V8LocalUtf8| {
-            let script_runner = Arc::new(Mutex::new(script.get_script_runner(name_utf8.as_str())));
-            let script_runner_clone = Arc::clone(&script_runner);
-            let script_runner_object = isolate_scope.new_object();
-            script_runner_object.set_native_function(ctx_scope,"add_input", new_native_function!(move |_isolate_scope, _ctx_scope, tensor_js: V8LocalObject| {
-                let tensor = get_tensor_from_js_tensor(&tensor_js)?;
-                let mut script_runner = script_runner_clone.lock().unwrap();
-                script_runner.as_mut().add_input(tensor.as_ref()).map_err(|e| e.get_msg().to_string())?;
-                Ok::<_, String>(None)
-            }));
-
-            let script_runner_clone = Arc::clone(&script_runner);
-            script_runner_object.set_native_function(ctx_scope, "add_output", new_native_function!(move |_isolate_scope, _ctx_scope| {
-                let mut script_runner = script_runner_clone.lock().unwrap();
-                script_runner.as_mut().add_output().map_err(|e| e.get_msg().to_string())?;
-                Ok::<_, String>(None)
-            }));
+    redis_ai_client.set_native_function(
+        ctx_scope,
+        "open_script",
+        new_native_function!(move |isolate_scope, ctx_scope, name_utf8: V8LocalUtf8| {
+            let client = redis_client_ref.borrow();
+            let client = client
+                .get()
+                .ok_or_else(|| "Used on invalid client".to_owned())?;
+
+            let script = client
+                .open_ai_script(name_utf8.as_str())
+                .map_err(|e| e.get_msg().to_string())?;
 
+            let script_object = isolate_scope.new_object();
             let script_ctx_ref = Weak::clone(&script_ctx_ref);
-            script_runner_object.set_native_function(ctx_scope, "run", new_native_function!(move |_isolate_scope, ctx_scope| {
-                let mut script_runner = script_runner.lock().unwrap();
-                let resolver = ctx_scope.new_resolver();
-                let promise = resolver.get_promise();
-                let mut persisted_resolver = resolver.to_value().persist();
-                let script_ctx_ref = Weak::clone(&script_ctx_ref);
-                script_runner.run(Box::new(move |res|{
-                    let script_ctx_upgraded = match script_ctx_ref.upgrade() {
-                        Some(s) => s,
-                        None => {
-                            persisted_resolver.forget();
-                            crate::v8_backend::log_warning("Use of invalid function context on redisai on_done");
-                            return;
-                        }
-                    };
-
-                    script_ctx_upgraded.compiled_library_api.run_on_background(Box::new(move || {
-                        let script_ctx_ref = match script_ctx_ref.upgrade() {
-                            Some(s) => s,
-                            None => {
-                                persisted_resolver.forget();
-                                crate::v8_backend::log_warning("Use of invalid function context on redisai on_done");
-                                return;
+            script_object.set_native_function(
+                ctx_scope,
+                "get_script_runner",
+                new_native_function!(move |isolate_scope, ctx_scope, name_utf8: V8LocalUtf8| {
+                    let script_runner =
+                        Arc::new(Mutex::new(script.get_script_runner(name_utf8.as_str())));
+                    let script_runner_clone = Arc::clone(&script_runner);
+                    let script_runner_object = isolate_scope.new_object();
+                    script_runner_object.set_native_function(
+                        ctx_scope,
+                        "add_input",
+                        new_native_function!(
+                            move |_isolate_scope, _ctx_scope, tensor_js: V8LocalObject| {
+                                let tensor = get_tensor_from_js_tensor(&tensor_js)?;
+                                let mut script_runner = script_runner_clone.lock().unwrap();
+                                script_runner
+                                    .as_mut()
+                                    .add_input(tensor.as_ref())
+                                    .map_err(|e| e.get_msg().to_string())?;
+                                Ok::<_, String>(None)
                             }
-                        };
-                        let isolate_scope = script_ctx_ref.isolate.enter();
-                        let ctx_scope = script_ctx_ref.context.enter(&isolate_scope);
-
-                        let resolver = persisted_resolver.take_local(&isolate_scope).as_resolver();
+                        ),
+                    );
+
+                    let script_runner_clone = Arc::clone(&script_runner);
+                    script_runner_object.set_native_function(
+                        ctx_scope,
+                        "add_output",
+                        new_native_function!(move |_isolate_scope, _ctx_scope| {
+                            let mut script_runner = script_runner_clone.lock().unwrap();
+                            script_runner
+                                .as_mut()
+                                .add_output()
+                                .map_err(|e| e.get_msg().to_string())?;
+                            Ok::<_, String>(None)
+                        }),
+                    );
+
+                    let script_ctx_ref = Weak::clone(&script_ctx_ref);
+                    script_runner_object.set_native_function(
+                        ctx_scope,
+                        "run",
+                        new_native_function!(move |_isolate_scope, ctx_scope| {
+                            let mut script_runner = script_runner.lock().unwrap();
+                            let resolver = ctx_scope.new_resolver();
+                            let promise = resolver.get_promise();
+                            let persisted_resolver = resolver.to_value().persist();
+                            let script_ctx_ref = Weak::clone(&script_ctx_ref);
+                            script_runner
+                                .run(redisai_run_on_done(script_ctx_ref, persisted_resolver));
+
+                            Ok::<_, String>(Some(promise.to_value()))
+                        }),
+                    );
+                    Ok::<_, String>(Some(script_runner_object.to_value()))
+                }),
+            );
+
+            script_object.freeze(ctx_scope);
+
+            Ok::<Option<_>, String>(Some(script_object.to_value()))
+        }),
+    );
 
-                        match res {
-                            Ok(res) => {
-                                let values = res.into_iter().map(|v| get_js_tensor_from_tensor(&script_ctx_ref, &isolate_scope, &ctx_scope, v).to_value()).collect::<Vec<V8LocalValue>>();
-                                let res_js = isolate_scope.new_array(&values.iter().collect::<Vec<&V8LocalValue>>()).to_value();
-                                script_ctx_ref.resolve(&resolver, &ctx_scope, &res_js);
-                            }
-                            Err(e) => {
-                                script_ctx_ref.reject(&resolver, &ctx_scope, &isolate_scope.new_string(e.get_msg()).to_value());
+    let script_ctx_ref = Arc::downgrade(script_ctx);
+    let redis_client_ref = Arc::clone(redis_client);
+    redis_ai_client.set_native_function(
+        ctx_scope,
+        "create_dag",
+        new_native_function!(move |isolate_scope, ctx_scope| {
+            let s = script_ctx_ref
+                .upgrade()
+                .ok_or("On create_dag, use of invalid script ctx.".to_string())?;
+            let dag_runner = s
+                .compiled_library_api
+                .redisai_create_dag()
+                .map_err(|e| e.get_msg().to_string())?;
+            let dag_runner = Arc::new(Mutex::new(dag_runner));
+            let dag_object = isolate_scope.new_object();
+
+            let dag_runner_clone = Arc::clone(&dag_runner);
+            dag_object.set_native_function(
+                ctx_scope,
+                "add_input",
+                new_native_function!(
+                    move |_isolate_scope,
+                          _ctx_scope,
+                          input_name_utf8: V8LocalUtf8,
+                          tensor_js: V8LocalObject| {
+                        let tensor = get_tensor_from_js_tensor(&tensor_js)?;
+                        let mut dag_runner = dag_runner_clone.lock().unwrap();
+                        dag_runner
+                            .as_mut()
+                            .add_input(input_name_utf8.as_str(), tensor.as_ref())
+                            .map_err(|e| e.get_msg().to_string())?;
+                        Ok::<_, String>(None)
+                    }
+                ),
+            );
+
+            let dag_runner_clone = Arc::clone(&dag_runner);
+            let redis_client_clone = Arc::clone(&redis_client_ref);
+            // Models used by more than one run of the DAG are opened only once.
+            let opened_models: RefCell<HashMap<String, Box<dyn AIModelInterface>>> =
+                RefCell::new(HashMap::new());
+            dag_object.set_native_function(
+                ctx_scope,
+                "add_model_run",
+                new_native_function!(
+                    move |_isolate_scope,
+                          ctx_scope,
+                          model_name_utf8: V8LocalUtf8,
+                          inputs: V8LocalArray,
+                          outputs: V8LocalArray| {
+                        let inputs = get_tensor_names(ctx_scope, &inputs)?;
+                        let outputs = get_tensor_names(ctx_scope, &outputs)?;
+                        let mut opened_models = opened_models.borrow_mut();
+                        let model = match opened_models.entry(model_name_utf8.as_str().to_string())
+                        {
+                            Entry::Occupied(e) => e.into_mut(),
+                            Entry::Vacant(e) => {
+                                let client = redis_client_clone.borrow();
+                                let client = client
+                                    .get()
+                                    .ok_or_else(|| "Used on invalid client".to_owned())?;
+                                e.insert(
+                                    client
+                                        .open_ai_model(model_name_utf8.as_str())
+                                        .map_err(|e| e.get_msg().to_string())?,
+                                )
                             }
-                        }
-
-                    }));
-                }));
-
-                Ok::<_, String>(Some(promise.to_value()))
-            }));
-            Ok::<_, String>(Some(script_runner_object.to_value()))
-        }));
-
-        script_object.freeze(ctx_scope);
+                        };
+                        let inputs = inputs.iter().map(|v| v.as_str()).collect::<Vec<&str>>();
+                        let outputs = outputs.iter().map(|v| v.as_str()).collect::<Vec<&str>>();
+                        let mut dag_runner = dag_runner_clone.lock().unwrap();
+                        dag_runner
+                            .as_mut()
+                            .add_model_run(model.as_ref(), &inputs, &outputs)
+                            .map_err(|e| e.get_msg().to_string())?;
+                        Ok::<_, String>(None)
+                    }
+                ),
+            );
+
+            let dag_runner_clone = Arc::clone(&dag_runner);
+            let redis_client_clone = Arc::clone(&redis_client_ref);
+            dag_object.set_native_function(
+                ctx_scope,
+                "add_script_run",
+                new_native_function!(
+                    move |_isolate_scope,
+                          ctx_scope,
+                          script_name_utf8: V8LocalUtf8,
+                          func_name_utf8: V8LocalUtf8,
+                          inputs: V8LocalArray,
+                          outputs: V8LocalArray| {
+                        let inputs = get_tensor_names(ctx_scope, &inputs)?;
+                        let outputs = get_tensor_names(ctx_scope, &outputs)?;
+                        let client = redis_client_clone.borrow();
+                        let client = client
+                            .get()
+                            .ok_or_else(|| "Used on invalid client".to_owned())?;
+                        let script = client
+                            .open_ai_script(script_name_utf8.as_str())
+                            .map_err(|e| e.get_msg().to_string())?;
+                        let inputs = inputs.iter().map(|v| v.as_str()).collect::<Vec<&str>>();
+                        let outputs = outputs.iter().map(|v| v.as_str()).collect::<Vec<&str>>();
+                        let mut dag_runner = dag_runner_clone.lock().unwrap();
+                        dag_runner
+                            .as_mut()
+                            .add_script_run(
+                                script.as_ref(),
+                                func_name_utf8.as_str(),
+                                &inputs,
+                                &outputs,
+                            )
+                            .map_err(|e| e.get_msg().to_string())?;
+                        Ok::<_, String>(None)
+                    }
+                ),
+            );
+
+            let dag_runner_clone = Arc::clone(&dag_runner);
+            let redis_client_clone = Arc::clone(&redis_client_ref);
+            dag_object.set_native_function(
+                ctx_scope,
+                "add_ops_from_string",
+                new_native_function!(move |_isolate_scope, _ctx_scope, ops_utf8: V8LocalUtf8| {
+                    // The ops are parsed against the keyspace, verify the client is still valid.
+                    let client = redis_client_clone.borrow();
+                    client
+                        .get()
+                        .ok_or_else(|| "Used on invalid client".to_owned())?;
+                    let mut dag_runner = dag_runner_clone.lock().unwrap();
+                    dag_runner
+                        .as_mut()
+                        .add_ops_from_string(ops_utf8.as_str())
+                        .map_err(|e| e.get_msg().to_string())?;
+                    Ok::<_, String>(None)
+                }),
+            );
+
+            let dag_runner_clone = Arc::clone(&dag_runner);
+            dag_object.set_native_function(
+                ctx_scope,
+                "add_output",
+                new_native_function!(
+                    move |_isolate_scope, _ctx_scope, output_name_utf8: V8LocalUtf8| {
+                        let mut dag_runner = dag_runner_clone.lock().unwrap();
+                        dag_runner
+                            .as_mut()
+                            .add_output(output_name_utf8.as_str())
+                            .map_err(|e| e.get_msg().to_string())?;
+                        Ok::<_, String>(None)
+                    }
+                ),
+            );
 
-        Ok::<Option<_>, String>(Some(script_object.to_value()))
-    }));
+            let script_ctx_ref = Weak::clone(&script_ctx_ref);
+            dag_object.set_native_function(
+                ctx_scope,
+                "run",
+                new_native_function!(move |_isolate_scope, ctx_scope| {
+                    let mut dag_runner = dag_runner.lock().unwrap();
+                    let resolver = ctx_scope.new_resolver();
+                    let promise = resolver.get_promise();
+                    let persisted_resolver = resolver.to_value().persist();
+                    let script_ctx_ref = Weak::clone(&script_ctx_ref);
+                    dag_runner.run(redisai_run_on_done(script_ctx_ref, persisted_resolver));
+
+                    Ok::<_, String>(Some(promise.to_value()))
+                }),
+            );
+
+            dag_object.freeze(ctx_scope);
+
+            Ok::<Option<_>, String>(Some(dag_object.to_value()))
+        }),
+    );
 
     redis_ai_client.to_value()
 }
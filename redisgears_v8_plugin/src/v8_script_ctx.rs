@@ -5,7 +5,12 @@
  */
 
 use redisgears_plugin_api::redisgears_plugin_api::backend_ctx::DebuggerBackendPayload;
-use redisgears_plugin_api::redisgears_plugin_api::load_library_ctx::{InfoSectionData, ModuleInfo};
+use redisgears_plugin_api::redisgears_plugin_api::function_ctx::FunctionCtxInterface;
+use redisgears_plugin_api::redisgears_plugin_api::keys_notifications_consumer_ctx::KeysNotificationsConsumerCtxInterface;
+use redisgears_plugin_api::redisgears_plugin_api::load_library_ctx::{
+    FunctionFlags, InfoSectionData, ModuleInfo, RegisteredKeys, RemoteFunctionCtx,
+};
+use redisgears_plugin_api::redisgears_plugin_api::stream_ctx::StreamCtxInterface;
 use redisgears_plugin_api::redisgears_plugin_api::{
     backend_ctx::CompiledLibraryInterface, load_library_ctx::LibraryCtxInterface,
     load_library_ctx::LoadLibraryCtxInterface, GearsApiError,
@@ -27,11 +32,20 @@ use v8_rs::v8::{
 use redisgears_plugin_api::redisgears_plugin_api::{GearsApiResult, RefCellWrapper};
 use std::cell::RefCell;
 use std::collections::HashMap;
+use std::mem::ManuallyDrop;
 use std::sync::atomic::AtomicBool;
 use std::sync::atomic::Ordering;
-use std::sync::Arc;
-use std::time::SystemTime;
+use std::sync::atomic::{AtomicU64, AtomicUsize};
+use std::sync::{Arc, Mutex, Weak};
+use std::time::{Duration, Instant, SystemTime};
 
+use crate::v8_backend::{
+    account_isolate_heap_size, gil_lock_timeout, gil_rdb_lock_timeout, record_js_activity,
+    verify_not_oom, SharedIsolateSlot,
+};
+use crate::v8_function_ctx::V8FunctionReplicas;
+use crate::v8_strings_cache::V8StringsCache;
+use crate::v8_watchdog;
 use crate::{get_error_from_object, get_exception_msg};
 
 #[derive(Debug)]
@@ -89,6 +103,69 @@ impl GilStateCtx {
     }
 }
 
+/// Upper bounds (in microseconds) of the GC pauses histogram buckets.
+/// The last bucket counts all the pauses above the last bound.
+const GC_PAUSE_BUCKETS_US: [u64; 4] = [1_000, 5_000, 20_000, 100_000];
+
+/// Statistics about the garbage collections that were performed on the
+/// isolate when Redis was idle (see [`V8ScriptCtx::idle_gc`]).
+#[derive(Debug, Default)]
+pub(crate) struct GcStats {
+    count: AtomicU64,
+    total_time_us: AtomicU64,
+    freed_bytes: AtomicU64,
+    pauses_histogram: [AtomicU64; GC_PAUSE_BUCKETS_US.len() + 1],
+}
+
+impl GcStats {
+    fn record(&self, pause: Duration, freed_bytes: usize) {
+        let pause_us = pause.as_micros() as u64;
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.total_time_us.fetch_add(pause_us, Ordering::Relaxed);
+        self.freed_bytes
+            .fetch_add(freed_bytes as u64, Ordering::Relaxed);
+        let bucket = GC_PAUSE_BUCKETS_US
+            .iter()
+            .position(|v| pause_us <= *v)
+            .unwrap_or(GC_PAUSE_BUCKETS_US.len());
+        self.pauses_histogram[bucket].fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Return the number of garbage collections performed.
+    pub(crate) fn count(&self) -> u64 {
+        self.count.load(Ordering::Relaxed)
+    }
+
+    /// Return the total time (in microseconds) spent on garbage collection.
+    /// Idle garbage collections are performed from the Redis cron and so
+    /// all this time is spent while holding the Redis GIL.
+    pub(crate) fn total_time_us(&self) -> u64 {
+        self.total_time_us.load(Ordering::Relaxed)
+    }
+
+    /// Add the statistics to the given info section data.
+    pub(crate) fn add_to_info(&self, data: &mut HashMap<String, String>) {
+        data.insert("idle_gc_count".to_owned(), self.count().to_string());
+        data.insert(
+            "idle_gc_time_holding_gil_us".to_owned(),
+            self.total_time_us().to_string(),
+        );
+        data.insert(
+            "idle_gc_freed_bytes".to_owned(),
+            self.freed_bytes.load(Ordering::Relaxed).to_string(),
+        );
+        let histogram = GC_PAUSE_BUCKETS_US
+            .iter()
+            .map(|v| format!("le_{}us", v))
+            .chain(std::iter::once("inf".to_owned()))
+            .zip(self.pauses_histogram.iter())
+            .map(|(bucket, count)| format!("{}={}", bucket, count.load(Ordering::Relaxed)))
+            .collect::<Vec<_>>()
+            .join(",");
+        data.insert("idle_gc_pauses_histogram".to_owned(), histogram);
+    }
+}
+
 pub(crate) enum GilStatus {
     Locked,
     Unlocked,
@@ -121,24 +198,232 @@ impl<'a> Drop for RdbLoadingGuard<'a> {
     }
 }
 
+/// The V8 isolate on which a library is running. An isolate can be shared
+/// between several libraries (see [`crate::v8_backend::shared_isolate_max_libraries`]),
+/// in which case each library runs on its own V8 context and the libraries
+/// globals are not shared.
+pub(crate) struct V8LibraryIsolate {
+    isolate: V8Isolate,
+
+    /// Set if the isolate might host more than a single library.
+    shared: bool,
+
+    /// The libraries hosted on the isolate.
+    libraries: Mutex<Vec<Weak<V8ScriptCtx>>>,
+
+    /// The isolate total heap size as last accounted in the combined heap size
+    /// of all the isolates.
+    accounted_heap_size: AtomicUsize,
+
+    /// The number of threads that entered the isolate or are waiting to enter it.
+    users: AtomicUsize,
+
+    /// Set while the isolate is entered by [`Self::try_enter_exclusive`].
+    exclusive: AtomicBool,
+}
+
+thread_local! {
+    /// Set on the thread that entered an isolate exclusively, so that
+    /// entering the isolate again from that thread does not wait for itself.
+    static HOLDS_EXCLUSIVE_ISOLATE: std::cell::Cell<bool> = std::cell::Cell::new(false);
+}
+
+/// An entered [`V8LibraryIsolate`], the thread is counted as a user of the
+/// isolate until the scope is dropped.
+pub(crate) struct V8LibraryIsolateScope<'isolate> {
+    isolate_scope: ManuallyDrop<V8IsolateScope<'isolate>>,
+    users: &'isolate AtomicUsize,
+}
+
+impl<'isolate> std::ops::Deref for V8LibraryIsolateScope<'isolate> {
+    type Target = V8IsolateScope<'isolate>;
+
+    fn deref(&self) -> &Self::Target {
+        &self.isolate_scope
+    }
+}
+
+impl<'isolate> Drop for V8LibraryIsolateScope<'isolate> {
+    fn drop(&mut self) {
+        // Exit the isolate before the thread stops being counted as a user.
+        unsafe { ManuallyDrop::drop(&mut self.isolate_scope) };
+        self.users.fetch_sub(1, Ordering::SeqCst);
+    }
+}
+
+/// The isolate entered by [`V8LibraryIsolate::try_enter_exclusive`].
+pub(crate) struct V8ExclusiveIsolateScope<'isolate> {
+    isolate_scope: ManuallyDrop<V8IsolateScope<'isolate>>,
+    exclusive: &'isolate AtomicBool,
+}
+
+impl<'isolate> Drop for V8ExclusiveIsolateScope<'isolate> {
+    fn drop(&mut self) {
+        unsafe { ManuallyDrop::drop(&mut self.isolate_scope) };
+        HOLDS_EXCLUSIVE_ISOLATE.with(|v| v.set(false));
+        self.exclusive.store(false, Ordering::SeqCst);
+    }
+}
+
+impl V8LibraryIsolate {
+    pub(crate) fn new(isolate: V8Isolate, shared: bool) -> Self {
+        Self {
+            isolate,
+            shared,
+            libraries: Mutex::new(Vec::new()),
+            accounted_heap_size: AtomicUsize::new(0),
+            users: AtomicUsize::new(0),
+            exclusive: AtomicBool::new(false),
+        }
+    }
+
+    /// Enter the isolate, waiting for the isolate lock if it is held by
+    /// another thread.
+    pub(crate) fn enter(&self) -> V8LibraryIsolateScope<'_> {
+        self.users.fetch_add(1, Ordering::SeqCst);
+        if !HOLDS_EXCLUSIVE_ISOLATE.with(|v| v.get()) {
+            // The exclusive scope is short and never runs JS code.
+            while self.exclusive.load(Ordering::SeqCst) {
+                std::thread::yield_now();
+            }
+        }
+        V8LibraryIsolateScope {
+            isolate_scope: ManuallyDrop::new(self.isolate.enter()),
+            users: &self.users,
+        }
+    }
+
+    /// Enter the isolate only if no other thread entered it or is waiting to
+    /// enter it, so the caller never waits for the isolate lock. Threads that
+    /// try to enter the isolate while the returned scope is alive wait for
+    /// it to be dropped.
+    pub(crate) fn try_enter_exclusive(&self) -> Option<V8ExclusiveIsolateScope<'_>> {
+        if self.exclusive.swap(true, Ordering::SeqCst) {
+            return None;
+        }
+        if self.users.load(Ordering::SeqCst) != 0 {
+            self.exclusive.store(false, Ordering::SeqCst);
+            return None;
+        }
+        HOLDS_EXCLUSIVE_ISOLATE.with(|v| v.set(true));
+        Some(V8ExclusiveIsolateScope {
+            isolate_scope: ManuallyDrop::new(self.isolate.enter()),
+            exclusive: &self.exclusive,
+        })
+    }
+
+    /// Returns [`true`] if the isolate might host more than a single library.
+    pub(crate) fn is_shared(&self) -> bool {
+        self.shared
+    }
+
+    /// Add the given library to the libraries hosted on the isolate.
+    pub(crate) fn add_library(&self, script_ctx: &Arc<V8ScriptCtx>) {
+        let mut libraries = self.libraries.lock().unwrap();
+        libraries.retain(|v| v.strong_count() > 0);
+        libraries.push(Arc::downgrade(script_ctx));
+    }
+
+    /// Return the libraries that are currently hosted on the isolate.
+    pub(crate) fn libraries(&self) -> Vec<Arc<V8ScriptCtx>> {
+        self.libraries
+            .lock()
+            .unwrap()
+            .iter()
+            .filter_map(|v| v.upgrade())
+            .collect()
+    }
+
+    /// Returns [`true`] if any of the libraries hosted on the isolate is
+    /// currently running JS code.
+    pub(crate) fn is_running(&self) -> bool {
+        self.libraries
+            .lock()
+            .unwrap()
+            .iter()
+            .filter_map(|v| v.upgrade())
+            .any(|v| v.is_running.load(Ordering::Relaxed))
+    }
+
+    /// Update the combined heap size of all the isolates with the current
+    /// total heap size of this isolate.
+    pub(crate) fn update_heap_size_accounting(&self) {
+        let curr = self.isolate.total_heap_size();
+        let prev = self.accounted_heap_size.swap(curr, Ordering::Relaxed);
+        account_isolate_heap_size(prev, curr);
+    }
+
+    /// The heap size attributed to each library is the heap growth while
+    /// the library was running, so it does not reflect memory that was
+    /// freed by the GC. Scale down the attributed heap sizes so that their
+    /// sum will not exceed the isolate used heap size.
+    pub(crate) fn rebalance_attributed_heap_size(&self) {
+        let libraries = self.libraries();
+        let used_heap_size = self.isolate.used_heap_size();
+        let attributed: usize = libraries
+            .iter()
+            .map(|v| v.attributed_heap_size.load(Ordering::Relaxed))
+            .sum();
+        if attributed <= used_heap_size {
+            return;
+        }
+        libraries.iter().for_each(|v| {
+            let curr = v.attributed_heap_size.load(Ordering::Relaxed);
+            let scaled = (curr as u128 * used_heap_size as u128 / attributed as u128) as usize;
+            v.attributed_heap_size.store(scaled, Ordering::Relaxed);
+        });
+    }
+}
+
+impl std::ops::Deref for V8LibraryIsolate {
+    type Target = V8Isolate;
+
+    fn deref(&self) -> &Self::Target {
+        &self.isolate
+    }
+}
+
+impl std::fmt::Debug for V8LibraryIsolate {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("V8LibraryIsolate")
+            .field("isolate", &self.isolate)
+            .field("shared", &self.shared)
+            .field("accounted_heap_size", &self.accounted_heap_size)
+            .finish()
+    }
+}
+
+impl Drop for V8LibraryIsolate {
+    fn drop(&mut self) {
+        account_isolate_heap_size(*self.accounted_heap_size.get_mut(), 0);
+    }
+}
+
 pub(crate) struct V8ScriptCtx {
     /// The name of the library.
     pub(crate) name: String,
 
     /// The initialisation script to run.
-    pub(crate) script: V8PersistedScript,
+    pub(crate) script: ManuallyDrop<V8PersistedScript>,
 
     /// Tensors API for RedisAI integrations.
-    pub(crate) tensor_object_template: V8PersistedObjectTemplate,
+    pub(crate) tensor_object_template: ManuallyDrop<V8PersistedObjectTemplate>,
 
     /// The V8 Inspector (used for debugging).
     pub(crate) inspector: Option<Arc<Inspector>>,
 
     /// The V8 context
-    pub(crate) context: V8Context,
+    pub(crate) context: ManuallyDrop<V8Context>,
+
+    /// Strings which are created over and over again by the library
+    /// invocations. Must be dropped before the isolate.
+    pub(crate) strings_cache: ManuallyDrop<V8StringsCache>,
 
-    /// The V8 isolate
-    pub(crate) isolate: V8Isolate,
+    /// The V8 isolate, might be shared with other libraries.
+    pub(crate) isolate: Arc<V8LibraryIsolate>,
+
+    /// The library place on the isolate, set if the isolate is shared.
+    _shared_isolate_slot: Option<SharedIsolateSlot>,
 
     /// Api to interact back with Redis for operations like command invocation and logging.
     pub(crate) compiled_library_api: Box<dyn CompiledLibraryInterface + Send + Sync>,
@@ -155,6 +440,42 @@ pub(crate) struct V8ScriptCtx {
     /// Signifies the present locking status of the running JavaScript code,
     /// enabling us to distinguish between background JS code execution and JS code that holds a lock on Redis.
     pub(crate) lock_state: RefCellWrapper<GilStateCtx>,
+
+    /// The time (as returned by [`v8_watchdog::now_ms`]) in which the Redis GIL
+    /// was locked, or `0` if the GIL is not locked. Unlike [`Self::lock_state`],
+    /// this can be read by the watchdog thread.
+    pub(crate) gil_locked_at: AtomicU64,
+
+    /// Set if a deadline for this script is currently armed on the watchdog.
+    /// Used to make sure we never have more than a single armed deadline per script.
+    pub(crate) watchdog_armed: AtomicBool,
+
+    /// The part of the isolate used heap size that is attributed to this
+    /// library. On a dedicated isolate this is simply the isolate used heap
+    /// size, on a shared isolate this is an estimation based on the heap
+    /// growth while the library was running.
+    pub(crate) attributed_heap_size: AtomicUsize,
+
+    /// The isolate used heap size when the library started running, only
+    /// maintained on a shared isolate.
+    run_start_heap_size: AtomicUsize,
+
+    /// A weak reference to the script itself, given to the watchdog when arming a deadline.
+    self_weak: Weak<V8ScriptCtx>,
+
+    /// Set when JS code was running since the last idle garbage collection.
+    pub(crate) heap_dirty: AtomicBool,
+
+    /// Statistics about idle garbage collections of the isolate.
+    pub(crate) gc_stats: GcStats,
+
+    /// The primary isolate of the library, set if this isolate is one of
+    /// the library isolate replicas.
+    pub(crate) primary: Option<Weak<V8ScriptCtx>>,
+
+    /// The replicas of the async functions registered by this script,
+    /// by the function name.
+    pub(crate) functions_replicas: Mutex<HashMap<String, Arc<V8FunctionReplicas>>>,
 }
 
 impl std::fmt::Debug for V8ScriptCtx {
@@ -172,10 +493,30 @@ impl std::fmt::Debug for V8ScriptCtx {
             )
             .field("is_running", &self.is_running)
             .field("lock_state", &self.lock_state)
+            .field("gil_locked_at", &self.gil_locked_at)
+            .field("watchdog_armed", &self.watchdog_armed)
+            .field("attributed_heap_size", &self.attributed_heap_size)
+            .field("heap_dirty", &self.heap_dirty)
+            .field("gc_stats", &self.gc_stats)
+            .field("is_replica", &self.primary.is_some())
             .finish()
     }
 }
 
+impl Drop for V8ScriptCtx {
+    fn drop(&mut self) {
+        // The isolate might be shared with libraries that are running on other
+        // threads, the library handles must be released while holding the isolate lock.
+        let _isolate_scope = self.isolate.enter();
+        unsafe {
+            ManuallyDrop::drop(&mut self.strings_cache);
+            ManuallyDrop::drop(&mut self.tensor_object_template);
+            ManuallyDrop::drop(&mut self.script);
+            ManuallyDrop::drop(&mut self.context);
+        }
+    }
+}
+
 pub(crate) struct OnDoneCtx<'isolate_scope, 'isolate, 'ctx_scope> {
     pub(crate) isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
     pub(crate) ctx_scope: &'ctx_scope V8ContextScope<'isolate_scope, 'isolate>,
@@ -183,21 +524,27 @@ pub(crate) struct OnDoneCtx<'isolate_scope, 'isolate, 'ctx_scope> {
 }
 
 impl V8ScriptCtx {
+    #[allow(clippy::too_many_arguments)]
     pub(crate) fn new(
+        self_weak: Weak<V8ScriptCtx>,
         name: String,
-        isolate: V8Isolate,
+        isolate: Arc<V8LibraryIsolate>,
+        shared_isolate_slot: Option<SharedIsolateSlot>,
         ctx: V8Context,
         script: V8PersistedScript,
         inspector: Option<Arc<Inspector>>,
         tensor_object_template: V8PersistedObjectTemplate,
         compiled_library_api: Box<dyn CompiledLibraryInterface + Send + Sync>,
+        primary: Option<&Arc<V8ScriptCtx>>,
     ) -> Self {
         Self {
             name,
             isolate,
-            context: ctx,
-            script,
-            tensor_object_template,
+            _shared_isolate_slot: shared_isolate_slot,
+            context: ManuallyDrop::new(ctx),
+            strings_cache: ManuallyDrop::new(V8StringsCache::new()),
+            script: ManuallyDrop::new(script),
+            tensor_object_template: ManuallyDrop::new(tensor_object_template),
             compiled_library_api,
             inspector,
             is_running: AtomicBool::new(false),
@@ -205,6 +552,15 @@ impl V8ScriptCtx {
             lock_state: RefCellWrapper {
                 ref_cell: RefCell::new(GilStateCtx::new()),
             },
+            gil_locked_at: AtomicU64::new(0),
+            watchdog_armed: AtomicBool::new(false),
+            attributed_heap_size: AtomicUsize::new(0),
+            run_start_heap_size: AtomicUsize::new(0),
+            self_weak,
+            heap_dirty: AtomicBool::new(false),
+            gc_stats: GcStats::default(),
+            primary: primary.map(Arc::downgrade),
+            functions_replicas: Mutex::new(HashMap::new()),
         }
     }
 
@@ -224,7 +580,12 @@ impl V8ScriptCtx {
     /// Currently, just set an atomic boolean indicating JS code is running.
     /// Returns [`true`] if JS code was already running or [`false`] otherwise.
     pub(crate) fn before_run(&self) -> bool {
-        self.is_running.swap(true, Ordering::Relaxed)
+        let was_running = self.is_running.swap(true, Ordering::Relaxed);
+        if !was_running && self.isolate.is_shared() {
+            self.run_start_heap_size
+                .store(self.isolate.used_heap_size(), Ordering::Relaxed);
+        }
+        was_running
     }
 
     /// Perform necessary operation after running JS code.
@@ -232,6 +593,88 @@ impl V8ScriptCtx {
     /// it to an atomic boolean indicating whether or not a JS code is running.
     pub(crate) fn after_run(&self, val: bool) {
         self.is_running.store(val, Ordering::Relaxed);
+        if !val {
+            if self.isolate.is_shared() {
+                self.attribute_heap_growth(self.run_start_heap_size.load(Ordering::Relaxed));
+            }
+            self.update_heap_size_accounting();
+            self.heap_dirty.store(true, Ordering::Relaxed);
+            record_js_activity();
+        }
+    }
+
+    /// Perform a full garbage collection on the isolate and record its
+    /// statistics. Expected to be called when Redis is idle. The collection
+    /// is skipped (and [`false`] is returned) if the isolate is used by
+    /// another thread, so the caller never waits for the isolate lock.
+    pub(crate) fn idle_gc(&self) -> bool {
+        let start = Instant::now();
+        let used_heap_size = self.isolate.used_heap_size();
+        {
+            let _isolate_scope = match self.isolate.try_enter_exclusive() {
+                Some(s) => s,
+                None => return false,
+            };
+            self.isolate.memory_pressure_notification();
+        }
+        let freed_bytes = used_heap_size.saturating_sub(self.isolate.used_heap_size());
+        self.gc_stats.record(start.elapsed(), freed_bytes);
+        self.heap_dirty.store(false, Ordering::Relaxed);
+        if self.isolate.is_shared() {
+            // the entire isolate was collected, including the other libraries heaps.
+            self.isolate
+                .libraries()
+                .iter()
+                .for_each(|v| v.heap_dirty.store(false, Ordering::Relaxed));
+            self.isolate.rebalance_attributed_heap_size();
+        }
+        self.update_heap_size_accounting();
+        true
+    }
+
+    /// Attribute to this library the change in the isolate used heap size
+    /// since the given heap size was taken.
+    pub(crate) fn attribute_heap_growth(&self, start_heap_size: usize) {
+        let curr = self.isolate.used_heap_size();
+        let attributed = self.attributed_heap_size.load(Ordering::Relaxed);
+        let attributed = if curr >= start_heap_size {
+            attributed.saturating_add(curr - start_heap_size)
+        } else {
+            attributed.saturating_sub(start_heap_size - curr)
+        };
+        self.attributed_heap_size
+            .store(attributed, Ordering::Relaxed);
+    }
+
+    /// Return the used heap size attributed to this library.
+    pub(crate) fn library_used_heap_size(&self) -> usize {
+        if self.isolate.is_shared() {
+            self.attributed_heap_size.load(Ordering::Relaxed)
+        } else {
+            self.isolate.used_heap_size()
+        }
+    }
+
+    /// Update the combined heap size of all the isolates with the current
+    /// total heap size of this script isolate.
+    pub(crate) fn update_heap_size_accounting(&self) {
+        self.isolate.update_heap_size_accounting();
+    }
+
+    /// Return the GIL lock timeout that applies to this script.
+    pub(crate) fn gil_lock_configured_timeout(&self) -> u128 {
+        if self.is_being_loaded_from_rdb() {
+            gil_rdb_lock_timeout()
+        } else {
+            gil_lock_timeout()
+        }
+    }
+
+    /// Arm a deadline on the watchdog, unless one is already armed.
+    pub(crate) fn arm_watchdog(&self, deadline: u64) {
+        if !self.watchdog_armed.swap(true, Ordering::SeqCst) {
+            v8_watchdog::arm(deadline, Weak::clone(&self.self_weak));
+        }
     }
 
     /// Returns [`true`] if the script is being debugged.
@@ -243,12 +686,20 @@ impl V8ScriptCtx {
     /// the current time for timeout purposes.
     pub(crate) fn after_lock_gil(&self) {
         self.lock_state.ref_cell.borrow_mut().set_lock();
+        if self.is_being_debugged() {
+            return;
+        }
+        let now = v8_watchdog::now_ms();
+        self.gil_locked_at.store(now, Ordering::SeqCst);
+        let timeout = u64::try_from(self.gil_lock_configured_timeout()).unwrap_or(u64::MAX);
+        self.arm_watchdog(now.saturating_add(timeout));
     }
 
     /// Perform necessary operation before unlocking Redis GIL like unset
     /// the current time for timeout purposes.
     pub(crate) fn before_release_gil(&self) {
         self.lock_state.ref_cell.borrow_mut().set_unlock();
+        self.gil_locked_at.store(0, Ordering::SeqCst);
     }
 
     /// Return [`true`] if Redis GIL is locked and [`false`] otherwise.
@@ -485,45 +936,108 @@ impl V8ScriptCtx {
     }
 }
 
+/// The loader given to the library isolate replicas. The registrations
+/// are done by the primary isolate, so everything a replica registers is
+/// ignored. The async functions are attached to the primary functions
+/// when they are registered, see [`V8FunctionReplicas`].
+struct ReplicaLoadLibraryCtx;
+
+impl LoadLibraryCtxInterface for ReplicaLoadLibraryCtx {
+    fn register_function(
+        &mut self,
+        _name: &str,
+        _function_ctx: Box<dyn FunctionCtxInterface>,
+        _flags: FunctionFlags,
+        _description: Option<String>,
+    ) -> Result<(), GearsApiError> {
+        Ok(())
+    }
+
+    fn register_async_function(
+        &mut self,
+        _name: &str,
+        _function_ctx: Box<dyn FunctionCtxInterface>,
+        _flags: FunctionFlags,
+        _description: Option<String>,
+    ) -> Result<(), GearsApiError> {
+        Ok(())
+    }
+
+    fn register_remote_task(
+        &mut self,
+        _name: &str,
+        _remote_function_ctx: RemoteFunctionCtx,
+    ) -> Result<(), GearsApiError> {
+        Ok(())
+    }
+
+    fn register_stream_consumer(
+        &mut self,
+        _name: &str,
+        _prefix: &[u8],
+        _stream_ctx: Box<dyn StreamCtxInterface>,
+        _window: usize,
+        _trim: bool,
+        _description: Option<String>,
+        _partition_key: Option<&[u8]>,
+    ) -> Result<(), GearsApiError> {
+        Ok(())
+    }
+
+    fn register_key_space_notification_consumer(
+        &mut self,
+        _name: &str,
+        _key: RegisteredKeys,
+        _keys_notifications_consumer_ctx: Box<dyn KeysNotificationsConsumerCtxInterface>,
+        _description: Option<String>,
+    ) -> Result<(), GearsApiError> {
+        Ok(())
+    }
+}
+
 pub(crate) struct V8LibraryCtx {
     pub(crate) script_ctx: Arc<V8ScriptCtx>,
+    /// The library isolate replicas, empty unless the library asked
+    /// for more than one isolate.
+    pub(crate) replicas: Vec<Arc<V8ScriptCtx>>,
 }
 
-impl LibraryCtxInterface for V8LibraryCtx {
-    fn load_library(
-        &self,
+impl V8LibraryCtx {
+    /// Evaluates the library code on the given isolate.
+    fn evaluate(
+        script_ctx: &V8ScriptCtx,
         load_library_ctx: &dyn LoadLibraryCtxInterface,
         is_being_loaded_from_rdb: bool,
     ) -> Result<(), GearsApiError> {
-        let isolate_scope = self.script_ctx.isolate.enter();
-        let ctx_scope = self.script_ctx.context.enter(&isolate_scope);
+        // libraries might be compiled together and evaluated one after the
+        // other, an earlier library evaluation might have reached the limit.
+        verify_not_oom()?;
+
+        let isolate_scope = script_ctx.isolate.enter();
+        let ctx_scope = script_ctx.context.enter(&isolate_scope);
         let trycatch = isolate_scope.new_try_catch();
 
-        if let Some(inspector) = self.script_ctx.inspector.as_ref() {
+        if let Some(inspector) = script_ctx.inspector.as_ref() {
             inspector
                 .guard(&isolate_scope)
                 .and_then(|i| i.schedule_pause_on_next_statement("Pause on load."))
                 .map_err(|e| GearsApiError::new(e.to_string()))?;
         }
 
-        let script = self
-            .script_ctx
+        let script = script_ctx
             .script
             .to_local(&isolate_scope)
             .map_err(GearsApiError::new)?;
 
-        let _rdb_loading_guard = self.script_ctx.mark_loading_rdb(is_being_loaded_from_rdb);
+        let _rdb_loading_guard = script_ctx.mark_loading_rdb(is_being_loaded_from_rdb);
 
         // set private content
-        let _load_library_guard = self
-            .script_ctx
-            .context
-            .set_private_data(0, &load_library_ctx);
+        let _load_library_guard = script_ctx.context.set_private_data(0, &load_library_ctx);
 
-        let res = self.script_ctx.run(&script, &ctx_scope, GilStatus::Locked);
+        let res = script_ctx.run(&script, &ctx_scope, GilStatus::Locked);
 
         let res =
-            res.ok_or_else(|| get_exception_msg(&self.script_ctx.isolate, trycatch, &ctx_scope))?;
+            res.ok_or_else(|| get_exception_msg(&script_ctx.isolate, trycatch, &ctx_scope))?;
 
         if res.is_promise() {
             let promise = res.as_promise();
@@ -539,24 +1053,79 @@ impl LibraryCtxInterface for V8LibraryCtx {
 
         Ok(())
     }
+}
+
+impl LibraryCtxInterface for V8LibraryCtx {
+    fn load_library(
+        &self,
+        load_library_ctx: &dyn LoadLibraryCtxInterface,
+        is_being_loaded_from_rdb: bool,
+    ) -> Result<(), GearsApiError> {
+        Self::evaluate(&self.script_ctx, load_library_ctx, is_being_loaded_from_rdb)?;
+        for replica in self.replicas.iter() {
+            Self::evaluate(replica, &ReplicaLoadLibraryCtx, is_being_loaded_from_rdb).map_err(
+                |e| {
+                    GearsApiError::new(format!(
+                        "Failed evaluating library isolate replica: {}",
+                        e.get_msg()
+                    ))
+                },
+            )?;
+        }
+        Ok(())
+    }
 
     fn get_info(&self) -> Option<ModuleInfo> {
         let sections = {
             let libraries_stats = {
                 let mut isolate_stats_data = HashMap::new();
 
+                // the heap sizes are of all the library isolates.
+                let isolates = || std::iter::once(&self.script_ctx).chain(self.replicas.iter());
+                isolate_stats_data
+                    .insert("isolates".to_owned(), (self.replicas.len() + 1).to_string());
                 isolate_stats_data.insert(
                     "total_heap_size".to_owned(),
-                    self.script_ctx.isolate.total_heap_size().to_string(),
+                    isolates()
+                        .map(|v| v.isolate.total_heap_size())
+                        .sum::<usize>()
+                        .to_string(),
                 );
                 isolate_stats_data.insert(
                     "used_heap_size".to_owned(),
-                    self.script_ctx.isolate.used_heap_size().to_string(),
+                    isolates()
+                        .map(|v| v.isolate.used_heap_size())
+                        .sum::<usize>()
+                        .to_string(),
                 );
                 isolate_stats_data.insert(
                     "heap_size_limit".to_owned(),
                     self.script_ctx.isolate.heap_size_limit().to_string(),
                 );
+                // on a shared isolate, the heap sizes above are of the entire
+                // isolate, this is the part attributed to the library.
+                isolate_stats_data.insert(
+                    "library_used_heap_size".to_owned(),
+                    isolates()
+                        .map(|v| v.library_used_heap_size())
+                        .sum::<usize>()
+                        .to_string(),
+                );
+                isolate_stats_data.insert(
+                    "shared_isolate_libraries".to_owned(),
+                    if self.script_ctx.isolate.is_shared() {
+                        self.script_ctx.isolate.libraries().len()
+                    } else {
+                        0
+                    }
+                    .to_string(),
+                );
+                self.script_ctx
+                    .gc_stats
+                    .add_to_info(&mut isolate_stats_data);
+                self.script_ctx
+                    .strings_cache
+                    .add_to_info(&mut isolate_stats_data);
 
                 InfoSectionData::KeyValuePairs(isolate_stats_data)
             };
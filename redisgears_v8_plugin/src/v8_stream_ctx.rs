@@ -5,7 +5,10 @@
  */
 
 use redisgears_plugin_api::redisgears_plugin_api::GearsApiError;
-use v8_rs::v8::{v8_value::V8LocalValue, v8_value::V8PersistValue};
+use v8_rs::v8::{
+    isolate_scope::V8IsolateScope, v8_context_scope::V8ContextScope, v8_object::V8LocalObject,
+    v8_value::V8LocalValue, v8_value::V8PersistValue,
+};
 
 use redisgears_plugin_api::redisgears_plugin_api::stream_ctx::{
     StreamCtxInterface, StreamProcessCtxInterface, StreamRecordAck, StreamRecordInterface,
@@ -16,6 +19,7 @@ use redisgears_plugin_api::redisgears_plugin_api::run_function_ctx::BackgroundRu
 use crate::v8_backend::bypass_memory_limit;
 use crate::v8_native_functions::{get_backgrounnd_client, get_redis_client, RedisClient};
 use crate::v8_script_ctx::{GilStatus, V8ScriptCtx};
+use crate::v8_strings_cache::V8CachedString;
 
 use std::cell::RefCell;
 use std::sync::Arc;
@@ -52,17 +56,17 @@ impl V8StreamCtx {
 }
 
 impl V8StreamCtxInternals {
-    fn process_record_internal_sync(
+    /// Convert the given stream record into the JS object given to the
+    /// stream consumer. The property names and the field names, which
+    /// repeat on every record, are taken from the library strings cache.
+    fn record_to_js_object<'isolate_scope, 'isolate>(
         &self,
+        isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+        ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
         stream_name: &[u8],
-        record: Box<dyn StreamRecordInterface>,
-        run_ctx: &dyn StreamProcessCtxInterface,
-        ack_callback: Box<dyn FnOnce(StreamRecordAck) + Send>,
-    ) -> Option<StreamRecordAck> {
-        let isolate_scope = self.script_ctx.isolate.enter();
-        let ctx_scope = self.script_ctx.context.enter(&isolate_scope);
-        let trycatch = isolate_scope.new_try_catch();
-
+        record: &dyn StreamRecordInterface,
+    ) -> V8LocalObject<'isolate_scope, 'isolate> {
+        let strings_cache = &self.script_ctx.strings_cache;
         let id = record.get_id();
         let id_v8_arr = isolate_scope.new_array(&[
             &isolate_scope.new_long(id.0 as i64),
@@ -77,7 +81,7 @@ impl V8StreamCtxInternals {
             .fields()
             .map(|(f, v)| {
                 let f = match str::from_utf8(f) {
-                    Ok(s) => isolate_scope.new_string(s).to_value(),
+                    Ok(s) => strings_cache.get_recurring(isolate_scope, s),
                     Err(_) => isolate_scope.new_null(),
                 };
                 let v = match str::from_utf8(v) {
@@ -107,30 +111,46 @@ impl V8StreamCtxInternals {
 
         let stream_data = isolate_scope.new_object();
         stream_data.set(
-            &ctx_scope,
-            &isolate_scope.new_string("id").to_value(),
+            ctx_scope,
+            &strings_cache.get(isolate_scope, V8CachedString::Id),
             &id_v8_arr.to_value(),
         );
         stream_data.set(
-            &ctx_scope,
-            &isolate_scope.new_string("stream_name").to_value(),
+            ctx_scope,
+            &strings_cache.get(isolate_scope, V8CachedString::StreamName),
             &stream_name_v8_str,
         );
         stream_data.set(
-            &ctx_scope,
-            &isolate_scope.new_string("stream_name_raw").to_value(),
+            ctx_scope,
+            &strings_cache.get(isolate_scope, V8CachedString::StreamNameRaw),
             &isolate_scope.new_array_buffer(stream_name).to_value(),
         );
         stream_data.set(
-            &ctx_scope,
-            &isolate_scope.new_string("record").to_value(),
+            ctx_scope,
+            &strings_cache.get(isolate_scope, V8CachedString::Record),
             &val_v8_arr.to_value(),
         );
         stream_data.set(
-            &ctx_scope,
-            &isolate_scope.new_string("record_raw").to_value(),
+            ctx_scope,
+            &strings_cache.get(isolate_scope, V8CachedString::RecordRaw),
             &raw_val_v8_arr.to_value(),
         );
+        stream_data
+    }
+
+    fn process_record_internal_sync(
+        &self,
+        stream_name: &[u8],
+        record: Box<dyn StreamRecordInterface>,
+        run_ctx: &dyn StreamProcessCtxInterface,
+        ack_callback: Box<dyn FnOnce(StreamRecordAck) + Send>,
+    ) -> Option<StreamRecordAck> {
+        let isolate_scope = self.script_ctx.isolate.enter();
+        let ctx_scope = self.script_ctx.context.enter(&isolate_scope);
+        let trycatch = isolate_scope.new_try_catch();
+
+        let stream_data =
+            self.record_to_js_object(&isolate_scope, &ctx_scope, stream_name, record.as_ref());
 
         let c = run_ctx.get_redis_client();
         let redis_client = Arc::new(RefCell::new(RedisClient::with_client(c.as_ref())));
@@ -201,74 +221,8 @@ impl V8StreamCtxInternals {
             let ctx_scope = self.script_ctx.context.enter(&isolate_scope);
             let trycatch = isolate_scope.new_try_catch();
 
-            let id = record.get_id();
-            let id_v8_arr = isolate_scope.new_array(&[
-                &isolate_scope.new_long(id.0 as i64),
-                &isolate_scope.new_long(id.1 as i64),
-            ]);
-            let stream_name_v8_str = match std::str::from_utf8(stream_name) {
-                Ok(s) => isolate_scope.new_string(s).to_value(),
-                Err(_) => isolate_scope.new_null(),
-            };
-
-            let vals = record
-                .fields()
-                .map(|(f, v)| {
-                    let f = match str::from_utf8(f) {
-                        Ok(s) => isolate_scope.new_string(s).to_value(),
-                        Err(_) => isolate_scope.new_null(),
-                    };
-                    let v = match str::from_utf8(v) {
-                        Ok(s) => isolate_scope.new_string(s).to_value(),
-                        Err(_) => isolate_scope.new_null(),
-                    };
-                    isolate_scope.new_array(&[&f, &v]).to_value()
-                })
-                .collect::<Vec<V8LocalValue>>();
-
-            let raw_vals = record
-                .fields()
-                .map(|(f, v)| {
-                    isolate_scope
-                        .new_array(&[
-                            &isolate_scope.new_array_buffer(f).to_value(),
-                            &isolate_scope.new_array_buffer(v).to_value(),
-                        ])
-                        .to_value()
-                })
-                .collect::<Vec<V8LocalValue>>();
-
-            let val_v8_arr = isolate_scope.new_array(&vals.iter().collect::<Vec<&V8LocalValue>>());
-
-            let raw_val_v8_arr =
-                isolate_scope.new_array(&raw_vals.iter().collect::<Vec<&V8LocalValue>>());
-
-            let stream_data = isolate_scope.new_object();
-            stream_data.set(
-                &ctx_scope,
-                &isolate_scope.new_string("id").to_value(),
-                &id_v8_arr.to_value(),
-            );
-            stream_data.set(
-                &ctx_scope,
-                &isolate_scope.new_string("stream_name").to_value(),
-                &stream_name_v8_str,
-            );
-            stream_data.set(
-                &ctx_scope,
-                &isolate_scope.new_string("stream_name_raw").to_value(),
-                &isolate_scope.new_array_buffer(stream_name).to_value(),
-            );
-            stream_data.set(
-                &ctx_scope,
-                &isolate_scope.new_string("record").to_value(),
-                &val_v8_arr.to_value(),
-            );
-            stream_data.set(
-                &ctx_scope,
-                &isolate_scope.new_string("record_raw").to_value(),
-                &raw_val_v8_arr.to_value(),
-            );
+            let stream_data =
+                self.record_to_js_object(&isolate_scope, &ctx_scope, stream_name, record.as_ref());
 
             let r_client = get_backgrounnd_client(
                 &self.script_ctx,
@@ -0,0 +1,176 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+//! A per library cache of persisted V8 strings. The conversion code
+//! creates the same strings (property names, reply type markers, stream
+//! field names, notification events, key types) on every invocation. Reusing a
+//! persisted string saves the allocation and, as V8 internalizes a
+//! string the first time it is used as a property key, also saves the
+//! internalization on every following property access.
+//!
+//! Only names are cached: the names Redis defines (notification events,
+//! key types, verbatim formats) and field names, that is stream record
+//! field names and RESP3 map keys, which usually come from a small schema.
+//! Key names, stream names and values are never cached, they are unbounded
+//! and would only churn the cache. Long strings are never cached either,
+//! and the least recently used string is evicted when the cache is full,
+//! so field names that do not recur can not push out the ones that do.
+//!
+//! The cache must only be accessed while the library isolate is entered.
+
+use redisgears_plugin_api::redisgears_plugin_api::RefCellWrapper;
+
+use v8_rs::v8::isolate_scope::V8IsolateScope;
+use v8_rs::v8::v8_value::{V8LocalValue, V8PersistValue};
+
+use std::cell::RefCell;
+use std::collections::{BTreeMap, HashMap};
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+/// The maximum number of recurring strings kept by the cache.
+const RECURRING_STRINGS_CAPACITY: usize = 1024;
+
+/// Longer strings are unlikely to recur (values rather than names)
+/// and are never cached.
+const MAX_RECURRING_STRING_LEN: usize = 64;
+
+/// Fixed strings which are used on every invocation.
+#[derive(Clone, Copy)]
+pub(crate) enum V8CachedString {
+    ReplyType,
+    Format,
+    Verbatim,
+    BigNumber,
+    Id,
+    StreamName,
+    StreamNameRaw,
+    Record,
+    RecordRaw,
+    Event,
+    Key,
+    KeyRaw,
+    Type,
+    Value,
+}
+
+impl V8CachedString {
+    const COUNT: usize = 14;
+
+    fn as_str(&self) -> &'static str {
+        match self {
+            V8CachedString::ReplyType => "__reply_type",
+            V8CachedString::Format => "__format",
+            V8CachedString::Verbatim => "verbatim",
+            V8CachedString::BigNumber => "big_number",
+            V8CachedString::Id => "id",
+            V8CachedString::StreamName => "stream_name",
+            V8CachedString::StreamNameRaw => "stream_name_raw",
+            V8CachedString::Record => "record",
+            V8CachedString::RecordRaw => "record_raw",
+            V8CachedString::Event => "event",
+            V8CachedString::Key => "key",
+            V8CachedString::KeyRaw => "key_raw",
+            V8CachedString::Type => "type",
+            V8CachedString::Value => "value",
+        }
+    }
+}
+
+#[derive(Default)]
+struct V8StringsCacheInner {
+    fixed: [Option<V8PersistValue>; V8CachedString::COUNT],
+    /// The recurring strings and the last time they were used.
+    recurring: HashMap<String, (V8PersistValue, u64)>,
+    /// The recurring strings by the last time they were used, the least
+    /// recently used string is evicted first when the cache is full.
+    usage_order: BTreeMap<u64, String>,
+    /// A logical clock, advanced on each use of a recurring string.
+    clock: u64,
+}
+
+pub(crate) struct V8StringsCache {
+    inner: RefCellWrapper<V8StringsCacheInner>,
+    hits: AtomicUsize,
+    misses: AtomicUsize,
+}
+
+impl V8StringsCache {
+    pub(crate) fn new() -> V8StringsCache {
+        V8StringsCache {
+            inner: RefCellWrapper {
+                ref_cell: RefCell::new(V8StringsCacheInner::default()),
+            },
+            hits: AtomicUsize::new(0),
+            misses: AtomicUsize::new(0),
+        }
+    }
+
+    /// Return the given fixed string.
+    pub(crate) fn get<'isolate_scope, 'isolate>(
+        &self,
+        isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+        string: V8CachedString,
+    ) -> V8LocalValue<'isolate_scope, 'isolate> {
+        let mut inner = self.inner.ref_cell.borrow_mut();
+        inner.fixed[string as usize]
+            .get_or_insert_with(|| {
+                isolate_scope
+                    .new_string(string.as_str())
+                    .to_value()
+                    .persist()
+            })
+            .as_local(isolate_scope)
+    }
+
+    /// Return a V8 string with the given content, reusing a previously
+    /// created string if the content recurs. Must only be used for names
+    /// (event names, key types, field names, ...), see the module docs.
+    pub(crate) fn get_recurring<'isolate_scope, 'isolate>(
+        &self,
+        isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+        string: &str,
+    ) -> V8LocalValue<'isolate_scope, 'isolate> {
+        if string.len() > MAX_RECURRING_STRING_LEN {
+            return isolate_scope.new_string(string).to_value();
+        }
+        let mut inner = self.inner.ref_cell.borrow_mut();
+        let inner = &mut *inner;
+        inner.clock += 1;
+        let now = inner.clock;
+        if let Some((v, last_used)) = inner.recurring.get_mut(string) {
+            self.hits.fetch_add(1, Ordering::Relaxed);
+            // promote the string to the most recently used.
+            if let Some(s) = inner.usage_order.remove(&*last_used) {
+                inner.usage_order.insert(now, s);
+            }
+            *last_used = now;
+            return v.as_local(isolate_scope);
+        }
+        self.misses.fetch_add(1, Ordering::Relaxed);
+        if inner.recurring.len() >= RECURRING_STRINGS_CAPACITY {
+            if let Some((_, least_recent)) = inner.usage_order.pop_first() {
+                inner.recurring.remove(&least_recent);
+            }
+        }
+        let value = isolate_scope.new_string(string).to_value().persist();
+        let local = value.as_local(isolate_scope);
+        inner.recurring.insert(string.to_owned(), (value, now));
+        inner.usage_order.insert(now, string.to_owned());
+        local
+    }
+
+    /// Adds the cache statistics to the library info.
+    pub(crate) fn add_to_info(&self, info: &mut HashMap<String, String>) {
+        info.insert(
+            "strings_cache_hits".to_owned(),
+            self.hits.load(Ordering::Relaxed).to_string(),
+        );
+        info.insert(
+            "strings_cache_misses".to_owned(),
+            self.misses.load(Ordering::Relaxed).to_string(),
+        );
+    }
+}
@@ -0,0 +1,619 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+//! A compact binary encoding of JS values, used to pass arguments and
+//! results of remote functions between shards. Unlike JSON, the encoding
+//! keeps the distinction between integers and doubles, preserves `Set`s,
+//! `Map`s, `BigInt`s, `NaN`/`Infinity`, nested `ArrayBuffer`s, typed arrays
+//! and `DataView`s, and does not require parsing text on the receiving side.
+//!
+//! Values that can not be represented (functions, `undefined` at the top
+//! level, objects with a custom `toJSON`, ...) are not serialized and the
+//! caller is expected to fall back to JSON. `WeakMap`s and `WeakSet`s can
+//! not be enumerated and are rejected, JSON would silently turn them into
+//! empty objects.
+//!
+//! Shards that do not know the encoding can not read it, so it is only
+//! used when the `remote-functions-structured-encoding` configuration is
+//! enabled.
+
+use v8_rs::v8::v8_array::V8LocalArray;
+use v8_rs::v8::{
+    isolate_scope::V8IsolateScope, v8_context_scope::V8ContextScope, v8_object::V8LocalObject,
+    v8_value::V8LocalValue,
+};
+
+/// The version of the encoding, written as the first byte.
+const FORMAT_VERSION: u8 = 1;
+
+/// Maximum nesting level of values we are willing to serialize.
+const MAX_NESTING_LEVEL: usize = 100;
+
+const TAG_NULL: u8 = 0;
+const TAG_TRUE: u8 = 1;
+const TAG_FALSE: u8 = 2;
+const TAG_INTEGER: u8 = 3;
+const TAG_DOUBLE: u8 = 4;
+const TAG_STRING: u8 = 5;
+const TAG_ARRAY_BUFFER: u8 = 6;
+const TAG_ARRAY: u8 = 7;
+const TAG_SET: u8 = 8;
+const TAG_OBJECT: u8 = 9;
+const TAG_BIG_INT: u8 = 10;
+const TAG_MAP: u8 = 11;
+const TAG_ARRAY_BUFFER_VIEW: u8 = 12;
+
+/// Built-in objects that have no representation in the encoding and that
+/// JSON would turn into plain objects, losing their content or type.
+const UNSUPPORTED_OBJECTS: &[&str] = &["WeakMap", "WeakSet"];
+
+/// The views on an `ArrayBuffer` the encoding supports, the index on this
+/// list is written to identify the view type so it must never be reordered.
+const ARRAY_BUFFER_VIEWS: &[&str] = &[
+    "DataView",
+    "Int8Array",
+    "Uint8Array",
+    "Uint8ClampedArray",
+    "Int16Array",
+    "Uint16Array",
+    "Int32Array",
+    "Uint32Array",
+    "Float32Array",
+    "Float64Array",
+    "BigInt64Array",
+    "BigUint64Array",
+];
+
+/// The reason a value was not serialized.
+#[derive(Debug)]
+pub(crate) enum SerializeError {
+    /// The value can not be represented by the encoding, the caller
+    /// should fall back to JSON.
+    NotRepresentable,
+    /// The value can not be passed to a remote function at all.
+    Unsupported(String),
+}
+
+/// Return the value found by following the given fields path from the global object.
+fn get_global<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    path: &[&str],
+) -> Option<V8LocalValue<'isolate_scope, 'isolate>> {
+    let (first, rest) = path.split_first()?;
+    let mut val = ctx_scope.get_globals().get_str_field(ctx_scope, first)?;
+    for field in rest {
+        if !val.is_object() && !val.is_function() {
+            return None;
+        }
+        val = val.as_object().get_str_field(ctx_scope, field)?;
+    }
+    Some(val)
+}
+
+/// Call the global function found on the given path.
+fn call_global<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    path: &[&str],
+    args: Option<&[&V8LocalValue<'isolate_scope, 'isolate>]>,
+) -> Option<V8LocalValue<'isolate_scope, 'isolate>> {
+    get_global(ctx_scope, path)
+        .filter(|f| f.is_function())?
+        .call(ctx_scope, args)
+}
+
+/// Return the builtin type of the given value as reported by
+/// `Object.prototype.toString` (`Map`, `BigInt`, `Uint8Array`, ...).
+fn builtin_type_name<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    val: &V8LocalValue<'isolate_scope, 'isolate>,
+) -> Option<String> {
+    let to_string = get_global(ctx_scope, &["Object", "prototype", "toString"])?;
+    let no_args = call_global(ctx_scope, &["Array", "of"], None)?;
+    let res = call_global(
+        ctx_scope,
+        &["Reflect", "apply"],
+        Some(&[&to_string, val, &no_args]),
+    )?
+    .to_utf8()?;
+    res.as_str()
+        .strip_prefix("[object ")
+        .and_then(|v| v.strip_suffix(']'))
+        .map(|v| v.to_string())
+}
+
+/// Write the content of an `ArrayBuffer` view (a typed array or a `DataView`),
+/// only the viewed range of the underlying `ArrayBuffer` is written.
+fn write_array_buffer_view<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    buff: &mut Vec<u8>,
+    view_type: usize,
+    obj: &V8LocalObject<'isolate_scope, 'isolate>,
+) -> Result<(), SerializeError> {
+    let get_usize = |name: &str| {
+        obj.get_str_field(ctx_scope, name)
+            .filter(|v| v.is_long() && v.get_long() >= 0)
+            .map(|v| v.get_long() as usize)
+    };
+    let buffer = obj
+        .get_str_field(ctx_scope, "buffer")
+        .filter(|v| v.is_array_buffer())
+        .ok_or_else(|| {
+            // views on a SharedArrayBuffer
+            SerializeError::Unsupported(format!(
+                "{} values that are not backed by an ArrayBuffer can not be passed to remote functions",
+                ARRAY_BUFFER_VIEWS[view_type]
+            ))
+        })?;
+    let offset = get_usize("byteOffset").ok_or(SerializeError::NotRepresentable)?;
+    let len = get_usize("byteLength").ok_or(SerializeError::NotRepresentable)?;
+    let buffer = buffer.as_array_buffer();
+    let data = buffer
+        .data()
+        .get(offset..offset + len)
+        .ok_or(SerializeError::NotRepresentable)?;
+    buff.push(TAG_ARRAY_BUFFER_VIEW);
+    buff.push(view_type as u8);
+    write_bytes(buff, data);
+    Ok(())
+}
+
+fn write_varint(buff: &mut Vec<u8>, mut val: u64) {
+    while val >= 0x80 {
+        buff.push((val as u8) | 0x80);
+        val >>= 7;
+    }
+    buff.push(val as u8);
+}
+
+fn write_bytes(buff: &mut Vec<u8>, data: &[u8]) {
+    write_varint(buff, data.len() as u64);
+    buff.extend_from_slice(data);
+}
+
+fn write_values<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    buff: &mut Vec<u8>,
+    nesting_level: usize,
+    tag: u8,
+    values: &[V8LocalValue<'isolate_scope, 'isolate>],
+) -> Result<(), SerializeError> {
+    buff.push(tag);
+    write_varint(buff, values.len() as u64);
+    values
+        .iter()
+        .try_for_each(|v| write_value(ctx_scope, buff, nesting_level + 1, v))
+}
+
+/// Write the entries of a `Map`, each entry is written as its key followed by its value.
+fn write_map<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    buff: &mut Vec<u8>,
+    nesting_level: usize,
+    val: &V8LocalValue<'isolate_scope, 'isolate>,
+) -> Result<(), SerializeError> {
+    let entries = call_global(ctx_scope, &["Array", "from"], Some(&[val]))
+        .filter(|v| v.is_array())
+        .ok_or(SerializeError::NotRepresentable)?;
+    let entries: Vec<_> = entries.as_array().iter(ctx_scope).collect();
+    buff.push(TAG_MAP);
+    write_varint(buff, entries.len() as u64);
+    for entry in entries.iter() {
+        if !entry.is_array() {
+            return Err(SerializeError::NotRepresentable);
+        }
+        let key_value: Vec<_> = entry.as_array().iter(ctx_scope).collect();
+        if key_value.len() != 2 {
+            return Err(SerializeError::NotRepresentable);
+        }
+        write_value(ctx_scope, buff, nesting_level + 1, &key_value[0])
+            .and_then(|_| write_value(ctx_scope, buff, nesting_level + 1, &key_value[1]))
+            .map_err(|e| match e {
+                // JSON would turn the Map into an empty object, do not fall back to it.
+                SerializeError::NotRepresentable => SerializeError::Unsupported(
+                    "Map values with entries that can not be serialized can not be passed to remote functions".to_string(),
+                ),
+                e => e,
+            })?;
+    }
+    Ok(())
+}
+
+fn write_big_int(buff: &mut Vec<u8>, val: &V8LocalValue) -> Result<(), SerializeError> {
+    // the decimal representation, it is what `BigInt()` accepts back.
+    let s = val.to_utf8().ok_or(SerializeError::NotRepresentable)?;
+    buff.push(TAG_BIG_INT);
+    write_bytes(buff, s.as_str().as_bytes());
+    Ok(())
+}
+
+fn write_value<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    buff: &mut Vec<u8>,
+    nesting_level: usize,
+    val: &V8LocalValue<'isolate_scope, 'isolate>,
+) -> Result<(), SerializeError> {
+    if nesting_level > MAX_NESTING_LEVEL {
+        return Err(SerializeError::NotRepresentable);
+    }
+    if val.is_array_buffer() {
+        buff.push(TAG_ARRAY_BUFFER);
+        write_bytes(buff, val.as_array_buffer().data());
+    } else if val.is_null() {
+        buff.push(TAG_NULL);
+    } else if val.is_boolean() {
+        buff.push(if val.get_boolean() {
+            TAG_TRUE
+        } else {
+            TAG_FALSE
+        });
+    } else if val.is_long() {
+        let v = val.get_long();
+        buff.push(TAG_INTEGER);
+        // zigzag encoding so small negative numbers will also be small.
+        write_varint(buff, ((v << 1) ^ (v >> 63)) as u64);
+    } else if val.is_number() {
+        buff.push(TAG_DOUBLE);
+        buff.extend_from_slice(&val.get_number().to_le_bytes());
+    } else if val.is_string() {
+        buff.push(TAG_STRING);
+        let s = val.to_utf8().ok_or(SerializeError::NotRepresentable)?;
+        write_bytes(buff, s.as_str().as_bytes());
+    } else if val.is_set() {
+        let arr: V8LocalArray = val.as_set().into();
+        let values: Vec<_> = arr.iter(ctx_scope).collect();
+        write_values(ctx_scope, buff, nesting_level, TAG_SET, &values)?;
+    } else if val.is_array() {
+        let arr = val.as_array();
+        let values: Vec<_> = arr.iter(ctx_scope).collect();
+        write_values(ctx_scope, buff, nesting_level, TAG_ARRAY, &values)?;
+    } else if val.is_object() && !val.is_function() && !val.is_string_object() {
+        let obj = val.as_object();
+        let type_name = builtin_type_name(ctx_scope, val).unwrap_or_default();
+        if UNSUPPORTED_OBJECTS.contains(&type_name.as_str()) {
+            return Err(SerializeError::Unsupported(format!(
+                "{type_name} values can not be passed to remote functions"
+            )));
+        }
+        if type_name == "Map" {
+            return write_map(ctx_scope, buff, nesting_level, val);
+        }
+        if type_name == "BigInt" {
+            // a BigInt object, like `Object(1n)`.
+            return write_big_int(buff, val);
+        }
+        if let Some(view_type) = ARRAY_BUFFER_VIEWS
+            .iter()
+            .position(|v| *v == type_name.as_str())
+        {
+            // make sure it is a real view and not an object that only claims to be one.
+            if call_global(ctx_scope, &["ArrayBuffer", "isView"], Some(&[val]))
+                .map_or(false, |v| v.is_boolean() && v.get_boolean())
+            {
+                return write_array_buffer_view(ctx_scope, buff, view_type, &obj);
+            }
+        }
+        if obj
+            .get_str_field(ctx_scope, "toJSON")
+            .map_or(false, |v| v.is_function())
+        {
+            // the object has a custom JSON representation (like Date),
+            // let JSON handle it.
+            return Err(SerializeError::NotRepresentable);
+        }
+        let mut fields = Vec::new();
+        for key in obj.get_own_property_names(ctx_scope).iter(ctx_scope) {
+            let field = obj
+                .get(ctx_scope, &key)
+                .ok_or(SerializeError::NotRepresentable)?;
+            if field.is_undefined() || field.is_function() {
+                // same as JSON, skip fields that can not be represented.
+                continue;
+            }
+            let key = key.to_utf8().ok_or(SerializeError::NotRepresentable)?;
+            fields.push((key, field));
+        }
+        buff.push(TAG_OBJECT);
+        write_varint(buff, fields.len() as u64);
+        for (key, field) in fields.iter() {
+            write_bytes(buff, key.as_str().as_bytes());
+            write_value(ctx_scope, buff, nesting_level + 1, field)?;
+        }
+    } else if !val.is_undefined()
+        && !val.is_function()
+        && builtin_type_name(ctx_scope, val).map_or(false, |v| v == "BigInt")
+    {
+        write_big_int(buff, val)?;
+    } else {
+        return Err(SerializeError::NotRepresentable);
+    }
+    Ok(())
+}
+
+/// Serialize the given value, return an error if the value (or any of
+/// its nested values) can not be represented by the binary encoding.
+pub(crate) fn serialize_value<'isolate_scope, 'isolate>(
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    val: &V8LocalValue<'isolate_scope, 'isolate>,
+) -> Result<Vec<u8>, SerializeError> {
+    let mut buff = vec![FORMAT_VERSION];
+    write_value(ctx_scope, &mut buff, 0, val)?;
+    Ok(buff)
+}
+
+struct Reader<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    fn read_u8(&mut self) -> Option<u8> {
+        let (first, rest) = self.data.split_first()?;
+        self.data = rest;
+        Some(*first)
+    }
+
+    fn read_varint(&mut self) -> Option<u64> {
+        let mut res = 0u64;
+        for shift in (0..64).step_by(7) {
+            let b = self.read_u8()?;
+            res |= ((b & 0x7f) as u64) << shift;
+            if b & 0x80 == 0 {
+                return Some(res);
+            }
+        }
+        None
+    }
+
+    fn read_bytes(&mut self) -> Option<&'a [u8]> {
+        let len = usize::try_from(self.read_varint()?).ok()?;
+        if len > self.data.len() {
+            return None;
+        }
+        let (res, rest) = self.data.split_at(len);
+        self.data = rest;
+        Some(res)
+    }
+
+    fn read_str(&mut self) -> Option<&'a str> {
+        std::str::from_utf8(self.read_bytes()?).ok()
+    }
+
+    fn read_len(&mut self) -> Option<usize> {
+        let len = usize::try_from(self.read_varint()?).ok()?;
+        // each value takes at least one byte, protect against bogus lengths.
+        if len > self.data.len() {
+            return None;
+        }
+        Some(len)
+    }
+}
+
+/// Construct an object using the global constructor with the given name,
+/// same as `new name(...args)`.
+fn construct_global<'isolate_scope, 'isolate>(
+    isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    name: &str,
+    args: &[&V8LocalValue<'isolate_scope, 'isolate>],
+) -> Option<V8LocalValue<'isolate_scope, 'isolate>> {
+    let constructor = get_global(ctx_scope, &[name]).filter(|v| v.is_function())?;
+    let args = isolate_scope.new_array(args).to_value();
+    call_global(
+        ctx_scope,
+        &["Reflect", "construct"],
+        Some(&[&constructor, &args]),
+    )
+}
+
+fn read_value<'isolate_scope, 'isolate>(
+    isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    reader: &mut Reader,
+    nesting_level: usize,
+) -> Option<V8LocalValue<'isolate_scope, 'isolate>> {
+    if nesting_level > MAX_NESTING_LEVEL {
+        return None;
+    }
+    Some(match reader.read_u8()? {
+        TAG_NULL => isolate_scope.new_null(),
+        TAG_TRUE => isolate_scope.new_bool(true),
+        TAG_FALSE => isolate_scope.new_bool(false),
+        TAG_INTEGER => {
+            let v = reader.read_varint()?;
+            isolate_scope.new_long(((v >> 1) as i64) ^ -((v & 1) as i64))
+        }
+        TAG_DOUBLE => {
+            let bytes = reader.data.get(..8)?.try_into().ok()?;
+            reader.data = &reader.data[8..];
+            isolate_scope.new_double(f64::from_le_bytes(bytes))
+        }
+        TAG_STRING => isolate_scope.new_string(reader.read_str()?).to_value(),
+        TAG_ARRAY_BUFFER => isolate_scope
+            .new_array_buffer(reader.read_bytes()?)
+            .to_value(),
+        TAG_ARRAY => {
+            let len = reader.read_len()?;
+            let values = (0..len)
+                .map(|_| read_value(isolate_scope, ctx_scope, reader, nesting_level + 1))
+                .collect::<Option<Vec<_>>>()?;
+            isolate_scope
+                .new_array(&values.iter().collect::<Vec<&V8LocalValue>>())
+                .to_value()
+        }
+        TAG_SET => {
+            let len = reader.read_len()?;
+            let set = isolate_scope.new_set();
+            for _ in 0..len {
+                set.add(
+                    ctx_scope,
+                    &read_value(isolate_scope, ctx_scope, reader, nesting_level + 1)?,
+                );
+            }
+            set.to_value()
+        }
+        TAG_OBJECT => {
+            let len = reader.read_len()?;
+            let obj = isolate_scope.new_object();
+            for _ in 0..len {
+                let key = isolate_scope.new_string(reader.read_str()?).to_value();
+                let val = read_value(isolate_scope, ctx_scope, reader, nesting_level + 1)?;
+                obj.set(ctx_scope, &key, &val);
+            }
+            obj.to_value()
+        }
+        TAG_BIG_INT => {
+            let val = isolate_scope.new_string(reader.read_str()?).to_value();
+            call_global(ctx_scope, &["BigInt"], Some(&[&val]))?
+        }
+        TAG_MAP => {
+            let len = reader.read_len()?;
+            let entries = (0..len)
+                .map(|_| {
+                    let key = read_value(isolate_scope, ctx_scope, reader, nesting_level + 1)?;
+                    let val = read_value(isolate_scope, ctx_scope, reader, nesting_level + 1)?;
+                    Some(isolate_scope.new_array(&[&key, &val]).to_value())
+                })
+                .collect::<Option<Vec<_>>>()?;
+            let entries = isolate_scope
+                .new_array(&entries.iter().collect::<Vec<&V8LocalValue>>())
+                .to_value();
+            construct_global(isolate_scope, ctx_scope, "Map", &[&entries])?
+        }
+        TAG_ARRAY_BUFFER_VIEW => {
+            let view_type = ARRAY_BUFFER_VIEWS.get(reader.read_u8()? as usize)?;
+            let buffer = isolate_scope
+                .new_array_buffer(reader.read_bytes()?)
+                .to_value();
+            construct_global(isolate_scope, ctx_scope, view_type, &[&buffer])?
+        }
+        _ => return None,
+    })
+}
+
+/// Deserialize a value that was serialized with [`serialize_value`],
+/// return [`None`] if the data is malformed.
+pub(crate) fn deserialize_value<'isolate_scope, 'isolate>(
+    isolate_scope: &'isolate_scope V8IsolateScope<'isolate>,
+    ctx_scope: &V8ContextScope<'isolate_scope, 'isolate>,
+    data: &[u8],
+) -> Option<V8LocalValue<'isolate_scope, 'isolate>> {
+    let mut reader = Reader { data };
+    if reader.read_u8()? != FORMAT_VERSION {
+        return None;
+    }
+    let res = read_value(isolate_scope, ctx_scope, &mut reader, 0)?;
+    if !reader.data.is_empty() {
+        return None;
+    }
+    Some(res)
+}
+
+/// A scalar value that can be read from the encoding without entering V8.
+#[derive(Debug, Clone, PartialEq)]
+pub(crate) enum ScalarValue {
+    Integer(i64),
+    Double(f64),
+    String(String),
+}
+
+fn read_scalar(reader: &mut Reader) -> Option<ScalarValue> {
+    Some(match reader.read_u8()? {
+        TAG_INTEGER => {
+            let v = reader.read_varint()?;
+            ScalarValue::Integer(((v >> 1) as i64) ^ -((v & 1) as i64))
+        }
+        TAG_DOUBLE => {
+            let bytes = reader.data.get(..8)?.try_into().ok()?;
+            reader.data = &reader.data[8..];
+            ScalarValue::Double(f64::from_le_bytes(bytes))
+        }
+        TAG_STRING => ScalarValue::String(reader.read_str()?.to_string()),
+        _ => return None,
+    })
+}
+
+/// Read a value that was serialized with [`serialize_value`] without
+/// entering V8. Only a single scalar or an array (or a `Set`) of scalars
+/// are supported, a single scalar is returned as a list of one element.
+/// Return [`None`] if the data is malformed or holds any other value.
+pub(crate) fn deserialize_scalars(data: &[u8]) -> Option<Vec<ScalarValue>> {
+    let mut reader = Reader { data };
+    if reader.read_u8()? != FORMAT_VERSION {
+        return None;
+    }
+    let res = match reader.data.first()? {
+        &TAG_ARRAY | &TAG_SET => {
+            reader.read_u8()?;
+            let len = reader.read_len()?;
+            (0..len)
+                .map(|_| read_scalar(&mut reader))
+                .collect::<Option<Vec<_>>>()?
+        }
+        _ => vec![read_scalar(&mut reader)?],
+    };
+    if !reader.data.is_empty() {
+        return None;
+    }
+    Some(res)
+}
+
+/// Returns the number of elements of a serialized array (or `Set`) without
+/// entering V8, return [`None`] if the serialized value is not an array.
+pub(crate) fn array_len(data: &[u8]) -> Option<usize> {
+    let mut reader = Reader { data };
+    if reader.read_u8()? != FORMAT_VERSION {
+        return None;
+    }
+    match reader.read_u8()? {
+        TAG_ARRAY | TAG_SET => reader.read_len(),
+        _ => None,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_varint_round_trip() {
+        for v in [0u64, 1, 127, 128, 300, u32::MAX as u64, u64::MAX] {
+            let mut buff = Vec::new();
+            write_varint(&mut buff, v);
+            let mut reader = Reader { data: &buff };
+            assert_eq!(reader.read_varint(), Some(v));
+            assert!(reader.data.is_empty());
+        }
+    }
+
+    #[test]
+    fn test_truncated_bytes_are_rejected() {
+        let mut buff = Vec::new();
+        write_bytes(&mut buff, b"hello");
+        let mut reader = Reader {
+            data: &buff[..buff.len() - 1],
+        };
+        assert_eq!(reader.read_bytes(), None);
+    }
+
+    #[test]
+    fn test_deserialize_scalars() {
+        let mut buff = vec![FORMAT_VERSION, TAG_ARRAY];
+        write_varint(&mut buff, 2);
+        buff.push(TAG_INTEGER);
+        write_varint(&mut buff, 3); // zigzag encoding of -2
+        buff.push(TAG_STRING);
+        write_bytes(&mut buff, b"foo");
+        assert_eq!(
+            deserialize_scalars(&buff),
+            Some(vec![
+                ScalarValue::Integer(-2),
+                ScalarValue::String("foo".to_string())
+            ])
+        );
+
+        buff = vec![FORMAT_VERSION, TAG_NULL];
+        assert_eq!(deserialize_scalars(&buff), None);
+    }
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright Redis Ltd. 2018 - present
+ * Licensed under your choice of the Redis Source Available License 2.0 (RSALv2) or
+ * the Server Side Public License v1 (SSPLv1).
+ */
+
+//! A deadline based watchdog for scripts that hold the Redis GIL.
+//! A deadline is armed when a script locks the GIL, and the watchdog
+//! thread sleeps until the nearest deadline instead of periodically
+//! scanning all the isolates.
+
+use std::cmp::{Ordering, Reverse};
+use std::collections::BinaryHeap;
+use std::sync::{Condvar, Mutex, Weak};
+use std::time::{Duration, Instant};
+
+use crate::v8_script_ctx::V8ScriptCtx;
+
+lazy_static::lazy_static! {
+    static ref EPOCH: Instant = Instant::now();
+    static ref WATCHDOG: Watchdog = Watchdog {
+        queue: Mutex::new(DeadlineQueue::default()),
+        condvar: Condvar::new(),
+    };
+}
+
+/// Return the number of milliseconds passed since the watchdog epoch.
+/// The returned value is always positive so `0` can be used to indicate
+/// an unset time.
+pub(crate) fn now_ms() -> u64 {
+    EPOCH.elapsed().as_millis() as u64 + 1
+}
+
+struct DeadlineEntry {
+    deadline: u64,
+    script_ctx: Weak<V8ScriptCtx>,
+}
+
+impl PartialEq for DeadlineEntry {
+    fn eq(&self, other: &Self) -> bool {
+        self.deadline == other.deadline
+    }
+}
+
+impl Eq for DeadlineEntry {}
+
+impl PartialOrd for DeadlineEntry {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for DeadlineEntry {
+    fn cmp(&self, other: &Self) -> Ordering {
+        self.deadline.cmp(&other.deadline)
+    }
+}
+
+/// Armed deadlines ordered by the earliest one.
+#[derive(Default)]
+struct DeadlineQueue {
+    entries: BinaryHeap<Reverse<DeadlineEntry>>,
+    /// Set by [`notify`], cause the next wait to return immediately.
+    notified: bool,
+}
+
+impl DeadlineQueue {
+    /// Add a deadline to the queue, return `true` if the new deadline
+    /// is the nearest one.
+    fn arm(&mut self, deadline: u64, script_ctx: Weak<V8ScriptCtx>) -> bool {
+        let is_nearest = self.next_deadline().map_or(true, |v| deadline < v);
+        self.entries.push(Reverse(DeadlineEntry {
+            deadline,
+            script_ctx,
+        }));
+        is_nearest
+    }
+
+    fn next_deadline(&self) -> Option<u64> {
+        self.entries.peek().map(|v| v.0.deadline)
+    }
+
+    fn pop_expired(&mut self, now: u64) -> Vec<Weak<V8ScriptCtx>> {
+        let mut res = Vec::new();
+        while self.next_deadline().map_or(false, |v| v <= now) {
+            res.push(self.entries.pop().unwrap().0.script_ctx);
+        }
+        res
+    }
+}
+
+struct Watchdog {
+    queue: Mutex<DeadlineQueue>,
+    condvar: Condvar,
+}
+
+/// Arm a deadline (in milliseconds since the watchdog epoch, see [`now_ms`])
+/// for the given script. The watchdog thread is only woken up if the new
+/// deadline is nearer than all the already armed deadlines.
+pub(crate) fn arm(deadline: u64, script_ctx: Weak<V8ScriptCtx>) {
+    if WATCHDOG.queue.lock().unwrap().arm(deadline, script_ctx) {
+        WATCHDOG.condvar.notify_one();
+    }
+}
+
+/// Wake up the watchdog thread, used when the watchdog thread should
+/// re-evaluate its state (like when entering an OOM state).
+pub(crate) fn notify() {
+    WATCHDOG.queue.lock().unwrap().notified = true;
+    WATCHDOG.condvar.notify_one();
+}
+
+/// Block until the nearest deadline is reached, or until `max_wait` passed,
+/// whichever comes first. Return the scripts whose deadlines expired.
+/// Might return an empty list on spurious wake ups.
+pub(crate) fn wait_for_expired(max_wait: Option<Duration>) -> Vec<Weak<V8ScriptCtx>> {
+    let mut queue = WATCHDOG.queue.lock().unwrap();
+    let now = now_ms();
+    let wait = queue
+        .next_deadline()
+        .map(|v| Duration::from_millis(v.saturating_sub(now)));
+    let wait = match (wait, max_wait) {
+        (Some(w), Some(m)) => Some(w.min(m)),
+        (w, m) => w.or(m),
+    };
+    if !queue.notified && wait.map_or(true, |v| !v.is_zero()) {
+        queue = match wait {
+            Some(w) => WATCHDOG.condvar.wait_timeout(queue, w).unwrap().0,
+            None => WATCHDOG.condvar.wait(queue).unwrap(),
+        };
+    }
+    queue.notified = false;
+    queue.pop_expired(now_ms())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_deadline_queue_pops_expired_by_order() {
+        let mut queue = DeadlineQueue::default();
+        assert!(queue.arm(20, Weak::new()));
+        assert!(queue.arm(10, Weak::new()));
+        assert!(!queue.arm(30, Weak::new()));
+        assert_eq!(queue.pop_expired(5).len(), 0);
+        assert_eq!(queue.pop_expired(20).len(), 2);
+        assert_eq!(queue.next_deadline(), Some(30));
+    }
+}